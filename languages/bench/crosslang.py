@@ -0,0 +1,478 @@
+"""
+Cross-language benchmark. Starts a throwaway redis-server and runs the C, C++
+and Python peers against each other in every pairing:
+
+- command round trips, with a server in one language and a client in another,
+  over redis and, between C and C++, over the shared-memory channel
+- entry write-to-read latency, with the writer paced at a fixed rate
+- the highest entry rate a writer and reader pair can sustain, with the
+  writer going flat out
+
+Then it prints a comparison report and writes the results as JSON.
+"""
+from __future__ import annotations
+
+import argparse
+import itertools
+import json
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+from typing import Any, Optional
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# How long to wait for redis-server and peers to come up, and for servers
+#   to exit once told to stop
+STARTUP_TIMEOUT_S = 10
+SHUTDOWN_TIMEOUT_S = 10
+
+# Percentiles to report
+PERCENTILES = [50, 90, 99, 99.9]
+
+LANGS = ["c", "cpp", "python"]
+
+# Ways commands can go. The shared-memory channel is only between C and C++
+#   elements on the same host, everything else always goes over redis.
+TRANSPORTS = ["redis", "shm"]
+SHM_LANGS = ["c", "cpp"]
+SHM_ENV = "ATOM_COMMAND_SHM"
+
+
+class BenchRedis:
+    """
+    Runs redis-server on a unix socket in a temp directory, the same as the
+    C and C++ benchmark fixture
+    """
+
+    def __init__(self, server: str):
+        self.server = server
+        self.dir: Optional[str] = None
+        self.proc: Optional[subprocess.Popen] = None
+        self.socket = ""
+
+    def start(self) -> None:
+        self.dir = tempfile.mkdtemp(prefix="atom_bench_")
+        self.socket = os.path.join(self.dir, "redis.sock")
+        self.proc = subprocess.Popen(
+            [
+                self.server,
+                "--port",
+                "0",
+                "--unixsocket",
+                self.socket,
+                "--dir",
+                self.dir,
+                "--save",
+                "",
+                "--appendonly",
+                "no",
+            ],
+            stdout=subprocess.DEVNULL,
+        )
+
+        deadline = time.monotonic() + STARTUP_TIMEOUT_S
+        while time.monotonic() < deadline:
+            try:
+                with socket.socket(socket.AF_UNIX) as s:
+                    s.connect(self.socket)
+                return
+            except OSError:
+                time.sleep(0.01)
+        raise RuntimeError(f"redis-server didn't come up on {self.socket}")
+
+    def stop(self) -> None:
+        if self.proc is not None:
+            self.proc.terminate()
+            self.proc.wait()
+            self.proc = None
+        if self.dir is not None:
+            shutil.rmtree(self.dir, ignore_errors=True)
+            self.dir = None
+
+
+def percentile(samples: list[int], p: float) -> float:
+    """Gets the p-th percentile of sorted samples, nearest rank"""
+    if not samples:
+        return 0.0
+    rank = min(len(samples) - 1, max(0, int(round(p / 100.0 * len(samples))) - 1))
+    return float(samples[rank])
+
+
+def summarize(samples_ns: list[int]) -> dict[str, float]:
+    """Gets the percentiles, mean and max of samples in us"""
+    samples = sorted(samples_ns)
+    summary = {f"p{p:g}": percentile(samples, p) / 1000.0 for p in PERCENTILES}
+    summary["mean"] = (sum(samples) / len(samples) / 1000.0) if samples else 0.0
+    summary["max"] = (samples[-1] / 1000.0) if samples else 0.0
+    return summary
+
+
+def rate(count: int, elapsed_ns: int) -> float:
+    return (count * 1e9 / elapsed_ns) if elapsed_ns > 0 else 0.0
+
+
+class Runner:
+    def __init__(self, args: argparse.Namespace, env: dict[str, str]):
+        self.args = args
+        self.env = env
+
+    def command(self, lang: str) -> list[str]:
+        """Gets the command line that runs the peer for a language"""
+        if lang == "c":
+            return [self.args.peer_c]
+        if lang == "cpp":
+            return [self.args.peer_cpp]
+        return [sys.executable, os.path.join(BENCH_DIR, "peer.py")]
+
+    def start(
+        self,
+        lang: str,
+        role: str,
+        name: str,
+        options: list[str],
+        stdin=None,
+        transport: str = "redis",
+    ) -> subprocess.Popen:
+        env = dict(self.env)
+        env[SHM_ENV] = "1" if transport == "shm" else "0"
+        return subprocess.Popen(
+            self.command(lang) + [role, "--name", name] + options,
+            stdin=stdin,
+            stdout=subprocess.PIPE,
+            env=env,
+            text=True,
+        )
+
+    @staticmethod
+    def wait_ready(proc: subprocess.Popen) -> None:
+        """Waits for a peer to say it's ready, skipping anything it logs"""
+        for line in proc.stdout:
+            if line.strip() == "ready":
+                return
+        raise RuntimeError(f"Peer didn't come up: {proc.args}")
+
+    @staticmethod
+    def result(proc: subprocess.Popen) -> dict[str, Any]:
+        """Gets the JSON a peer prints once it's done"""
+        for line in proc.stdout:
+            line = line.strip()
+            if line.startswith("{"):
+                return json.loads(line)
+        raise RuntimeError(f"Peer had no result: {proc.args}")
+
+    @staticmethod
+    def finish(proc: subprocess.Popen) -> None:
+        try:
+            proc.wait(timeout=SHUTDOWN_TIMEOUT_S)
+        except subprocess.TimeoutExpired:
+            proc.send_signal(signal.SIGKILL)
+            proc.wait()
+
+    def commands(
+        self, server: str, client: str, runs: str, transport: str
+    ) -> list[dict]:
+        """Runs the command round trips for a pairing over a transport"""
+        name = f"bench_{server}_{client}_{transport}_server"
+        srv = self.start(server, "server", name, [], transport=transport)
+        try:
+            self.wait_ready(srv)
+            cli = self.start(
+                client,
+                "client",
+                f"bench_{server}_{client}_{transport}_client",
+                [
+                    "--peer",
+                    name,
+                    "--runs",
+                    runs,
+                    "--warmup",
+                    str(self.args.warmup),
+                    "--stop",
+                ],
+                transport=transport,
+            )
+            result = self.result(cli)
+            self.finish(cli)
+        finally:
+            self.finish(srv)
+
+        return [
+            {
+                "server": server,
+                "client": client,
+                "transport": transport,
+                "size": run["size"],
+                "count": run["count"],
+                "errors": run["errors"],
+                "rate": rate(run["count"], run["elapsed_ns"]),
+                "rtt_us": summarize(run["samples_ns"]),
+            }
+            for run in result["runs"]
+        ]
+
+    def entries(
+        self, writer: str, reader: str, runs: str, hz: float, phase: str
+    ) -> list[dict]:
+        """Runs the entry writes and reads for a pairing"""
+        name = f"bench_{writer}_{reader}_{phase}_writer"
+        rdr = self.start(
+            reader,
+            "reader",
+            f"bench_{writer}_{reader}_{phase}_reader",
+            [
+                "--peer",
+                name,
+                "--runs",
+                runs,
+                "--idle-timeout",
+                str(self.args.idle_timeout),
+            ],
+        )
+        wtr = None
+        try:
+            self.wait_ready(rdr)
+            wtr = self.start(
+                writer,
+                "writer",
+                name,
+                ["--runs", runs, "--rate", str(hz)],
+                stdin=subprocess.PIPE,
+            )
+            read = self.result(rdr)
+            self.finish(rdr)
+            wtr.stdin.close()
+            written = self.result(wtr)
+        finally:
+            if wtr is not None:
+                if not wtr.stdin.closed:
+                    wtr.stdin.close()
+                self.finish(wtr)
+            self.finish(rdr)
+
+        results = []
+        for w, r in zip(written["runs"], read["runs"]):
+            results.append(
+                {
+                    "writer": writer,
+                    "reader": reader,
+                    "size": w["size"],
+                    "count": w["count"],
+                    "errors": w["errors"],
+                    "lost": r["lost"],
+                    "write_rate": rate(w["count"], w["elapsed_ns"]),
+                    "read_rate": rate(max(0, r["received"] - 1), r["elapsed_ns"]),
+                    "latency_us": summarize(r["samples_ns"]),
+                }
+            )
+        return results
+
+
+def runs_arg(sizes: list[int], count: int, max_bytes: int, min_count: int) -> str:
+    """
+    Gets the runs option for the peers. Big payloads get fewer iterations s.t.
+    each size moves about the same amount of data at most
+    """
+    return ",".join(
+        f"{size}:{max(min_count, min(count, max_bytes // max(size, 1)))}"
+        for size in sizes
+    )
+
+
+def fmt_size(size: int) -> str:
+    for unit, shift in (("MB", 20), ("KB", 10)):
+        if size >= (1 << shift) and size % (1 << shift) == 0:
+            return f"{size >> shift}{unit}"
+    return f"{size}B"
+
+
+def report(results: dict[str, Any]) -> str:
+    """Formats the results as markdown tables"""
+    pcts = [f"p{p:g}" for p in PERCENTILES]
+    lines = [
+        "# Cross-language benchmark",
+        "",
+        "## Command round trip (us)",
+        "",
+        "Over redis every pairing goes through the same command and response "
+        "streams. Over shm, C and C++ pairings go through the shared-memory "
+        "channel instead, which Python doesn't have.",
+        "",
+        "| transport | server | client | size | "
+        + " | ".join(pcts)
+        + " | max | cmd/s | errors |",
+        "|---|---|---|---|" + "---|" * (len(pcts) + 3),
+    ]
+    for r in results["commands"]:
+        lines.append(
+            f"| {r['transport']} | {r['server']} | {r['client']} | "
+            f"{fmt_size(r['size'])} | "
+            + " | ".join(f"{r['rtt_us'][p]:.0f}" for p in pcts)
+            + f" | {r['rtt_us']['max']:.0f} | {r['rate']:.0f} | {r['errors']} |"
+        )
+
+    lines += [
+        "",
+        f"## Entry write-to-read latency at {results['config']['rate']:g}/s (us)",
+        "",
+        "| writer | reader | size | " + " | ".join(pcts) + " | max | lost |",
+        "|---|---|---|" + "---|" * (len(pcts) + 2),
+    ]
+    for r in results["entries_paced"]:
+        lines.append(
+            f"| {r['writer']} | {r['reader']} | {fmt_size(r['size'])} | "
+            + " | ".join(f"{r['latency_us'][p]:.0f}" for p in pcts)
+            + f" | {r['latency_us']['max']:.0f} | {r['lost']} |"
+        )
+
+    lines += [
+        "",
+        "## Entry rate, writer flat out",
+        "",
+        "| writer | reader | size | written/s | read/s | p50 latency (us) | lost |",
+        "|---|---|---|---|---|---|---|",
+    ]
+    for r in results["entries_flat"]:
+        lines.append(
+            f"| {r['writer']} | {r['reader']} | {fmt_size(r['size'])} | "
+            f"{r['write_rate']:.0f} | {r['read_rate']:.0f} | "
+            f"{r['latency_us']['p50']:.0f} | {r['lost']} |"
+        )
+
+    return "\n".join(lines) + "\n"
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
+    )
+    parser.add_argument(
+        "--langs",
+        default=",".join(LANGS),
+        help="Languages to pair up, from c, cpp and python",
+    )
+    parser.add_argument(
+        "--transports",
+        default=",".join(TRANSPORTS),
+        help="How commands go, from redis and shm. shm only pairs C and C++",
+    )
+    parser.add_argument(
+        "--sizes",
+        default="16,256,4096,65536,1048576",
+        help="Payload sizes in bytes",
+    )
+    parser.add_argument(
+        "--count", type=int, default=2000, help="Commands or entries per size"
+    )
+    parser.add_argument(
+        "--max-bytes",
+        type=int,
+        default=64 << 20,
+        help="Caps the count s.t. no size moves more than this many bytes",
+    )
+    parser.add_argument(
+        "--min-count", type=int, default=50, help="Least commands or entries per size"
+    )
+    parser.add_argument(
+        "--rate",
+        type=float,
+        default=1000,
+        help="Entries per second written when measuring latency",
+    )
+    parser.add_argument(
+        "--paced-count", type=int, default=500, help="Entries per size when paced"
+    )
+    parser.add_argument(
+        "--warmup", type=int, default=100, help="Commands sent before timing"
+    )
+    parser.add_argument(
+        "--idle-timeout",
+        type=int,
+        default=2000,
+        help="ms a reader waits for the next entry before giving up on the rest",
+    )
+    parser.add_argument(
+        "--peer-c", default=os.path.join(BENCH_DIR, "build", "peer_c")
+    )
+    parser.add_argument(
+        "--peer-cpp", default=os.path.join(BENCH_DIR, "build", "peer_cpp")
+    )
+    parser.add_argument(
+        "--redis-server", default=os.getenv("REDIS_SERVER_BIN", "redis-server")
+    )
+    parser.add_argument("--out", help="Where to write the results as JSON")
+    parser.add_argument("--report", help="Where to write the report as markdown")
+    args = parser.parse_args()
+
+    langs = [lang for lang in args.langs.split(",") if lang]
+    for lang in langs:
+        if lang not in LANGS:
+            parser.error(f"Unknown language {lang}")
+    transports = [t for t in args.transports.split(",") if t]
+    for transport in transports:
+        if transport not in TRANSPORTS:
+            parser.error(f"Unknown transport {transport}")
+    sizes = [int(size) for size in args.sizes.split(",")]
+
+    results: dict[str, Any] = {
+        "config": {
+            "langs": langs,
+            "transports": transports,
+            "sizes": sizes,
+            "count": args.count,
+            "max_bytes": args.max_bytes,
+            "rate": args.rate,
+            "paced_count": args.paced_count,
+            "warmup": args.warmup,
+        },
+        "commands": [],
+        "entries_paced": [],
+        "entries_flat": [],
+    }
+
+    redis = BenchRedis(args.redis_server)
+    try:
+        redis.start()
+        env = dict(os.environ)
+        env["ATOM_NUCLEUS_SOCKET"] = redis.socket
+        runner = Runner(args, env)
+
+        full = runs_arg(sizes, args.count, args.max_bytes, args.min_count)
+        paced = runs_arg(
+            sizes, min(args.count, args.paced_count), args.max_bytes, args.min_count
+        )
+
+        for first, second in itertools.product(langs, repeat=2):
+            print(f"{first} -> {second}", file=sys.stderr, flush=True)
+            for transport in transports:
+                if transport == "shm" and not (
+                    first in SHM_LANGS and second in SHM_LANGS
+                ):
+                    continue
+                results["commands"] += runner.commands(
+                    first, second, full, transport
+                )
+            results["entries_paced"] += runner.entries(
+                first, second, paced, args.rate, "paced"
+            )
+            results["entries_flat"] += runner.entries(first, second, full, 0, "flat")
+    finally:
+        redis.stop()
+
+    text = report(results)
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump(results, f, indent=2)
+    if args.report:
+        with open(args.report, "w") as f:
+            f.write(text)
+    print(text)
+
+
+if __name__ == "__main__":
+    main()
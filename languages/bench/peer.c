@@ -0,0 +1,603 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file peer.c
+//
+//  @brief C side of the cross-language benchmark. See README.md for the
+//			roles and what each prints.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hiredis/hiredis.h>
+
+#include <atom/atom.h>
+#include <atom/redis.h>
+#include <atom/element.h>
+#include <atom/element_entry_read.h>
+#include <atom/element_entry_write.h>
+#include <atom/element_command_server.h>
+#include <atom/element_command_send.h>
+
+// Most sizes that can be run in one go
+#define PEER_MAX_RUNS 32
+
+// Keys of the benchmark entries
+#define PEER_KEY_SEQ "seq"
+#define PEER_KEY_TIME "t"
+#define PEER_KEY_DATA "data"
+#define PEER_N_KEYS 3
+
+// How long readers and servers block per read
+#define PEER_POLL_MS 100
+
+// Timeout of the commands we serve
+#define PEER_COMMAND_TIMEOUT_MS 1000
+
+// Size of a run and how many commands or entries to send for it
+struct peer_run {
+	size_t size;
+	size_t count;
+};
+
+struct peer_args {
+	const char *role;
+	const char *name;
+	const char *peer;
+	struct peer_run runs[PEER_MAX_RUNS];
+	size_t n_runs;
+	double rate;
+	size_t warmup;
+	int start_timeout_ms;
+	int idle_timeout_ms;
+	bool stop;
+};
+
+// State of a reader for one run
+struct peer_reader {
+	uint64_t *samples;
+	size_t received;
+	size_t next_seq;
+	size_t lost;
+	uint64_t first_ns;
+	uint64_t last_ns;
+	char last_id[STREAM_ID_BUFFLEN];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the time on the monotonic clock in ns. It's shared by all
+//			processes on the host s.t. times written in entries can be
+//			compared with it by the reader.
+//
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t peer_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sleeps until the monotonic clock reaches ns
+//
+////////////////////////////////////////////////////////////////////////////////
+static void peer_sleep_until(
+	uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Prints the samples of a run as a JSON list
+//
+////////////////////////////////////////////////////////////////////////////////
+static void peer_print_samples(
+	const uint64_t *samples,
+	size_t n)
+{
+	size_t i;
+
+	printf("[");
+	for (i = 0; i < n; ++i) {
+		printf((i == 0) ? "%lu" : ",%lu", (unsigned long)samples[i]);
+	}
+	printf("]");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Echoes the command data back
+//
+////////////////////////////////////////////////////////////////////////////////
+static int peer_echo_cb(
+	uint8_t *data,
+	size_t data_len,
+	uint8_t **response,
+	size_t *response_len,
+	char **error_str,
+	void *user_data,
+	void **cleanup_ptr)
+{
+	if (data_len > 0) {
+		*response = (uint8_t *)malloc(data_len);
+		memcpy(*response, data, data_len);
+	}
+	*response_len = data_len;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Tells the server to stop
+//
+////////////////////////////////////////////////////////////////////////////////
+static int peer_stop_cb(
+	uint8_t *data,
+	size_t data_len,
+	uint8_t **response,
+	size_t *response_len,
+	char **error_str,
+	void *user_data,
+	void **cleanup_ptr)
+{
+	*(bool *)user_data = true;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Serves echo until told to stop
+//
+////////////////////////////////////////////////////////////////////////////////
+static int peer_server(
+	redisContext *ctx,
+	struct element *elem,
+	struct peer_args *args)
+{
+	bool stop = false;
+
+	if (!element_command_add(elem, "echo", peer_echo_cb, NULL, NULL,
+			PEER_COMMAND_TIMEOUT_MS) ||
+		!element_command_add(elem, "stop", peer_stop_cb, NULL, &stop,
+			PEER_COMMAND_TIMEOUT_MS))
+	{
+		fprintf(stderr, "Failed to add commands\n");
+		return 1;
+	}
+
+	printf("ready\n");
+	fflush(stdout);
+
+	while (!stop) {
+		element_command_loop(ctx, elem, false, PEER_POLL_MS);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sends echo commands of each size, timing each round trip
+//
+////////////////////////////////////////////////////////////////////////////////
+static int peer_client(
+	redisContext *ctx,
+	struct element *elem,
+	struct peer_args *args)
+{
+	size_t r, i, errors;
+	uint64_t start_ns, end_ns, *samples;
+	uint8_t *data;
+
+	printf("{\"lang\":\"c\",\"role\":\"client\",\"runs\":[");
+
+	for (r = 0; r < args->n_runs; ++r) {
+		data = (uint8_t *)malloc(args->runs[r].size + 1);
+		memset(data, 'x', args->runs[r].size);
+		samples = (uint64_t *)malloc(args->runs[r].count * sizeof(uint64_t));
+		errors = 0;
+
+		for (i = 0; i < args->warmup; ++i) {
+			element_command_send(ctx, elem, args->peer, "echo", data,
+				args->runs[r].size, true, NULL, NULL, NULL);
+		}
+
+		start_ns = peer_now_ns();
+		for (i = 0; i < args->runs[r].count; ++i) {
+			uint64_t sent_ns = peer_now_ns();
+			if (element_command_send(ctx, elem, args->peer, "echo", data,
+				args->runs[r].size, true, NULL, NULL, NULL) != ATOM_NO_ERROR)
+			{
+				errors += 1;
+			}
+			samples[i] = peer_now_ns() - sent_ns;
+		}
+		end_ns = peer_now_ns();
+
+		printf("%s{\"size\":%lu,\"count\":%lu,\"errors\":%lu,\"elapsed_ns\":%lu,"
+			"\"samples_ns\":", (r == 0) ? "" : ",",
+			(unsigned long)args->runs[r].size, (unsigned long)args->runs[r].count,
+			(unsigned long)errors, (unsigned long)(end_ns - start_ns));
+		peer_print_samples(samples, args->runs[r].count);
+		printf("}");
+
+		free(samples);
+		free(data);
+	}
+
+	printf("]}\n");
+	fflush(stdout);
+
+	if (args->stop) {
+		element_command_send(ctx, elem, args->peer, "stop", NULL, 0, true,
+			NULL, NULL, NULL);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes entries of each size, at the rate if it's set or else as
+//			fast as we can. Waits for stdin to close before cleaning up the
+//			streams s.t. the reader can finish with them.
+//
+////////////////////////////////////////////////////////////////////////////////
+static int peer_writer(
+	redisContext *ctx,
+	struct element *elem,
+	struct peer_args *args)
+{
+	struct element_entry_write_info *infos[PEER_MAX_RUNS];
+	char stream[ATOM_NAME_MAXLEN], seq[32], now[32];
+	size_t r, i, errors;
+	uint64_t start_ns, end_ns, period_ns;
+	uint8_t *data;
+	char c;
+
+	period_ns = (args->rate > 0) ? (uint64_t)(1e9 / args->rate) : 0;
+
+	printf("{\"lang\":\"c\",\"role\":\"writer\",\"runs\":[");
+
+	for (r = 0; r < args->n_runs; ++r) {
+		snprintf(stream, sizeof(stream), "bench_%lu", (unsigned long)args->runs[r].size);
+		infos[r] = element_entry_write_init(ctx, elem, stream, PEER_N_KEYS);
+		infos[r]->items[0].key = PEER_KEY_SEQ;
+		infos[r]->items[0].key_len = strlen(PEER_KEY_SEQ);
+		infos[r]->items[1].key = PEER_KEY_TIME;
+		infos[r]->items[1].key_len = strlen(PEER_KEY_TIME);
+		infos[r]->items[2].key = PEER_KEY_DATA;
+		infos[r]->items[2].key_len = strlen(PEER_KEY_DATA);
+
+		data = (uint8_t *)malloc(args->runs[r].size + 1);
+		memset(data, 'x', args->runs[r].size);
+		infos[r]->items[2].data = data;
+		infos[r]->items[2].data_len = args->runs[r].size;
+		errors = 0;
+
+		start_ns = peer_now_ns();
+		for (i = 0; i < args->runs[r].count; ++i) {
+			if (period_ns > 0) {
+				peer_sleep_until(start_ns + (i * period_ns));
+			}
+
+			infos[r]->items[0].data = (uint8_t *)seq;
+			infos[r]->items[0].data_len = snprintf(seq, sizeof(seq), "%lu",
+				(unsigned long)i);
+			infos[r]->items[1].data = (uint8_t *)now;
+			infos[r]->items[1].data_len = snprintf(now, sizeof(now), "%lu",
+				(unsigned long)peer_now_ns());
+
+			// Keep everything s.t. a slow reader is measured as slow
+			//	rather than as losing entries
+			if (element_entry_write(ctx, infos[r],
+				ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP,
+				(int)args->runs[r].count) != ATOM_NO_ERROR)
+			{
+				errors += 1;
+			}
+		}
+		end_ns = peer_now_ns();
+
+		printf("%s{\"size\":%lu,\"count\":%lu,\"errors\":%lu,\"elapsed_ns\":%lu}",
+			(r == 0) ? "" : ",", (unsigned long)args->runs[r].size,
+			(unsigned long)args->runs[r].count, (unsigned long)errors,
+			(unsigned long)(end_ns - start_ns));
+		free(data);
+	}
+
+	printf("]}\n");
+	fflush(stdout);
+
+	while (read(STDIN_FILENO, &c, 1) > 0);
+
+	for (r = 0; r < args->n_runs; ++r) {
+		element_entry_write_cleanup(ctx, infos[r]);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Notes an entry read: its latency from the time it was written
+//			and whether any were skipped before it
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool peer_read_cb(
+	const char *id,
+	const struct redis_xread_kv_item *kv_items,
+	int n_kv_items,
+	void *user_data)
+{
+	struct peer_reader *reader = (struct peer_reader *)user_data;
+	uint64_t now_ns = peer_now_ns();
+	size_t seq;
+
+	strncpy(reader->last_id, id, STREAM_ID_BUFFLEN - 1);
+	if (!kv_items[0].found || !kv_items[1].found) {
+		return true;
+	}
+
+	seq = strtoul(kv_items[0].reply->str, NULL, 10);
+	if (seq > reader->next_seq) {
+		reader->lost += seq - reader->next_seq;
+	}
+	reader->next_seq = seq + 1;
+
+	if (reader->received == 0) {
+		reader->first_ns = now_ns;
+	}
+	reader->last_ns = now_ns;
+	reader->samples[reader->received] =
+		now_ns - strtoull(kv_items[1].reply->str, NULL, 10);
+	reader->received += 1;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Reads the entries of each size from the writer, giving up on a
+//			size once it's been quiet for the idle timeout
+//
+////////////////////////////////////////////////////////////////////////////////
+static int peer_reader(
+	redisContext *ctx,
+	struct element *elem,
+	struct peer_args *args)
+{
+	struct redis_xread_kv_item kv_items[PEER_N_KEYS];
+	struct element_entry_read_info info;
+	struct peer_reader reader;
+	char stream[ATOM_NAME_MAXLEN];
+	size_t r;
+	uint64_t waited_since_ns;
+
+	kv_items[0].key = PEER_KEY_SEQ;
+	kv_items[0].key_len = strlen(PEER_KEY_SEQ);
+	kv_items[1].key = PEER_KEY_TIME;
+	kv_items[1].key_len = strlen(PEER_KEY_TIME);
+	kv_items[2].key = PEER_KEY_DATA;
+	kv_items[2].key_len = strlen(PEER_KEY_DATA);
+
+	info.element = args->peer;
+	info.stream = stream;
+	info.kv_items = kv_items;
+	info.n_kv_items = PEER_N_KEYS;
+	info.user_data = &reader;
+	info.response_cb = peer_read_cb;
+
+	printf("ready\n");
+	fflush(stdout);
+
+	printf("{\"lang\":\"c\",\"role\":\"reader\",\"runs\":[");
+
+	for (r = 0; r < args->n_runs; ++r) {
+		snprintf(stream, sizeof(stream), "bench_%lu", (unsigned long)args->runs[r].size);
+		memset(&reader, 0, sizeof(reader));
+		reader.samples = (uint64_t *)malloc(args->runs[r].count * sizeof(uint64_t));
+		strcpy(reader.last_id, "0");
+		waited_since_ns = peer_now_ns();
+
+		while (reader.next_seq < args->runs[r].count) {
+			size_t received = reader.received;
+
+			element_entry_read_since(ctx, elem, &info, reader.last_id,
+				PEER_POLL_MS, args->runs[r].count - reader.received);
+
+			if (reader.received != received) {
+				waited_since_ns = peer_now_ns();
+			} else if ((peer_now_ns() - waited_since_ns) / 1000000 >=
+				(uint64_t)((reader.received == 0) ?
+					args->start_timeout_ms : args->idle_timeout_ms))
+			{
+				break;
+			}
+		}
+
+		reader.lost += args->runs[r].count - reader.next_seq;
+		printf("%s{\"size\":%lu,\"count\":%lu,\"received\":%lu,\"lost\":%lu,"
+			"\"elapsed_ns\":%lu,\"samples_ns\":", (r == 0) ? "" : ",",
+			(unsigned long)args->runs[r].size, (unsigned long)args->runs[r].count,
+			(unsigned long)reader.received, (unsigned long)reader.lost,
+			(unsigned long)(reader.last_ns - reader.first_ns));
+		peer_print_samples(reader.samples, reader.received);
+		printf("}");
+		free(reader.samples);
+	}
+
+	printf("]}\n");
+	fflush(stdout);
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Parses the runs from "size:count,size:count,..."
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool peer_parse_runs(
+	const char *str,
+	struct peer_args *args)
+{
+	char *end;
+
+	args->n_runs = 0;
+	while (*str != '\0') {
+		if (args->n_runs == PEER_MAX_RUNS) {
+			return false;
+		}
+
+		args->runs[args->n_runs].size = strtoul(str, &end, 10);
+		if (*end != ':') {
+			return false;
+		}
+		args->runs[args->n_runs].count = strtoul(end + 1, &end, 10);
+		if ((args->runs[args->n_runs].count == 0) ||
+			((*end != ',') && (*end != '\0')))
+		{
+			return false;
+		}
+
+		args->n_runs += 1;
+		str = (*end == ',') ? end + 1 : end;
+	}
+
+	return args->n_runs > 0;
+}
+
+static void peer_usage(
+	const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s server|client|writer|reader --name NAME [--peer PEER]\n"
+		"\t[--runs SIZE:COUNT,...] [--rate HZ] [--warmup N] [--stop]\n"
+		"\t[--start-timeout MS] [--idle-timeout MS]\n", prog);
+}
+
+int main(
+	int argc,
+	char **argv)
+{
+	static const struct option options[] = {
+		{"name", required_argument, NULL, 'n'},
+		{"peer", required_argument, NULL, 'p'},
+		{"runs", required_argument, NULL, 'r'},
+		{"rate", required_argument, NULL, 'R'},
+		{"warmup", required_argument, NULL, 'w'},
+		{"stop", no_argument, NULL, 's'},
+		{"start-timeout", required_argument, NULL, 'S'},
+		{"idle-timeout", required_argument, NULL, 'I'},
+		{NULL, 0, NULL, 0},
+	};
+	struct peer_args args;
+	redisContext *ctx = NULL;
+	struct element *elem = NULL;
+	int opt, ret = 1;
+
+	memset(&args, 0, sizeof(args));
+	args.start_timeout_ms = 10000;
+	args.idle_timeout_ms = 2000;
+	peer_parse_runs("16:1000", &args);
+
+	if (argc < 2) {
+		peer_usage(argv[0]);
+		goto done;
+	}
+	args.role = argv[1];
+	optind = 2;
+
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt) {
+			case 'n':
+				args.name = optarg;
+				break;
+			case 'p':
+				args.peer = optarg;
+				break;
+			case 'r':
+				if (!peer_parse_runs(optarg, &args)) {
+					fprintf(stderr, "Bad runs: %s\n", optarg);
+					goto done;
+				}
+				break;
+			case 'R':
+				args.rate = strtod(optarg, NULL);
+				break;
+			case 'w':
+				args.warmup = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				args.stop = true;
+				break;
+			case 'S':
+				args.start_timeout_ms = atoi(optarg);
+				break;
+			case 'I':
+				args.idle_timeout_ms = atoi(optarg);
+				break;
+			default:
+				peer_usage(argv[0]);
+				goto done;
+		}
+	}
+
+	if ((args.name == NULL) ||
+		((args.peer == NULL) && ((strcmp(args.role, "client") == 0) ||
+			(strcmp(args.role, "reader") == 0))))
+	{
+		peer_usage(argv[0]);
+		goto done;
+	}
+
+	ctx = redis_context_init();
+	if (ctx == NULL) {
+		fprintf(stderr, "Failed to connect to redis\n");
+		goto done;
+	}
+
+	elem = element_init(ctx, args.name);
+	if (elem == NULL) {
+		fprintf(stderr, "Failed to make element %s\n", args.name);
+		goto done;
+	}
+
+	if (strcmp(args.role, "server") == 0) {
+		ret = peer_server(ctx, elem, &args);
+	} else if (strcmp(args.role, "client") == 0) {
+		ret = peer_client(ctx, elem, &args);
+	} else if (strcmp(args.role, "writer") == 0) {
+		ret = peer_writer(ctx, elem, &args);
+	} else if (strcmp(args.role, "reader") == 0) {
+		ret = peer_reader(ctx, elem, &args);
+	} else {
+		peer_usage(argv[0]);
+	}
+
+done:
+	if (elem != NULL) {
+		element_cleanup(ctx, elem);
+	}
+	if (ctx != NULL) {
+		redis_context_cleanup(ctx);
+	}
+	return ret;
+}
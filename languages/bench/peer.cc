@@ -0,0 +1,475 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file peer.cc
+//
+//  @brief C++ side of the cross-language benchmark. Same roles, options
+//			and output as the C side, through the C++ Element API.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <atomcpp/element.h>
+#include <atomcpp/element_response.h>
+
+using namespace atom;
+
+// Keys of the benchmark entries
+#define PEER_KEY_SEQ "seq"
+#define PEER_KEY_TIME "t"
+#define PEER_KEY_DATA "data"
+
+// How long readers block per read
+#define PEER_POLL_MS 100
+
+// Timeout of the commands we serve
+#define PEER_COMMAND_TIMEOUT_MS 1000
+
+// Size of a run and how many commands or entries to send for it
+struct PeerRun {
+	size_t size;
+	size_t count;
+};
+
+struct PeerArgs {
+	std::string role;
+	std::string name;
+	std::string peer;
+	std::vector<PeerRun> runs;
+	double rate;
+	size_t warmup;
+	int start_timeout_ms;
+	int idle_timeout_ms;
+	bool stop;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the time on the monotonic clock in ns, same as the C side
+//
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t peerNowNs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sleeps until the monotonic clock reaches ns
+//
+////////////////////////////////////////////////////////////////////////////////
+static void peerSleepUntil(
+	uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes the samples of a run as a JSON list
+//
+////////////////////////////////////////////////////////////////////////////////
+static void peerPrintSamples(
+	std::ostream &out,
+	const std::vector<uint64_t> &samples)
+{
+	out << "[";
+	for (size_t i = 0; i < samples.size(); ++i) {
+		out << ((i == 0) ? "" : ",") << samples[i];
+	}
+	out << "]";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Echoes the command data back
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool peerEchoFn(
+	const uint8_t *data,
+	size_t data_len,
+	ElementResponse *resp,
+	void *user_data)
+{
+	resp->setData(data, data_len);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Tells the server to stop
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool peerStopFn(
+	const uint8_t *data,
+	size_t data_len,
+	ElementResponse *resp,
+	void *user_data)
+{
+	((std::atomic<bool> *)user_data)->store(true);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Serves echo until told to stop
+//
+////////////////////////////////////////////////////////////////////////////////
+static int peerServer(
+	Element &element,
+	PeerArgs &args)
+{
+	std::atomic<bool> stop(false);
+
+	element.addCommand("echo", "Echoes the data", peerEchoFn, NULL,
+		PEER_COMMAND_TIMEOUT_MS);
+	element.addCommand("stop", "Stops the server", peerStopFn, &stop,
+		PEER_COMMAND_TIMEOUT_MS);
+
+	std::cout << "ready" << std::endl;
+
+	while (!stop.load()) {
+		element.commandLoop(1);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sends echo commands of each size, timing each round trip
+//
+////////////////////////////////////////////////////////////////////////////////
+static int peerClient(
+	Element &element,
+	PeerArgs &args)
+{
+	std::ostringstream out;
+	ElementResponse response;
+
+	out << "{\"lang\":\"cpp\",\"role\":\"client\",\"runs\":[";
+
+	for (size_t r = 0; r < args.runs.size(); ++r) {
+		std::string data(args.runs[r].size, 'x');
+		std::vector<uint64_t> samples(args.runs[r].count);
+		size_t errors = 0;
+
+		for (size_t i = 0; i < args.warmup; ++i) {
+			response.reset();
+			element.sendCommand(response, args.peer, "echo",
+				(const uint8_t *)data.data(), data.size());
+		}
+
+		uint64_t start_ns = peerNowNs();
+		for (size_t i = 0; i < args.runs[r].count; ++i) {
+			uint64_t sent_ns = peerNowNs();
+			response.reset();
+			if ((element.sendCommand(response, args.peer, "echo",
+					(const uint8_t *)data.data(), data.size()) != ATOM_NO_ERROR) ||
+				response.isError())
+			{
+				errors += 1;
+			}
+			samples[i] = peerNowNs() - sent_ns;
+		}
+		uint64_t end_ns = peerNowNs();
+
+		out << ((r == 0) ? "" : ",") << "{\"size\":" << args.runs[r].size
+			<< ",\"count\":" << args.runs[r].count << ",\"errors\":" << errors
+			<< ",\"elapsed_ns\":" << (end_ns - start_ns) << ",\"samples_ns\":";
+		peerPrintSamples(out, samples);
+		out << "}";
+	}
+
+	out << "]}";
+	std::cout << out.str() << std::endl;
+
+	if (args.stop) {
+		response.reset();
+		element.sendCommand(response, args.peer, "stop", NULL, 0);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes entries of each size, at the rate if it's set or else as
+//			fast as we can. Waits for stdin to close before the streams are
+//			cleaned up with the element s.t. the reader can finish with them.
+//
+////////////////////////////////////////////////////////////////////////////////
+static int peerWriter(
+	Element &element,
+	PeerArgs &args)
+{
+	std::ostringstream out;
+	uint64_t period_ns = (args.rate > 0) ? (uint64_t)(1e9 / args.rate) : 0;
+
+	out << "{\"lang\":\"cpp\",\"role\":\"writer\",\"runs\":[";
+
+	for (size_t r = 0; r < args.runs.size(); ++r) {
+		std::string stream = "bench_" + std::to_string(args.runs[r].size);
+		entry_data_t data;
+		size_t errors = 0;
+
+		data[PEER_KEY_DATA] = std::string(args.runs[r].size, 'x');
+
+		uint64_t start_ns = peerNowNs();
+		for (size_t i = 0; i < args.runs[r].count; ++i) {
+			if (period_ns > 0) {
+				peerSleepUntil(start_ns + (i * period_ns));
+			}
+
+			data[PEER_KEY_SEQ] = std::to_string(i);
+			data[PEER_KEY_TIME] = std::to_string(peerNowNs());
+
+			// Keep everything s.t. a slow reader is measured as slow
+			//	rather than as losing entries
+			if (element.entryWrite(stream, data, ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP,
+				(int)args.runs[r].count) != ATOM_NO_ERROR)
+			{
+				errors += 1;
+			}
+		}
+		uint64_t end_ns = peerNowNs();
+
+		out << ((r == 0) ? "" : ",") << "{\"size\":" << args.runs[r].size
+			<< ",\"count\":" << args.runs[r].count << ",\"errors\":" << errors
+			<< ",\"elapsed_ns\":" << (end_ns - start_ns) << "}";
+	}
+
+	out << "]}";
+	std::cout << out.str() << std::endl;
+
+	char c;
+	while (read(STDIN_FILENO, &c, 1) > 0);
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Reads the entries of each size from the writer, giving up on a
+//			size once it's been quiet for the idle timeout
+//
+////////////////////////////////////////////////////////////////////////////////
+static int peerReader(
+	Element &element,
+	PeerArgs &args)
+{
+	std::ostringstream out;
+	std::vector<std::string> keys = {PEER_KEY_SEQ, PEER_KEY_TIME, PEER_KEY_DATA};
+	std::vector<Entry> entries;
+
+	std::cout << "ready" << std::endl;
+
+	out << "{\"lang\":\"cpp\",\"role\":\"reader\",\"runs\":[";
+
+	for (size_t r = 0; r < args.runs.size(); ++r) {
+		std::string stream = "bench_" + std::to_string(args.runs[r].size);
+		std::string last_id = "0";
+		std::vector<uint64_t> samples;
+		size_t next_seq = 0, lost = 0;
+		uint64_t first_ns = 0, last_ns = 0;
+		uint64_t waited_since_ns = peerNowNs();
+
+		samples.reserve(args.runs[r].count);
+
+		while (next_seq < args.runs[r].count) {
+			entries.clear();
+			element.entryReadSince(args.peer, stream, keys,
+				args.runs[r].count - samples.size(), entries, last_id,
+				PEER_POLL_MS);
+			uint64_t now_ns = peerNowNs();
+
+			if (entries.empty()) {
+				int timeout = samples.empty() ?
+					args.start_timeout_ms : args.idle_timeout_ms;
+				if ((now_ns - waited_since_ns) / 1000000 >= (uint64_t)timeout) {
+					break;
+				}
+				continue;
+			}
+
+			for (auto &e : entries) {
+				size_t seq = std::stoul(e.getKey(PEER_KEY_SEQ));
+				if (seq > next_seq) {
+					lost += seq - next_seq;
+				}
+				next_seq = seq + 1;
+
+				if (samples.empty()) {
+					first_ns = now_ns;
+				}
+				samples.push_back(now_ns - std::stoull(e.getKey(PEER_KEY_TIME)));
+			}
+			last_id = entries.back().getID();
+			last_ns = now_ns;
+			waited_since_ns = now_ns;
+		}
+
+		lost += args.runs[r].count - std::min(next_seq, args.runs[r].count);
+		out << ((r == 0) ? "" : ",") << "{\"size\":" << args.runs[r].size
+			<< ",\"count\":" << args.runs[r].count << ",\"received\":"
+			<< samples.size() << ",\"lost\":" << lost << ",\"elapsed_ns\":"
+			<< (last_ns - first_ns) << ",\"samples_ns\":";
+		peerPrintSamples(out, samples);
+		out << "}";
+	}
+
+	out << "]}";
+	std::cout << out.str() << std::endl;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Parses the runs from "size:count,size:count,..."
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool peerParseRuns(
+	const std::string &str,
+	std::vector<PeerRun> &runs)
+{
+	std::istringstream in(str);
+	std::string run;
+
+	runs.clear();
+	while (std::getline(in, run, ',')) {
+		size_t colon = run.find(':');
+		if (colon == std::string::npos) {
+			return false;
+		}
+
+		PeerRun r;
+		r.size = strtoul(run.substr(0, colon).c_str(), NULL, 10);
+		r.count = strtoul(run.substr(colon + 1).c_str(), NULL, 10);
+		if (r.count == 0) {
+			return false;
+		}
+		runs.push_back(r);
+	}
+
+	return !runs.empty();
+}
+
+static void peerUsage(
+	const char *prog)
+{
+	std::cerr << "Usage: " << prog
+		<< " server|client|writer|reader --name NAME [--peer PEER]\n"
+		<< "\t[--runs SIZE:COUNT,...] [--rate HZ] [--warmup N] [--stop]\n"
+		<< "\t[--start-timeout MS] [--idle-timeout MS]" << std::endl;
+}
+
+int main(
+	int argc,
+	char **argv)
+{
+	static const struct option options[] = {
+		{"name", required_argument, NULL, 'n'},
+		{"peer", required_argument, NULL, 'p'},
+		{"runs", required_argument, NULL, 'r'},
+		{"rate", required_argument, NULL, 'R'},
+		{"warmup", required_argument, NULL, 'w'},
+		{"stop", no_argument, NULL, 's'},
+		{"start-timeout", required_argument, NULL, 'S'},
+		{"idle-timeout", required_argument, NULL, 'I'},
+		{NULL, 0, NULL, 0},
+	};
+	PeerArgs args;
+	int opt;
+
+	args.rate = 0;
+	args.warmup = 0;
+	args.start_timeout_ms = 10000;
+	args.idle_timeout_ms = 2000;
+	args.stop = false;
+	peerParseRuns("16:1000", args.runs);
+
+	if (argc < 2) {
+		peerUsage(argv[0]);
+		return 1;
+	}
+	args.role = argv[1];
+	optind = 2;
+
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt) {
+			case 'n':
+				args.name = optarg;
+				break;
+			case 'p':
+				args.peer = optarg;
+				break;
+			case 'r':
+				if (!peerParseRuns(optarg, args.runs)) {
+					std::cerr << "Bad runs: " << optarg << std::endl;
+					return 1;
+				}
+				break;
+			case 'R':
+				args.rate = strtod(optarg, NULL);
+				break;
+			case 'w':
+				args.warmup = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				args.stop = true;
+				break;
+			case 'S':
+				args.start_timeout_ms = atoi(optarg);
+				break;
+			case 'I':
+				args.idle_timeout_ms = atoi(optarg);
+				break;
+			default:
+				peerUsage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (args.name.empty() ||
+		(args.peer.empty() && ((args.role == "client") || (args.role == "reader"))))
+	{
+		peerUsage(argv[0]);
+		return 1;
+	}
+
+	Element element(args.name);
+
+	if (args.role == "server") {
+		return peerServer(element, args);
+	} else if (args.role == "client") {
+		return peerClient(element, args);
+	} else if (args.role == "writer") {
+		return peerWriter(element, args);
+	} else if (args.role == "reader") {
+		return peerReader(element, args);
+	}
+
+	peerUsage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,225 @@
+"""
+Python side of the cross-language benchmark. Same roles, options and output
+as the C and C++ sides, through the Python Element API.
+"""
+from __future__ import annotations
+
+import argparse
+import json
+import sys
+import time
+
+from atom import Element
+from atom.messages import Response
+
+# Keys of the benchmark entries
+KEY_SEQ = "seq"
+KEY_TIME = "t"
+KEY_DATA = "data"
+
+# How long readers block per read
+POLL_MS = 100
+
+# Timeout of the commands we serve
+COMMAND_TIMEOUT_MS = 1000
+
+
+def parse_runs(runs: str) -> list[tuple[int, int]]:
+    """Parses the runs from "size:count,size:count,..." """
+    parsed = []
+    for run in runs.split(","):
+        size, count = run.split(":")
+        if int(count) <= 0:
+            raise argparse.ArgumentTypeError(f"Bad runs: {runs}")
+        parsed.append((int(size), int(count)))
+    return parsed
+
+
+def print_result(role: str, runs: list[dict]) -> None:
+    """Prints the result of a role as one line of JSON"""
+    print(json.dumps({"lang": "python", "role": role, "runs": runs}), flush=True)
+
+
+def server(element: Element, args: argparse.Namespace) -> None:
+    """Serves echo until told to stop"""
+
+    def stop(data):
+        element.command_loop_shutdown()
+        return Response()
+
+    element.command_add("echo", lambda data: Response(data=data), COMMAND_TIMEOUT_MS)
+    element.command_add("stop", stop, COMMAND_TIMEOUT_MS)
+    print("ready", flush=True)
+    element.command_loop(block=True, read_block_ms=POLL_MS)
+
+
+def client(element: Element, args: argparse.Namespace) -> None:
+    """Sends echo commands of each size, timing each round trip"""
+    runs = []
+    for size, count in args.runs:
+        data = b"x" * size
+        samples = []
+        errors = 0
+
+        for _ in range(args.warmup):
+            element.command_send(args.peer, "echo", data)
+
+        start_ns = time.monotonic_ns()
+        for _ in range(count):
+            sent_ns = time.monotonic_ns()
+            if element.command_send(args.peer, "echo", data)["err_code"] != 0:
+                errors += 1
+            samples.append(time.monotonic_ns() - sent_ns)
+        end_ns = time.monotonic_ns()
+
+        runs.append(
+            {
+                "size": size,
+                "count": count,
+                "errors": errors,
+                "elapsed_ns": end_ns - start_ns,
+                "samples_ns": samples,
+            }
+        )
+
+    print_result("client", runs)
+    if args.stop:
+        element.command_send(args.peer, "stop")
+
+
+def writer(element: Element, args: argparse.Namespace) -> None:
+    """
+    Writes entries of each size, at the rate if it's set or else as fast as
+    we can. Waits for stdin to close before the streams are cleaned up with
+    the element s.t. the reader can finish with them.
+    """
+    period_ns = int(1e9 / args.rate) if args.rate > 0 else 0
+    runs = []
+    for size, count in args.runs:
+        stream = f"bench_{size}"
+        data = b"x" * size
+        errors = 0
+
+        start_ns = time.monotonic_ns()
+        for i in range(count):
+            if period_ns > 0:
+                delay_ns = start_ns + (i * period_ns) - time.monotonic_ns()
+                if delay_ns > 0:
+                    time.sleep(delay_ns / 1e9)
+
+            # Keep everything s.t. a slow reader is measured as slow rather
+            #   than as losing entries
+            try:
+                element.entry_write(
+                    stream,
+                    {
+                        KEY_SEQ: str(i),
+                        KEY_TIME: str(time.monotonic_ns()),
+                        KEY_DATA: data,
+                    },
+                    maxlen=count,
+                )
+            except Exception:
+                errors += 1
+        end_ns = time.monotonic_ns()
+
+        runs.append(
+            {
+                "size": size,
+                "count": count,
+                "errors": errors,
+                "elapsed_ns": end_ns - start_ns,
+            }
+        )
+
+    print_result("writer", runs)
+    sys.stdin.read()
+
+
+def reader(element: Element, args: argparse.Namespace) -> None:
+    """
+    Reads the entries of each size from the writer, giving up on a size once
+    it's been quiet for the idle timeout
+    """
+    print("ready", flush=True)
+
+    runs = []
+    for size, count in args.runs:
+        stream = f"bench_{size}"
+        last_id = "0"
+        samples = []
+        next_seq = 0
+        lost = 0
+        first_ns = last_ns = 0
+        waited_since_ns = time.monotonic_ns()
+
+        while next_seq < count:
+            entries = element.entry_read_since(
+                args.peer, stream, last_id, n=count - len(samples), block=POLL_MS
+            )
+            now_ns = time.monotonic_ns()
+
+            if not entries:
+                timeout = args.start_timeout if not samples else args.idle_timeout
+                if (now_ns - waited_since_ns) // 1000000 >= timeout:
+                    break
+                continue
+
+            for entry in entries:
+                seq = int(entry[KEY_SEQ])
+                if seq > next_seq:
+                    lost += seq - next_seq
+                next_seq = seq + 1
+
+                if not samples:
+                    first_ns = now_ns
+                samples.append(now_ns - int(entry[KEY_TIME]))
+            last_id = entries[-1]["id"]
+            last_ns = now_ns
+            waited_since_ns = now_ns
+
+        lost += count - min(next_seq, count)
+        runs.append(
+            {
+                "size": size,
+                "count": count,
+                "received": len(samples),
+                "lost": lost,
+                "elapsed_ns": last_ns - first_ns,
+                "samples_ns": samples,
+            }
+        )
+
+    print_result("reader", runs)
+
+
+ROLES = {
+    "server": server,
+    "client": client,
+    "writer": writer,
+    "reader": reader,
+}
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("role", choices=ROLES.keys())
+    parser.add_argument("--name", required=True)
+    parser.add_argument("--peer")
+    parser.add_argument("--runs", type=parse_runs, default=parse_runs("16:1000"))
+    parser.add_argument("--rate", type=float, default=0)
+    parser.add_argument("--warmup", type=int, default=0)
+    parser.add_argument("--stop", action="store_true")
+    parser.add_argument("--start-timeout", type=int, default=10000)
+    parser.add_argument("--idle-timeout", type=int, default=2000)
+    args = parser.parse_args()
+
+    if (args.peer is None) and (args.role in ("client", "reader")):
+        parser.error("--peer is required for the client and reader")
+
+    element = Element(args.name)
+    ROLES[args.role](element, args)
+
+
+if __name__ == "__main__":
+    main()
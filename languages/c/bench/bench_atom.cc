@@ -0,0 +1,599 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file bench_atom.cc
+//
+//  @brief Throughput and latency benchmarks for the atom C library. Run
+//			against a throwaway redis-server, see bench_redis.h
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <benchmark/benchmark.h>
+#include <hiredis/hiredis.h>
+#include <syslog.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "atom.h"
+#include "redis.h"
+#include "element.h"
+#include "element_entry_read.h"
+#include "element_entry_write.h"
+#include "element_command_send.h"
+#include "element_command_server.h"
+#include "codec.h"
+#include "bench_redis.h"
+
+// Key the payload is written under
+#define BENCH_KEY "data"
+
+// How long a read waits for data before giving up
+#define BENCH_READ_TIMEOUT_MS 1000
+
+// Adds the payload sizes to a benchmark
+#define BENCH_SIZES(bm)								\
+	BENCHMARK(bm)									\
+		->RangeMultiplier(BENCH_SIZE_MULTIPLIER)	\
+		->Range(BENCH_MIN_SIZE, BENCH_MAX_SIZE)
+
+// Notes the throughput of a benchmark on a payload of range(0) bytes
+static void setBytes(
+	benchmark::State &state)
+{
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+// Picks whether round trips go through io_uring, skipping the benchmark
+//	if it should but the library was built without it
+static bool benchUring(
+	benchmark::State &state,
+	bool uring)
+{
+	redis_uring_enable(uring);
+	if (uring && !redis_uring_enabled()) {
+		state.SkipWithError("Built without io_uring, see ATOM_URING");
+		return false;
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Raw XADD of a single key, over the socket or through io_uring
+//
+////////////////////////////////////////////////////////////////////////////////
+static void benchRedisXadd(
+	benchmark::State &state,
+	bool uring)
+{
+	bool was_uring = redis_uring_enabled();
+	if (!benchUring(state, uring)) {
+		return;
+	}
+
+	redisContext *ctx = redis_context_init();
+	std::string payload(state.range(0), 'a');
+	struct redis_xadd_info info = {
+		BENCH_KEY, CONST_STRLEN(BENCH_KEY),
+		(const uint8_t *)payload.data(), payload.size()};
+	char id[STREAM_ID_BUFFLEN];
+
+	for (auto _ : state) {
+		if (!redis_xadd(ctx, "bench:xadd", &info, 1,
+			BENCH_STREAM_MAXLEN, false, id))
+		{
+			state.SkipWithError("XADD failed");
+			break;
+		}
+	}
+
+	setBytes(state);
+	redis_remove_key(ctx, "bench:xadd", true);
+	redis_context_cleanup(ctx);
+	redis_uring_enable(was_uring);
+}
+
+static void BM_RedisXadd(
+	benchmark::State &state)
+{
+	benchRedisXadd(state, false);
+}
+BENCH_SIZES(BM_RedisXadd);
+
+static void BM_RedisXaddUring(
+	benchmark::State &state)
+{
+	benchRedisXadd(state, true);
+}
+BENCH_SIZES(BM_RedisXaddUring);
+
+// Counts the entries read
+static bool benchXreadCB(
+	const char *id,
+	const struct redisReply *reply,
+	void *user_data)
+{
+	*(size_t *)user_data += 1;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Raw XREAD of a single entry already on the stream, over the
+//			socket or through io_uring
+//
+////////////////////////////////////////////////////////////////////////////////
+static void benchRedisXread(
+	benchmark::State &state,
+	bool uring)
+{
+	bool was_uring = redis_uring_enabled();
+	if (!benchUring(state, uring)) {
+		return;
+	}
+
+	redisContext *ctx = redis_context_init();
+	std::string payload(state.range(0), 'a');
+	struct redis_xadd_info info = {
+		BENCH_KEY, CONST_STRLEN(BENCH_KEY),
+		(const uint8_t *)payload.data(), payload.size()};
+	struct redis_stream_info stream_info;
+	char id[STREAM_ID_BUFFLEN];
+	size_t n_read = 0;
+
+	redis_xadd(ctx, "bench:xread", &info, 1, BENCH_STREAM_MAXLEN, false, id);
+	redis_init_stream_info(ctx, &stream_info, "bench:xread",
+		benchXreadCB, "0", &n_read);
+
+	for (auto _ : state) {
+		strcpy(stream_info.last_id, "0");
+		if (!redis_xread(ctx, &stream_info, 1, REDIS_XREAD_DONTBLOCK, 1)) {
+			state.SkipWithError("XREAD failed");
+			break;
+		}
+	}
+
+	if (n_read != (size_t)state.iterations()) {
+		state.SkipWithError("Missed entries");
+	}
+	setBytes(state);
+	redis_remove_key(ctx, "bench:xread", true);
+	redis_context_cleanup(ctx);
+	redis_uring_enable(was_uring);
+}
+
+static void BM_RedisXread(
+	benchmark::State &state)
+{
+	benchRedisXread(state, false);
+}
+BENCH_SIZES(BM_RedisXread);
+
+static void BM_RedisXreadUring(
+	benchmark::State &state)
+{
+	benchRedisXread(state, true);
+}
+BENCH_SIZES(BM_RedisXreadUring);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Same XREAD as BM_RedisXread through plain hiredis, which reads
+//			16k at a time, to compare against redis_get_reply
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_HiredisXread(
+	benchmark::State &state)
+{
+	redisContext *ctx = redis_context_init();
+	std::string payload(state.range(0), 'a');
+	struct redis_xadd_info info = {
+		BENCH_KEY, CONST_STRLEN(BENCH_KEY),
+		(const uint8_t *)payload.data(), payload.size()};
+	char id[STREAM_ID_BUFFLEN];
+	const char *argv[] = {"XREAD", "COUNT", "1", "STREAMS", "bench:hiredis", "0"};
+	size_t argvlen[] = {5, 5, 1, 7, 13, 1};
+
+	redis_xadd(ctx, "bench:hiredis", &info, 1, BENCH_STREAM_MAXLEN, false, id);
+
+	for (auto _ : state) {
+		redisReply *reply = (redisReply *)redisCommandArgv(ctx, 6, argv, argvlen);
+		if ((reply == NULL) || (reply->type != REDIS_REPLY_ARRAY)) {
+			state.SkipWithError("XREAD failed");
+			if (reply != NULL) {
+				freeReplyObject(reply);
+			}
+			break;
+		}
+		freeReplyObject(reply);
+	}
+
+	setBytes(state);
+	redis_remove_key(ctx, "bench:hiredis", true);
+	redis_context_cleanup(ctx);
+}
+BENCH_SIZES(BM_HiredisXread);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Entry write through an element
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_ElementEntryWrite(
+	benchmark::State &state)
+{
+	redisContext *ctx = redis_context_init();
+	struct element *elem = element_init(ctx, "bench_writer");
+	struct element_entry_write_info *info =
+		element_entry_write_init(ctx, elem, "bench", 1);
+	std::string payload(state.range(0), 'a');
+
+	info->items[0].key = BENCH_KEY;
+	info->items[0].key_len = CONST_STRLEN(BENCH_KEY);
+	info->items[0].data = (const uint8_t *)payload.data();
+	info->items[0].data_len = payload.size();
+
+	for (auto _ : state) {
+		if (element_entry_write(ctx, info,
+			ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP, BENCH_STREAM_MAXLEN) !=
+			ATOM_NO_ERROR)
+		{
+			state.SkipWithError("Entry write failed");
+			break;
+		}
+	}
+
+	setBytes(state);
+	element_entry_write_cleanup(ctx, info);
+	element_cleanup(ctx, elem);
+	redis_context_cleanup(ctx);
+}
+BENCH_SIZES(BM_ElementEntryWrite);
+
+// Counts the entries read
+static bool benchEntryReadCB(
+	const char *id,
+	const struct redis_xread_kv_item *kv_items,
+	int n_kv_items,
+	void *user_data)
+{
+	*(size_t *)user_data += 1;
+	return true;
+}
+
+// Writes to each of the fan-in streams in turn until told to stop
+static void benchFanInWriter(
+	size_t n_streams,
+	size_t size,
+	std::atomic<bool> *stop)
+{
+	redisContext *ctx = redis_context_init();
+	struct element *elem = element_init(ctx, "bench_fanin_writer");
+	std::vector<struct element_entry_write_info *> infos;
+	std::string payload(size, 'a');
+
+	for (size_t i = 0; i < n_streams; ++i) {
+		infos.push_back(element_entry_write_init(
+			ctx, elem, ("bench" + std::to_string(i)).c_str(), 1));
+		infos[i]->items[0].key = BENCH_KEY;
+		infos[i]->items[0].key_len = CONST_STRLEN(BENCH_KEY);
+		infos[i]->items[0].data = (const uint8_t *)payload.data();
+		infos[i]->items[0].data_len = payload.size();
+	}
+
+	while (!stop->load()) {
+		for (auto info : infos) {
+			element_entry_write(ctx, info,
+				ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP, BENCH_STREAM_MAXLEN);
+		}
+	}
+
+	for (auto info : infos) {
+		element_entry_write_cleanup(ctx, info);
+	}
+	element_cleanup(ctx, elem);
+	redis_context_cleanup(ctx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Reading at least one new entry from each of range(1) streams
+//			in a single read loop while a writer keeps them busy
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_ElementEntryReadLoopFanIn(
+	benchmark::State &state)
+{
+	size_t size = state.range(0);
+	size_t n_streams = state.range(1);
+	redisContext *ctx = redis_context_init();
+	struct element *elem = element_init(ctx, "bench_fanin_reader");
+	std::vector<struct element_entry_read_info> infos(n_streams);
+	std::vector<std::string> streams(n_streams);
+	std::vector<struct redis_xread_kv_item> kv_items(n_streams);
+	size_t n_read = 0;
+
+	for (size_t i = 0; i < n_streams; ++i) {
+		streams[i] = "bench" + std::to_string(i);
+		kv_items[i].key = BENCH_KEY;
+		kv_items[i].key_len = CONST_STRLEN(BENCH_KEY);
+		infos[i].element = "bench_fanin_writer";
+		infos[i].stream = streams[i].c_str();
+		infos[i].kv_items = &kv_items[i];
+		infos[i].n_kv_items = 1;
+		infos[i].user_data = &n_read;
+		infos[i].response_cb = benchEntryReadCB;
+		infos[i].items_to_read = 1;
+	}
+
+	std::atomic<bool> stop(false);
+	std::thread writer(benchFanInWriter, n_streams, size, &stop);
+
+	for (auto _ : state) {
+		if (element_entry_read_loop(ctx, elem, infos.data(), n_streams,
+			false, BENCH_READ_TIMEOUT_MS) != ATOM_NO_ERROR)
+		{
+			state.SkipWithError("Read loop failed");
+			break;
+		}
+	}
+
+	stop.store(true);
+	writer.join();
+
+	state.counters["entries"] = benchmark::Counter(n_read, benchmark::Counter::kIsRate);
+	state.SetBytesProcessed(n_read * size);
+	element_cleanup(ctx, elem);
+	redis_context_cleanup(ctx);
+}
+BENCHMARK(BM_ElementEntryReadLoopFanIn)
+	->ArgNames({"size", "streams"})
+	->Args({16, 1})->Args({16, 4})->Args({16, 16})
+	->Args({64 << 10, 1})->Args({64 << 10, 4})->Args({64 << 10, 16});
+
+// Echoes the command data back in the response
+static int benchEchoCB(
+	uint8_t *data,
+	size_t data_len,
+	uint8_t **response,
+	size_t *response_len,
+	char **error_str,
+	void *user_data,
+	void **cleanup_ptr)
+{
+	if (data_len != 0) {
+		*response = (uint8_t *)malloc(data_len);
+		memcpy(*response, data, data_len);
+		*response_len = data_len;
+	}
+	return 0;
+}
+
+// Tells the command server to stop
+static int benchStopCB(
+	uint8_t *data,
+	size_t data_len,
+	uint8_t **response,
+	size_t *response_len,
+	char **error_str,
+	void *user_data,
+	void **cleanup_ptr)
+{
+	((std::atomic<bool> *)user_data)->store(true);
+	return 0;
+}
+
+// Handles commands until told to stop
+static void benchCommandServer(
+	redisContext *ctx,
+	struct element *elem,
+	std::atomic<bool> *stop)
+{
+	while (!stop->load()) {
+		element_command_loop(ctx, elem, false, ELEMENT_COMMAND_LOOP_NO_TIMEOUT);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Command round trip to an echo command. With range(1) == 0 the
+//			send only waits for the ACK, else it waits for the response
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_ElementCommandSend(
+	benchmark::State &state)
+{
+	std::string payload(state.range(0), 'a');
+	bool block = (state.range(1) != 0);
+	std::atomic<bool> stop(false);
+
+	// Set up the server before starting it s.t. it sees every command
+	redisContext *server_ctx = redis_context_init();
+	struct element *server = element_init(server_ctx, "bench_cmd_server");
+	element_command_add(server, "echo", benchEchoCB, NULL, NULL, 1000);
+	element_command_add(server, "stop", benchStopCB, NULL, &stop, 1000);
+	std::thread server_thread(benchCommandServer, server_ctx, server, &stop);
+
+	redisContext *ctx = redis_context_init();
+	struct element *elem = element_init(ctx, "bench_cmd_client");
+
+	for (auto _ : state) {
+		if (element_command_send(ctx, elem, "bench_cmd_server", "echo",
+			(const uint8_t *)payload.data(), payload.size(), block,
+			NULL, NULL, NULL) != ATOM_NO_ERROR)
+		{
+			state.SkipWithError("Command failed");
+			break;
+		}
+	}
+
+	element_command_send(ctx, elem, "bench_cmd_server", "stop",
+		NULL, 0, false, NULL, NULL, NULL);
+	server_thread.join();
+
+	setBytes(state);
+	element_cleanup(ctx, elem);
+	redis_context_cleanup(ctx);
+	element_cleanup(server_ctx, server);
+	redis_context_cleanup(server_ctx);
+}
+
+// Runs the command benchmark on each size, blocking and not
+static void benchCommandArgs(
+	benchmark::internal::Benchmark *bm)
+{
+	for (int block = 0; block <= 1; ++block) {
+		for (long size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE;
+			size *= BENCH_SIZE_MULTIPLIER)
+		{
+			bm->Args({size, block});
+		}
+		bm->Args({BENCH_MAX_SIZE, block});
+	}
+}
+BENCHMARK(BM_ElementCommandSend)
+	->ArgNames({"size", "block"})
+	->Apply(benchCommandArgs);
+
+// Sensor payloads to compress
+enum bench_payload_kind {
+	BENCH_PAYLOAD_DEPTH,
+	BENCH_PAYLOAD_POINTS,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Makes a representative sensor payload: a 640x480 16-bit depth
+//			image of a sloped floor with a bit of noise, or a point cloud
+//			of the same as x/y/z floats
+//
+////////////////////////////////////////////////////////////////////////////////
+static std::string benchSensorPayload(
+	enum bench_payload_kind kind)
+{
+	const int width = 640, height = 480;
+	std::string payload;
+	unsigned int seed = 1;
+
+	for (int v = 0; v < height; ++v) {
+		for (int u = 0; u < width; ++u) {
+			uint16_t depth = 1000 + (v * 4) + (rand_r(&seed) % 4);
+			if (kind == BENCH_PAYLOAD_DEPTH) {
+				payload.append((const char *)&depth, sizeof(depth));
+			} else {
+				float xyz[3] = {
+					(u - (width / 2)) * depth / 525.0f / 1000.0f,
+					(v - (height / 2)) * depth / 525.0f / 1000.0f,
+					depth / 1000.0f};
+				payload.append((const char *)xyz, sizeof(xyz));
+			}
+		}
+	}
+
+	return payload;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Compresses and decompresses a sensor payload with a codec,
+//			noting the compression ratio
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_Codec(
+	benchmark::State &state)
+{
+	struct atom_codec codec;
+	struct atom_codec_buffer buf = {NULL, 0, 0};
+	std::string payload = benchSensorPayload(
+		(enum bench_payload_kind)state.range(1));
+
+	memset(&codec, 0, sizeof(codec));
+	codec.type = (enum atom_codec_type)state.range(0);
+	if (!atom_codec_supported(codec.type)) {
+		state.SkipWithError("Codec not built in");
+		return;
+	}
+
+	// Decode through a fake entry the same way readers do
+	redisReply key, value, codec_value;
+	redisReply *elements[2] = {&key, &value};
+	redisReply kv;
+	char codec_str[ATOM_CODEC_VALUE_MAXLEN];
+	memset(&key, 0, sizeof(key));
+	key.type = REDIS_REPLY_STRING;
+	key.str = (char *)BENCH_KEY;
+	key.len = CONST_STRLEN(BENCH_KEY);
+	memset(&kv, 0, sizeof(kv));
+	kv.type = REDIS_REPLY_ARRAY;
+	kv.elements = 2;
+	kv.element = elements;
+
+	for (auto _ : state) {
+		if (!atom_codec_encode(&codec, (const uint8_t *)payload.data(),
+			payload.size(), &buf))
+		{
+			state.SkipWithError("Encode failed");
+			break;
+		}
+
+		memset(&value, 0, sizeof(value));
+		value.type = REDIS_REPLY_STRING;
+		value.str = (char *)malloc(buf.len);
+		memcpy(value.str, buf.data, buf.len);
+		value.len = buf.len;
+		memset(&codec_value, 0, sizeof(codec_value));
+		codec_value.type = REDIS_REPLY_STRING;
+		codec_value.str = codec_str;
+		codec_value.len = atom_codec_key_value(&codec, codec_str);
+
+		bool decoded = atom_codec_decode_kv(&kv, &codec_value) &&
+			(value.len == payload.size());
+		free(value.str);
+		if (!decoded) {
+			state.SkipWithError("Decode failed");
+			break;
+		}
+	}
+
+	state.counters["ratio"] = (double)payload.size() / buf.len;
+	state.SetBytesProcessed(state.iterations() * payload.size());
+	atom_codec_buffer_free(&buf);
+}
+BENCHMARK(BM_Codec)
+	->ArgNames({"codec", "payload"})
+	->Args({ATOM_CODEC_LZ4, BENCH_PAYLOAD_DEPTH})
+	->Args({ATOM_CODEC_LZ4, BENCH_PAYLOAD_POINTS})
+	->Args({ATOM_CODEC_ZSTD, BENCH_PAYLOAD_DEPTH})
+	->Args({ATOM_CODEC_ZSTD, BENCH_PAYLOAD_POINTS});
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Formatted log to atom
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_AtomLogf(
+	benchmark::State &state)
+{
+	redisContext *ctx = redis_context_init();
+	struct element *elem = element_init(ctx, "bench_log");
+	size_t i = 0;
+
+	for (auto _ : state) {
+		if (atom_logf(ctx, elem, LOG_DEBUG, "benchmark log %lu", i++) !=
+			ATOM_NO_ERROR)
+		{
+			state.SkipWithError("Log failed");
+			break;
+		}
+	}
+
+	element_cleanup(ctx, elem);
+	redis_context_cleanup(ctx);
+}
+BENCHMARK(BM_AtomLogf);
+
+ATOM_BENCHMARK_MAIN();
@@ -0,0 +1,146 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file bench_redis.h
+//
+//  @brief Benchmark fixture that runs a throwaway redis-server on a unix
+//			socket in a temp directory for the duration of the benchmarks.
+//			The socket is exported in ATOM_NUCLEUS_SOCKET s.t.
+//			redis_context_init() and everything built on it connect to the
+//			throwaway server and not the nucleus.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_BENCH_REDIS_H
+#define __ATOM_BENCH_REDIS_H
+
+#include <benchmark/benchmark.h>
+#include <hiredis/hiredis.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+
+#include "redis.h"
+
+// redis-server to run. Can be overridden in the environment
+#define BENCH_REDIS_SERVER_ENV "REDIS_SERVER_BIN"
+#define BENCH_REDIS_SERVER_DEFAULT "redis-server"
+
+// How long to wait for the server to come up
+#define BENCH_REDIS_STARTUP_TIMEOUT_MS 5000
+
+// Payload sizes to run the data benchmarks with, 16B to 8MB
+#define BENCH_MIN_SIZE 16
+#define BENCH_MAX_SIZE (8 << 20)
+#define BENCH_SIZE_MULTIPLIER 8
+
+// Stream length to trim to when writing s.t. the server doesn't hold
+//	onto gigabytes of large payloads
+#define BENCH_STREAM_MAXLEN 8
+
+class BenchRedis {
+	char dir[64];
+	std::string socket;
+	pid_t pid;
+
+public:
+	BenchRedis() : pid(-1)
+	{
+		dir[0] = '\0';
+	}
+
+	~BenchRedis()
+	{
+		stop();
+	}
+
+	// Starts the server and waits until it's accepting connections
+	bool start()
+	{
+		const char *server = getenv(BENCH_REDIS_SERVER_ENV);
+		if (server == NULL) {
+			server = BENCH_REDIS_SERVER_DEFAULT;
+		}
+
+		strcpy(dir, "/tmp/atom_bench_XXXXXX");
+		if (mkdtemp(dir) == NULL) {
+			perror("mkdtemp");
+			return false;
+		}
+		socket = std::string(dir) + "/redis.sock";
+
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return false;
+		}
+		if (pid == 0) {
+			int null_fd = open("/dev/null", O_WRONLY);
+			dup2(null_fd, STDOUT_FILENO);
+			execlp(server, server,
+				"--port", "0",
+				"--unixsocket", socket.c_str(),
+				"--dir", dir,
+				"--save", "",
+				"--appendonly", "no",
+				(char *)NULL);
+			perror("execlp redis-server");
+			_exit(1);
+		}
+
+		for (int waited = 0; waited < BENCH_REDIS_STARTUP_TIMEOUT_MS; waited += 10) {
+			redisContext *ctx = redisConnectUnix(socket.c_str());
+			bool up = (ctx != NULL) && !ctx->err;
+			if (ctx != NULL) {
+				redisFree(ctx);
+			}
+			if (up) {
+				setenv(REDIS_LOCAL_SOCKET_ENV, socket.c_str(), 1);
+				return true;
+			}
+			usleep(10000);
+		}
+
+		fprintf(stderr, "redis-server didn't come up on %s\n", socket.c_str());
+		return false;
+	}
+
+	// Stops the server and removes the temp directory
+	void stop()
+	{
+		if (pid > 0) {
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+			pid = -1;
+		}
+		if (dir[0] != '\0') {
+			unlink(socket.c_str());
+			rmdir(dir);
+			dir[0] = '\0';
+		}
+	}
+};
+
+// Main for benchmark binaries. Same as BENCHMARK_MAIN() but with the
+//	throwaway redis-server running around the benchmarks
+#define ATOM_BENCHMARK_MAIN()								\
+	int main(int argc, char **argv)							\
+	{														\
+		BenchRedis redis;									\
+		if (!redis.start()) {								\
+			return 1;										\
+		}													\
+		benchmark::Initialize(&argc, argv);					\
+		if (benchmark::ReportUnrecognizedArguments(argc, argv)) {	\
+			return 1;										\
+		}													\
+		benchmark::RunSpecifiedBenchmarks();				\
+		return 0;											\
+	}
+
+#endif // __ATOM_BENCH_REDIS_H
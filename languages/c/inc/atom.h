@@ -16,6 +16,7 @@
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <hiredis/hiredis.h>
 #include <syslog.h>
 
@@ -52,6 +53,21 @@ enum atom_error_t {
 
 #define ATOM_LOG_STREAM_NAME "log"
 
+// Registry of elements and data streams s.t. they can be found without
+//	scanning the keyspace. The elements set has the element names and the
+//	streams set has the full data stream keys. Each change is published on
+//	the channel as the command or data stream key with a + in front when
+//	added and a - when removed.
+#define ATOM_REGISTRY_ELEMENTS_KEY "atom:registry:elements"
+#define ATOM_REGISTRY_STREAMS_KEY "atom:registry:streams"
+#define ATOM_REGISTRY_CHANNEL "atom:registry"
+#define ATOM_REGISTRY_ADD '+'
+#define ATOM_REGISTRY_REMOVE '-'
+
+// Set this in the environment to also SCAN for elements and streams that
+//	aren't in the registry, i.e. ones from libraries that don't register
+#define ATOM_DISCOVERY_SCAN_ENV "ATOM_DISCOVERY_SCAN"
+
 #define ATOM_VERSION_KEY "version"
 #define ATOM_LANGUAGE_KEY "language"
 
@@ -67,6 +83,14 @@ enum atom_error_t {
 // Max length of a log string
 #define ATOM_LOG_MAXLEN 1024
 
+// Defaults for the log shipper. The ring size is rounded up to a power of 2
+#define ATOM_LOG_SHIPPER_DEFAULT_RING_SIZE 1024
+#define ATOM_LOG_SHIPPER_DEFAULT_BATCH_SIZE 64
+#define ATOM_LOG_SHIPPER_DEFAULT_FLUSH_MS 10
+
+// How long to wait for the log shipper to flush at exit
+#define ATOM_LOG_SHIPPER_EXIT_FLUSH_MS 1000
+
 //
 // Keys for sending a command to an element
 //
@@ -115,12 +139,14 @@ enum ack_keys_t {
 #define RESPONSE_KEY_ERR_CODE_STR "err_code"
 #define RESPONSE_KEY_ERR_STR_STR "err_str"
 #define RESPONSE_KEY_DATA_STR "data"
+#define RESPONSE_KEY_SER_STR "ser"
 
 enum command_keys_t {
 	RESPONSE_KEY_CMD = STREAM_N_KEYS,
 	RESPONSE_KEY_ERR_CODE,
 	RESPONSE_KEY_ERR_STR,
 	RESPONSE_KEY_DATA,
+	RESPONSE_KEY_SER,
 	RESPONSE_N_KEYS,
 };
 
@@ -138,16 +164,57 @@ enum atom_log_keys_t {
 	LOG_N_KEYS
 };
 
+// Settings for the background log shipper
+struct atom_log_shipper_config {
+	// Number of log messages that can be waiting to be shipped. Messages
+	//	logged while it's full are dropped
+	size_t ring_size;
+	// Max number of log messages to pipeline to redis at once. Reaching it
+	//	wakes the shipper early
+	size_t batch_size;
+	// How long the shipper waits before shipping a partial batch
+	int flush_ms;
+};
+
+// Counters kept by the log shipper
+struct atom_log_stats {
+	// Messages put in the ring
+	uint64_t queued;
+	// Messages written to the log stream
+	uint64_t shipped;
+	// Messages dropped since the ring was full
+	uint64_t dropped_full;
+	// Messages dropped by level-based sampling
+	uint64_t dropped_sampled;
+	// Messages dropped since redis couldn't be reached or errored
+	uint64_t dropped_error;
+};
+
 //
 // Additional (optional) keys in the droplets
 //
 #define DATA_KEY_TIMESTAMP_STR "timestamp"
+#define DATA_KEY_SER_STR "ser"
+#define DATA_KEY_CODEC_STR "codec"
+#define DATA_KEY_TRACE_STR "trace"
 
 enum data_keys_t {
 	DATA_KEY_TIMESTAMP,
+	DATA_KEY_SER,
+	DATA_KEY_CODEC,
+	DATA_KEY_TRACE,
 	DATA_N_ADDITIONAL_KEYS
 };
 
+//
+// Serialization methods. Written in the "ser" key of responses
+//	and entries s.t. readers in any language can deserialize
+//	the data automatically
+//
+#define ATOM_SER_MSGPACK "msgpack"
+#define ATOM_SER_ARROW "arrow"
+#define ATOM_SER_NONE "none"
+
 // Result list for calls to get elements/streams
 struct atom_list_node {
 	char *name;
@@ -155,7 +222,10 @@ struct atom_list_node {
 };
 
 // Calls the associated data_cb for each element that's present in the system.
-//	NOTE: duplicates may occur
+//	Elements are looked up in the registry, falling back to a SCAN if none
+//	are registered or ATOM_DISCOVERY_SCAN is set.
+//	NOTE: duplicates may occur.
+//	ctx can be NULL to use the calling thread's cached connection.
 enum atom_error_t atom_get_all_elements_cb(
 	redisContext *ctx,
 	bool (*data_cb)(const char *element, void* user_data),
@@ -163,14 +233,32 @@ enum atom_error_t atom_get_all_elements_cb(
 
 // Calls the associated data_cb for all streams in the system. If element is
 //	NULL then will return all streams in the ststem, else just streams
-//	belonging to the passed element.
-//	NOTE: duplicates may occur
+//	belonging to the passed element. Streams are looked up in the registry,
+//	falling back to a SCAN if none of them are registered or
+//	ATOM_DISCOVERY_SCAN is set.
+//	NOTE: duplicates may occur.
+//	ctx can be NULL to use the calling thread's cached connection.
 enum atom_error_t atom_get_all_data_streams_cb(
 	redisContext *ctx,
 	const char *element,
 	bool (*data_cb)(const char *stream, void* user_data),
 	void *user_data);
 
+// Adds an element to the registry, or removes it if add is false.
+//	ctx can be NULL to use the calling thread's cached connection.
+enum atom_error_t atom_register_element(
+	redisContext *ctx,
+	const char *element,
+	bool add);
+
+// Adds a data stream, by its full key, to the registry, or removes it
+//	if add is false. ctx can be NULL to use the calling thread's cached
+//	connection.
+enum atom_error_t atom_register_data_stream(
+	redisContext *ctx,
+	const char *stream_key,
+	bool add);
+
 // Returns a sorted list of all elements in the system without
 //	duplicates. NOTE: the list must be freed
 //	using atom_list_free()
@@ -211,7 +299,34 @@ char *atom_get_data_stream_str(
 	const char *name,
 	char buffer[ATOM_NAME_MAXLEN]);
 
-// Logs a message to the standard log stream
+// Starts the background log shipper with the config, or the defaults
+//	if config is NULL. The shipper is otherwise started with the defaults
+//	on the first log.
+enum atom_error_t atom_log_shipper_start(
+	const struct atom_log_shipper_config *config);
+
+// Ships what's been logged and stops the log shipper. Must not be called
+//	while other threads are logging.
+void atom_log_shipper_stop(void);
+
+// Waits until everything logged so far has been shipped, up to
+//	timeout_ms. A timeout of 0 waits forever.
+enum atom_error_t atom_log_flush(
+	int timeout_ms);
+
+// Keeps only 1 in every_n messages logged at the level. every_n of 0 or 1
+//	keeps all of them, which is the default for each level.
+enum atom_error_t atom_log_set_sampling(
+	int level,
+	unsigned int every_n);
+
+// Gets the log shipper's counters
+void atom_log_get_stats(
+	struct atom_log_stats *stats);
+
+// Logs a message to the standard log stream. The message is queued
+//	for the background log shipper and this returns without waiting on
+//	redis. ctx isn't used and can be NULL.
 enum atom_error_t atom_log(
 	redisContext *ctx,
 	struct element *element,
@@ -0,0 +1,120 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file codec.h
+//
+//  @brief Compression codecs for entry and command data. When a writer
+//			has a codec set and the data is over its threshold each value
+//			is compressed and framed with a small header, and the codec is
+//			noted in the "codec" key s.t. readers decompress automatically.
+//			LZ4 and Zstd are built in with ATOM_HAVE_LZ4 and ATOM_HAVE_ZSTD,
+//			see the Makefile. Writers fall back to no compression for a
+//			codec that isn't built in. Codecs are only supported by the C
+//			and C++ clients: Python readers and command servers treat
+//			compressed data as an error.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_CODEC_H
+#define __ATOM_CODEC_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <hiredis/hiredis.h>
+
+// Key the codec is noted in, and its value for each codec. A dictionary
+//	is noted after the codec, i.e. "zstd:name"
+#define ATOM_CODEC_KEY_STR "codec"
+#define ATOM_CODEC_NONE_STR "none"
+#define ATOM_CODEC_LZ4_STR "lz4"
+#define ATOM_CODEC_ZSTD_STR "zstd"
+#define ATOM_CODEC_DICT_SEPARATOR ':'
+
+enum atom_codec_type {
+	ATOM_CODEC_NONE,
+	ATOM_CODEC_LZ4,
+	ATOM_CODEC_ZSTD,
+	ATOM_CODEC_N_TYPES
+};
+
+// Data smaller than this isn't worth compressing
+#define ATOM_CODEC_DEFAULT_THRESHOLD 4096
+
+// Longest dictionary name and most dictionaries that can be added
+#define ATOM_CODEC_DICT_NAME_MAXLEN 32
+#define ATOM_CODEC_MAX_DICTS 16
+
+// Longest value of the codec key
+#define ATOM_CODEC_VALUE_MAXLEN (8 + ATOM_CODEC_DICT_NAME_MAXLEN)
+
+// Codec for a stream or command. Data under threshold bytes, 0 for the
+//	default, is written as-is. level is the LZ4 acceleration or Zstd level,
+//	0 for the library's default. dict names a dictionary added with
+//	atom_codec_add_dict, or is empty for none. Readers need the same
+//	dictionary added under the same name.
+struct atom_codec {
+	enum atom_codec_type type;
+	size_t threshold;
+	int level;
+	char dict[ATOM_CODEC_DICT_NAME_MAXLEN];
+};
+
+// Buffer values are compressed into, grown as needed s.t. a writer can
+//	keep reusing it
+struct atom_codec_buffer {
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+};
+
+// Whether the codec is built in
+bool atom_codec_supported(
+	enum atom_codec_type type);
+
+// Adds a dictionary, e.g. one trained with zstd --train on representative
+//	data, under a name. The data is copied. Returns false if the name is
+//	taken or there's no room.
+bool atom_codec_add_dict(
+	const char *name,
+	const void *data,
+	size_t len);
+
+// Whether data totalling len bytes should be compressed with the codec
+bool atom_codec_should_encode(
+	const struct atom_codec *codec,
+	size_t len);
+
+// Writes the value of the codec key for the codec, returning its length
+size_t atom_codec_key_value(
+	const struct atom_codec *codec,
+	char value[ATOM_CODEC_VALUE_MAXLEN]);
+
+// Compresses a value into the buffer with its frame header. Returns false
+//	if the codec isn't built in, its dictionary wasn't added or it fails.
+bool atom_codec_encode(
+	const struct atom_codec *codec,
+	const uint8_t *data,
+	size_t len,
+	struct atom_codec_buffer *buf);
+
+// Decompresses, in place, each framed value in an entry's key/value reply
+//	using the codec noted in the codec key value. The codec key value is
+//	then emptied s.t. decoding again does nothing.
+bool atom_codec_decode_kv(
+	redisReply *kv,
+	redisReply *codec_value);
+
+// Frees a buffer's memory
+void atom_codec_buffer_free(
+	struct atom_codec_buffer *buf);
+
+#ifdef __cplusplus
+ }
+#endif
+
+#endif // __ATOM_CODEC_H
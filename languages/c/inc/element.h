@@ -15,12 +15,16 @@
  extern "C" {
 #endif
 
+#include <pthread.h>
+
 #include "atom.h"
 #include "redis.h"
 #include "element_command_send.h"
 #include "element_command_server.h"
+#include "element_command_shm.h"
 #include "element_entry_read.h"
 #include "element_entry_write.h"
+#include "trace.h"
 
 // Element itself. Element consists of a name, command stream
 //	and response stream.
@@ -44,7 +48,19 @@ struct element {
 		char last_id[STREAM_ID_BUFFLEN];
 		redisContext *ctx;
 		struct element_command *hash[ELEMENT_COMMAND_HASH_N_BINS];
+
+		// Held while a command handler runs s.t. the command loop and
+		//	the shared-memory channel run them one at a time
+		pthread_mutex_t lock;
+		struct element_command_shm_server *shm;
 	} command;
+
+	// Shared-memory channels to the commands of other elements on the
+	//	host, see element_command_shm.h
+	struct _element_shm_info {
+		pthread_mutex_t lock;
+		struct element_command_shm_client *clients;
+	} shm;
 };
 
 // Initializes an element of the given name.
@@ -57,6 +73,14 @@ void element_cleanup(
 	redisContext *ctx,
 	struct element *elem);
 
+// Gets back a context the element lost its connection on, reconnecting
+//	it in place. Keeps trying if forever is set, else gives up after
+//	REDIS_RECONNECT_DEFAULT_TIMEOUT_MS.
+bool element_reconnect(
+	redisContext *ctx,
+	struct element *elem,
+	bool forever);
+
 #ifdef __cplusplus
  }
 #endif
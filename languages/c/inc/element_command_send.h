@@ -17,6 +17,7 @@
 
 #include "atom.h"
 #include "redis.h"
+#include "codec.h"
 
 // Forward declaration of the element struct
 struct element;
@@ -40,6 +41,24 @@ enum atom_error_t element_command_send(
 	void *user_data,
 	char **error_str);
 
+// Same as element_command_send, but if codec is non-NULL the data is
+//	compressed with it when it's over the codec's threshold
+enum atom_error_t element_command_send_codec(
+	redisContext *ctx,
+	struct element *elem,
+	const char *cmd_elem,
+	const char *cmd,
+	const uint8_t *data,
+	size_t data_len,
+	const struct atom_codec *codec,
+	bool block,
+	bool (*response_cb)(
+		const uint8_t *response,
+		size_t response_len,
+		void *user_data),
+	void *user_data,
+	char **error_str);
+
 #ifdef __cplusplus
  }
 #endif
@@ -17,6 +17,7 @@
 
 #include "atom.h"
 #include "redis.h"
+#include "codec.h"
 
 // Forward declaration of the element struct
 struct element;
@@ -48,6 +49,8 @@ struct element_command {
 	void (*cleanup)(void *cleanup_ptr);
 	int timeout;
 	void *user_data;
+	char *ser;
+	struct atom_codec codec;
 	struct element_command *next;
 };
 
@@ -73,6 +76,26 @@ bool element_command_add(
 	void *user_data,
 	int timeout);
 
+// Gets a command the element implements, or NULL if it doesn't
+struct element_command *element_command_get(
+	struct element *elem,
+	const char *command);
+
+// Sets the serialization method for a command's response data. If set,
+//	it's sent back to the caller in the "ser" key of each response s.t.
+//	they can deserialize the data automatically. Pass NULL to clear it.
+bool element_command_set_ser(
+	struct element *elem,
+	const char *command,
+	const char *ser);
+
+// Sets the codec a command's response data is compressed with when it's
+//	over the codec's threshold, see codec.h
+bool element_command_set_codec(
+	struct element *elem,
+	const char *command,
+	const struct atom_codec *codec);
+
 // Runs the command monitoring loop. Will perform XREADs on the command
 //	stream and process all commands. If loop is false will only do the XREAD
 //	once. If timeout is nonzero will return if we don't get a command
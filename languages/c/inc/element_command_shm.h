@@ -0,0 +1,117 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file element_command_shm.h
+//
+//  @brief Shared-memory channel for commands between elements on the same
+//			host. An element serving commands maps a segment with a few
+//			request/response slots and advertises it in redis under
+//			"atom:shm:<element>" along with the protocol version and its
+//			host. Callers on the same host that can map the segment put
+//			their command in a free slot and wait on it with a futex
+//			instead of going through the command and response streams.
+//			Anything that doesn't fit, e.g. no channel, a different host,
+//			all slots busy or data too big, goes over redis as usual.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ATOM_ELEMENT_COMMAND_SHM_H
+#define __ATOM_ELEMENT_COMMAND_SHM_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atom.h"
+#include "redis.h"
+#include "trace.h"
+
+// Forward declaration of the element struct
+struct element;
+
+// Key the channel is advertised under, followed by the element name. The
+//	value is "<version> <host> <segment name>"
+#define ELEMENT_COMMAND_SHM_KEY_PREFIX "atom:shm:"
+
+// Bump when the segment layout changes s.t. mismatched callers use redis
+#define ELEMENT_COMMAND_SHM_VERSION 3
+
+// Number of commands that can be in flight on a channel at once and the
+//	room for the request and response in each. Bigger requests go over
+//	redis, bigger responses are handed over in a segment of their own.
+#define ELEMENT_COMMAND_SHM_N_SLOTS 8
+#define ELEMENT_COMMAND_SHM_SLOT_DATA_LEN (64 * 1024)
+
+// How often the server notes it's alive, and how long it can go without
+//	doing so before callers give up on the channel and use redis. Callers
+//	waiting on a response give up on it if the server goes quiet.
+#define ELEMENT_COMMAND_SHM_HEARTBEAT_MS 100
+#define ELEMENT_COMMAND_SHM_STALE_MS 1000
+
+// How long a caller waits before looking for a channel to an element
+//	again after not finding one
+#define ELEMENT_COMMAND_SHM_RETRY_MS 5000
+
+// Set to 0 to turn the channel off, both for serving and for calling
+#define ELEMENT_COMMAND_SHM_ENV "ATOM_COMMAND_SHM"
+
+// Longest segment name
+#define ELEMENT_COMMAND_SHM_NAME_MAXLEN 256
+
+// If set, called by the serving thread after it takes a request and
+//	before it acks it. Only for tests, to stall the server there.
+extern void (*element_command_shm_received_hook)(void);
+
+// Whether the channel is turned on for the process
+bool element_command_shm_enabled(void);
+
+// Maps the element's segment, advertises it and starts the thread serving
+//	it. The element's command handlers are run one at a time between this
+//	thread and the command loop. Called by element_command_loop, does
+//	nothing if the channel's already started.
+enum atom_error_t element_command_shm_start(
+	redisContext *ctx,
+	struct element *elem);
+
+// Stops serving the channel and takes it down. Callers waiting on it fall
+//	back to redis.
+void element_command_shm_stop(
+	redisContext *ctx,
+	struct element *elem);
+
+// Tries to send a command over the channel to cmd_elem, with the same
+//	arguments as element_command_send. If trace is non-NULL the command's
+//	steps are traced as children of it and it's passed along to the
+//	element. Returns false if the command wasn't sent s.t. the caller
+//	sends it over redis, else true with the result of the command in ret.
+bool element_command_shm_send(
+	redisContext *ctx,
+	struct element *elem,
+	const char *cmd_elem,
+	const char *cmd,
+	const uint8_t *data,
+	size_t data_len,
+	bool block,
+	bool (*response_cb)(
+		const uint8_t *response,
+		size_t response_len,
+		void *user_data),
+	void *user_data,
+	char **error_str,
+	const struct atom_trace_context *trace,
+	enum atom_error_t *ret);
+
+// Unmaps the channels the element has sent commands over
+void element_command_shm_clients_cleanup(
+	struct element *elem);
+
+#ifdef __cplusplus
+ }
+#endif
+
+#endif // __ATOM_ELEMENT_COMMAND_SHM_H
@@ -51,7 +51,8 @@ enum atom_error_t element_entry_read_loop(
 	bool loop_forever,
 	int timeout);
 
-// Allows an element to get the N most recent items on a stream
+// Allows an element to get the N most recent items on a stream.
+//	ctx can be NULL to use the calling thread's cached connection.
 enum atom_error_t element_entry_read_n(
 	redisContext *ctx,
 	struct element *elem,
@@ -59,7 +60,8 @@ enum atom_error_t element_entry_read_n(
 	size_t n);
 
 // Reads at most N items that have happened since the passed
-//	last_seen_id
+//	last_seen_id.
+//	ctx can be NULL to use the calling thread's cached connection.
 #define ENTRY_READ_SINCE_BEGIN_BLOCKING_WITH_NEWEST_ID "$"
 #define ENTRY_READ_SINCE_BEGIN_WITH_OLDEST_ID "0"
 enum atom_error_t element_entry_read_since(
@@ -70,6 +72,80 @@ enum atom_error_t element_entry_read_since(
 	int timeout,
 	size_t maxcount);
 
+// Reads all items on a stream between two IDs, inclusive, calling the
+//	response callback on each in order. Items are paged in page_size at a
+//	time s.t. memory use doesn't depend on the size of the range. Returning
+//	false from the response callback stops the read without an error. An
+//	entry that can't be parsed stops it with ATOM_DESERIALIZATION_ERROR.
+//	ctx can be NULL to use the calling thread's cached connection.
+#define ENTRY_READ_RANGE_OLDEST_ID "-"
+#define ENTRY_READ_RANGE_NEWEST_ID "+"
+#define ENTRY_READ_RANGE_DEFAULT_PAGE_SIZE REDIS_XRANGE_DEFAULT_COUNT
+enum atom_error_t element_entry_read_range(
+	redisContext *ctx,
+	struct element *elem,
+	struct element_entry_read_info *info,
+	const char *start_id,
+	const char *end_id,
+	size_t page_size);
+
+// Subscription to the streams in the infos. It keeps the last ID read
+//	on each stream s.t. it can be polled over and over without setting
+//	anything up again and without missing what's written between polls.
+//	The infos need to stay around for as long as the subscription.
+struct element_entry_subscription {
+	struct element *elem;
+	struct element_entry_read_info *infos;
+	struct redis_stream_info *stream_infos;
+	size_t n_infos;
+};
+
+// Makes a subscription reading from start_id on, or from now on if it's
+//	ELEMENT_ENTRY_SUBSCRIPTION_START_NOW. Returns NULL on error.
+//	ctx can be NULL to use the calling thread's cached connection.
+#define ELEMENT_ENTRY_SUBSCRIPTION_START_NOW NULL
+struct element_entry_subscription *element_entry_subscription_init(
+	redisContext *ctx,
+	struct element *elem,
+	struct element_entry_read_info *infos,
+	size_t n_infos,
+	const char *start_id);
+
+// Reads entries on the subscription, calling the response callbacks,
+//	until at least n have been read or timeout ms have passed. Pass
+//	REDIS_XREAD_BLOCK_INDEFINITE to wait as long as it takes or
+//	REDIS_XREAD_DONTBLOCK to only read what's there already. Timing out
+//	isn't an error. If n_read is non-NULL it gets the number read.
+//	ctx can be NULL to use the calling thread's cached connection.
+enum atom_error_t element_entry_subscription_poll(
+	redisContext *ctx,
+	struct element_entry_subscription *sub,
+	size_t n,
+	int timeout,
+	size_t *n_read);
+
+// Cleans up a subscription
+void element_entry_subscription_cleanup(
+	struct element_entry_subscription *sub);
+
+// Reads the newest entry of each of the streams at one point in time, in
+//	one round trip, calling the response callback of each info with its
+//	entry. Streams without any entries are skipped. If reference_ms is
+//	set, each stream's entry is instead the one of its newest window
+//	entries with the ID time closest to the reference, or to the newest
+//	entry of the first stream with ELEMENT_ENTRY_READ_ALIGN_FIRST.
+//	ctx can be NULL to use the calling thread's cached connection.
+#define ELEMENT_ENTRY_READ_LATEST 0
+#define ELEMENT_ENTRY_READ_ALIGN_FIRST UINT64_MAX
+#define ELEMENT_ENTRY_READ_DEFAULT_ALIGN_WINDOW 32
+enum atom_error_t element_entry_read_latest_multi(
+	redisContext *ctx,
+	struct element *elem,
+	struct element_entry_read_info *infos,
+	size_t n_infos,
+	uint64_t reference_ms,
+	size_t window);
+
 #ifdef __cplusplus
  }
 #endif
@@ -17,22 +17,66 @@
 
 #include "atom.h"
 #include "redis.h"
+#include "codec.h"
+#include "trace.h"
 
 // Defaults for the data stream.
 #define ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP 0
 #define ELEMENT_DATA_WRITE_DEFAULT_MAXLEN 1024
 
+// Default number of writes between retention trims
+#define ELEMENT_ENTRY_RETENTION_DEFAULT_TRIM_EVERY 16
+
 // Forward declaration of the element struct
 struct element;
 
+// Retention for a data stream on top of the maxlen passed to each write,
+//	0 turning either limit off. Entries older than max_age_ms on the
+//	server's clock are trimmed by ID, which needs redis >= 6.2, and the
+//	oldest entries are trimmed s.t. the stream holds about max_bytes of
+//	data. The writer turns the byte budget into a number of entries using
+//	the average size of what it wrote since the last trim. To keep writes
+//	cheap the trims are only done every trim_every writes (0 for the
+//	default), pipelined with the write, and are approximate s.t. redis
+//	only drops whole nodes.
+struct element_entry_retention {
+	uint64_t max_age_ms;
+	uint64_t max_bytes;
+	unsigned int trim_every;
+};
+
 // Element data stream struct. Will allocate the memory for the XADD infos
 //	and initialize the stream for the droplets. Infos will be
 //	allocated to hold some more info than the user requests
-//	s.t. we can throw a timestamp and/or other things on there
+//	s.t. we can throw a timestamp and/or other things on there. If ser
+//	is non-NULL it's written in the "ser" key of each entry to note how
+//	the values were serialized. Set retention to have the stream
+//	trimmed by age and/or size, and codec to have the values compressed.
+//	While tracing each entry also gets a trace key.
 struct element_entry_write_info {
 	struct redis_xadd_info *items;
 	size_t n_items;
-	char stream[STREAM_ID_BUFFLEN];
+	const char *ser;
+	char stream[ATOM_NAME_MAXLEN];
+	struct element_entry_retention retention;
+	struct atom_codec codec;
+
+	// Writes and bytes written since the last trim
+	unsigned int trim_writes;
+	uint64_t trim_bytes;
+
+	// What's written when the values are compressed, s.t. the items the
+	//	caller filled in are left alone
+	struct redis_xadd_info *codec_items;
+	struct atom_codec_buffer *codec_buffers;
+	char codec_value[ATOM_CODEC_VALUE_MAXLEN];
+
+	// Value of the trace key while tracing, see trace.h
+	char trace_value[ATOM_TRACE_VALUE_MAXLEN];
+
+	// Whether the stream's been registered. That's done after the first
+	//	write s.t. watchers are only told about streams that exist
+	bool registered;
 };
 
 // Initializes a stream. Once this is done
@@ -49,15 +93,35 @@ void element_entry_write_cleanup(
 	redisContext *ctx,
 	struct element_entry_write_info *stream);
 
+// Frees the info for a stream without removing the stream itself, for
+//	when others should still be able to read what was written
+void element_entry_write_free(
+	struct element_entry_write_info *stream);
+
 // Adds data to an element stream. The stream struct contains
 //	an aray of XADD infos where the user will be responsible for filling
 //	out the value for each piece of data.
+//	ctx can be NULL to use the calling thread's cached connection.
 enum atom_error_t element_entry_write(
 	redisContext *ctx,
 	struct element_entry_write_info *stream,
 	int timestamp,
 	int maxlen);
 
+// Writes an entry to each of the streams atomically and in one round
+//	trip, e.g. to publish the same entry on a raw and a downsampled
+//	stream. Each info needs its items filled in as for
+//	element_entry_write and can only be passed once. If ret_ids is
+//	non-NULL it gets the ID of each entry in the order of the infos.
+//	ctx can be NULL to use the calling thread's cached connection.
+enum atom_error_t element_entry_write_multi(
+	redisContext *ctx,
+	struct element_entry_write_info **infos,
+	size_t n_infos,
+	int timestamp,
+	int maxlen,
+	char (*ret_ids)[STREAM_ID_BUFFLEN]);
+
 #ifdef __cplusplus
  }
 #endif
@@ -17,9 +17,12 @@
 
 #include <hiredis/hiredis.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-// Default address and port of the local redis server
+// Default socket of the local redis server and the environment
+//	variable that overrides it
 #define REDIS_DEFAULT_LOCAL_SOCKET "/shared/redis.sock"
+#define REDIS_LOCAL_SOCKET_ENV "ATOM_NUCLEUS_SOCKET"
 
 // Default address and port of the remote redis server
 #define REDIS_DEFAULT_REMOTE_ADDR "127.0.0.1"
@@ -71,6 +74,12 @@ struct redis_xread_kv_item {
 	redisReply *reply;
 };
 
+// Gets the server's current time as a stream ID, a little early s.t. no
+//	new entries are skipped. See redis_clock_get.
+bool redis_get_time_id(
+	redisContext *ctx,
+	char id[STREAM_ID_BUFFLEN]);
+
 // Initializes a stream info s.t. it's ready for pub-sub like blocking
 //	for xread. CTX may be NULL if last_id is provided. If last_id is NULL
 //	then ctx will be used to get the current time and use that as the
@@ -116,6 +125,41 @@ bool redis_xrevrange(
 	size_t n,
 	void *user_data);
 
+// Iterator over a range of a stream. Pages through the range with
+//	XRANGE COUNT at a time, requesting the next page before handing
+//	out the current one.
+#define REDIS_XRANGE_DEFAULT_COUNT 256
+struct redis_xrange_iter {
+	redisContext *ctx;
+	char *name;
+	char next_id[STREAM_ID_BUFFLEN];
+	char end_id[STREAM_ID_BUFFLEN];
+	size_t count;
+	redisReply *page;
+	size_t item;
+	bool pending;
+};
+
+// Starts iterating over the entries between the start and end IDs,
+//	inclusive. "-" and "+" can be used for the oldest and newest entries
+bool redis_xrange_iter_init(
+	redisContext *ctx,
+	struct redis_xrange_iter *iter,
+	const char *stream_name,
+	const char *start_id,
+	const char *end_id,
+	size_t count);
+
+// Gets the next entry in the range. *id is NULL once we're out of entries
+bool redis_xrange_iter_next(
+	struct redis_xrange_iter *iter,
+	const char **id,
+	const struct redisReply **data);
+
+// Cleans up the iterator
+void redis_xrange_iter_cleanup(
+	struct redis_xrange_iter *iter);
+
 // Adds data to ,a stream with a given max length.
 #define REDIS_XADD_NO_MAXLEN (-1)
 bool redis_xadd(
@@ -127,6 +171,85 @@ bool redis_xadd(
 	bool approx_maxlen,
 	char ret_id[STREAM_ID_BUFFLEN]);
 
+// Queues an XADD without sending it s.t. several can be pipelined.
+//	Each needs its reply gotten with redis_xadd_get_reply.
+bool redis_xadd_append(
+	redisContext *ctx,
+	const char *stream_name,
+	struct redis_xadd_info *infos,
+	size_t info_len,
+	int maxlen,
+	bool approx_maxlen);
+
+// Gets the reply to an XADD queued with redis_xadd_append
+bool redis_xadd_get_reply(
+	redisContext *ctx,
+	char ret_id[STREAM_ID_BUFFLEN]);
+
+// Queues an XTRIM without sending it s.t. it can be pipelined with
+//	writes. Keeps the newest threshold entries or, if minid, the entries
+//	with IDs from threshold ms on. MINID needs redis >= 6.2.
+bool redis_xtrim_append(
+	redisContext *ctx,
+	const char *stream_name,
+	bool minid,
+	uint64_t threshold,
+	bool approx);
+
+// Gets the reply to an XTRIM queued with redis_xtrim_append
+bool redis_xtrim_get_reply(
+	redisContext *ctx,
+	long long *n_trimmed);
+
+// Queues an XREVRANGE of the n newest entries on the stream s.t.
+//	several can be pipelined or put in a transaction
+bool redis_xrevrange_append(
+	redisContext *ctx,
+	const char *stream_name,
+	size_t n);
+
+// Gets the time in ms from a stream ID
+uint64_t redis_stream_id_ms(
+	const char *id);
+
+// Queues the MULTI/EXEC around commands appended in between s.t. they're
+//	run atomically in one round trip
+bool redis_multi_append(
+	redisContext *ctx);
+bool redis_exec_append(
+	redisContext *ctx);
+bool redis_discard_append(
+	redisContext *ctx);
+
+// Gets the replies to a transaction of n_queued commands. Returns the
+//	reply to the EXEC with the replies to each command, which needs to be
+//	freed with freeReplyObject, or NULL if the transaction failed or was
+//	discarded.
+redisReply *redis_exec_get_reply(
+	redisContext *ctx,
+	size_t n_queued);
+
+// Calls the callback with each member of the set for which the key made
+//	by putting key_prefix in front of the member exists. Takes two round
+//	trips no matter the number of members. Returns the number of times
+//	the callback was called or -1 on error.
+int redis_get_set_members_existing(
+	redisContext *ctx,
+	const char *set,
+	const char *key_prefix,
+	bool (*data_cb)(const char *member, void *user_data),
+	void *user_data);
+
+// Adds the member to the set, or removes it if add is false, and
+//	publishes the message on the channel, in one round trip
+bool redis_set_update_publish(
+	redisContext *ctx,
+	const char *set,
+	const char *member,
+	bool add,
+	const char *channel,
+	const char *message);
+
 // Calls the callback with each key that matches the
 //	pattern. NOTE: the scanning API currently can be prone
 //	to duplicates. Returns the number of times the callback
@@ -164,6 +287,169 @@ redisContext *redis_context_init(void);
 // Frees a redis context
 void redis_context_cleanup(redisContext *ctx);
 
+// Bounds of the backoff between reconnect attempts. Each failed attempt
+//	doubles the delay, and a random amount of up to half of it is taken
+//	off s.t. clients that lost redis at the same time don't all come back
+//	at the same time.
+#define REDIS_RECONNECT_BACKOFF_MIN_MS 10
+#define REDIS_RECONNECT_BACKOFF_MAX_MS 2000
+
+// How long a cached connection can sit unused before it's PINGed to
+//	make sure it's still good before handing it out
+#define REDIS_THREAD_CONTEXT_IDLE_CHECK_MS 5000
+
+// Backoff state for reconnecting
+struct redis_backoff {
+	int delay_ms;
+	uint64_t next_attempt_ms;
+};
+
+// Gets a monotonic time in ms
+uint64_t redis_monotonic_ms(void);
+
+// Resets the backoff after a successful connect
+void redis_backoff_reset(
+	struct redis_backoff *backoff);
+
+// Notes a failed attempt. Returns how long to wait before the next one
+int redis_backoff_failed(
+	struct redis_backoff *backoff);
+
+// Whether the backoff has passed s.t. it's OK to try again
+bool redis_backoff_ready(
+	const struct redis_backoff *backoff);
+
+// Gets this thread's cached connection, connecting if needed. Meant for
+//	calls that aren't passed a context. Returns NULL if redis can't be
+//	reached, and won't try again until the backoff has passed. The
+//	connection belongs to the thread and is freed when it exits.
+redisContext *redis_context_thread(void);
+
+// Drops this thread's cached connection, e.g. after an error on it.
+//	The next redis_context_thread() reconnects.
+void redis_context_thread_drop(void);
+
+// How much is read off the socket at a time when getting replies. hiredis
+//	reads 16k at a time, which takes hundreds of read()s for a large entry.
+//	This doesn't help small commands, which still take a write() and a
+//	read() each unless they're pipelined or go through io_uring, see the
+//	README.
+#define REDIS_READ_CHUNK_LEN (256 * 1024)
+
+// Set to 0 to not use io_uring for round trips in a build with it, i.e.
+//	made with ATOM_URING=1
+#define REDIS_URING_ENV "ATOM_REDIS_URING"
+
+// Number of entries in each thread's ring. A round trip takes two.
+#define REDIS_URING_ENTRIES 8
+
+// Gets the next reply, same as redisGetReply but reading
+//	REDIS_READ_CHUNK_LEN at a time. Everything appended is flushed first.
+//	With io_uring the flush and the read are one syscall.
+int redis_get_reply(
+	redisContext *ctx,
+	void **reply);
+
+// Whether round trips go through io_uring. Always false if the library
+//	was built without it.
+bool redis_uring_enabled(void);
+
+// Turns io_uring on or off for the process. Threads that can't set up a
+//	ring, e.g. on a kernel without it, use the socket as usual.
+void redis_uring_enable(
+	bool enable);
+
+// Sends a command and gets its reply, same as redisCommandArgv but
+//	reading with redis_get_reply
+redisReply *redis_command_argv(
+	redisContext *ctx,
+	int argc,
+	const char **argv,
+	const size_t *argvlen);
+
+// Counters for connections that were lost and gotten back with
+//	redis_context_reconnect(). Times are in ms from when the connection
+//	was found broken to when it was back.
+struct redis_reconnect_stats {
+	uint64_t n_disconnects;
+	uint64_t n_reconnects;
+	uint64_t n_failed_attempts;
+	uint64_t last_reconnect_ms;
+	uint64_t max_reconnect_ms;
+	uint64_t total_reconnect_ms;
+};
+
+// Timeout to pass to redis_context_reconnect to keep trying until redis
+//	comes back
+#define REDIS_RECONNECT_FOREVER 0
+
+// Default time to spend trying to reconnect when not looping forever
+#define REDIS_RECONNECT_DEFAULT_TIMEOUT_MS 5000
+
+// Reconnects a broken context in place s.t. everyone holding it can keep
+//	using it. Tries with backoff until it's back or timeout_ms has passed.
+bool redis_context_reconnect(
+	redisContext *ctx,
+	int timeout_ms);
+
+// Gets the counters for the reconnects done in this process
+void redis_get_reconnect_stats(
+	struct redis_reconnect_stats *stats);
+
+// Offset from the local monotonic clock to the server's clock. It's
+//	measured with a few TIME round trips, keeping the one with the lowest
+//	RTT, and kept per context since contexts can go to different servers.
+//	Times are in us unless noted.
+struct redis_clock {
+	int64_t offset_us;
+	uint64_t rtt_us;
+	uint64_t synced_ms;
+	bool valid;
+};
+
+// Number of round trips per measurement and how often it's refreshed
+#define REDIS_CLOCK_SYNC_SAMPLES 3
+#define REDIS_CLOCK_REFRESH_MS 60000
+
+// How many contexts have their own offset. Past this the one measured the
+//	longest ago is dropped.
+#define REDIS_CLOCK_MAX_CONTEXTS 64
+
+// How old the offset can be when it's used for the ID a read starts from,
+//	and how much further back than the RTT the ID is moved, s.t. a server
+//	clock that's been stepped or slewed doesn't put it past new entries.
+//	Refreshing for this is a single round trip. See redis_get_time_id.
+#define REDIS_CLOCK_ID_MAX_AGE_MS 1000
+#define REDIS_CLOCK_ID_MARGIN_MS 5
+
+// Measures the offset to the server's clock for ctx now
+bool redis_clock_sync(
+	redisContext *ctx);
+
+// Drops the offset measured for ctx. Done when it's cleaned up.
+void redis_clock_forget(
+	const redisContext *ctx);
+
+// Gets the clock offset for ctx, measuring it if it hasn't been yet or
+//	it's stale. ctx can be NULL to use the offset most recently measured
+//	by any context without a round trip. Returns false if there's no offset.
+bool redis_clock_get(
+	redisContext *ctx,
+	struct redis_clock *clock);
+
+// Gets what the server's clock reads now in ms without a round trip once
+//	the offset is known
+bool redis_clock_server_ms(
+	redisContext *ctx,
+	uint64_t *ms);
+
+// Converts the time in a stream ID to ms on the local monotonic clock,
+//	s.t. the latency of an entry is redis_monotonic_ms() minus it
+bool redis_clock_id_to_monotonic_ms(
+	redisContext *ctx,
+	const char *id,
+	uint64_t *ms);
+
 #ifdef __cplusplus
  }
 #endif
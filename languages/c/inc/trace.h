@@ -0,0 +1,170 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file trace.h
+//
+//  @brief Tracing of commands and entries across elements. When tracing is
+//			on, commands, ACKs, responses and entries carry a "trace" key
+//			with the trace ID, the ID of the span that sent them and when
+//			they were sent. Each element records spans (XADD, queue wait,
+//			handler run, ACK/response wait, ...) into a ring buffer per
+//			thread, which can be dumped as Chrome trace/Perfetto JSON or
+//			published on the element's "trace" stream. Spans from all the
+//			elements in a chain share the trace ID, and timestamps are
+//			wall-clock us s.t. dumps from different elements line up.
+//			When tracing is off the cost is a branch on a global.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_TRACE_H
+#define __ATOM_TRACE_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <hiredis/hiredis.h>
+
+#include "atom.h"
+
+// Forward declaration of the element struct
+struct element;
+
+// Key the trace context is sent in. The value is
+//	"<trace ID>-<span ID>-<sent us>" with the IDs in hex
+#define ATOM_TRACE_KEY_STR "trace"
+
+// Longest value of the trace key
+#define ATOM_TRACE_VALUE_MAXLEN 64
+
+// Set to 1 to turn tracing on at startup
+#define ATOM_TRACE_ENV "ATOM_TRACE"
+
+// Number of spans kept per thread, older ones are overwritten
+#define ATOM_TRACE_RING_LEN 2048
+
+// Longest detail noted with a span, e.g. the element and command
+#define ATOM_TRACE_DETAIL_MAXLEN 64
+
+// Stream and key dumps are published on, and how many are kept
+#define ATOM_TRACE_STREAM_NAME "trace"
+#define ATOM_TRACE_STREAM_KEY_STR "json"
+#define ATOM_TRACE_STREAM_MAXLEN 16
+
+// Where a span fits in a trace. A trace ID of 0 means there's none.
+struct atom_trace_context {
+	uint64_t trace_id;
+	uint64_t span_id;
+	uint64_t sent_us;
+};
+
+// Span being timed. The name has to outlive the span, i.e. be a literal.
+struct atom_trace_span {
+	const char *name;
+	char detail[ATOM_TRACE_DETAIL_MAXLEN];
+	uint64_t trace_id;
+	uint64_t span_id;
+	uint64_t parent_id;
+	uint64_t start_us;
+	uint64_t dur_us;
+};
+
+// Initializer for a span that hasn't begun, s.t. ending it does nothing
+#define ATOM_TRACE_SPAN_INIT {NULL, {0}, 0, 0, 0, 0, 0}
+
+// Whether tracing is on: < 0 until the environment's been checked
+extern int atom_trace_on;
+
+// Checks the environment for whether tracing is on
+bool atom_trace_init(void);
+
+// Whether tracing is on
+static inline bool atom_trace_enabled(void)
+{
+	int on = __atomic_load_n(&atom_trace_on, __ATOMIC_RELAXED);
+
+	return __builtin_expect(on > 0, 0) ||
+		(__builtin_expect(on < 0, 0) && atom_trace_init());
+}
+
+// Turns tracing on or off for the process
+void atom_trace_enable(
+	bool enable);
+
+// Wall-clock time in us, which span times are in
+uint64_t atom_trace_now_us(void);
+
+// Starts timing a span. It's a child of parent if non-NULL, else of the
+//	thread's current span, else it starts a new trace.
+void atom_trace_begin(
+	struct atom_trace_span *span,
+	const struct atom_trace_context *parent,
+	const char *name,
+	const char *detail_fmt,
+	...) __attribute__((format(printf, 4, 5)));
+
+// Stops timing a span and records it in the thread's ring. Does nothing
+//	for a span that wasn't begun or has already ended.
+void atom_trace_end(
+	struct atom_trace_span *span);
+
+// Gets the context to send for children of the span, sent now
+void atom_trace_span_context(
+	const struct atom_trace_span *span,
+	struct atom_trace_context *context);
+
+// Sets the span spans begun on this thread are children of, e.g. while
+//	running a command's handler. NULL clears it. The previous one is
+//	put in prev if non-NULL s.t. it can be restored.
+void atom_trace_set_current(
+	const struct atom_trace_context *context,
+	struct atom_trace_context *prev);
+
+// Writes the value of the trace key for a context, returning its length
+size_t atom_trace_value(
+	const struct atom_trace_context *context,
+	char value[ATOM_TRACE_VALUE_MAXLEN]);
+
+// Parses the value of a trace key
+bool atom_trace_parse(
+	const char *value,
+	size_t len,
+	struct atom_trace_context *context);
+
+// Finds and parses the trace key in an entry's key/value reply
+bool atom_trace_find(
+	const redisReply *kv,
+	struct atom_trace_context *context);
+
+// Writes the spans recorded on all threads as Chrome trace JSON, with the
+//	process named process_name if non-NULL. If clear is set the spans
+//	are dropped once written.
+bool atom_trace_dump(
+	FILE *f,
+	const char *process_name,
+	bool clear);
+
+// Same as atom_trace_dump but into a string the caller frees
+char *atom_trace_dump_str(
+	const char *process_name,
+	bool clear,
+	size_t *len);
+
+// Publishes a dump on the element's trace stream
+enum atom_error_t atom_trace_publish(
+	redisContext *ctx,
+	struct element *elem,
+	bool clear);
+
+// Drops the spans recorded on all threads
+void atom_trace_clear(void);
+
+#ifdef __cplusplus
+ }
+#endif
+
+#endif // __ATOM_TRACE_H
@@ -14,16 +14,13 @@
 #include <stdbool.h>
 #include <string.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <assert.h>
-#include <unistd.h>
-#include <limits.h>
 
 #include "redis.h"
 #include "atom.h"
 #include "element.h"
 
-#define ATOM_LOG_DEFAULT_ELEMENT_NAME "none"
-
 // User data callback to send to the redis helper for finding elements
 struct atom_get_element_cb_info {
 	bool (*user_cb)(const char *key, void *user_data);
@@ -34,9 +31,110 @@ struct atom_get_element_cb_info {
 struct atom_get_data_stream_cb_info {
 	bool (*user_cb)(const char *stream, void *user_data);
 	void *user_data;
+	const char *prefix;
 	size_t offset;
+	int n_filtered;
+};
+
+// Number of items to start the list builder with
+#define ATOM_LIST_BUILDER_INITIAL_LEN 64
+
+// Items collected to make a sorted list out of
+struct atom_list_builder {
+	char **items;
+	size_t n_items;
+	size_t max_items;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Whether discovery should also SCAN for elements and streams
+//			that aren't in the registry, i.e. ones from libraries that
+//			don't register
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool atom_discovery_scan(void)
+{
+	const char *scan = getenv(ATOM_DISCOVERY_SCAN_ENV);
+	return (scan != NULL) && (scan[0] != '\0') && (strcmp(scan, "0") != 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds to or removes from a registry set and lets watchers know.
+//			The message is the key that was added or removed with a
+//			+ or - in front of it.
+//
+////////////////////////////////////////////////////////////////////////////////
+static enum atom_error_t atom_registry_update(
+	redisContext *ctx,
+	const char *set,
+	const char *member,
+	const char *key,
+	bool add)
+{
+	char message[ATOM_NAME_MAXLEN + 2];
+	enum atom_error_t err = ATOM_INTERNAL_ERROR;
+
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		err = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	if (snprintf(message, sizeof(message), "%c%s",
+		add ? ATOM_REGISTRY_ADD : ATOM_REGISTRY_REMOVE, key) >= sizeof(message))
+	{
+		goto done;
+	}
+
+	if (!redis_set_update_publish(ctx, set, member, add,
+		ATOM_REGISTRY_CHANNEL, message))
+	{
+		err = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	err = ATOM_NO_ERROR;
+
+done:
+	return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Registers an element s.t. it can be found without a SCAN
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t atom_register_element(
+	redisContext *ctx,
+	const char *element,
+	bool add)
+{
+	char key[ATOM_NAME_MAXLEN];
+
+	if (atom_get_command_stream_str(element, key) == NULL) {
+		return ATOM_INTERNAL_ERROR;
+	}
+
+	return atom_registry_update(ctx, ATOM_REGISTRY_ELEMENTS_KEY,
+		element, key, add);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Registers a data stream s.t. it can be found without a SCAN
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t atom_register_data_stream(
+	redisContext *ctx,
+	const char *stream_key,
+	bool add)
+{
+	return atom_registry_update(ctx, ATOM_REGISTRY_STREAMS_KEY,
+		stream_key, stream_key, add);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  @brief Data callback for when we get a key that matches the element
@@ -71,25 +169,47 @@ enum atom_error_t atom_get_all_elements_cb(
 	void *user_data)
 {
 	struct atom_get_element_cb_info info;
+	int n_found;
 	enum atom_error_t err = ATOM_INTERNAL_ERROR;
 
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		err = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
 	// Set up the callback info s.t. when our cb is called we can pass
 	//	it along to the user
 	info.user_cb = data_cb;
 	info.user_data = user_data;
 
-	// Want to get all matching keys for the element command stream prefix.
-	//
-	if (redis_get_matching_keys(ctx,
-		ATOM_COMMAND_STREAM_PREFIX "*",
-		atom_get_element_cb,
-		&info) < 0)
-	{
-		atom_logf(ctx, NULL, LOG_ERR, "Failed to check for elements");
+	// Look in the registry first. Only the elements whose command stream
+	//	is still around are passed on
+	n_found = redis_get_set_members_existing(ctx,
+		ATOM_REGISTRY_ELEMENTS_KEY,
+		ATOM_COMMAND_STREAM_PREFIX,
+		data_cb,
+		user_data);
+	if (n_found < 0) {
+		atom_logf(ctx, NULL, LOG_ERR, "Failed to check the element registry");
 		err = ATOM_REDIS_ERROR;
 		goto done;
 	}
 
+	// If nothing's registered or we were asked to, fall back to
+	//	scanning for all command streams
+	if ((n_found == 0) || atom_discovery_scan()) {
+		if (redis_get_matching_keys(ctx,
+			ATOM_COMMAND_STREAM_PREFIX "*",
+			atom_get_element_cb,
+			&info) < 0)
+		{
+			atom_logf(ctx, NULL, LOG_ERR, "Failed to check for elements");
+			err = ATOM_REDIS_ERROR;
+			goto done;
+		}
+	}
+
 	err = ATOM_NO_ERROR;
 
 done:
@@ -116,6 +236,29 @@ static bool atom_get_data_stream_cb(
 	return info->user_cb(&key[info->offset], info->user_data);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Data callback for each stream in the registry. The registry
+//			has the streams of all elements, so need to filter on the
+//			prefix before passing it along
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool atom_get_registered_data_stream_cb(
+	const char *key,
+	void *user_data)
+{
+	struct atom_get_data_stream_cb_info *info;
+
+	info = (struct atom_get_data_stream_cb_info*)user_data;
+
+	if (strncmp(key, info->prefix, info->offset) != 0) {
+		info->n_filtered++;
+		return true;
+	}
+
+	return info->user_cb(&key[info->offset], info->user_data);
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -132,12 +275,21 @@ enum atom_error_t atom_get_all_data_streams_cb(
 {
 	struct atom_get_data_stream_cb_info info;
 	char stream_prefix_buffer[128];
+	int n_found;
 	enum atom_error_t err = ATOM_INTERNAL_ERROR;
 
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		err = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
 	// Set up the callback info s.t. when our cb is called we can pass
 	//	it along to the user
 	info.user_cb = data_cb;
 	info.user_data = user_data;
+	info.prefix = stream_prefix_buffer;
+	info.n_filtered = 0;
 
 	// Make the stream pattern
 	if (element != NULL) {
@@ -150,17 +302,32 @@ enum atom_error_t atom_get_all_data_streams_cb(
 		info.offset = CONST_STRLEN(ATOM_DATA_STREAM_PREFIX);
 	}
 
-	// Want to get all matching keys for the element command stream prefix.
-	if (redis_get_matching_keys(ctx,
-		stream_prefix_buffer,
-		atom_get_data_stream_cb,
-		&info) < 0)
-	{
-		atom_logf(ctx, NULL, LOG_ERR, "Failed to check for streams");
+	// Look in the registry first
+	n_found = redis_get_set_members_existing(ctx,
+		ATOM_REGISTRY_STREAMS_KEY,
+		"",
+		atom_get_registered_data_stream_cb,
+		&info);
+	if (n_found < 0) {
+		atom_logf(ctx, NULL, LOG_ERR, "Failed to check the stream registry");
 		err = ATOM_REDIS_ERROR;
 		goto done;
 	}
 
+	// If none of the matching streams are registered or we were asked to,
+	//	fall back to scanning for them
+	if (((n_found - info.n_filtered) == 0) || atom_discovery_scan()) {
+		if (redis_get_matching_keys(ctx,
+			stream_prefix_buffer,
+			atom_get_data_stream_cb,
+			&info) < 0)
+		{
+			atom_logf(ctx, NULL, LOG_ERR, "Failed to check for streams");
+			err = ATOM_REDIS_ERROR;
+			goto done;
+		}
+	}
+
 	err = ATOM_NO_ERROR;
 
 done:
@@ -170,7 +337,7 @@ done:
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  @brief Gets a callback when an element/data stream
-//			is found. Adds it to the list, allocating the memory
+//			is found. Collects it in the builder, growing it
 //			as needed
 //
 ////////////////////////////////////////////////////////////////////////////////
@@ -178,44 +345,72 @@ static bool atom_add_to_list(
 	const char *item,
 	void *user_data)
 {
-	struct atom_list_node **list;
-	struct atom_list_node *new_node;
-	int ret;
+	struct atom_list_builder *builder;
 
-	// Assign the user data to the list
-	list = (struct atom_list_node **)user_data;
+	builder = (struct atom_list_builder *)user_data;
 
-	// Want to see if the item is in the list or if we've gone
-	//	past the point in the list at which we should add the item
-	while ((*list) != NULL) {
-		ret = strcmp((*list)->name, item);
+	if (builder->n_items == builder->max_items) {
+		builder->max_items = (builder->max_items == 0) ?
+			ATOM_LIST_BUILDER_INITIAL_LEN : 2 * builder->max_items;
+		builder->items = realloc(builder->items,
+			builder->max_items * sizeof(char *));
+		assert(builder->items != NULL);
+	}
 
-		// If the item is in the list, we're done
-		if (ret == 0) {
-			return true;
+	builder->items[builder->n_items] = strdup(item);
+	assert(builder->items[builder->n_items] != NULL);
+	builder->n_items++;
 
-		// Else if the item is greater than the current item
-		//	we want to insert it where we are;
-		} else if (ret > 0) {
-			break;
+	return true;
+}
 
-		// Otherwise we want to keep iterating
-		} else {
-			list = &((*list)->next);
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Compares two items for sorting
+//
+////////////////////////////////////////////////////////////////////////////////
+static int atom_list_compare(
+	const void *a,
+	const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sorts the collected items and makes the list out of them,
+//			dropping duplicates. The list takes over the strings.
+//
+////////////////////////////////////////////////////////////////////////////////
+static struct atom_list_node *atom_list_build(
+	struct atom_list_builder *builder)
+{
+	struct atom_list_node *list = NULL;
+	struct atom_list_node *new_node;
+	size_t i;
+
+	qsort(builder->items, builder->n_items, sizeof(char *), atom_list_compare);
+
+	// Build it from the back s.t. each node goes on the front
+	for (i = builder->n_items; i > 0; --i) {
+		if ((list != NULL) && (strcmp(list->name, builder->items[i - 1]) == 0)) {
+			free(builder->items[i - 1]);
+			continue;
 		}
-	}
 
-	// If we got here then we want to make a new node
-	//	and put it in the list at the current location
-	new_node = malloc(sizeof(struct atom_list_node));
-	assert(new_node != NULL);
-	new_node->name = strdup(item);
-	assert(new_node->name != NULL);
+		new_node = malloc(sizeof(struct atom_list_node));
+		assert(new_node != NULL);
+		new_node->name = builder->items[i - 1];
+		new_node->next = list;
+		list = new_node;
+	}
 
-	new_node->next = *list;
-	*list = new_node;
+	free(builder->items);
+	builder->items = NULL;
+	builder->n_items = 0;
+	builder->max_items = 0;
 
-	return true;
+	return list;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -248,11 +443,16 @@ enum atom_error_t atom_get_all_elements(
 	redisContext *ctx,
 	struct atom_list_node **result)
 {
-	*result = NULL;
-	return atom_get_all_elements_cb(
+	struct atom_list_builder builder = { NULL, 0, 0 };
+	enum atom_error_t err;
+
+	err = atom_get_all_elements_cb(
 		ctx,
 		atom_add_to_list,
-		result);
+		&builder);
+	*result = atom_list_build(&builder);
+
+	return err;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -265,12 +465,17 @@ enum atom_error_t atom_get_all_data_streams(
 	const char *element,
 	struct atom_list_node **result)
 {
-	*result = NULL;
-	return atom_get_all_data_streams_cb(
+	struct atom_list_builder builder = { NULL, 0, 0 };
+	enum atom_error_t err;
+
+	err = atom_get_all_data_streams_cb(
 		ctx,
 		element,
 		atom_add_to_list,
-		result);
+		&builder);
+	*result = atom_list_build(&builder);
+
+	return err;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -429,157 +634,3 @@ char *atom_get_data_stream_str(
 
 	return ret;
 }
-
-////////////////////////////////////////////////////////////////////////////////
-//
-//  @brief Logs a message to the global log stream.
-//			- ctx can be NULL, but this is not recommended if it can be avoided
-//			as it's a performance hit to make the context.
-//			- element can be NULL as well, and if so the default element
-//			name will be logged
-//
-////////////////////////////////////////////////////////////////////////////////
-enum atom_error_t atom_log(
-	redisContext *ctx,
-	struct element *element,
-	int level,
-	const char *msg,
-	size_t msg_len)
-{
-	// Hostname, only need to get it once
-	static char hostname[HOST_NAME_MAX + 1];
-	static size_t hostname_len = 0;
-
-	struct redis_xadd_info infos[LOG_N_KEYS];
-	char level_str[2];
-	enum atom_error_t err = ATOM_INTERNAL_ERROR;
-	bool made_context = false;
-	FILE *f;
-
-	// Check the level
-	if ((level < LOG_EMERG) || (level > LOG_DEBUG)) {
-		err = ATOM_COMMAND_INVALID_DATA;
-		goto done;
-	}
-
-	// If we haven't gotten the hostname, we need to do so
-	if (hostname_len == 0) {
-		assert(gethostname(hostname, sizeof(hostname)) == 0);
-		hostname[HOST_NAME_MAX] = '\0';
-		hostname_len = strnlen(hostname, HOST_NAME_MAX);
-	}
-
-	// If we weren't passed a context then we'll make one
-	if (ctx == NULL) {
-		ctx = redis_context_init();
-		assert(ctx != NULL);
-		made_context = true;
-	}
-
-	// Make the level string
-	level_str[0] = '0' + level;
-	level_str[1] = '\0';
-
-	// Fill in the infos
-	infos[LOG_KEY_LEVEL].key = LOG_KEY_LEVEL_STR;
-	infos[LOG_KEY_LEVEL].key_len = sizeof(LOG_KEY_LEVEL_STR) - 1;
-	infos[LOG_KEY_LEVEL].data = (const uint8_t*)level_str;
-	infos[LOG_KEY_LEVEL].data_len = 1;
-
-	infos[LOG_KEY_ELEMENT].key = LOG_KEY_ELEMENT_STR;
-	infos[LOG_KEY_ELEMENT].key_len = sizeof(LOG_KEY_ELEMENT_STR) - 1;
-
-	if (element != NULL) {
-		infos[LOG_KEY_ELEMENT].data = (const uint8_t*)element->name.str;
-		infos[LOG_KEY_ELEMENT].data_len = element->name.len;
-	} else {
-		infos[LOG_KEY_ELEMENT].data = (const uint8_t*)ATOM_LOG_DEFAULT_ELEMENT_NAME;
-		infos[LOG_KEY_ELEMENT].data_len = sizeof(ATOM_LOG_DEFAULT_ELEMENT_NAME) - 1;
-	}
-
-	infos[LOG_KEY_MESSAGE].key = LOG_KEY_MESSAGE_STR;
-	infos[LOG_KEY_MESSAGE].key_len = sizeof(LOG_KEY_MESSAGE_STR) - 1;
-	infos[LOG_KEY_MESSAGE].data = (const uint8_t*)msg;
-	infos[LOG_KEY_MESSAGE].data_len = msg_len;
-
-	infos[LOG_KEY_HOST].key = LOG_KEY_HOST_STR;
-	infos[LOG_KEY_HOST].key_len = sizeof(LOG_KEY_HOST_STR) - 1;
-	infos[LOG_KEY_HOST].data = (const uint8_t*)hostname;
-	infos[LOG_KEY_HOST].data_len = hostname_len;
-
-	if (!redis_xadd(
-		ctx,
-		ATOM_LOG_STREAM_NAME,
-		infos,
-		LOG_N_KEYS,
-		ATOM_DEFAULT_MAXLEN,
-		true,
-		NULL))
-	{
-		err = ATOM_REDIS_ERROR;
-		goto done;
-	}
-
-	// If we made our context then we need to free it
-	if (made_context) {
-		redis_context_cleanup(ctx);
-	}
-
-	// And if we're printing logs to stdout we should do so
-	#ifdef ATOM_PRINT_LOGS
-		f = (level <= LOG_ERR) ? stderr : stdout;
-		fprintf(f, "Level: %d, Host: %s, Element: %s, Msg: %s\n",
-			level,
-			hostname,
-			(element != NULL) ?
-				element->name.str : ATOM_LOG_DEFAULT_ELEMENT_NAME,
-			msg);
-	#endif
-
-	err = ATOM_NO_ERROR;
-
-done:
-	return err;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-//
-//  @brief Logs a message to the global log stream using variadic args
-//
-////////////////////////////////////////////////////////////////////////////////
-enum atom_error_t atom_vlogf(
-	redisContext *ctx,
-	struct element *element,
-	int level,
-	const char *fmt,
-	va_list args)
-{
-    char log_buffer[ATOM_LOG_MAXLEN];
-    size_t len;
-
-    // Use the variadic version of snprintf
-    len = vsnprintf(log_buffer, sizeof(log_buffer), fmt, args);
-
-   	return atom_log(ctx, element, level, log_buffer, len);
-}
-
-////////////////////////////////////////////////////////////////////////////////
-//
-//  @brief Logs a message to the global log stream using printf-style formats
-//
-////////////////////////////////////////////////////////////////////////////////
-enum atom_error_t atom_logf(
-	redisContext *ctx,
-	struct element *element,
-	int level,
-	const char *fmt,
-	...)
-{
-    va_list args;
-
-    // Start the variadic list
-    va_start(args, fmt);
-
-    // Call the variadic version
-    return atom_vlogf(ctx, element, level, fmt, args);
-}
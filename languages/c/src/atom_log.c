@@ -0,0 +1,681 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file atom_log.c
+//
+//  @brief Implements logging to the global log stream. Log messages are
+//			put in a lock-free ring and shipped to redis by a background
+//			thread with its own connection, pipelining the XADDs in
+//			batches. This keeps logging off the caller's connection and
+//			out of its latency.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <hiredis/hiredis.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include "redis.h"
+#include "atom.h"
+#include "element.h"
+
+#define ATOM_LOG_DEFAULT_ELEMENT_NAME "none"
+
+// Slot in the log ring. seq is the position the slot can be written at
+//	when it's free and that position + 1 once it's been filled in
+struct atom_log_slot {
+	atomic_size_t seq;
+	int level;
+	size_t element_len;
+	size_t msg_len;
+	char element[ATOM_NAME_MAXLEN];
+	char msg[ATOM_LOG_MAXLEN];
+};
+
+// State of the log shipper. Producers claim positions at the tail of the
+//	ring and the shipper thread consumes from the head.
+struct atom_log_shipper {
+	struct atom_log_slot *ring;
+	size_t mask;
+	size_t batch_size;
+	int flush_ms;
+
+	atomic_size_t tail;
+	size_t head;
+
+	// Shipper thread and what it uses to wait on work
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t shipped;
+	bool stopping;
+	bool flush_requested;
+
+	// Position the shipper has gotten through, under the lock
+	size_t done;
+
+	// Shipper thread's cached connection while it's shipping a batch
+	redisContext *ctx;
+
+	char hostname[HOST_NAME_MAX + 1];
+	size_t hostname_len;
+};
+
+static struct atom_log_shipper shipper = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.shipped = PTHREAD_COND_INITIALIZER,
+};
+
+// Whether the shipper is up. Producers check this before touching the ring
+static atomic_bool shipper_running;
+
+// Producers between checking that the shipper is up and being done with
+//	the ring. Stopping waits for them s.t. the ring isn't freed under them.
+static atomic_uint shipper_producers;
+
+// Serializes starting and stopping the shipper
+static pthread_mutex_t shipper_start_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool shipper_handlers_registered;
+
+// Sampling for each level
+static atomic_uint sample_every[LOG_DEBUG + 1];
+static atomic_uint_fast64_t sample_count[LOG_DEBUG + 1];
+
+// Counters
+static atomic_uint_fast64_t stat_queued;
+static atomic_uint_fast64_t stat_shipped;
+static atomic_uint_fast64_t stat_dropped_full;
+static atomic_uint_fast64_t stat_dropped_sampled;
+static atomic_uint_fast64_t stat_dropped_error;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the time ms from now for a timed wait
+//
+////////////////////////////////////////////////////////////////////////////////
+static void atom_log_deadline(
+	struct timespec *ts,
+	int ms)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec += 1;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes a log message to the log stream on the shipper's
+//			connection. Only queues the XADD, the replies are gotten
+//			once the batch has been sent.
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool atom_log_ship_append(
+	struct atom_log_slot *slot)
+{
+	struct redis_xadd_info infos[LOG_N_KEYS];
+	char level_str[2];
+
+	// Make the level string
+	level_str[0] = '0' + slot->level;
+	level_str[1] = '\0';
+
+	// Fill in the infos
+	infos[LOG_KEY_LEVEL].key = LOG_KEY_LEVEL_STR;
+	infos[LOG_KEY_LEVEL].key_len = sizeof(LOG_KEY_LEVEL_STR) - 1;
+	infos[LOG_KEY_LEVEL].data = (const uint8_t*)level_str;
+	infos[LOG_KEY_LEVEL].data_len = 1;
+
+	infos[LOG_KEY_ELEMENT].key = LOG_KEY_ELEMENT_STR;
+	infos[LOG_KEY_ELEMENT].key_len = sizeof(LOG_KEY_ELEMENT_STR) - 1;
+	infos[LOG_KEY_ELEMENT].data = (const uint8_t*)slot->element;
+	infos[LOG_KEY_ELEMENT].data_len = slot->element_len;
+
+	infos[LOG_KEY_MESSAGE].key = LOG_KEY_MESSAGE_STR;
+	infos[LOG_KEY_MESSAGE].key_len = sizeof(LOG_KEY_MESSAGE_STR) - 1;
+	infos[LOG_KEY_MESSAGE].data = (const uint8_t*)slot->msg;
+	infos[LOG_KEY_MESSAGE].data_len = slot->msg_len;
+
+	infos[LOG_KEY_HOST].key = LOG_KEY_HOST_STR;
+	infos[LOG_KEY_HOST].key_len = sizeof(LOG_KEY_HOST_STR) - 1;
+	infos[LOG_KEY_HOST].data = (const uint8_t*)shipper.hostname;
+	infos[LOG_KEY_HOST].data_len = shipper.hostname_len;
+
+	// And if we're printing logs to stdout we should do so
+	#ifdef ATOM_PRINT_LOGS
+		fprintf((slot->level <= LOG_ERR) ? stderr : stdout,
+			"Level: %d, Host: %s, Element: %.*s, Msg: %.*s\n",
+			slot->level,
+			shipper.hostname,
+			(int)slot->element_len, slot->element,
+			(int)slot->msg_len, slot->msg);
+	#endif
+
+	if (shipper.ctx == NULL) {
+		return false;
+	}
+
+	return redis_xadd_append(
+		shipper.ctx,
+		ATOM_LOG_STREAM_NAME,
+		infos,
+		LOG_N_KEYS,
+		ATOM_DEFAULT_MAXLEN,
+		true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Ships up to a batch of log messages from the ring. Returns the
+//			number of messages taken off of the ring.
+//
+////////////////////////////////////////////////////////////////////////////////
+static size_t atom_log_ship_batch(void)
+{
+	struct atom_log_slot *slot;
+	size_t n_taken = 0;
+	size_t n_appended = 0;
+	size_t n_failed = 0;
+	size_t i;
+
+	// Queue an XADD for each filled-in slot at the head of the ring. Each
+	//	slot can be handed back to the producers as soon as it's been
+	//	queued since hiredis copies the command into its buffer.
+	while (n_taken < shipper.batch_size) {
+		slot = &shipper.ring[shipper.head & shipper.mask];
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+			shipper.head + 1)
+		{
+			break;
+		}
+
+		// Get the thread's cached connection. If redis isn't up we'll drop
+		//	this batch, and the cache backs off reconnecting s.t. we don't
+		//	hammer redis while it's down
+		if (n_taken == 0) {
+			shipper.ctx = redis_context_thread();
+		}
+
+		if (atom_log_ship_append(slot)) {
+			n_appended++;
+		} else {
+			n_failed++;
+		}
+
+		atomic_store_explicit(&slot->seq, shipper.head + shipper.mask + 1,
+			memory_order_release);
+		shipper.head++;
+		n_taken++;
+	}
+
+	// Send the batch and get the replies
+	for (i = 0; i < n_appended; ++i) {
+		if (!redis_xadd_get_reply(shipper.ctx, NULL)) {
+			n_failed++;
+			continue;
+		}
+		atomic_fetch_add(&stat_shipped, 1);
+	}
+	atomic_fetch_add(&stat_dropped_error, n_failed);
+
+	// If the connection broke then drop it s.t. we reconnect
+	if ((shipper.ctx != NULL) && shipper.ctx->err) {
+		redis_context_thread_drop();
+	}
+	shipper.ctx = NULL;
+
+	return n_taken;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Shipper thread. Ships full batches as soon as they're ready and
+//			whatever's in the ring every flush interval or when someone
+//			is waiting on a flush.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void *atom_log_shipper_thread(
+	void *arg)
+{
+	struct timespec deadline;
+	size_t n_taken;
+	bool stopping = false;
+
+	while (true) {
+		n_taken = atom_log_ship_batch();
+
+		pthread_mutex_lock(&shipper.lock);
+		shipper.done = shipper.head;
+		pthread_cond_broadcast(&shipper.shipped);
+
+		// If we shipped a full batch there's likely more waiting
+		if (n_taken == shipper.batch_size) {
+			pthread_mutex_unlock(&shipper.lock);
+			continue;
+		}
+
+		// Once stopping, we're done when the ring is empty
+		if (stopping) {
+			pthread_mutex_unlock(&shipper.lock);
+			break;
+		}
+
+		if (!shipper.stopping && !shipper.flush_requested) {
+			atom_log_deadline(&deadline, shipper.flush_ms);
+			pthread_cond_timedwait(&shipper.wake, &shipper.lock, &deadline);
+		}
+		shipper.flush_requested = false;
+		stopping = shipper.stopping;
+		pthread_mutex_unlock(&shipper.lock);
+	}
+
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Flushes the shipper at exit s.t. the last logs make it out
+//
+////////////////////////////////////////////////////////////////////////////////
+static void atom_log_shipper_atexit(void)
+{
+	atom_log_flush(ATOM_LOG_SHIPPER_EXIT_FLUSH_MS);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief The shipper thread doesn't survive a fork, so the child starts
+//			its own on its first log
+//
+////////////////////////////////////////////////////////////////////////////////
+static void atom_log_shipper_atfork_child(void)
+{
+	if (atomic_load(&shipper_running)) {
+		atomic_store(&shipper_running, false);
+		free(shipper.ring);
+		shipper.ring = NULL;
+	}
+	atomic_store(&shipper_producers, 0);
+	pthread_mutex_init(&shipper.lock, NULL);
+	pthread_cond_init(&shipper.wake, NULL);
+	pthread_cond_init(&shipper.shipped, NULL);
+	pthread_mutex_init(&shipper_start_lock, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Starts the log shipper. Call with the start lock held.
+//
+////////////////////////////////////////////////////////////////////////////////
+static enum atom_error_t atom_log_shipper_start_locked(
+	const struct atom_log_shipper_config *config)
+{
+	size_t ring_size;
+	size_t i;
+	enum atom_error_t err = ATOM_INTERNAL_ERROR;
+
+	if (atomic_load(&shipper_running)) {
+		goto done;
+	}
+
+	// Use the defaults for anything not set
+	ring_size = ((config != NULL) && (config->ring_size > 0)) ?
+		config->ring_size : ATOM_LOG_SHIPPER_DEFAULT_RING_SIZE;
+	shipper.batch_size = ((config != NULL) && (config->batch_size > 0)) ?
+		config->batch_size : ATOM_LOG_SHIPPER_DEFAULT_BATCH_SIZE;
+	shipper.flush_ms = ((config != NULL) && (config->flush_ms > 0)) ?
+		config->flush_ms : ATOM_LOG_SHIPPER_DEFAULT_FLUSH_MS;
+
+	// Round the ring up to a power of 2 s.t. positions can be masked
+	for (shipper.mask = 1; shipper.mask < ring_size; shipper.mask <<= 1);
+	ring_size = shipper.mask;
+	shipper.mask -= 1;
+
+	shipper.ring = malloc(ring_size * sizeof(struct atom_log_slot));
+	if (shipper.ring == NULL) {
+		goto done;
+	}
+	for (i = 0; i < ring_size; ++i) {
+		atomic_init(&shipper.ring[i].seq, i);
+	}
+	atomic_store(&shipper.tail, 0);
+	shipper.head = 0;
+	shipper.done = 0;
+	shipper.stopping = false;
+	shipper.flush_requested = false;
+	shipper.ctx = NULL;
+
+	// Get the hostname once for all of the messages
+	if (gethostname(shipper.hostname, sizeof(shipper.hostname)) != 0) {
+		shipper.hostname[0] = '\0';
+	}
+	shipper.hostname[HOST_NAME_MAX] = '\0';
+	shipper.hostname_len = strnlen(shipper.hostname, HOST_NAME_MAX);
+
+	if (pthread_create(&shipper.thread, NULL, atom_log_shipper_thread, NULL) != 0) {
+		free(shipper.ring);
+		shipper.ring = NULL;
+		goto done;
+	}
+
+	if (!shipper_handlers_registered) {
+		atexit(atom_log_shipper_atexit);
+		pthread_atfork(NULL, NULL, atom_log_shipper_atfork_child);
+		shipper_handlers_registered = true;
+	}
+
+	atomic_store(&shipper_running, true);
+	err = ATOM_NO_ERROR;
+
+done:
+	return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Starts the background log shipper
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t atom_log_shipper_start(
+	const struct atom_log_shipper_config *config)
+{
+	enum atom_error_t err;
+
+	pthread_mutex_lock(&shipper_start_lock);
+	err = atom_log_shipper_start_locked(config);
+	pthread_mutex_unlock(&shipper_start_lock);
+
+	return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Ships everything in the ring and stops the log shipper
+//
+////////////////////////////////////////////////////////////////////////////////
+void atom_log_shipper_stop(void)
+{
+	pthread_mutex_lock(&shipper_start_lock);
+
+	if (atomic_load(&shipper_running)) {
+		atomic_store(&shipper_running, false);
+
+		// Let anyone already writing to the ring finish s.t. their
+		//	message is shipped with the rest and the ring isn't freed
+		//	under them
+		while (atomic_load(&shipper_producers) != 0) {
+			sched_yield();
+		}
+
+		pthread_mutex_lock(&shipper.lock);
+		shipper.stopping = true;
+		pthread_cond_signal(&shipper.wake);
+		pthread_mutex_unlock(&shipper.lock);
+
+		pthread_join(shipper.thread, NULL);
+		free(shipper.ring);
+		shipper.ring = NULL;
+	}
+
+	pthread_mutex_unlock(&shipper_start_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Waits until everything logged so far has been shipped
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t atom_log_flush(
+	int timeout_ms)
+{
+	struct timespec deadline;
+	size_t target;
+	enum atom_error_t err = ATOM_NO_ERROR;
+
+	if (!atomic_load(&shipper_running)) {
+		goto done;
+	}
+
+	if (timeout_ms > 0) {
+		atom_log_deadline(&deadline, timeout_ms);
+	}
+
+	target = atomic_load(&shipper.tail);
+
+	pthread_mutex_lock(&shipper.lock);
+	shipper.flush_requested = true;
+	pthread_cond_signal(&shipper.wake);
+
+	while (shipper.done < target) {
+		if (timeout_ms > 0) {
+			if (pthread_cond_timedwait(&shipper.shipped, &shipper.lock,
+				&deadline) == ETIMEDOUT)
+			{
+				err = ATOM_INTERNAL_ERROR;
+				break;
+			}
+		} else {
+			pthread_cond_wait(&shipper.shipped, &shipper.lock);
+		}
+	}
+	pthread_mutex_unlock(&shipper.lock);
+
+done:
+	return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the sampling for a level
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t atom_log_set_sampling(
+	int level,
+	unsigned int every_n)
+{
+	if ((level < LOG_EMERG) || (level > LOG_DEBUG)) {
+		return ATOM_COMMAND_INVALID_DATA;
+	}
+
+	atomic_store(&sample_every[level], every_n);
+	return ATOM_NO_ERROR;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the log shipper's counters
+//
+////////////////////////////////////////////////////////////////////////////////
+void atom_log_get_stats(
+	struct atom_log_stats *stats)
+{
+	stats->queued = atomic_load(&stat_queued);
+	stats->shipped = atomic_load(&stat_shipped);
+	stats->dropped_full = atomic_load(&stat_dropped_full);
+	stats->dropped_sampled = atomic_load(&stat_dropped_sampled);
+	stats->dropped_error = atomic_load(&stat_dropped_error);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Logs a message to the global log stream.
+//			- ctx isn't used, the message is shipped on the log shipper's
+//			own connection. It's kept for compatibility and can be NULL.
+//			- element can be NULL as well, and if so the default element
+//			name will be logged
+//			- messages dropped by sampling or since the ring is full
+//			aren't errors, they're only counted in the stats
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t atom_log(
+	redisContext *ctx,
+	struct element *element,
+	int level,
+	const char *msg,
+	size_t msg_len)
+{
+	struct atom_log_slot *slot;
+	unsigned int every_n;
+	size_t pos;
+	intptr_t diff;
+	bool producing = false;
+	enum atom_error_t err = ATOM_INTERNAL_ERROR;
+
+	// Check the level
+	if ((level < LOG_EMERG) || (level > LOG_DEBUG)) {
+		err = ATOM_COMMAND_INVALID_DATA;
+		goto done;
+	}
+
+	// Sample the level if asked to
+	every_n = atomic_load_explicit(&sample_every[level], memory_order_relaxed);
+	if ((every_n > 1) &&
+		((atomic_fetch_add_explicit(&sample_count[level], 1,
+			memory_order_relaxed) % every_n) != 0))
+	{
+		atomic_fetch_add_explicit(&stat_dropped_sampled, 1, memory_order_relaxed);
+		err = ATOM_NO_ERROR;
+		goto done;
+	}
+
+	// Start the shipper if this is the first log. Once it's up, note
+	//	we're using the ring s.t. it isn't stopped under us, and check
+	//	it's still up now that we have.
+	while (true) {
+		if (!atomic_load(&shipper_running)) {
+			pthread_mutex_lock(&shipper_start_lock);
+			if (!atomic_load(&shipper_running)) {
+				err = atom_log_shipper_start_locked(NULL);
+			}
+			pthread_mutex_unlock(&shipper_start_lock);
+			if (!atomic_load(&shipper_running)) {
+				goto done;
+			}
+		}
+
+		atomic_fetch_add(&shipper_producers, 1);
+		if (atomic_load(&shipper_running)) {
+			producing = true;
+			break;
+		}
+		atomic_fetch_sub(&shipper_producers, 1);
+	}
+
+	// Claim a slot at the tail of the ring. If the slot at our position
+	//	hasn't been shipped yet then the ring is full
+	pos = atomic_load_explicit(&shipper.tail, memory_order_relaxed);
+	while (true) {
+		slot = &shipper.ring[pos & shipper.mask];
+		diff = (intptr_t)atomic_load_explicit(&slot->seq, memory_order_acquire) -
+			(intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&shipper.tail, &pos,
+				pos + 1, memory_order_relaxed, memory_order_relaxed))
+			{
+				break;
+			}
+		} else if (diff < 0) {
+			atomic_fetch_add_explicit(&stat_dropped_full, 1, memory_order_relaxed);
+			err = ATOM_NO_ERROR;
+			goto done;
+		} else {
+			pos = atomic_load_explicit(&shipper.tail, memory_order_relaxed);
+		}
+	}
+
+	// Fill in the slot and hand it to the shipper
+	slot->level = level;
+	if (element != NULL) {
+		slot->element_len = (element->name.len < ATOM_NAME_MAXLEN) ?
+			element->name.len : ATOM_NAME_MAXLEN;
+		memcpy(slot->element, element->name.str, slot->element_len);
+	} else {
+		slot->element_len = sizeof(ATOM_LOG_DEFAULT_ELEMENT_NAME) - 1;
+		memcpy(slot->element, ATOM_LOG_DEFAULT_ELEMENT_NAME, slot->element_len);
+	}
+	slot->msg_len = (msg_len < ATOM_LOG_MAXLEN) ? msg_len : ATOM_LOG_MAXLEN;
+	memcpy(slot->msg, msg, slot->msg_len);
+
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	atomic_fetch_add_explicit(&stat_queued, 1, memory_order_relaxed);
+
+	// Wake the shipper early once there's a full batch
+	if (((pos + 1) % shipper.batch_size) == 0) {
+		pthread_cond_signal(&shipper.wake);
+	}
+
+	err = ATOM_NO_ERROR;
+
+done:
+	if (producing) {
+		atomic_fetch_sub(&shipper_producers, 1);
+	}
+	return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Logs a message to the global log stream using variadic args
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t atom_vlogf(
+	redisContext *ctx,
+	struct element *element,
+	int level,
+	const char *fmt,
+	va_list args)
+{
+    char log_buffer[ATOM_LOG_MAXLEN];
+    int len;
+
+    // Use the variadic version of snprintf
+    len = vsnprintf(log_buffer, sizeof(log_buffer), fmt, args);
+    if (len < 0) {
+        return ATOM_INTERNAL_ERROR;
+    } else if (len >= sizeof(log_buffer)) {
+        len = sizeof(log_buffer) - 1;
+    }
+
+   	return atom_log(ctx, element, level, log_buffer, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Logs a message to the global log stream using printf-style formats
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t atom_logf(
+	redisContext *ctx,
+	struct element *element,
+	int level,
+	const char *fmt,
+	...)
+{
+    va_list args;
+    enum atom_error_t err;
+
+    // Start the variadic list
+    va_start(args, fmt);
+
+    // Call the variadic version
+    err = atom_vlogf(ctx, element, level, fmt, args);
+
+    va_end(args);
+    return err;
+}
@@ -0,0 +1,590 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file codec.c
+//
+//  @brief Implements the compression codecs for entry and command data
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <hiredis/hiredis.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#ifdef ATOM_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef ATOM_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "redis.h"
+#include "codec.h"
+
+// Each compressed value starts with a header of a NUL s.t. it can't be
+//	mistaken for any of the text values written alongside, the magic, the
+//	codec and then the uncompressed length, little-endian
+#define ATOM_CODEC_MAGIC_0 '\0'
+#define ATOM_CODEC_MAGIC_1 'A'
+#define ATOM_CODEC_MAGIC_2 'C'
+#define ATOM_CODEC_HEADER_LEN 8
+
+// Biggest value we'll decompress, s.t. a corrupt header can't make us
+//	allocate gigabytes
+#define ATOM_CODEC_MAX_DECODED_LEN ((size_t)1 << 31)
+
+// Dictionaries added with atom_codec_add_dict
+struct atom_codec_dict {
+	char name[ATOM_CODEC_DICT_NAME_MAXLEN];
+	void *data;
+	size_t len;
+};
+
+static struct atom_codec_dict atom_codec_dicts[ATOM_CODEC_MAX_DICTS];
+static size_t atom_codec_n_dicts;
+static pthread_mutex_t atom_codec_dict_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef ATOM_HAVE_ZSTD
+// Zstd contexts are expensive to make, so each thread keeps its own
+struct atom_codec_zstd_contexts {
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+};
+
+static pthread_key_t atom_codec_zstd_key;
+static pthread_once_t atom_codec_zstd_once = PTHREAD_ONCE_INIT;
+static bool atom_codec_zstd_key_valid = false;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Frees a thread's zstd contexts when it exits
+//
+////////////////////////////////////////////////////////////////////////////////
+static void atom_codec_zstd_free(
+	void *data)
+{
+	struct atom_codec_zstd_contexts *zstd = (struct atom_codec_zstd_contexts *)data;
+
+	ZSTD_freeCCtx(zstd->cctx);
+	ZSTD_freeDCtx(zstd->dctx);
+	free(zstd);
+}
+
+static void atom_codec_zstd_key_init(void)
+{
+	atom_codec_zstd_key_valid =
+		(pthread_key_create(&atom_codec_zstd_key, atom_codec_zstd_free) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets this thread's zstd contexts, making them if needed. Returns
+//			NULL if they can't be kept for the thread.
+//
+////////////////////////////////////////////////////////////////////////////////
+static struct atom_codec_zstd_contexts *atom_codec_zstd_get(void)
+{
+	struct atom_codec_zstd_contexts *zstd;
+
+	pthread_once(&atom_codec_zstd_once, atom_codec_zstd_key_init);
+	if (!atom_codec_zstd_key_valid) {
+		return NULL;
+	}
+
+	zstd = pthread_getspecific(atom_codec_zstd_key);
+	if (zstd == NULL) {
+		zstd = malloc(sizeof(struct atom_codec_zstd_contexts));
+		assert(zstd != NULL);
+		zstd->cctx = ZSTD_createCCtx();
+		zstd->dctx = ZSTD_createDCtx();
+		assert((zstd->cctx != NULL) && (zstd->dctx != NULL));
+		if (pthread_setspecific(atom_codec_zstd_key, zstd) != 0) {
+			atom_codec_zstd_free(zstd);
+			return NULL;
+		}
+	}
+
+	return zstd;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Whether the codec is built in
+//
+////////////////////////////////////////////////////////////////////////////////
+bool atom_codec_supported(
+	enum atom_codec_type type)
+{
+	switch (type) {
+		case ATOM_CODEC_NONE:
+			return true;
+#ifdef ATOM_HAVE_LZ4
+		case ATOM_CODEC_LZ4:
+			return true;
+#endif
+#ifdef ATOM_HAVE_ZSTD
+		case ATOM_CODEC_ZSTD:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds a dictionary under a name
+//
+////////////////////////////////////////////////////////////////////////////////
+bool atom_codec_add_dict(
+	const char *name,
+	const void *data,
+	size_t len)
+{
+	bool ret_val = false;
+	size_t i;
+
+	if ((strlen(name) == 0) || (strlen(name) >= ATOM_CODEC_DICT_NAME_MAXLEN) ||
+		(strchr(name, ATOM_CODEC_DICT_SEPARATOR) != NULL))
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&atom_codec_dict_lock);
+
+	if (atom_codec_n_dicts == ATOM_CODEC_MAX_DICTS) {
+		goto done;
+	}
+	for (i = 0; i < atom_codec_n_dicts; ++i) {
+		if (!strcmp(atom_codec_dicts[i].name, name)) {
+			goto done;
+		}
+	}
+
+	strcpy(atom_codec_dicts[atom_codec_n_dicts].name, name);
+	atom_codec_dicts[atom_codec_n_dicts].data = malloc(len);
+	assert(atom_codec_dicts[atom_codec_n_dicts].data != NULL);
+	memcpy(atom_codec_dicts[atom_codec_n_dicts].data, data, len);
+	atom_codec_dicts[atom_codec_n_dicts].len = len;
+	++atom_codec_n_dicts;
+
+	ret_val = true;
+
+done:
+	pthread_mutex_unlock(&atom_codec_dict_lock);
+	return ret_val;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Finds a dictionary by name. Dictionaries are never removed so
+//			it's fine to use it once found.
+//
+////////////////////////////////////////////////////////////////////////////////
+static const struct atom_codec_dict *atom_codec_find_dict(
+	const char *name,
+	size_t name_len)
+{
+	const struct atom_codec_dict *dict = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&atom_codec_dict_lock);
+	for (i = 0; i < atom_codec_n_dicts; ++i) {
+		if ((strlen(atom_codec_dicts[i].name) == name_len) &&
+			!strncmp(atom_codec_dicts[i].name, name, name_len))
+		{
+			dict = &atom_codec_dicts[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&atom_codec_dict_lock);
+
+	return dict;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Whether data of the length should be compressed
+//
+////////////////////////////////////////////////////////////////////////////////
+bool atom_codec_should_encode(
+	const struct atom_codec *codec,
+	size_t len)
+{
+	if ((codec == NULL) || (codec->type == ATOM_CODEC_NONE)) {
+		return false;
+	}
+
+	return len >= ((codec->threshold != 0) ?
+		codec->threshold : ATOM_CODEC_DEFAULT_THRESHOLD);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes the value of the codec key
+//
+////////////////////////////////////////////////////////////////////////////////
+size_t atom_codec_key_value(
+	const struct atom_codec *codec,
+	char value[ATOM_CODEC_VALUE_MAXLEN])
+{
+	const char *name;
+
+	switch (codec->type) {
+		case ATOM_CODEC_LZ4:
+			name = ATOM_CODEC_LZ4_STR;
+			break;
+		case ATOM_CODEC_ZSTD:
+			name = ATOM_CODEC_ZSTD_STR;
+			break;
+		default:
+			name = ATOM_CODEC_NONE_STR;
+			break;
+	}
+
+	if (codec->dict[0] != '\0') {
+		return snprintf(value, ATOM_CODEC_VALUE_MAXLEN, "%s%c%s",
+			name, ATOM_CODEC_DICT_SEPARATOR, codec->dict);
+	}
+	return snprintf(value, ATOM_CODEC_VALUE_MAXLEN, "%s", name);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Makes sure the buffer can hold len bytes
+//
+////////////////////////////////////////////////////////////////////////////////
+static void atom_codec_buffer_reserve(
+	struct atom_codec_buffer *buf,
+	size_t len)
+{
+	if (buf->cap < len) {
+		buf->data = realloc(buf->data, len);
+		assert(buf->data != NULL);
+		buf->cap = len;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the most a value of len bytes can compress to
+//
+////////////////////////////////////////////////////////////////////////////////
+static size_t atom_codec_bound(
+	enum atom_codec_type type,
+	size_t len)
+{
+	switch (type) {
+#ifdef ATOM_HAVE_LZ4
+		case ATOM_CODEC_LZ4:
+			return LZ4_compressBound(len);
+#endif
+#ifdef ATOM_HAVE_ZSTD
+		case ATOM_CODEC_ZSTD:
+			return ZSTD_compressBound(len);
+#endif
+		default:
+			return len;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Compresses len bytes into out, which holds cap. Returns the
+//			compressed length, 0 on error.
+//
+////////////////////////////////////////////////////////////////////////////////
+static size_t atom_codec_compress(
+	const struct atom_codec *codec,
+	const struct atom_codec_dict *dict,
+	const uint8_t *data,
+	size_t len,
+	uint8_t *out,
+	size_t cap)
+{
+	size_t compressed_len = 0;
+
+	switch (codec->type) {
+#ifdef ATOM_HAVE_LZ4
+		case ATOM_CODEC_LZ4: {
+			int accel = (codec->level > 0) ? codec->level : 1;
+			int lz4_len;
+
+			if (dict != NULL) {
+				LZ4_stream_t *stream = LZ4_createStream();
+				assert(stream != NULL);
+				LZ4_loadDict(stream, dict->data, dict->len);
+				lz4_len = LZ4_compress_fast_continue(stream, (const char *)data,
+					(char *)out, len, cap, accel);
+				LZ4_freeStream(stream);
+			} else {
+				lz4_len = LZ4_compress_fast((const char *)data, (char *)out,
+					len, cap, accel);
+			}
+			if (lz4_len > 0) {
+				compressed_len = lz4_len;
+			}
+			break;
+		}
+#endif
+#ifdef ATOM_HAVE_ZSTD
+		case ATOM_CODEC_ZSTD: {
+			struct atom_codec_zstd_contexts *zstd = atom_codec_zstd_get();
+			int level = (codec->level != 0) ? codec->level : ZSTD_CLEVEL_DEFAULT;
+
+			if (zstd == NULL) {
+				break;
+			}
+			if (dict != NULL) {
+				compressed_len = ZSTD_compress_usingDict(zstd->cctx, out, cap,
+					data, len, dict->data, dict->len, level);
+			} else {
+				compressed_len = ZSTD_compressCCtx(zstd->cctx, out, cap,
+					data, len, level);
+			}
+			if (ZSTD_isError(compressed_len)) {
+				compressed_len = 0;
+			}
+			break;
+		}
+#endif
+		default:
+			break;
+	}
+
+	return compressed_len;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Compresses a value into the buffer after the frame header
+//
+////////////////////////////////////////////////////////////////////////////////
+bool atom_codec_encode(
+	const struct atom_codec *codec,
+	const uint8_t *data,
+	size_t len,
+	struct atom_codec_buffer *buf)
+{
+	const struct atom_codec_dict *dict = NULL;
+	size_t compressed_len;
+	size_t cap;
+
+	if (!atom_codec_supported(codec->type) || (codec->type == ATOM_CODEC_NONE) ||
+		(len > ATOM_CODEC_MAX_DECODED_LEN))
+	{
+		return false;
+	}
+
+	if (codec->dict[0] != '\0') {
+		dict = atom_codec_find_dict(codec->dict, strlen(codec->dict));
+		if (dict == NULL) {
+			return false;
+		}
+	}
+
+	cap = atom_codec_bound(codec->type, len);
+	atom_codec_buffer_reserve(buf, ATOM_CODEC_HEADER_LEN + cap);
+
+	compressed_len = atom_codec_compress(codec, dict, data, len,
+		buf->data + ATOM_CODEC_HEADER_LEN, cap);
+	if (compressed_len == 0) {
+		return false;
+	}
+
+	buf->data[0] = ATOM_CODEC_MAGIC_0;
+	buf->data[1] = ATOM_CODEC_MAGIC_1;
+	buf->data[2] = ATOM_CODEC_MAGIC_2;
+	buf->data[3] = (uint8_t)codec->type;
+	buf->data[4] = len & 0xFF;
+	buf->data[5] = (len >> 8) & 0xFF;
+	buf->data[6] = (len >> 16) & 0xFF;
+	buf->data[7] = (len >> 24) & 0xFF;
+	buf->len = ATOM_CODEC_HEADER_LEN + compressed_len;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Decompresses a framed value into a new buffer. Returns NULL if
+//			it's not framed for the codec or doesn't decompress.
+//
+////////////////////////////////////////////////////////////////////////////////
+static char *atom_codec_decode(
+	enum atom_codec_type type,
+	const struct atom_codec_dict *dict,
+	const uint8_t *data,
+	size_t len,
+	size_t *decoded_len)
+{
+	char *out;
+	size_t raw_len;
+	bool ok = false;
+
+	if ((len < ATOM_CODEC_HEADER_LEN) || (data[0] != ATOM_CODEC_MAGIC_0) ||
+		(data[1] != ATOM_CODEC_MAGIC_1) || (data[2] != ATOM_CODEC_MAGIC_2) ||
+		(data[3] != (uint8_t)type))
+	{
+		return NULL;
+	}
+
+	raw_len = (size_t)data[4] | ((size_t)data[5] << 8) |
+		((size_t)data[6] << 16) | ((size_t)data[7] << 24);
+	if (raw_len > ATOM_CODEC_MAX_DECODED_LEN) {
+		return NULL;
+	}
+
+	// hiredis NUL-terminates its strings, so we do too
+	out = malloc(raw_len + 1);
+	assert(out != NULL);
+	data += ATOM_CODEC_HEADER_LEN;
+	len -= ATOM_CODEC_HEADER_LEN;
+
+	switch (type) {
+#ifdef ATOM_HAVE_LZ4
+		case ATOM_CODEC_LZ4:
+			if (dict != NULL) {
+				ok = LZ4_decompress_safe_usingDict((const char *)data, out,
+					len, raw_len, dict->data, dict->len) == (int)raw_len;
+			} else {
+				ok = LZ4_decompress_safe((const char *)data, out,
+					len, raw_len) == (int)raw_len;
+			}
+			break;
+#endif
+#ifdef ATOM_HAVE_ZSTD
+		case ATOM_CODEC_ZSTD: {
+			struct atom_codec_zstd_contexts *zstd = atom_codec_zstd_get();
+			if (zstd == NULL) {
+				break;
+			}
+			if (dict != NULL) {
+				ok = ZSTD_decompress_usingDict(zstd->dctx, out, raw_len,
+					data, len, dict->data, dict->len) == raw_len;
+			} else {
+				ok = ZSTD_decompressDCtx(zstd->dctx, out, raw_len,
+					data, len) == raw_len;
+			}
+			break;
+		}
+#endif
+		default:
+			break;
+	}
+
+	if (!ok) {
+		free(out);
+		return NULL;
+	}
+
+	out[raw_len] = '\0';
+	*decoded_len = raw_len;
+	return out;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Decompresses the framed values of an entry in place
+//
+////////////////////////////////////////////////////////////////////////////////
+bool atom_codec_decode_kv(
+	redisReply *kv,
+	redisReply *codec_value)
+{
+	const struct atom_codec_dict *dict = NULL;
+	enum atom_codec_type type;
+	const char *sep;
+	size_t name_len;
+	size_t decoded_len;
+	char *decoded;
+	size_t i;
+
+	// Nothing to do if it wasn't compressed or we already did it
+	if ((codec_value->len == 0) ||
+		((codec_value->len == CONST_STRLEN(ATOM_CODEC_NONE_STR)) &&
+			!strncmp(codec_value->str, ATOM_CODEC_NONE_STR, codec_value->len)))
+	{
+		return true;
+	}
+
+	sep = memchr(codec_value->str, ATOM_CODEC_DICT_SEPARATOR, codec_value->len);
+	name_len = (sep != NULL) ? (size_t)(sep - codec_value->str) : codec_value->len;
+
+	if ((name_len == CONST_STRLEN(ATOM_CODEC_LZ4_STR)) &&
+		!strncmp(codec_value->str, ATOM_CODEC_LZ4_STR, name_len))
+	{
+		type = ATOM_CODEC_LZ4;
+	} else if ((name_len == CONST_STRLEN(ATOM_CODEC_ZSTD_STR)) &&
+		!strncmp(codec_value->str, ATOM_CODEC_ZSTD_STR, name_len))
+	{
+		type = ATOM_CODEC_ZSTD;
+	} else {
+		fprintf(stderr, "Unknown codec %.*s\n", (int)codec_value->len,
+			codec_value->str);
+		return false;
+	}
+
+	if (!atom_codec_supported(type)) {
+		fprintf(stderr, "Codec %.*s not built in\n", (int)name_len,
+			codec_value->str);
+		return false;
+	}
+
+	if (sep != NULL) {
+		dict = atom_codec_find_dict(sep + 1,
+			codec_value->len - name_len - 1);
+		if (dict == NULL) {
+			fprintf(stderr, "Missing codec dictionary %.*s\n",
+				(int)(codec_value->len - name_len - 1), sep + 1);
+			return false;
+		}
+	}
+
+	// Only the values are framed, so check every other element
+	for (i = 1; i < kv->elements; i += 2) {
+		redisReply *value = kv->element[i];
+
+		if ((value->type != REDIS_REPLY_STRING) ||
+			(value->len < ATOM_CODEC_HEADER_LEN) ||
+			(value->str[0] != ATOM_CODEC_MAGIC_0))
+		{
+			continue;
+		}
+
+		decoded = atom_codec_decode(type, dict, (const uint8_t *)value->str,
+			value->len, &decoded_len);
+		if (decoded == NULL) {
+			fprintf(stderr, "Failed to decode value\n");
+			return false;
+		}
+
+		free(value->str);
+		value->str = decoded;
+		value->len = decoded_len;
+	}
+
+	codec_value->str[0] = '\0';
+	codec_value->len = 0;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Frees a buffer's memory
+//
+////////////////////////////////////////////////////////////////////////////////
+void atom_codec_buffer_free(
+	struct atom_codec_buffer *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = 0;
+	buf->cap = 0;
+}
@@ -59,6 +59,13 @@ struct element *element_init(
 	//	all of the bins to empty
 	memset(elem->command.hash, 0, sizeof(elem->command.hash));
 
+	// No command channels until the command loop starts serving one or
+	//	we send a command to an element that serves one
+	pthread_mutex_init(&elem->command.lock, NULL);
+	elem->command.shm = NULL;
+	pthread_mutex_init(&elem->shm.lock, NULL);
+	elem->shm.clients = NULL;
+
 	// Finally, make the redis context for the element to send responses
 	//	to commands on. This is done since the context for receiving the command
 	//	is in use
@@ -106,6 +113,12 @@ struct element *element_init(
 		goto err_cleanup;
 	}
 
+	// Register the element s.t. others can find it without a SCAN
+	if (atom_register_element(ctx, elem->name.str, true) != ATOM_NO_ERROR) {
+		atom_logf(ctx, elem, LOG_ERR, "Failed to register element");
+		goto err_cleanup;
+	}
+
 	// If we got here, then we're good. Skip the error cleanup
 	goto done;
 
@@ -128,6 +141,9 @@ static void element_free_command(
 		if (cmd->name != NULL) {
 			free(cmd->name);
 		}
+		if (cmd->ser != NULL) {
+			free(cmd->ser);
+		}
 		free(cmd);
 	}
 }
@@ -166,8 +182,13 @@ void element_cleanup(
 {
 	if (elem != NULL) {
 
-		// Clean up the name
+		// Take down the command channels before anything they use
+		element_command_shm_stop(ctx, elem);
+		element_command_shm_clients_cleanup(elem);
+
+		// Clean up the name, taking it out of the registry
 		if (elem->name.str != NULL) {
+			atom_register_element(ctx, elem->name.str, false);
 			free(elem->name.str);
 		}
 
@@ -190,8 +211,37 @@ void element_cleanup(
 
 		// Clean up the hashtable
 		element_free_command_hash(elem->command.hash);
+		pthread_mutex_destroy(&elem->command.lock);
+		pthread_mutex_destroy(&elem->shm.lock);
 
 		// And free the element itself
 		free(elem);
 	}
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets back a context the element lost its connection on. The
+//			context is reconnected in place with backoff, so loops using it
+//			can carry on from the last IDs they saw.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool element_reconnect(
+	redisContext *ctx,
+	struct element *elem,
+	bool forever)
+{
+	uint64_t start_ms = redis_monotonic_ms();
+
+	if (!redis_context_reconnect(ctx,
+		forever ? REDIS_RECONNECT_FOREVER : REDIS_RECONNECT_DEFAULT_TIMEOUT_MS))
+	{
+		atom_logf(NULL, elem, LOG_ERR, "Failed to reconnect to redis");
+		return false;
+	}
+
+	atom_logf(NULL, elem, LOG_WARNING, "Reconnected to redis in %lu ms",
+		(unsigned long)(redis_monotonic_ms() - start_ms));
+
+	return true;
+}
@@ -40,6 +40,11 @@ struct element_response_stream_data {
 		const struct redis_xread_kv_item *kv_items,
 		void* user_data);
 	void *user_data;
+
+	// Span the command was sent from if we're tracing, and the name of
+	//	the span noting how long the reply took to get back
+	const struct atom_trace_context *trace;
+	const char *trace_name;
 };
 
 // Data we want to obtain from the ACK
@@ -72,6 +77,8 @@ static bool element_response_stream_callback(
 {
 	struct element_response_stream_data *data;
 	bool ret_val = false;
+	struct atom_trace_span span = ATOM_TRACE_SPAN_INIT;
+	struct atom_trace_context reply_trace;
 
 	// Cast the user data
 	data = (struct element_response_stream_data*)user_data;
@@ -101,6 +108,12 @@ static bool element_response_stream_callback(
 			// If we're here then we know that the element matches and
 			//	the command ID matches. At this point we should call the
 			//	user callback s.t. it can check the rest of the data
+			if ((data->trace != NULL) && atom_trace_find(reply, &reply_trace)) {
+				atom_trace_begin(&span, data->trace, data->trace_name,
+					"%s", data->cmd_elem);
+				span.start_us = reply_trace.sent_us;
+				atom_trace_end(&span);
+			}
 			if (!data->user_cb(data->kv_items, data->user_data)) {
 				atom_logf(NULL, NULL, LOG_ERR, "Failed to call user callback!");
 				goto done;
@@ -136,10 +149,14 @@ static void element_response_stream_init_data(
 	bool (*user_cb)(
 		const struct redis_xread_kv_item *kv_items,
 		void* user_data),
-	void *user_data)
+	void *user_data,
+	const struct atom_trace_context *trace,
+	const char *trace_name)
 {
 	// Initialize all of the necessary fields of the data
 	data->elem = elem;
+	data->trace = trace;
+	data->trace_name = trace_name;
 	data->cmd_elem = cmd_elem;
 	data->cmd_id = cmd_id;
 	data->user_data = user_data;
@@ -357,6 +374,8 @@ static void element_command_init_response_data(
 	response_items[RESPONSE_KEY_ERR_STR].key_len = CONST_STRLEN(RESPONSE_KEY_ERR_STR_STR);
 	response_items[RESPONSE_KEY_DATA].key = RESPONSE_KEY_DATA_STR;
 	response_items[RESPONSE_KEY_DATA].key_len = CONST_STRLEN(RESPONSE_KEY_DATA_STR);
+	response_items[RESPONSE_KEY_SER].key = RESPONSE_KEY_SER_STR;
+	response_items[RESPONSE_KEY_SER].key_len = CONST_STRLEN(RESPONSE_KEY_SER_STR);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -381,10 +400,40 @@ enum atom_error_t element_command_send(
 		void *user_data),
 	void *user_data,
 	char **error_str)
+{
+	return element_command_send_codec(ctx, elem, cmd_elem, cmd, data,
+		data_len, NULL, block, response_cb, user_data, error_str);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sends a command to another element, compressing the data with
+//			the codec if it's non-NULL and the data is over its threshold
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t element_command_send_codec(
+	redisContext *ctx,
+	struct element *elem,
+	const char *cmd_elem,
+	const char *cmd,
+	const uint8_t *data,
+	size_t data_len,
+	const struct atom_codec *codec,
+	bool block,
+	bool (*response_cb)(
+		const uint8_t *response,
+		size_t response_len,
+		void *user_data),
+	void *user_data,
+	char **error_str)
 {
 	int ret;
+	enum atom_error_t shm_ret;
 	struct redis_stream_info stream_info;
-	struct redis_xadd_info cmd_data[CMD_N_KEYS];
+	struct redis_xadd_info cmd_data[CMD_N_KEYS + 2];
+	size_t n_cmd_keys = CMD_N_KEYS;
+	struct atom_codec_buffer codec_buffer = {NULL, 0, 0};
+	char codec_value[ATOM_CODEC_VALUE_MAXLEN];
 	char cmd_elem_stream[ATOM_NAME_MAXLEN];
 	char cmd_id[STREAM_ID_BUFFLEN];
 
@@ -396,22 +445,79 @@ enum atom_error_t element_command_send(
 	struct element_command_response_data response_data;
 	struct redis_xread_kv_item response_items[RESPONSE_N_KEYS];
 
+	bool tracing = atom_trace_enabled();
+	struct atom_trace_span send_span = ATOM_TRACE_SPAN_INIT;
+	struct atom_trace_span step_span = ATOM_TRACE_SPAN_INIT;
+	struct atom_trace_context trace;
+	char trace_value[ATOM_TRACE_VALUE_MAXLEN];
+
 	// Initialize the error code and error string
 	ret = ATOM_INTERNAL_ERROR;
 	if (error_str != NULL) {
 		*error_str = NULL;
 	}
 
+	// The whole command is a span, with a child for each step
+	if (tracing) {
+		atom_trace_begin(&send_span, NULL, "command_send", "%s:%s",
+			cmd_elem, cmd);
+	}
+
+	// Elements on the same host can take the command over shared memory.
+	//	If there's no channel to the element it goes over redis.
+	if (tracing) {
+		atom_trace_span_context(&send_span, &trace);
+	}
+	if (element_command_shm_send(ctx, elem, cmd_elem, cmd, data, data_len,
+		block, response_cb, user_data, error_str, tracing ? &trace : NULL,
+		&shm_ret))
+	{
+		ret = shm_ret;
+		goto done;
+	}
+
 	// Want to set up the data for the command
 	element_command_init_data(
 		cmd_data, elem->name.str, elem->name.len, cmd, data, data_len);
 
+	// Compress the data if it's big enough, noting the codec s.t. the
+	//	element can decompress it
+	if ((data != NULL) && atom_codec_should_encode(codec, data_len)) {
+		if (atom_codec_encode(codec, data, data_len, &codec_buffer)) {
+			cmd_data[CMD_KEY_DATA].data = codec_buffer.data;
+			cmd_data[CMD_KEY_DATA].data_len = codec_buffer.len;
+
+			cmd_data[n_cmd_keys].key = ATOM_CODEC_KEY_STR;
+			cmd_data[n_cmd_keys].key_len = CONST_STRLEN(ATOM_CODEC_KEY_STR);
+			cmd_data[n_cmd_keys].data = (uint8_t*)codec_value;
+			cmd_data[n_cmd_keys].data_len = atom_codec_key_value(
+				codec, codec_value);
+			++n_cmd_keys;
+		} else {
+			atom_logf(ctx, elem, LOG_ERR,
+				"Failed to compress command data, sending it uncompressed");
+		}
+	}
+
+	// Note the span the command was sent from s.t. the element can tie
+	//	its handling of it back to us
+	if (tracing) {
+		atom_trace_span_context(&send_span, &trace);
+		cmd_data[n_cmd_keys].key = ATOM_TRACE_KEY_STR;
+		cmd_data[n_cmd_keys].key_len = CONST_STRLEN(ATOM_TRACE_KEY_STR);
+		cmd_data[n_cmd_keys].data = (uint8_t*)trace_value;
+		cmd_data[n_cmd_keys].data_len = atom_trace_value(&trace, trace_value);
+		++n_cmd_keys;
+
+		atom_trace_begin(&step_span, &trace, "xadd", "%s", cmd_elem);
+	}
+
 	// Get the name of the element stream we want to write to
 	atom_get_command_stream_str(cmd_elem, cmd_elem_stream);
 
 	// Now, call the XADD to send the data over to the element. We want to
 	//	note the command ID since we'll expect it back in the ACK and response
-	if (!redis_xadd(ctx, cmd_elem_stream, cmd_data, CMD_N_KEYS,
+	if (!redis_xadd(ctx, cmd_elem_stream, cmd_data, n_cmd_keys,
 		ELEMENT_COMMAND_STREAM_MAXLEN, ATOM_DEFAULT_APPROX_MAXLEN, cmd_id))
 	{
 		atom_logf(ctx, elem, LOG_ERR, "Failed to XADD command data to stream");
@@ -419,13 +525,19 @@ enum atom_error_t element_command_send(
 		goto done;
 	}
 
+	if (tracing) {
+		atom_trace_end(&step_span);
+		atom_trace_begin(&step_span, &trace, "ack_wait", "%s", cmd_id);
+	}
+
 	// Need to set up the ack. This will initialize our user data
 	//	and set up the keys we're looking for in the ack
 	element_command_init_ack_data(&ack_data, ack_items);
 	// Need to set up the general response callback
 	element_response_stream_init_data(
 		&stream_info, &stream_data, elem, cmd_elem, cmd_id, ack_items,
-		ACK_N_KEYS, element_command_ack_callback, &ack_data);
+		ACK_N_KEYS, element_command_ack_callback, &ack_data,
+		tracing ? &trace : NULL, "ack_transit");
 
 	// Now, we're ready to call the XREAD. We want to do this until either
 	//	the ACK is found or we've timed out. Note that this re-does the
@@ -453,6 +565,11 @@ enum atom_error_t element_command_send(
 		goto done;
 	}
 
+	if (tracing) {
+		atom_trace_end(&step_span);
+		atom_trace_begin(&step_span, &trace, "response_wait", "%s", cmd_id);
+	}
+
 	// Need to set up the response. This will initialize our user data
 	//	and set up the keys we're looking for in the ack
 	element_command_init_response_data(
@@ -461,7 +578,7 @@ enum atom_error_t element_command_send(
 	element_response_stream_init_data(
 		&stream_info, &stream_data, elem, cmd_elem, cmd_id, response_items,
 		RESPONSE_N_KEYS, element_command_response_callback,
-		&response_data);
+		&response_data, tracing ? &trace : NULL, "response_transit");
 
 	// Now, we're ready to call the XREAD. Want to do this until either
 	//	the response is found or we've timed out. Note that this re-does the
@@ -493,5 +610,10 @@ enum atom_error_t element_command_send(
 	}
 
 done:
+	if (tracing) {
+		atom_trace_end(&step_span);
+		atom_trace_end(&send_span);
+	}
+	atom_codec_buffer_free(&codec_buffer);
 	return ret;
 }
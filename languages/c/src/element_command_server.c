@@ -64,7 +64,7 @@ static uint32_t element_command_hash_fn(
 //			NULL.
 //
 ////////////////////////////////////////////////////////////////////////////////
-static struct element_command *element_command_get(
+struct element_command *element_command_get(
 	struct element *elem,
 	const char *command)
 {
@@ -113,6 +113,33 @@ static void element_command_init_shared_data(
 	atom_get_response_stream_str(req_elem, req_elem_stream);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds the trace key to an ACK or response if we're tracing the
+//			command, returning the number of keys added
+//
+////////////////////////////////////////////////////////////////////////////////
+static size_t element_command_add_trace(
+	const struct atom_trace_context *trace,
+	struct redis_xadd_info *info,
+	char value[ATOM_TRACE_VALUE_MAXLEN])
+{
+	struct atom_trace_context sent;
+
+	if (trace == NULL) {
+		return 0;
+	}
+
+	sent = *trace;
+	sent.sent_us = atom_trace_now_us();
+
+	info->key = ATOM_TRACE_KEY_STR;
+	info->key_len = CONST_STRLEN(ATOM_TRACE_KEY_STR);
+	info->data = (uint8_t*)value;
+	info->data_len = atom_trace_value(&sent, value);
+	return 1;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  @brief Sends an ACK to the requesting element letting them know that we
@@ -124,13 +151,16 @@ static bool element_command_send_ack(
 	struct element *elem,
 	const char *id,
 	const char *req_elem,
-	int timeout)
+	int timeout,
+	const struct atom_trace_context *trace)
 {
-	struct redis_xadd_info ack_info[ACK_N_KEYS];
+	struct redis_xadd_info ack_info[ACK_N_KEYS + 1];
+	size_t n_ack_keys = ACK_N_KEYS;
 	bool ret_val = false;
 	char timeout_buffer[32];
 	size_t timeout_len;
 	char req_elem_stream[ATOM_NAME_MAXLEN];
+	char trace_value[ATOM_TRACE_VALUE_MAXLEN];
 
 	// Need to set up the XADD info to send back
 	element_command_init_shared_data(
@@ -143,10 +173,12 @@ static bool element_command_send_ack(
 		timeout_buffer, sizeof(timeout_buffer), "%d", timeout);
 	ack_info[ACK_KEY_TIMEOUT].data = (uint8_t*)timeout_buffer;
 	ack_info[ACK_KEY_TIMEOUT].data_len = timeout_len;
+	n_ack_keys += element_command_add_trace(trace, &ack_info[n_ack_keys],
+		trace_value);
 
 	// And want to call the XADD to send the info back to the caller
 	if (!redis_xadd(
-		ctx, req_elem_stream, ack_info, ACK_N_KEYS,
+		ctx, req_elem_stream, ack_info, n_ack_keys,
 		ATOM_DEFAULT_MAXLEN, ATOM_DEFAULT_APPROX_MAXLEN, NULL))
 	{
 		atom_logf(ctx, elem, LOG_ERR, "Failed to send ACK");
@@ -174,14 +206,19 @@ static bool element_command_send_response(
 	uint8_t *response,
 	size_t response_len,
 	enum atom_error_t error_code,
-	char *error_str)
+	char *error_str,
+	const struct atom_trace_context *trace)
 {
-	struct redis_xadd_info response_info[RESPONSE_N_KEYS];
+	struct redis_xadd_info response_info[RESPONSE_N_KEYS + 2];
 	bool ret_val = false;
 	char req_elem_stream[ATOM_NAME_MAXLEN];
 	char err_code_buffer[32];
 	size_t err_code_len;
 	int response_idx = STREAM_N_KEYS;
+	int response_data_idx = 0;
+	struct atom_codec_buffer codec_buffer = {NULL, 0, 0};
+	char codec_value[ATOM_CODEC_VALUE_MAXLEN];
+	char trace_value[ATOM_TRACE_VALUE_MAXLEN];
 
 	// Need to set up the XADD info to send back
 	element_command_init_shared_data(
@@ -218,6 +255,7 @@ static bool element_command_send_response(
 
 	// If we have response data, fill that in
 	if (response != NULL) {
+		response_data_idx = response_idx;
 		response_info[response_idx].key = RESPONSE_KEY_DATA_STR;
 		response_info[response_idx].key_len = CONST_STRLEN(
 			RESPONSE_KEY_DATA_STR);
@@ -226,6 +264,44 @@ static bool element_command_send_response(
 		++response_idx;
 	}
 
+	// If we have response data and know how it was serialized, note
+	//	the serialization s.t. the caller can deserialize it
+	if ((response != NULL) && (cmd != NULL) && (cmd->ser != NULL)) {
+		response_info[response_idx].key = RESPONSE_KEY_SER_STR;
+		response_info[response_idx].key_len = CONST_STRLEN(
+			RESPONSE_KEY_SER_STR);
+		response_info[response_idx].data = (uint8_t*)cmd->ser;
+		response_info[response_idx].data_len = strlen(cmd->ser);
+		++response_idx;
+	}
+
+	// Compress the response data if the command has a codec and it's
+	//	big enough, noting the codec s.t. the caller can decompress it
+	if ((response != NULL) && (cmd != NULL) &&
+		atom_codec_should_encode(&cmd->codec, response_len))
+	{
+		if (atom_codec_encode(&cmd->codec, response, response_len,
+			&codec_buffer))
+		{
+			response_info[response_data_idx].data = codec_buffer.data;
+			response_info[response_data_idx].data_len = codec_buffer.len;
+
+			response_info[response_idx].key = ATOM_CODEC_KEY_STR;
+			response_info[response_idx].key_len = CONST_STRLEN(
+				ATOM_CODEC_KEY_STR);
+			response_info[response_idx].data = (uint8_t*)codec_value;
+			response_info[response_idx].data_len = atom_codec_key_value(
+				&cmd->codec, codec_value);
+			++response_idx;
+		} else {
+			atom_logf(ctx, elem, LOG_ERR,
+				"Failed to compress response, sending it uncompressed");
+		}
+	}
+
+	response_idx += element_command_add_trace(trace,
+		&response_info[response_idx], trace_value);
+
 	// And want to call the XADD to send the info back to the caller
 	if (!redis_xadd(
 		ctx, req_elem_stream, response_info, response_idx,
@@ -239,6 +315,7 @@ static bool element_command_send_response(
 	ret_val = true;
 
 done:
+	atom_codec_buffer_free(&codec_buffer);
 	return ret_val;
 }
 
@@ -263,6 +340,11 @@ static bool element_cmd_rep_xread_cb(
 	size_t response_len = 0;
 	char *error_str = NULL;
 	void *cleanup_ptr = NULL;
+	bool tracing = false;
+	struct atom_trace_span span = ATOM_TRACE_SPAN_INIT;
+	struct atom_trace_span handler_span = ATOM_TRACE_SPAN_INIT;
+	struct atom_trace_context trace, handler_trace, prev_trace;
+	const char *cmd_name;
 
 	// Want to cast the user data to our expected data struct
 	data = (struct element_command_cb_data *)user_data;
@@ -296,6 +378,22 @@ static bool element_cmd_rep_xread_cb(
 		NULL;
 	timeout = (cmd != NULL) ? cmd->timeout : ELEMENT_NO_COMMAND_TIMEOUT_MS;
 
+	// If the caller's tracing the command, note how long it waited in
+	//	the stream and then time handling it, sending our span back in
+	//	the ACK and response
+	if (atom_trace_enabled() && atom_trace_find(reply, &trace)) {
+		tracing = true;
+		cmd_name = data->kv_items[CMD_KEY_CMD].found ?
+			data->kv_items[CMD_KEY_CMD].reply->str : "";
+
+		atom_trace_begin(&span, &trace, "queue_wait", "%s", cmd_name);
+		span.start_us = trace.sent_us;
+		atom_trace_end(&span);
+
+		atom_trace_begin(&span, &trace, "command_handle", "%s", cmd_name);
+		atom_trace_span_context(&span, &trace);
+	}
+
 	// At this point we know that we got a message and have a caller
 	//	to respond back to, so we need to send an ACK
 	if (!element_command_send_ack(
@@ -303,7 +401,8 @@ static bool element_cmd_rep_xread_cb(
 		data->elem,
 		id,
 		data->kv_items[CMD_KEY_ELEMENT].reply->str,
-		timeout))
+		timeout,
+		tracing ? &trace : NULL))
 	{
 		atom_logf(data->elem->command.ctx, data->elem, LOG_ERR,
 			"Failed to send ACK to caller");
@@ -332,6 +431,15 @@ static bool element_cmd_rep_xread_cb(
 		response_len = 0;
 		error_str = NULL;
 
+		// Anything the handler sends is part of the trace
+		if (tracing) {
+			atom_trace_begin(&handler_span, &trace, "handler", "%s", cmd->name);
+			atom_trace_span_context(&handler_span, &handler_trace);
+			atom_trace_set_current(&handler_trace, &prev_trace);
+		}
+
+		// Handlers are run one at a time with the shared-memory channel
+		pthread_mutex_lock(&data->elem->command.lock);
 		ret = cmd->cb(
 			data->kv_items[CMD_KEY_DATA].found ?
 				(uint8_t*)data->kv_items[CMD_KEY_DATA].reply->str : NULL,
@@ -342,6 +450,12 @@ static bool element_cmd_rep_xread_cb(
 			&error_str,
 			cmd->user_data,
 			&cleanup_ptr);
+		pthread_mutex_unlock(&data->elem->command.lock);
+
+		if (tracing) {
+			atom_trace_set_current(&prev_trace, NULL);
+			atom_trace_end(&handler_span);
+		}
 
 		// If the return is an error, we want to append it atop the internal
 		//	element errors
@@ -362,7 +476,8 @@ static bool element_cmd_rep_xread_cb(
 		response,
 		response_len,
 		data->err_code,
-		error_str))
+		error_str,
+		tracing ? &trace : NULL))
 	{
 		atom_logf(data->elem->command.ctx, data->elem, LOG_ERR,
 			"Failed to send response to caller");
@@ -373,6 +488,9 @@ static bool element_cmd_rep_xread_cb(
 	ret_val = true;
 
 done:
+	if (tracing) {
+		atom_trace_end(&span);
+	}
 	if (cleanup_ptr != NULL) {
 		if (cmd->cleanup != NULL) {
 			cmd->cleanup(cleanup_ptr);
@@ -426,6 +544,15 @@ enum atom_error_t element_command_loop(
 	cmd_data.n_kv_items = CMD_N_KEYS;
 	cmd_data.err_code = ATOM_INTERNAL_ERROR;
 
+	// Serve the command channel for callers on the host too. If it can't
+	//	be set up they just use redis
+	if (element_command_shm_enabled() && (elem->command.shm == NULL) &&
+		(element_command_shm_start(ctx, elem) != ATOM_NO_ERROR))
+	{
+		atom_logf(ctx, elem, LOG_WARNING,
+			"Failed to start command channel, serving over redis only");
+	}
+
 	// Want to set up the XREAD. Should be a pretty straightforward
 	//	setup of the stream info
 	if (!redis_init_stream_info(
@@ -452,10 +579,30 @@ enum atom_error_t element_command_loop(
 			timeout,
 			REDIS_XREAD_NOMAXCOUNT))
 		{
+			// If we lost the connection then get it back and read again.
+			//	The stream info's last ID is that of the last command we
+			//	handled s.t. we pick up right after it.
+			if (ctx->err) {
+				if (!element_reconnect(ctx, elem, loop)) {
+					ret = ATOM_REDIS_ERROR;
+					goto done;
+				}
+				continue;
+			}
+
 			atom_logf(ctx, elem, LOG_ERR, "Redis issue/timeout");
 			ret = ATOM_REDIS_ERROR;
 		}
 
+		// Responses go out on the element's own context, so make sure
+		//	that's still good too
+		if (elem->command.ctx->err &&
+			!element_reconnect(elem->command.ctx, elem, loop))
+		{
+			ret = ATOM_REDIS_ERROR;
+			goto done;
+		}
+
 		// And if we shouldn't be looping then break out
 		if (!loop) {
 			break;
@@ -515,6 +662,8 @@ bool element_command_add(
 	cmd->cleanup = cleanup;
 	cmd->timeout = timeout;
 	cmd->user_data = user_data;
+	cmd->ser = NULL;
+	memset(&cmd->codec, 0, sizeof(cmd->codec));
 
 	// Get the hash for the element
 	hash = element_command_hash_fn(cmd->name);
@@ -529,3 +678,57 @@ bool element_command_add(
 
 	return true;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the serialization method for a command that's already been
+//			added to the element. The method is noted in the "ser" key of
+//			each response that carries data.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool element_command_set_ser(
+	struct element *elem,
+	const char *command,
+	const char *ser)
+{
+	struct element_command *cmd;
+
+	// Find the command
+	cmd = element_command_get(elem, command);
+	if (cmd == NULL) {
+		return false;
+	}
+
+	// Swap out the serialization
+	if (cmd->ser != NULL) {
+		free(cmd->ser);
+		cmd->ser = NULL;
+	}
+	if (ser != NULL) {
+		cmd->ser = strdup(ser);
+		assert(cmd->ser != NULL);
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the codec for a command's response data
+//
+////////////////////////////////////////////////////////////////////////////////
+bool element_command_set_codec(
+	struct element *elem,
+	const char *command,
+	const struct atom_codec *codec)
+{
+	struct element_command *cmd;
+
+	cmd = element_command_get(elem, command);
+	if (cmd == NULL) {
+		return false;
+	}
+
+	cmd->codec = *codec;
+	return true;
+}
@@ -0,0 +1,1157 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file element_command_shm.c
+//
+//  @brief Implements the shared-memory command channel. Each slot in the
+//			segment goes FREE -> CLAIMED -> REQUEST -> RECEIVED -> ACKED
+//			-> RESPONSE -> FREE, with the caller owning it while it's
+//			CLAIMED or RESPONSE and the server while it's RECEIVED or
+//			ACKED. The state is the futex the caller waits on, and the
+//			server waits on the doorbell in the header. The server notes
+//			it's alive from a thread of its own s.t. a slow handler doesn't
+//			make it look gone.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <hiredis/hiredis.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "redis.h"
+#include "atom.h"
+#include "element.h"
+
+// This value is returned to the caller when the command they
+//	request is not supported. It tells them how long to wait for our
+//	error response
+#define ELEMENT_NO_COMMAND_TIMEOUT_MS 1000
+
+// Longest host name we compare
+#define ELEMENT_COMMAND_SHM_HOST_MAXLEN 256
+
+// Longest name of a segment an overflowing response is handed over in,
+//	the channel's segment name with the slot and sequence number
+#define ELEMENT_COMMAND_SHM_OVERFLOW_NAME_MAXLEN (ELEMENT_COMMAND_SHM_NAME_MAXLEN + 32)
+
+// Called by the serving thread between taking a request and acking it,
+//	see element_command_shm.h
+void (*element_command_shm_received_hook)(void) = NULL;
+
+// States of a slot
+enum element_command_shm_slot_state {
+	SHM_SLOT_FREE,
+	SHM_SLOT_CLAIMED,
+	SHM_SLOT_REQUEST,
+	SHM_SLOT_RECEIVED,
+	SHM_SLOT_ACKED,
+	SHM_SLOT_RESPONSE,
+	SHM_SLOT_ABANDONED,
+};
+
+// Slot flags. The caller isn't waiting for the response.
+#define SHM_SLOT_NO_RESPONSE 0x1
+
+// Slot for one command. The request is the command name, its terminator
+//	and then the data. The response is the error string with its
+//	terminator, if there is one, and then the data. A response that
+//	doesn't fit is put in a segment of its own, see
+//	element_command_shm_overflow_name. The trace is the caller's span
+//	the command was sent from, with a trace ID of 0 if it's not traced.
+struct element_command_shm_slot {
+	uint32_t state;
+	uint32_t flags;
+	uint32_t seq;
+	int32_t timeout;
+	int32_t err_code;
+	uint32_t cmd_len;
+	uint32_t data_len;
+	uint32_t err_str_len;
+	uint32_t response_len;
+	uint32_t has_response;
+	uint32_t overflow;
+	struct atom_trace_context trace;
+	uint8_t request[ELEMENT_COMMAND_SHM_SLOT_DATA_LEN];
+	uint8_t response[ELEMENT_COMMAND_SHM_SLOT_DATA_LEN];
+};
+
+// Layout of the segment
+struct element_command_shm_header {
+	uint32_t version;
+	uint32_t n_slots;
+	uint32_t slot_data_len;
+	uint32_t doorbell;
+	uint64_t heartbeat_ms;
+	struct element_command_shm_slot slots[ELEMENT_COMMAND_SHM_N_SLOTS];
+};
+
+// Serving side of the channel
+struct element_command_shm_server {
+	struct element *elem;
+	struct element_command_shm_header *hdr;
+	char name[ELEMENT_COMMAND_SHM_NAME_MAXLEN];
+	char key[ATOM_NAME_MAXLEN];
+	pthread_t thread;
+	pthread_t heartbeat_thread;
+	uint32_t stop;
+};
+
+// Mapping of another element's segment. Each caller using it holds a
+//	reference, as does the element's entry for it until the mapping goes
+//	stale, s.t. it's only unmapped once nobody is using it.
+struct element_command_shm_map {
+	struct element_command_shm_header *hdr;
+	char name[ELEMENT_COMMAND_SHM_NAME_MAXLEN];
+	unsigned int refs;
+	uint32_t next_slot;
+};
+
+// Channel to another element, kept in a list on the calling element
+struct element_command_shm_client {
+	char *elem_name;
+	struct element_command_shm_map *map;
+	uint64_t retry_ms;
+	struct element_command_shm_client *next;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Waits for the futex to change from val, for up to timeout_ms.
+//			The segment is shared between processes so this can't use the
+//			private futex ops.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void element_command_shm_futex_wait(
+	uint32_t *futex,
+	uint32_t val,
+	int timeout_ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	syscall(SYS_futex, futex, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Wakes everything waiting on the futex
+//
+////////////////////////////////////////////////////////////////////////////////
+static void element_command_shm_futex_wake(
+	uint32_t *futex)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Moves a slot from one state to another if it's still in the first
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool element_command_shm_slot_move(
+	struct element_command_shm_slot *slot,
+	uint32_t from,
+	uint32_t to)
+{
+	return __atomic_compare_exchange_n(&slot->state, &from, to, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Puts a slot in a state and wakes whoever is waiting on it
+//
+////////////////////////////////////////////////////////////////////////////////
+static void element_command_shm_slot_set(
+	struct element_command_shm_slot *slot,
+	uint32_t state)
+{
+	__atomic_store_n(&slot->state, state, __ATOMIC_RELEASE);
+	element_command_shm_futex_wake(&slot->state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Whether the server hasn't been heard from in too long
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool element_command_shm_stale(
+	struct element_command_shm_header *hdr)
+{
+	uint64_t heartbeat_ms = __atomic_load_n(&hdr->heartbeat_ms,
+		__ATOMIC_ACQUIRE);
+
+	return (redis_monotonic_ms() - heartbeat_ms) > ELEMENT_COMMAND_SHM_STALE_MS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Whether the channel is turned on for the process
+//
+////////////////////////////////////////////////////////////////////////////////
+bool element_command_shm_enabled(void)
+{
+	const char *env = getenv(ELEMENT_COMMAND_SHM_ENV);
+
+	return (env == NULL) || (strcmp(env, "0") != 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the name of the segment a slot's overflowing response is
+//			handed over in. The slot's sequence number is bumped with each
+//			request s.t. a late response can't be mistaken for a newer one.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void element_command_shm_overflow_name(
+	const char *name,
+	size_t slot_idx,
+	uint32_t seq,
+	char overflow_name[ELEMENT_COMMAND_SHM_OVERFLOW_NAME_MAXLEN])
+{
+	snprintf(overflow_name, ELEMENT_COMMAND_SHM_OVERFLOW_NAME_MAXLEN, "%s.%zu.%u",
+		name, slot_idx, seq);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Parses the value a channel is advertised with. Returns false if
+//			it's not on this host or is a version we don't speak.
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool element_command_shm_parse_advert(
+	const char *value,
+	char name[ELEMENT_COMMAND_SHM_NAME_MAXLEN])
+{
+	unsigned int version;
+	char host[ELEMENT_COMMAND_SHM_HOST_MAXLEN];
+	char our_host[ELEMENT_COMMAND_SHM_HOST_MAXLEN];
+
+	if ((sscanf(value, "%u %255s %255s", &version, host, name) != 3) ||
+		(version != ELEMENT_COMMAND_SHM_VERSION))
+	{
+		return false;
+	}
+
+	if (gethostname(our_host, sizeof(our_host)) != 0) {
+		return false;
+	}
+	our_host[sizeof(our_host) - 1] = '\0';
+
+	return strcmp(host, our_host) == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the advertised segment name for an element, if there's
+//			one on this host
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool element_command_shm_get_advert(
+	redisContext *ctx,
+	const char *key,
+	char name[ELEMENT_COMMAND_SHM_NAME_MAXLEN])
+{
+	redisReply *reply;
+	bool ret_val = false;
+
+	reply = redisCommand(ctx, "GET %s", key);
+	if (reply == NULL) {
+		goto done;
+	}
+
+	if (reply->type == REDIS_REPLY_STRING) {
+		ret_val = element_command_shm_parse_advert(reply->str, name);
+	}
+
+	freeReplyObject(reply);
+done:
+	return ret_val;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Maps a segment. The server creates it, callers open the
+//			existing one.
+//
+////////////////////////////////////////////////////////////////////////////////
+static struct element_command_shm_header *element_command_shm_map(
+	const char *name,
+	bool create)
+{
+	struct element_command_shm_header *hdr = NULL;
+	struct stat st;
+	void *addr;
+	int fd;
+
+	fd = shm_open(name, create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0600);
+	if (fd < 0) {
+		goto done;
+	}
+
+	if (create) {
+		if (ftruncate(fd, sizeof(struct element_command_shm_header)) != 0) {
+			goto close_fd;
+		}
+	} else if ((fstat(fd, &st) != 0) ||
+		((size_t)st.st_size < sizeof(struct element_command_shm_header)))
+	{
+		goto close_fd;
+	}
+
+	addr = mmap(NULL, sizeof(struct element_command_shm_header),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		goto close_fd;
+	}
+	hdr = (struct element_command_shm_header *)addr;
+
+	// Make sure a caller and the server agree on the layout
+	if (!create &&
+		((hdr->version != ELEMENT_COMMAND_SHM_VERSION) ||
+		(hdr->n_slots != ELEMENT_COMMAND_SHM_N_SLOTS) ||
+		(hdr->slot_data_len != ELEMENT_COMMAND_SHM_SLOT_DATA_LEN)))
+	{
+		munmap(hdr, sizeof(struct element_command_shm_header));
+		hdr = NULL;
+	}
+
+close_fd:
+	close(fd);
+done:
+	return hdr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes the response for a slot, in a segment of its own if it
+//			doesn't fit in the slot
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool element_command_shm_write_response(
+	struct element_command_shm_server *server,
+	struct element_command_shm_slot *slot,
+	size_t slot_idx,
+	const uint8_t *response,
+	size_t response_len,
+	const char *error_str)
+{
+	char overflow_name[ELEMENT_COMMAND_SHM_OVERFLOW_NAME_MAXLEN];
+	size_t err_str_len = (error_str != NULL) ? (strlen(error_str) + 1) : 0;
+	size_t len = err_str_len + response_len;
+	uint8_t *dst = slot->response;
+	void *addr = NULL;
+	bool ret_val = false;
+	int fd;
+
+	slot->err_str_len = err_str_len;
+	slot->response_len = response_len;
+	slot->has_response = (response != NULL);
+	slot->overflow = (len > ELEMENT_COMMAND_SHM_SLOT_DATA_LEN);
+
+	if (slot->overflow) {
+		element_command_shm_overflow_name(
+			server->name, slot_idx, slot->seq, overflow_name);
+		shm_unlink(overflow_name);
+
+		fd = shm_open(overflow_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0) {
+			goto done;
+		}
+		if (ftruncate(fd, len) == 0) {
+			addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if ((addr == NULL) || (addr == MAP_FAILED)) {
+			shm_unlink(overflow_name);
+			goto done;
+		}
+		dst = (uint8_t *)addr;
+	}
+
+	if (err_str_len > 0) {
+		memcpy(dst, error_str, err_str_len);
+	}
+	if (response_len > 0) {
+		memcpy(dst + err_str_len, response, response_len);
+	}
+
+	if (slot->overflow) {
+		munmap(addr, len);
+	}
+
+	ret_val = true;
+
+done:
+	return ret_val;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Serves the request in a slot. Acks it, runs the command's handler
+//			and hands back the response, same as element_cmd_rep_xread_cb
+//			does for the command stream.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void element_command_shm_serve_slot(
+	struct element_command_shm_server *server,
+	struct element_command_shm_slot *slot,
+	size_t slot_idx)
+{
+	struct element *elem = server->elem;
+	struct element_command *cmd = NULL;
+	bool valid;
+	int ret;
+	uint8_t *response = NULL;
+	size_t response_len = 0;
+	char *error_str = NULL;
+	void *cleanup_ptr = NULL;
+	char overflow_name[ELEMENT_COMMAND_SHM_OVERFLOW_NAME_MAXLEN];
+	bool tracing = false;
+	struct atom_trace_span span = ATOM_TRACE_SPAN_INIT;
+	struct atom_trace_span handler_span = ATOM_TRACE_SPAN_INIT;
+	struct atom_trace_context trace, handler_trace, prev_trace;
+
+	// Take the request before reading it s.t. the caller can't take it
+	//	back and the slot be reused under us. If the caller already gave
+	//	up on it there's nothing to do.
+	if (!element_command_shm_slot_move(slot, SHM_SLOT_REQUEST,
+		SHM_SLOT_RECEIVED))
+	{
+		return;
+	}
+
+	// Make sure the request is well-formed before looking up the command
+	valid = ((slot->cmd_len + 1 + (size_t)slot->data_len) <=
+			ELEMENT_COMMAND_SHM_SLOT_DATA_LEN) &&
+		(slot->request[slot->cmd_len] == '\0');
+	if (valid) {
+		cmd = element_command_get(elem, (const char *)slot->request);
+	}
+
+	if (element_command_shm_received_hook != NULL) {
+		element_command_shm_received_hook();
+	}
+
+	// If the caller's tracing the command, note how long it waited in
+	//	the slot and then time handling it, same as over redis
+	trace = slot->trace;
+	if ((trace.trace_id != 0) && atom_trace_enabled()) {
+		tracing = true;
+
+		atom_trace_begin(&span, &trace, "queue_wait", "%s",
+			valid ? (const char *)slot->request : "");
+		span.start_us = trace.sent_us;
+		atom_trace_end(&span);
+
+		atom_trace_begin(&span, &trace, "command_handle", "%s",
+			valid ? (const char *)slot->request : "");
+		atom_trace_span_context(&span, &trace);
+	}
+
+	// Ack the request with the timeout. If the caller gave up on us before
+	//	then it's sent the command over redis, so it mustn't be run here
+	//	too and the slot's done with.
+	slot->timeout = (cmd != NULL) ? cmd->timeout : ELEMENT_NO_COMMAND_TIMEOUT_MS;
+	if (!element_command_shm_slot_move(slot, SHM_SLOT_RECEIVED, SHM_SLOT_ACKED)) {
+		element_command_shm_slot_set(slot, SHM_SLOT_FREE);
+		goto done;
+	}
+	element_command_shm_futex_wake(&slot->state);
+
+	if (cmd == NULL) {
+		if (valid) {
+			atom_logf(NULL, elem, LOG_ERR, "Unsupported command!");
+			slot->err_code = ATOM_COMMAND_UNSUPPORTED;
+		} else {
+			atom_logf(NULL, elem, LOG_ERR, "Invalid command request!");
+			slot->err_code = ATOM_COMMAND_INVALID_DATA;
+		}
+	} else {
+
+		// Anything the handler sends is part of the trace
+		if (tracing) {
+			atom_trace_begin(&handler_span, &trace, "handler", "%s", cmd->name);
+			atom_trace_span_context(&handler_span, &handler_trace);
+			atom_trace_set_current(&handler_trace, &prev_trace);
+		}
+
+		// Handlers are run one at a time between us and the command loop
+		pthread_mutex_lock(&elem->command.lock);
+		ret = cmd->cb(
+			slot->request + slot->cmd_len + 1,
+			slot->data_len,
+			&response,
+			&response_len,
+			&error_str,
+			cmd->user_data,
+			&cleanup_ptr);
+		pthread_mutex_unlock(&elem->command.lock);
+
+		if (tracing) {
+			atom_trace_set_current(&prev_trace, NULL);
+			atom_trace_end(&handler_span);
+		}
+
+		slot->err_code = (ret != 0) ? (ATOM_USER_ERRORS_BEGIN + ret) :
+			ATOM_NO_ERROR;
+	}
+
+	// If the caller isn't waiting then the slot's done with, else hand
+	//	over the response unless they gave up waiting on it
+	if (slot->flags & SHM_SLOT_NO_RESPONSE) {
+		element_command_shm_slot_set(slot, SHM_SLOT_FREE);
+	} else {
+		if (!element_command_shm_write_response(server, slot, slot_idx,
+			response, response_len, error_str))
+		{
+			atom_logf(NULL, elem, LOG_ERR, "Failed to write response");
+			slot->err_code = ATOM_INTERNAL_ERROR;
+			slot->err_str_len = 0;
+			slot->has_response = 0;
+			slot->overflow = 0;
+		}
+
+		if (element_command_shm_slot_move(slot, SHM_SLOT_ACKED,
+			SHM_SLOT_RESPONSE))
+		{
+			element_command_shm_futex_wake(&slot->state);
+		} else {
+			if (slot->overflow) {
+				element_command_shm_overflow_name(
+					server->name, slot_idx, slot->seq, overflow_name);
+				shm_unlink(overflow_name);
+			}
+			element_command_shm_slot_set(slot, SHM_SLOT_FREE);
+		}
+	}
+
+	if (cleanup_ptr != NULL) {
+		if (cmd->cleanup != NULL) {
+			cmd->cleanup(cleanup_ptr);
+		} else {
+			atom_logf(NULL, elem, LOG_ERR,
+				"Cleanup ptr non-null but no cleanup fn!");
+		}
+	} else {
+		if (response != NULL) {
+			free(response);
+		}
+		if (error_str != NULL) {
+			free(error_str);
+		}
+	}
+
+done:
+	if (tracing) {
+		atom_trace_end(&span);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Thread noting the server's alive every heartbeat until it's
+//			stopped, whatever the serving thread is busy with
+//
+////////////////////////////////////////////////////////////////////////////////
+static void *element_command_shm_heartbeat(
+	void *arg)
+{
+	struct element_command_shm_server *server = arg;
+
+	while (!__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&server->hdr->heartbeat_ms, redis_monotonic_ms(),
+			__ATOMIC_RELEASE);
+		element_command_shm_futex_wait(&server->stop, 0,
+			ELEMENT_COMMAND_SHM_HEARTBEAT_MS);
+	}
+
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Thread serving the channel. Serves any requests and then waits
+//			on the doorbell. The doorbell is read before looking at the
+//			slots s.t. a request that comes in while we're looking wakes
+//			us right back up.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void *element_command_shm_serve(
+	void *arg)
+{
+	struct element_command_shm_server *server = arg;
+	struct element_command_shm_header *hdr = server->hdr;
+	uint32_t doorbell;
+	bool served;
+	size_t i;
+
+	while (!__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE)) {
+
+		doorbell = __atomic_load_n(&hdr->doorbell, __ATOMIC_SEQ_CST);
+
+		served = false;
+		for (i = 0; i < ELEMENT_COMMAND_SHM_N_SLOTS; ++i) {
+			if (__atomic_load_n(&hdr->slots[i].state, __ATOMIC_ACQUIRE) ==
+				SHM_SLOT_REQUEST)
+			{
+				element_command_shm_serve_slot(server, &hdr->slots[i], i);
+				served = true;
+			}
+		}
+
+		if (!served) {
+			element_command_shm_futex_wait(&hdr->doorbell, doorbell,
+				ELEMENT_COMMAND_SHM_HEARTBEAT_MS);
+		}
+	}
+
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Tells the serving and heartbeat threads to stop
+//
+////////////////////////////////////////////////////////////////////////////////
+static void element_command_shm_server_stop(
+	struct element_command_shm_server *server)
+{
+	__atomic_store_n(&server->stop, 1, __ATOMIC_RELEASE);
+	element_command_shm_futex_wake(&server->stop);
+	__atomic_fetch_add(&server->hdr->doorbell, 1, __ATOMIC_SEQ_CST);
+	element_command_shm_futex_wake(&server->hdr->doorbell);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Maps the element's segment, starts serving it and advertises it.
+//			A segment left behind by an earlier run of the element is
+//			taken down first.
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t element_command_shm_start(
+	redisContext *ctx,
+	struct element *elem)
+{
+	struct element_command_shm_server *server;
+	char host[ELEMENT_COMMAND_SHM_HOST_MAXLEN];
+	char old_name[ELEMENT_COMMAND_SHM_NAME_MAXLEN];
+	redisReply *reply;
+	size_t i;
+	enum atom_error_t ret = ATOM_INTERNAL_ERROR;
+
+	if (elem->command.shm != NULL) {
+		return ATOM_NO_ERROR;
+	}
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		return ATOM_REDIS_ERROR;
+	}
+
+	server = calloc(1, sizeof(struct element_command_shm_server));
+	assert(server != NULL);
+	server->elem = elem;
+
+	snprintf(server->key, sizeof(server->key), "%s%s",
+		ELEMENT_COMMAND_SHM_KEY_PREFIX, elem->name.str);
+
+	// Segment names can't have slashes past the leading one
+	snprintf(server->name, sizeof(server->name), "/atom.%s.%d",
+		elem->name.str, (int)getpid());
+	for (i = 1; server->name[i] != '\0'; ++i) {
+		if (server->name[i] == '/') {
+			server->name[i] = '_';
+		}
+	}
+
+	if (element_command_shm_get_advert(ctx, server->key, old_name)) {
+		shm_unlink(old_name);
+	}
+	shm_unlink(server->name);
+
+	server->hdr = element_command_shm_map(server->name, true);
+	if (server->hdr == NULL) {
+		atom_logf(ctx, elem, LOG_WARNING,
+			"Failed to map shared memory for commands: %s", strerror(errno));
+		goto err_free;
+	}
+	server->hdr->version = ELEMENT_COMMAND_SHM_VERSION;
+	server->hdr->n_slots = ELEMENT_COMMAND_SHM_N_SLOTS;
+	server->hdr->slot_data_len = ELEMENT_COMMAND_SHM_SLOT_DATA_LEN;
+	server->hdr->heartbeat_ms = redis_monotonic_ms();
+
+	if (pthread_create(&server->heartbeat_thread, NULL,
+		element_command_shm_heartbeat, server) != 0)
+	{
+		atom_logf(ctx, elem, LOG_ERR, "Failed to start command channel thread");
+		goto err_unmap;
+	}
+	if (pthread_create(&server->thread, NULL, element_command_shm_serve,
+		server) != 0)
+	{
+		atom_logf(ctx, elem, LOG_ERR, "Failed to start command channel thread");
+		goto err_stop_heartbeat;
+	}
+
+	// Only advertise once we're serving
+	if (gethostname(host, sizeof(host)) != 0) {
+		goto err_stop;
+	}
+	host[sizeof(host) - 1] = '\0';
+	reply = redisCommand(ctx, "SET %s %d %s %s", server->key,
+		ELEMENT_COMMAND_SHM_VERSION, host, server->name);
+	if ((reply == NULL) || (reply->type == REDIS_REPLY_ERROR)) {
+		atom_logf(ctx, elem, LOG_ERR, "Failed to advertise command channel");
+		if (reply != NULL) {
+			freeReplyObject(reply);
+		}
+		ret = ATOM_REDIS_ERROR;
+		goto err_stop;
+	}
+	freeReplyObject(reply);
+
+	elem->command.shm = server;
+	return ATOM_NO_ERROR;
+
+err_stop:
+	element_command_shm_server_stop(server);
+	pthread_join(server->thread, NULL);
+err_stop_heartbeat:
+	element_command_shm_server_stop(server);
+	pthread_join(server->heartbeat_thread, NULL);
+err_unmap:
+	munmap(server->hdr, sizeof(struct element_command_shm_header));
+	shm_unlink(server->name);
+err_free:
+	free(server);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Stops serving the channel and takes it down. The heartbeat is
+//			cleared s.t. callers with it mapped go back to redis right away.
+//
+////////////////////////////////////////////////////////////////////////////////
+void element_command_shm_stop(
+	redisContext *ctx,
+	struct element *elem)
+{
+	struct element_command_shm_server *server = elem->command.shm;
+
+	if (server == NULL) {
+		return;
+	}
+	elem->command.shm = NULL;
+
+	redis_remove_key(ctx, server->key, true);
+
+	element_command_shm_server_stop(server);
+	pthread_join(server->thread, NULL);
+	pthread_join(server->heartbeat_thread, NULL);
+
+	__atomic_store_n(&server->hdr->heartbeat_ms, 0, __ATOMIC_RELEASE);
+	munmap(server->hdr, sizeof(struct element_command_shm_header));
+	shm_unlink(server->name);
+	free(server);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Drops a reference to a mapping, unmapping it with the last one.
+//			Must be called with the element's channel lock held.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void element_command_shm_map_put(
+	struct element_command_shm_map *map)
+{
+	if (--map->refs == 0) {
+		munmap(map->hdr, sizeof(struct element_command_shm_header));
+		free(map);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets a reference to the mapping of an element's segment, mapping
+//			it if it's advertised and we haven't looked for it recently.
+//			Returns NULL if there's no channel to the element.
+//
+////////////////////////////////////////////////////////////////////////////////
+static struct element_command_shm_map *element_command_shm_map_get(
+	redisContext *ctx,
+	struct element *elem,
+	const char *cmd_elem)
+{
+	struct element_command_shm_client *client;
+	struct element_command_shm_map *map = NULL;
+	struct element_command_shm_header *hdr;
+	char key[ATOM_NAME_MAXLEN];
+	char name[ELEMENT_COMMAND_SHM_NAME_MAXLEN];
+	uint64_t now_ms;
+
+	pthread_mutex_lock(&elem->shm.lock);
+
+	for (client = elem->shm.clients; client != NULL; client = client->next) {
+		if (strcmp(client->elem_name, cmd_elem) == 0) {
+			break;
+		}
+	}
+	if (client == NULL) {
+		client = calloc(1, sizeof(struct element_command_shm_client));
+		assert(client != NULL);
+		client->elem_name = strdup(cmd_elem);
+		assert(client->elem_name != NULL);
+		client->next = elem->shm.clients;
+		elem->shm.clients = client;
+	}
+
+	// Look for the channel if we don't have it and it's time to
+	now_ms = redis_monotonic_ms();
+	if ((client->map == NULL) && (now_ms >= client->retry_ms)) {
+		client->retry_ms = now_ms + ELEMENT_COMMAND_SHM_RETRY_MS;
+
+		snprintf(key, sizeof(key), "%s%s",
+			ELEMENT_COMMAND_SHM_KEY_PREFIX, cmd_elem);
+		if (element_command_shm_get_advert(ctx, key, name) &&
+			((hdr = element_command_shm_map(name, false)) != NULL))
+		{
+			client->map = calloc(1, sizeof(struct element_command_shm_map));
+			assert(client->map != NULL);
+			client->map->hdr = hdr;
+			client->map->refs = 1;
+			memcpy(client->map->name, name, sizeof(client->map->name));
+		}
+	}
+
+	// Take it unless the server's gone quiet, in which case drop it
+	//	and look again later
+	if (client->map != NULL) {
+		if (element_command_shm_stale(client->map->hdr)) {
+			element_command_shm_map_put(client->map);
+			client->map = NULL;
+		} else {
+			map = client->map;
+			map->refs += 1;
+		}
+	}
+
+	pthread_mutex_unlock(&elem->shm.lock);
+	return map;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gives back a reference from element_command_shm_map_get. If the
+//			server went quiet the mapping is dropped s.t. we look for the
+//			channel again later.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void element_command_shm_map_release(
+	struct element *elem,
+	const char *cmd_elem,
+	struct element_command_shm_map *map,
+	bool stale)
+{
+	struct element_command_shm_client *client;
+
+	pthread_mutex_lock(&elem->shm.lock);
+
+	if (stale) {
+		for (client = elem->shm.clients; client != NULL; client = client->next) {
+			if ((client->map == map) && (strcmp(client->elem_name, cmd_elem) == 0)) {
+				element_command_shm_map_put(map);
+				client->map = NULL;
+				client->retry_ms = redis_monotonic_ms() +
+					ELEMENT_COMMAND_SHM_RETRY_MS;
+				break;
+			}
+		}
+	}
+	element_command_shm_map_put(map);
+
+	pthread_mutex_unlock(&elem->shm.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Claims a free slot, starting after the last one claimed s.t.
+//			callers spread out over the slots
+//
+////////////////////////////////////////////////////////////////////////////////
+static struct element_command_shm_slot *element_command_shm_claim(
+	struct element_command_shm_map *map,
+	size_t *slot_idx)
+{
+	uint32_t start;
+	size_t i, idx;
+
+	start = __atomic_fetch_add(&map->next_slot, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < ELEMENT_COMMAND_SHM_N_SLOTS; ++i) {
+		idx = (start + i) % ELEMENT_COMMAND_SHM_N_SLOTS;
+		if (element_command_shm_slot_move(&map->hdr->slots[idx],
+			SHM_SLOT_FREE, SHM_SLOT_CLAIMED))
+		{
+			*slot_idx = idx;
+			return &map->hdr->slots[idx];
+		}
+	}
+
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Hands a slot's response to the caller, same as
+//			element_command_response_callback does for the response stream
+//
+////////////////////////////////////////////////////////////////////////////////
+static enum atom_error_t element_command_shm_read_response(
+	struct element_command_shm_map *map,
+	struct element_command_shm_slot *slot,
+	size_t slot_idx,
+	bool (*response_cb)(
+		const uint8_t *response,
+		size_t response_len,
+		void *user_data),
+	void *user_data,
+	char **error_str)
+{
+	char overflow_name[ELEMENT_COMMAND_SHM_OVERFLOW_NAME_MAXLEN];
+	size_t len = (size_t)slot->err_str_len + slot->response_len;
+	const uint8_t *src = slot->response;
+	void *addr = NULL;
+	enum atom_error_t ret = slot->err_code;
+	int fd;
+
+	if (slot->overflow) {
+		element_command_shm_overflow_name(
+			map->name, slot_idx, slot->seq, overflow_name);
+		fd = shm_open(overflow_name, O_RDONLY, 0);
+		shm_unlink(overflow_name);
+		if (fd < 0) {
+			return ATOM_INTERNAL_ERROR;
+		}
+		addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED) {
+			return ATOM_INTERNAL_ERROR;
+		}
+		src = (const uint8_t *)addr;
+	}
+
+	if (ret == ATOM_NO_ERROR) {
+		if ((response_cb != NULL) && slot->has_response) {
+			if (!response_cb(src + slot->err_str_len, slot->response_len,
+				user_data))
+			{
+				ret = ATOM_CALLBACK_FAILED;
+			}
+		}
+	} else if ((slot->err_str_len > 0) && (error_str != NULL)) {
+		*error_str = strndup((const char *)src, slot->err_str_len - 1);
+		assert(*error_str != NULL);
+	}
+
+	if (addr != NULL) {
+		munmap(addr, len);
+	}
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Tries to send a command over the channel. Anything that keeps
+//			the command from getting to the server, i.e. no channel, no
+//			free slot, too much data or the server going quiet before
+//			acking, returns false s.t. the command goes over redis instead.
+//			Once the command is acked we're committed to the channel.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool element_command_shm_send(
+	redisContext *ctx,
+	struct element *elem,
+	const char *cmd_elem,
+	const char *cmd,
+	const uint8_t *data,
+	size_t data_len,
+	bool block,
+	bool (*response_cb)(
+		const uint8_t *response,
+		size_t response_len,
+		void *user_data),
+	void *user_data,
+	char **error_str,
+	const struct atom_trace_context *trace,
+	enum atom_error_t *ret)
+{
+	struct element_command_shm_map *map;
+	struct element_command_shm_slot *slot;
+	size_t slot_idx;
+	size_t cmd_len = strlen(cmd);
+	uint64_t deadline_ms = 0;
+	uint64_t now_ms;
+	uint32_t state;
+	bool stale = false;
+	bool sent = false;
+	struct atom_trace_span step_span = ATOM_TRACE_SPAN_INIT;
+
+	if (!element_command_shm_enabled() ||
+		((cmd_len + 1 + data_len) > ELEMENT_COMMAND_SHM_SLOT_DATA_LEN))
+	{
+		return false;
+	}
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		return false;
+	}
+
+	map = element_command_shm_map_get(ctx, elem, cmd_elem);
+	if (map == NULL) {
+		return false;
+	}
+
+	slot = element_command_shm_claim(map, &slot_idx);
+	if (slot == NULL) {
+		goto done;
+	}
+
+	if (trace != NULL) {
+		atom_trace_begin(&step_span, trace, "shm_request", "%s", cmd_elem);
+	}
+
+	// Fill in the request and ring the doorbell. The trace goes along with
+	//	it s.t. the element can tie its handling of it back to us.
+	slot->seq += 1;
+	slot->flags = block ? 0 : SHM_SLOT_NO_RESPONSE;
+	slot->cmd_len = cmd_len;
+	slot->data_len = data_len;
+	memcpy(slot->request, cmd, cmd_len + 1);
+	if (data_len > 0) {
+		memcpy(slot->request + cmd_len + 1, data, data_len);
+	}
+	if (trace != NULL) {
+		slot->trace = *trace;
+		slot->trace.sent_us = atom_trace_now_us();
+	} else {
+		memset(&slot->trace, 0, sizeof(slot->trace));
+	}
+	__atomic_store_n(&slot->state, SHM_SLOT_REQUEST, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&map->hdr->doorbell, 1, __ATOMIC_SEQ_CST);
+	element_command_shm_futex_wake(&map->hdr->doorbell);
+
+	if (trace != NULL) {
+		atom_trace_end(&step_span);
+		atom_trace_begin(&step_span, trace, "ack_wait", "%u", slot->seq);
+	}
+
+	// Wait for the ack. If the server goes quiet take the request back
+	//	and send it over redis. If it's been received, abandon it instead:
+	//	the server only runs the handler if it can ack, and frees the slot
+	//	if it finds the request abandoned.
+	while (((state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)) ==
+		SHM_SLOT_REQUEST) || (state == SHM_SLOT_RECEIVED))
+	{
+		if (element_command_shm_stale(map->hdr) &&
+			element_command_shm_slot_move(slot, state,
+				(state == SHM_SLOT_RECEIVED) ? SHM_SLOT_ABANDONED : SHM_SLOT_FREE))
+		{
+			atom_logf(ctx, elem, LOG_WARNING,
+				"No ACK on command channel to %s, using redis", cmd_elem);
+			stale = true;
+			goto done;
+		}
+		element_command_shm_futex_wait(&slot->state, state,
+			ELEMENT_COMMAND_SHM_HEARTBEAT_MS);
+	}
+	sent = true;
+
+	// If we're not blocking then the slot's the server's to free
+	if (!block) {
+		*ret = ATOM_NO_ERROR;
+		goto done;
+	}
+
+	if (trace != NULL) {
+		atom_trace_end(&step_span);
+		atom_trace_begin(&step_span, trace, "response_wait", "%u", slot->seq);
+	}
+
+	// Wait for the response for as long as the ack said to, where no
+	//	timeout means waiting forever, or until the server goes quiet. If
+	//	it doesn't come give up on it unless it came just now.
+	if (slot->timeout > 0) {
+		deadline_ms = redis_monotonic_ms() + slot->timeout;
+	}
+	while ((state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)) ==
+		SHM_SLOT_ACKED)
+	{
+		now_ms = redis_monotonic_ms();
+		stale = element_command_shm_stale(map->hdr);
+		if (stale || ((deadline_ms != 0) && (now_ms >= deadline_ms))) {
+			if (element_command_shm_slot_move(slot, SHM_SLOT_ACKED,
+				SHM_SLOT_ABANDONED))
+			{
+				atom_logf(ctx, elem, LOG_ERR, "Failed to get response");
+				*ret = ATOM_COMMAND_NO_RESPONSE;
+				goto done;
+			}
+			stale = false;
+			continue;
+		}
+		element_command_shm_futex_wait(&slot->state, SHM_SLOT_ACKED,
+			((deadline_ms != 0) &&
+				(deadline_ms - now_ms < ELEMENT_COMMAND_SHM_HEARTBEAT_MS)) ?
+				(int)(deadline_ms - now_ms) : ELEMENT_COMMAND_SHM_HEARTBEAT_MS);
+	}
+
+	*ret = element_command_shm_read_response(map, slot, slot_idx,
+		response_cb, user_data, error_str);
+	element_command_shm_slot_set(slot, SHM_SLOT_FREE);
+
+done:
+	atom_trace_end(&step_span);
+	element_command_shm_map_release(elem, cmd_elem, map, stale);
+	return sent;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Unmaps the channels the element has sent commands over and frees
+//			the list of them
+//
+////////////////////////////////////////////////////////////////////////////////
+void element_command_shm_clients_cleanup(
+	struct element *elem)
+{
+	struct element_command_shm_client *client, *to_delete;
+
+	pthread_mutex_lock(&elem->shm.lock);
+
+	client = elem->shm.clients;
+	while (client != NULL) {
+		to_delete = client;
+		client = client->next;
+		if (to_delete->map != NULL) {
+			element_command_shm_map_put(to_delete->map);
+		}
+		free(to_delete->elem_name);
+		free(to_delete);
+	}
+	elem->shm.clients = NULL;
+
+	pthread_mutex_unlock(&elem->shm.lock);
+}
@@ -22,40 +22,80 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  @brief Generic callback for when we get an XREAD on a stream
-//			we were listening to. Will process the kv items
-//			and then call the user callback with the kv items
+//  @brief Processes an entry into the kv items and then calls the user
+//			callback with them. Returns an error if the entry couldn't be
+//			parsed, else notes in keep_going whether the user callback
+//			wants more entries.
 //
 ////////////////////////////////////////////////////////////////////////////////
-static bool element_entry_read_cb(
+static enum atom_error_t element_entry_read_handle(
 	const char *id,
 	const struct redisReply *reply,
-	void *user_data)
+	struct element_entry_read_info *info,
+	bool *keep_going)
 {
-	bool ret_val = false;
-	struct element_entry_read_info *info;
-
-	// Cast the user data
-	info = (struct element_entry_read_info *)user_data;
+	enum atom_error_t ret = ATOM_NO_ERROR;
+	struct atom_trace_span span = ATOM_TRACE_SPAN_INIT;
+	struct atom_trace_context trace, prev_trace;
+
+	// If the entry was traced, note how long it took to get to us and
+	//	make the callback part of its trace, along with anything it sends
+	if (atom_trace_enabled() && atom_trace_find(reply, &trace)) {
+		atom_trace_begin(&span, &trace, "entry_read", "%s:%s %s",
+			info->element, info->stream, id);
+		span.start_us = trace.sent_us;
+		atom_trace_end(&span);
+
+		atom_trace_begin(&span, &trace, "entry_handler", "%s:%s %s",
+			info->element, info->stream, id);
+		atom_trace_span_context(&span, &trace);
+		atom_trace_set_current(&trace, &prev_trace);
+	}
 
 	// Now, we want to parse the reply into the kv items
 	if (!redis_xread_parse_kv(reply, info->kv_items, info->n_kv_items)) {
 		atom_logf(NULL, NULL, LOG_ERR, "Failed to parse reply!");
+		ret = ATOM_DESERIALIZATION_ERROR;
 		goto done;
 	}
 
 	// Send the kv items along to the user response
-	if (!info->response_cb(id, info->kv_items, info->n_kv_items, info->user_data)) {
-		atom_logf(NULL, NULL, LOG_ERR,
-			"Failed to call user response callback with kv items");
-		goto done;
+	*keep_going = info->response_cb(
+		id, info->kv_items, info->n_kv_items, info->user_data);
+
+done:
+	if (span.start_us != 0) {
+		atom_trace_end(&span);
+		atom_trace_set_current(&prev_trace, NULL);
 	}
+	return ret;
+}
 
-	// Note the success
-	ret_val = true;
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Generic callback for when we get an XREAD on a stream
+//			we were listening to. Will process the kv items
+//			and then call the user callback with the kv items
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool element_entry_read_cb(
+	const char *id,
+	const struct redisReply *reply,
+	void *user_data)
+{
+	bool keep_going = false;
 
-done:
-	return ret_val;
+	if (element_entry_read_handle(id, reply,
+		(struct element_entry_read_info *)user_data, &keep_going) != ATOM_NO_ERROR)
+	{
+		return false;
+	}
+
+	if (!keep_going) {
+		atom_logf(NULL, NULL, LOG_ERR,
+			"Failed to call user response callback with kv items");
+	}
+	return keep_going;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -126,6 +166,11 @@ enum atom_error_t element_entry_read_loop(
 				timeout,
 				REDIS_XREAD_NOMAXCOUNT))
 			{
+				// If we lost the connection then get it back and read
+				//	again from the last IDs we saw on each stream
+				if (ctx->err && element_reconnect(ctx, elem, true)) {
+					continue;
+				}
 				atom_logf(ctx, elem, LOG_ERR, "Redis issue/timeout");
 				ret = ATOM_REDIS_ERROR;
 				goto done;
@@ -145,6 +190,9 @@ enum atom_error_t element_entry_read_loop(
 				timeout,
 				REDIS_XREAD_NOMAXCOUNT))
 			{
+				if (ctx->err && element_reconnect(ctx, elem, false)) {
+					continue;
+				}
 				atom_logf(ctx, elem, LOG_ERR, "Redis issue/timeout");
 				ret = ATOM_REDIS_ERROR;
 				goto done;
@@ -194,6 +242,12 @@ enum atom_error_t element_entry_read_n(
 	int ret = ATOM_INTERNAL_ERROR;
 	char stream_name[ATOM_NAME_MAXLEN];
 
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
 	// Get the stream name
 	atom_get_data_stream_str(info->element, info->stream, stream_name);
 
@@ -236,6 +290,12 @@ enum atom_error_t element_entry_read_since(
 	// Initialize the return to an internal error
 	ret = ATOM_INTERNAL_ERROR;
 
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
 	// Get the full stream name for the data stream
 	atom_get_data_stream_str(info->element, info->stream, stream_name);
 
@@ -261,3 +321,399 @@ enum atom_error_t element_entry_read_since(
 done:
 	return ret;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Reads the items on a stream between two IDs, inclusive, in order.
+//			Pages through the range with XRANGE, prefetching the next page
+//			while the current one is being handled, s.t. arbitrarily long
+//			ranges can be replayed in constant memory. Stops early if the
+//			response callback returns false.
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t element_entry_read_range(
+	redisContext *ctx,
+	struct element *elem,
+	struct element_entry_read_info *info,
+	const char *start_id,
+	const char *end_id,
+	size_t page_size)
+{
+	int ret = ATOM_INTERNAL_ERROR;
+	char stream_name[ATOM_NAME_MAXLEN];
+	struct redis_xrange_iter iter;
+	const char *id;
+	const struct redisReply *data;
+	bool keep_going;
+
+	// Start the iterator out empty s.t. it can be cleaned up from anywhere
+	memset(&iter, 0, sizeof(iter));
+
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	// Get the stream name
+	atom_get_data_stream_str(info->element, info->stream, stream_name);
+
+	info->items_read = 0;
+
+	// Request the first page
+	if (!redis_xrange_iter_init(
+		ctx,
+		&iter,
+		stream_name,
+		(start_id != NULL) ? start_id : ENTRY_READ_RANGE_OLDEST_ID,
+		(end_id != NULL) ? end_id : ENTRY_READ_RANGE_NEWEST_ID,
+		page_size))
+	{
+		atom_logf(ctx, elem, LOG_ERR, "Failed to call XRANGE");
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	// And go through the entries
+	while (true) {
+		if (!redis_xrange_iter_next(&iter, &id, &data)) {
+			atom_logf(ctx, elem, LOG_ERR, "Failed to read XRANGE page");
+			ret = ATOM_REDIS_ERROR;
+			goto done;
+		}
+		if (id == NULL) {
+			break;
+		}
+
+		// Stop if the callback doesn't want more, which isn't an error
+		info->items_read += 1;
+		ret = element_entry_read_handle(id, data, info, &keep_going);
+		if (ret != ATOM_NO_ERROR) {
+			goto done;
+		}
+		if (!keep_going) {
+			break;
+		}
+	}
+
+	// Note the success
+	ret = ATOM_NO_ERROR;
+
+done:
+	redis_xrange_iter_cleanup(&iter);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Picks the entry in an XREVRANGE reply with the ID time closest
+//			to the reference, or the newest one if there's no reference.
+//			Entries are newest first s.t. ties go to the newer one.
+//			Returns NULL if there aren't any entries.
+//
+////////////////////////////////////////////////////////////////////////////////
+static const redisReply *element_entry_read_nearest(
+	const redisReply *entries,
+	uint64_t reference_ms)
+{
+	const redisReply *entry;
+	const redisReply *nearest = NULL;
+	uint64_t nearest_diff = UINT64_MAX;
+	uint64_t ms;
+	uint64_t diff;
+	size_t i;
+
+	for (i = 0; i < entries->elements; ++i) {
+
+		// Make sure the entry is an (ID, kv array) pair
+		entry = entries->element[i];
+		if ((entry->type != REDIS_REPLY_ARRAY) || (entry->elements != 2) ||
+			(entry->element[0]->type != REDIS_REPLY_STRING) ||
+			(entry->element[1]->type != REDIS_REPLY_ARRAY))
+		{
+			continue;
+		}
+
+		if (reference_ms == ELEMENT_ENTRY_READ_LATEST) {
+			return entry;
+		}
+
+		ms = redis_stream_id_ms(entry->element[0]->str);
+		diff = (ms > reference_ms) ? (ms - reference_ms) : (reference_ms - ms);
+		if (diff < nearest_diff) {
+			nearest = entry;
+			nearest_diff = diff;
+		}
+	}
+
+	return nearest;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Reads the newest entry, or the one nearest the reference, of
+//			each stream. The XREVRANGEs are done in a MULTI/EXEC s.t. no
+//			writes land between them and it's all one round trip.
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t element_entry_read_latest_multi(
+	redisContext *ctx,
+	struct element *elem,
+	struct element_entry_read_info *infos,
+	size_t n_infos,
+	uint64_t reference_ms,
+	size_t window)
+{
+	enum atom_error_t ret = ATOM_INTERNAL_ERROR;
+	char stream_name[ATOM_NAME_MAXLEN];
+	redisReply *reply = NULL;
+	const redisReply *entry;
+	size_t n_queued = 0;
+	size_t n;
+	size_t i;
+
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	// Only need the newest entry of each stream unless aligning
+	if (reference_ms == ELEMENT_ENTRY_READ_LATEST) {
+		n = 1;
+	} else {
+		n = (window != 0) ? window : ELEMENT_ENTRY_READ_DEFAULT_ALIGN_WINDOW;
+	}
+
+	if (!redis_multi_append(ctx)) {
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+	for (i = 0; i < n_infos; ++i) {
+		atom_get_data_stream_str(infos[i].element, infos[i].stream, stream_name);
+		if (!redis_xrevrange_append(ctx, stream_name, n)) {
+			break;
+		}
+		++n_queued;
+	}
+
+	// Always finish the transaction s.t. the context is left usable, but
+	//	if not everything made it in then discard it
+	if (!((n_queued == n_infos) ?
+		redis_exec_append(ctx) : redis_discard_append(ctx)))
+	{
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	reply = redis_exec_get_reply(ctx, n_queued);
+	if ((n_queued != n_infos) || (reply == NULL)) {
+		atom_logf(ctx, elem, LOG_ERR, "Failed to read %zu streams", n_infos);
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	for (i = 0; i < n_infos; ++i) {
+		if (reply->element[i]->type != REDIS_REPLY_ARRAY) {
+			atom_logf(ctx, elem, LOG_ERR, "Failed to read stream %s",
+				infos[i].stream);
+			ret = ATOM_REDIS_ERROR;
+			goto done;
+		}
+	}
+
+	// Align to the newest entry of the first stream if asked to. If it
+	//	doesn't have one then just take the newest of each.
+	if (reference_ms == ELEMENT_ENTRY_READ_ALIGN_FIRST) {
+		entry = (n_infos > 0) ?
+			element_entry_read_nearest(reply->element[0],
+				ELEMENT_ENTRY_READ_LATEST) : NULL;
+		reference_ms = (entry != NULL) ?
+			redis_stream_id_ms(entry->element[0]->str) :
+			ELEMENT_ENTRY_READ_LATEST;
+	}
+
+	// Pass each stream's entry along
+	for (i = 0; i < n_infos; ++i) {
+		entry = element_entry_read_nearest(reply->element[i], reference_ms);
+		if (entry == NULL) {
+			continue;
+		}
+		if (!element_entry_read_cb(entry->element[0]->str, entry->element[1],
+			&infos[i]))
+		{
+			ret = ATOM_CALLBACK_FAILED;
+			goto done;
+		}
+	}
+
+	ret = ATOM_NO_ERROR;
+
+done:
+	if (reply != NULL) {
+		freeReplyObject(reply);
+	}
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Makes a subscription to the streams in the infos. Unlike the
+//			read loop this only gets the time once for all of the streams.
+//
+////////////////////////////////////////////////////////////////////////////////
+struct element_entry_subscription *element_entry_subscription_init(
+	redisContext *ctx,
+	struct element *elem,
+	struct element_entry_read_info *infos,
+	size_t n_infos,
+	const char *start_id)
+{
+	struct element_entry_subscription *sub = NULL;
+	char now_id[STREAM_ID_BUFFLEN];
+	char *stream_name;
+	size_t i;
+
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		goto done;
+	}
+
+	// Start from now if we weren't told where to
+	if (start_id == ELEMENT_ENTRY_SUBSCRIPTION_START_NOW) {
+		if (!redis_get_time_id(ctx, now_id)) {
+			atom_logf(ctx, elem, LOG_ERR, "Failed to get the time");
+			goto done;
+		}
+		start_id = now_id;
+	}
+
+	sub = malloc(sizeof(struct element_entry_subscription));
+	assert(sub != NULL);
+	sub->elem = elem;
+	sub->infos = infos;
+	sub->n_infos = n_infos;
+
+	sub->stream_infos = malloc(n_infos * sizeof(struct redis_stream_info));
+	assert(sub->stream_infos != NULL);
+	memset(sub->stream_infos, 0, n_infos * sizeof(struct redis_stream_info));
+
+	for (i = 0; i < n_infos; ++i) {
+		stream_name = atom_get_data_stream_str(
+			infos[i].element, infos[i].stream, NULL);
+		assert(stream_name != NULL);
+
+		redis_init_stream_info(
+			NULL,
+			&sub->stream_infos[i],
+			stream_name,
+			element_entry_read_cb,
+			start_id,
+			&infos[i]);
+	}
+
+done:
+	return sub;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Reads on the subscription until we've read at least n entries
+//			or the timeout passes. Picks up from the last IDs read s.t.
+//			nothing is missed between polls.
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t element_entry_subscription_poll(
+	redisContext *ctx,
+	struct element_entry_subscription *sub,
+	size_t n,
+	int timeout,
+	size_t *n_read)
+{
+	enum atom_error_t ret = ATOM_INTERNAL_ERROR;
+	uint64_t deadline = 0;
+	uint64_t now;
+	size_t total = 0;
+	int block;
+	size_t i;
+
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	if (timeout > 0) {
+		deadline = redis_monotonic_ms() + timeout;
+	}
+
+	while (true) {
+
+		// Only block for what's left of the timeout
+		block = timeout;
+		if (timeout > 0) {
+			now = redis_monotonic_ms();
+			if (now >= deadline) {
+				break;
+			}
+			block = deadline - now;
+		}
+
+		for (i = 0; i < sub->n_infos; ++i) {
+			sub->stream_infos[i].items_read = 0;
+		}
+
+		if (!redis_xread(
+			ctx,
+			sub->stream_infos,
+			sub->n_infos,
+			block,
+			REDIS_XREAD_NOMAXCOUNT))
+		{
+			// If we lost the connection then get it back and read again
+			//	from the last IDs we saw on each stream
+			if (ctx->err && element_reconnect(ctx, sub->elem, false)) {
+				continue;
+			}
+			atom_logf(ctx, sub->elem, LOG_ERR, "Redis issue");
+			ret = ATOM_REDIS_ERROR;
+			goto done;
+		}
+
+		for (i = 0; i < sub->n_infos; ++i) {
+			total += sub->stream_infos[i].items_read;
+		}
+
+		if ((total >= n) || (timeout == REDIS_XREAD_DONTBLOCK)) {
+			break;
+		}
+	}
+
+	ret = ATOM_NO_ERROR;
+
+done:
+	if (n_read != NULL) {
+		*n_read = total;
+	}
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Cleans up a subscription
+//
+////////////////////////////////////////////////////////////////////////////////
+void element_entry_subscription_cleanup(
+	struct element_entry_subscription *sub)
+{
+	size_t i;
+
+	if (sub != NULL) {
+		for (i = 0; i < sub->n_infos; ++i) {
+			free((char*)sub->stream_infos[i].name);
+		}
+		free(sub->stream_infos);
+		free(sub);
+	}
+}
+
@@ -15,11 +15,15 @@
 #include <assert.h>
 #include <malloc.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "redis.h"
 #include "atom.h"
 #include "element.h"
 
+// Enough for any int
+#define ELEMENT_DATA_WRITE_TIMESTAMP_BUFFLEN 64
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  @brief Initializes a data write info. Will allocate the memory for the
@@ -47,22 +51,41 @@ struct element_entry_write_info *element_entry_write_init(
 	// Set up the stream name
 	atom_get_data_stream_str(elem->name.str, name, info->stream);
 
+	// It's registered s.t. others can find it without a SCAN once the
+	//	first write has made it
+	info->registered = false;
+
 	// Note the number of droplet items
 	info->n_items = n_items;
 
+	// Default to not noting a serialization
+	info->ser = NULL;
+
+	// And to only trimming with the maxlen passed to each write
+	memset(&info->retention, 0, sizeof(info->retention));
+	info->trim_writes = 0;
+	info->trim_bytes = 0;
+
+	// And to not compressing. The buffers for compressing are made the
+	//	first time they're needed
+	memset(&info->codec, 0, sizeof(info->codec));
+	info->codec_items = NULL;
+	info->codec_buffers = NULL;
+
 	// Return the info
 	return info;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  @brief Cleans up a data write info
+//  @brief Frees a data write info, leaving the stream in redis
 //
 ////////////////////////////////////////////////////////////////////////////////
-void element_entry_write_cleanup(
-	redisContext *ctx,
+void element_entry_write_free(
 	struct element_entry_write_info *info)
 {
+	size_t i;
+
 	if (info != NULL) {
 
 		// Free the items
@@ -70,30 +93,58 @@ void element_entry_write_cleanup(
 			free(info->items);
 		}
 
-		// Remove the stream key
-		redis_remove_key(ctx, info->stream, true);
+		// And anything we compressed into
+		if (info->codec_buffers != NULL) {
+			for (i = 0; i < info->n_items; ++i) {
+				atom_codec_buffer_free(&info->codec_buffers[i]);
+			}
+			free(info->codec_buffers);
+		}
+		free(info->codec_items);
 
 		// Free the info itself
 		free(info);
 	}
 }
 
-
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  @brief Writes a piece of data to the system. Must write on a stream
-//			info that's been initialized.
+//  @brief Cleans up a data write info
 //
 ////////////////////////////////////////////////////////////////////////////////
-enum atom_error_t element_entry_write(
+void element_entry_write_cleanup(
 	redisContext *ctx,
+	struct element_entry_write_info *info)
+{
+	if (info != NULL) {
+
+		// Remove the stream key and take it out of the registry
+		redis_remove_key(ctx, info->stream, true);
+		if (info->registered) {
+			atom_register_data_stream(ctx, info->stream, false);
+		}
+
+		// And free the info
+		element_entry_write_free(info);
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds the timestamp, serialization and trace keys after the
+//			user's items if needed, returning the number of items to write.
+//			The timestamp is printed into timestamp_buffer, which needs to
+//			stay valid until the write is done.
+//
+////////////////////////////////////////////////////////////////////////////////
+static size_t element_entry_write_add_keys(
 	struct element_entry_write_info *info,
 	int timestamp,
-	int maxlen)
+	char timestamp_buffer[ELEMENT_DATA_WRITE_TIMESTAMP_BUFFLEN],
+	const struct atom_trace_context *trace)
 {
-	enum atom_error_t ret = ATOM_INTERNAL_ERROR;
 	size_t n_items;
-	char timestamp_buffer[64];
 	size_t timestamp_buffer_len;
 
 	// Initialize the number of infos to that of the stream itself
@@ -105,7 +156,7 @@ enum atom_error_t element_entry_write(
 
 		// Make the string
 		timestamp_buffer_len = snprintf(
-			timestamp_buffer, sizeof(timestamp_buffer), "%d", timestamp);
+			timestamp_buffer, ELEMENT_DATA_WRITE_TIMESTAMP_BUFFLEN, "%d", timestamp);
 
 		// Add it to the droplet items
 		// Initialize the timestamp key and key len
@@ -122,26 +173,451 @@ enum atom_error_t element_entry_write(
 		++n_items;
 	}
 
-	// And we want to XADD the data to the stream to create it. This will
-	//	also put the ID of the item in the stream that we added with our
-	//	info into our last id
-	if (!redis_xadd(
+	// If the values were serialized, note the method s.t. readers
+	//	can deserialize them
+	if (info->ser != NULL) {
+		info->items[n_items].key = DATA_KEY_SER_STR;
+		info->items[n_items].key_len = CONST_STRLEN(DATA_KEY_SER_STR);
+		info->items[n_items].data = (const uint8_t*)info->ser;
+		info->items[n_items].data_len = strlen(info->ser);
+		++n_items;
+	}
+
+	// If we're tracing, note the write s.t. readers can tie the entry
+	//	back to it
+	if (trace != NULL) {
+		info->items[n_items].key = DATA_KEY_TRACE_STR;
+		info->items[n_items].key_len = CONST_STRLEN(DATA_KEY_TRACE_STR);
+		info->items[n_items].data = (const uint8_t*)info->trace_value;
+		info->items[n_items].data_len = atom_trace_value(trace,
+			info->trace_value);
+		++n_items;
+	}
+
+	return n_items;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Compresses the caller's values if the stream has a codec and
+//			they're over its threshold. Returns the items to write, which
+//			are either the info's items or copies pointing at the
+//			compressed values followed by the codec key, in which case
+//			n_items is updated. If compressing fails the values are
+//			written as they are.
+//
+////////////////////////////////////////////////////////////////////////////////
+static struct redis_xadd_info *element_entry_write_encode(
+	struct element_entry_write_info *info,
+	size_t *n_items)
+{
+	size_t total = 0;
+	size_t i;
+
+	for (i = 0; i < info->n_items; ++i) {
+		total += info->items[i].data_len;
+	}
+	if (!atom_codec_should_encode(&info->codec, total)) {
+		return info->items;
+	}
+
+	if (info->codec_items == NULL) {
+		info->codec_items = malloc(sizeof(struct redis_xadd_info) *
+			(info->n_items + DATA_N_ADDITIONAL_KEYS));
+		assert(info->codec_items != NULL);
+		info->codec_buffers = calloc(info->n_items,
+			sizeof(struct atom_codec_buffer));
+		assert(info->codec_buffers != NULL);
+	}
+
+	for (i = 0; i < info->n_items; ++i) {
+		if (!atom_codec_encode(&info->codec, info->items[i].data,
+			info->items[i].data_len, &info->codec_buffers[i]))
+		{
+			atom_logf(NULL, NULL, LOG_ERR,
+				"Failed to compress %s, writing it uncompressed", info->stream);
+			return info->items;
+		}
+		info->codec_items[i] = info->items[i];
+		info->codec_items[i].data = info->codec_buffers[i].data;
+		info->codec_items[i].data_len = info->codec_buffers[i].len;
+	}
+
+	// Copy over the timestamp and serialization keys as they are
+	for (i = info->n_items; i < *n_items; ++i) {
+		info->codec_items[i] = info->items[i];
+	}
+
+	info->codec_items[*n_items].key = DATA_KEY_CODEC_STR;
+	info->codec_items[*n_items].key_len = CONST_STRLEN(DATA_KEY_CODEC_STR);
+	info->codec_items[*n_items].data = (const uint8_t*)info->codec_value;
+	info->codec_items[*n_items].data_len = atom_codec_key_value(&info->codec,
+		info->codec_value);
+	*n_items += 1;
+
+	return info->codec_items;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Notes a write against the retention
+//
+////////////////////////////////////////////////////////////////////////////////
+static void element_entry_write_note(
+	struct element_entry_write_info *info,
+	const struct redis_xadd_info *items,
+	size_t n_items)
+{
+	size_t i;
+
+	if ((info->retention.max_age_ms == 0) && (info->retention.max_bytes == 0)) {
+		return;
+	}
+
+	for (i = 0; i < n_items; ++i) {
+		info->trim_bytes += items[i].key_len + items[i].data_len;
+	}
+	info->trim_writes += 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Returns whether it's time to trim for the retention
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool element_entry_write_trim_due(
+	struct element_entry_write_info *info)
+{
+	unsigned int trim_every;
+
+	if ((info->retention.max_age_ms == 0) && (info->retention.max_bytes == 0)) {
+		return false;
+	}
+
+	trim_every = (info->retention.trim_every != 0) ?
+		info->retention.trim_every : ELEMENT_ENTRY_RETENTION_DEFAULT_TRIM_EVERY;
+	return info->trim_writes >= trim_every;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the time the max age window ends at. Entry IDs are the
+//			server's time, so this is the server's clock if we know its
+//			offset, else ours. Measuring the offset is a round trip, so
+//			this has to be called before anything's queued on ctx.
+//
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t element_entry_write_trim_now_ms(
+	redisContext *ctx)
+{
+	struct timespec now;
+	uint64_t now_ms;
+
+	if (redis_clock_server_ms(ctx, &now_ms)) {
+		return now_ms;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return ((uint64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Queues the XTRIMs for the retention after the XADD, with the
+//			max age measured back from now_ms. Returns the number queued,
+//			each needing its reply gotten.
+//
+////////////////////////////////////////////////////////////////////////////////
+static int element_entry_write_trim_append(
+	redisContext *ctx,
+	struct element_entry_write_info *info,
+	uint64_t now_ms)
+{
+	uint64_t avg_bytes;
+	int n_appended = 0;
+
+	// Keep the entries with IDs, i.e. times, in the window
+	if (info->retention.max_age_ms != 0) {
+		if ((now_ms > info->retention.max_age_ms) &&
+			redis_xtrim_append(ctx, info->stream, true,
+				now_ms - info->retention.max_age_ms, ATOM_DEFAULT_APPROX_MAXLEN))
+		{
+			++n_appended;
+		}
+	}
+
+	// Keep as many entries as fit in the budget at their recent size,
+	//	always keeping at least the newest one
+	if ((info->retention.max_bytes != 0) && (info->trim_writes != 0)) {
+		avg_bytes = info->trim_bytes / info->trim_writes;
+		if (avg_bytes == 0) {
+			avg_bytes = 1;
+		}
+		if (redis_xtrim_append(ctx, info->stream, false,
+			(info->retention.max_bytes > avg_bytes) ?
+				(info->retention.max_bytes / avg_bytes) : 1,
+			ATOM_DEFAULT_APPROX_MAXLEN))
+		{
+			++n_appended;
+		}
+	}
+
+	info->trim_writes = 0;
+	info->trim_bytes = 0;
+
+	return n_appended;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Registers the stream after its first write s.t. others can find
+//			it without a SCAN. Watchers are told about it then, once it
+//			exists, and not when the info is made.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void element_entry_write_register(
+	redisContext *ctx,
+	struct element_entry_write_info *info)
+{
+	if (info->registered) {
+		return;
+	}
+
+	if (atom_register_data_stream(ctx, info->stream, true) != ATOM_NO_ERROR) {
+		atom_logf(ctx, NULL, LOG_ERR, "Failed to register stream %s",
+			info->stream);
+		return;
+	}
+	info->registered = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes a piece of data to the system. Must write on a stream
+//			info that's been initialized.
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t element_entry_write(
+	redisContext *ctx,
+	struct element_entry_write_info *info,
+	int timestamp,
+	int maxlen)
+{
+	enum atom_error_t ret = ATOM_INTERNAL_ERROR;
+	struct redis_xadd_info *items;
+	size_t n_items;
+	char timestamp_buffer[ELEMENT_DATA_WRITE_TIMESTAMP_BUFFLEN];
+	int n_trims;
+	uint64_t now_ms;
+	int i;
+	bool tracing = atom_trace_enabled();
+	struct atom_trace_span span = ATOM_TRACE_SPAN_INIT;
+	struct atom_trace_context trace;
+
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	if (tracing) {
+		atom_trace_begin(&span, NULL, "entry_write", "%s", info->stream);
+		atom_trace_span_context(&span, &trace);
+	}
+
+	// Add the timestamp and serialization keys if needed and compress
+	n_items = element_entry_write_add_keys(info, timestamp, timestamp_buffer,
+		tracing ? &trace : NULL);
+	items = element_entry_write_encode(info, &n_items);
+
+	// If it's not time to trim for the retention we just want to XADD
+	//	the data to the stream
+	element_entry_write_note(info, items, n_items);
+	if (!element_entry_write_trim_due(info)) {
+		if (!redis_xadd(
+			ctx,
+			info->stream,
+			items,
+			n_items,
+			maxlen,
+			ATOM_DEFAULT_APPROX_MAXLEN,
+			NULL))
+		{
+			atom_logf(ctx, NULL, LOG_ERR, "Failed to XADD data to stream");
+			ret = ATOM_REDIS_ERROR;
+			goto done;
+		}
+
+		element_entry_write_register(ctx, info);
+		ret = ATOM_NO_ERROR;
+		goto done;
+	}
+
+	// Otherwise pipeline the trims after the XADD s.t. it's still one
+	//	round trip
+	now_ms = element_entry_write_trim_now_ms(ctx);
+	if (!redis_xadd_append(
 		ctx,
 		info->stream,
-		info->items,
+		items,
 		n_items,
 		maxlen,
-		ATOM_DEFAULT_APPROX_MAXLEN,
-		NULL))
+		ATOM_DEFAULT_APPROX_MAXLEN))
 	{
 		atom_logf(ctx, NULL, LOG_ERR, "Failed to XADD data to stream");
 		ret = ATOM_REDIS_ERROR;
 		goto done;
 	}
+	n_trims = element_entry_write_trim_append(ctx, info, now_ms);
+
+	if (!redis_xadd_get_reply(ctx, NULL)) {
+		atom_logf(ctx, NULL, LOG_ERR, "Failed to XADD data to stream");
+		ret = ATOM_REDIS_ERROR;
+	}
+	for (i = 0; i < n_trims; ++i) {
+		if (!redis_xtrim_get_reply(ctx, NULL)) {
+			atom_logf(ctx, NULL, LOG_ERR, "Failed to trim stream %s",
+				info->stream);
+		}
+	}
+	if (ret == ATOM_REDIS_ERROR) {
+		goto done;
+	}
+	element_entry_write_register(ctx, info);
 
 	// Note the success
 	ret = ATOM_NO_ERROR;
 
 done:
+	if (tracing) {
+		atom_trace_end(&span);
+	}
 	return ret;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes an entry to each of the streams in a MULTI/EXEC s.t.
+//			readers see either all of them or none, in one round trip. If
+//			ret_ids is non-NULL the ID of each entry is put in it in the
+//			same order as the infos. Must write on stream infos that have
+//			been initialized, each at most once.
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t element_entry_write_multi(
+	redisContext *ctx,
+	struct element_entry_write_info **infos,
+	size_t n_infos,
+	int timestamp,
+	int maxlen,
+	char (*ret_ids)[STREAM_ID_BUFFLEN])
+{
+	enum atom_error_t ret = ATOM_INTERNAL_ERROR;
+	char timestamp_buffer[ELEMENT_DATA_WRITE_TIMESTAMP_BUFFLEN];
+	redisReply *reply = NULL;
+	struct redis_xadd_info *items;
+	size_t n_items;
+	size_t n_queued = 0;
+	uint64_t now_ms = 0;
+	bool appended = true;
+	size_t i;
+	bool tracing = atom_trace_enabled();
+	struct atom_trace_span span = ATOM_TRACE_SPAN_INIT;
+	struct atom_trace_context trace;
+
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	// The entries all carry the one span
+	if (tracing) {
+		atom_trace_begin(&span, NULL, "entry_write_multi", "%zu streams",
+			n_infos);
+		atom_trace_span_context(&span, &trace);
+	}
+
+	// Get the time for any trims by age before anything's queued
+	for (i = 0; i < n_infos; ++i) {
+		if (element_entry_write_trim_due(infos[i]) &&
+			(infos[i]->retention.max_age_ms != 0))
+		{
+			now_ms = element_entry_write_trim_now_ms(ctx);
+			break;
+		}
+	}
+
+	if (!redis_multi_append(ctx)) {
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	// Queue all of the XADDs first s.t. their IDs are at the start of the
+	//	EXEC reply. The data is copied in as we go, so the timestamp
+	//	buffer can be shared.
+	for (i = 0; (i < n_infos) && appended; ++i) {
+		n_items = element_entry_write_add_keys(infos[i], timestamp,
+			timestamp_buffer, tracing ? &trace : NULL);
+		items = element_entry_write_encode(infos[i], &n_items);
+		element_entry_write_note(infos[i], items, n_items);
+
+		appended = redis_xadd_append(ctx, infos[i]->stream, items,
+			n_items, maxlen, ATOM_DEFAULT_APPROX_MAXLEN);
+		if (appended) {
+			++n_queued;
+		}
+	}
+
+	// Then the trims for the streams that are due
+	for (i = 0; (i < n_infos) && appended; ++i) {
+		if (element_entry_write_trim_due(infos[i])) {
+			n_queued += element_entry_write_trim_append(ctx, infos[i],
+				now_ms);
+		}
+	}
+
+	// Always finish the transaction s.t. the context is left usable, but
+	//	if not everything made it in then discard it
+	if (!(appended ? redis_exec_append(ctx) : redis_discard_append(ctx)))
+	{
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	reply = redis_exec_get_reply(ctx, n_queued);
+	if (!appended || (reply == NULL)) {
+		atom_logf(ctx, NULL, LOG_ERR, "Failed to XADD data to %zu streams",
+			n_infos);
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	for (i = 0; i < n_infos; ++i) {
+		if (reply->element[i]->type != REDIS_REPLY_STRING) {
+			atom_logf(ctx, NULL, LOG_ERR, "Failed to XADD data to stream %s",
+				infos[i]->stream);
+			ret = ATOM_REDIS_ERROR;
+			goto done;
+		}
+		if (ret_ids != NULL) {
+			strncpy(ret_ids[i], reply->element[i]->str, STREAM_ID_BUFFLEN);
+		}
+	}
+
+	for (i = 0; i < n_infos; ++i) {
+		element_entry_write_register(ctx, infos[i]);
+	}
+
+	ret = ATOM_NO_ERROR;
+
+done:
+	if (reply != NULL) {
+		freeReplyObject(reply);
+	}
+	if (tracing) {
+		atom_trace_end(&span);
+	}
+	return ret;
+}
+
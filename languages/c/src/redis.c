@@ -12,9 +12,22 @@
 #include <hiredis/hiredis.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <inttypes.h>
 #include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef ATOM_HAVE_URING
+#include <liburing.h>
+#include <hiredis/sds.h>
+#endif
 
 #include "redis.h"
+#include "codec.h"
 
 // If this is 1 then will print out each redis command before sending
 //	it s.t. we can see what's going on in the system
@@ -28,6 +41,8 @@
 #define REDIS_XADD_MAXLEN_STR "MAXLEN"
 #define REDIS_XADD_MAXLEN_APPROX_STR "~"
 #define REDIS_XADD_MAXLEN_BUFFLEN 32
+#define REDIS_XTRIM_CMD_STR "XTRIM"
+#define REDIS_XTRIM_MINID_STR "MINID"
 
 #define REDIS_XREAD_MAX_ARGS 64
 #define REDIS_XREAD_CMD_STR "XREAD"
@@ -326,7 +341,7 @@ bool redis_xread(
 
 	// Now we should have a constructed XREAD command which we
 	//	can send to redis and then attempt to get the reply
-	reply = redisCommandArgv(ctx, argc, argv, argvlen);
+	reply = redis_command_argv(ctx, argc, argv, argvlen);
 	if (reply == NULL) {
 		fprintf(stderr, "NULL from redisCommand\n");
 		goto done;
@@ -370,6 +385,7 @@ bool redis_xread_parse_kv(
 {
 	int idx, item;
 	bool ret_val = false;
+	redisReply *codec_value = NULL;
 
 	// Initialize all of the found fields to false
 	for (item = 0; item < n_items; ++item) {
@@ -386,6 +402,14 @@ bool redis_xread_parse_kv(
 	// Now, we want to loop over the reply looking for keys
 	for (idx = 0; idx < reply->elements; idx += 2) {
 
+		// Note if the values were compressed
+		if ((reply->element[idx]->len == CONST_STRLEN(ATOM_CODEC_KEY_STR)) &&
+			(!strncmp(reply->element[idx]->str, ATOM_CODEC_KEY_STR,
+				CONST_STRLEN(ATOM_CODEC_KEY_STR))))
+		{
+			codec_value = reply->element[idx + 1];
+		}
+
 		// For the key, we want to see if it's in the list of items that
 		//	we care about
 		for (item = 0; item < n_items; ++item) {
@@ -406,6 +430,14 @@ bool redis_xread_parse_kv(
 		}
 	}
 
+	// Decompress the values in place s.t. everyone reading them gets
+	//	them as they were written
+	if ((codec_value != NULL) &&
+		!atom_codec_decode_kv((redisReply *)reply, codec_value))
+	{
+		goto done;
+	}
+
 	// Note the success
 	ret_val = true;
 
@@ -472,13 +504,14 @@ bool redis_xrevrange(
 		fprintf(stderr, "Reply level 0 not array!\n");
 		goto free_reply;
 	}
-	if (reply->elements != n) {
-		fprintf(stderr, "Failed to read %lu elements\n", n);
+	if (reply->elements > n) {
+		fprintf(stderr, "Read more than %lu elements\n", n);
 		goto free_reply;
 	}
 
-	// Otherwise, loop over the elements
-	for (item = 0; item < n; ++item) {
+	// Otherwise, loop over the elements. There may be fewer than N
+	//	if the stream is shorter than that
+	for (item = 0; item < reply->elements; ++item) {
 
 		// Get the item
 		reply_item = reply->element[item];
@@ -520,28 +553,243 @@ done:
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// 	@brief	Adds the array of (key, value) pairs to the redis stream.
-//			Pass maxlen == REDIS_XADD_NO_MAXLEN to not use the maxlen
-//			parameter
+//  @brief	Requests the next page of an XRANGE iteration and flushes the
+//			request out to redis s.t. redis works on it while we process
+//			the current page. The reply is picked up on the next call to
+//			redis_xrange_iter_next().
 //
 ////////////////////////////////////////////////////////////////////////////////
-bool redis_xadd(
+static bool redis_xrange_iter_request(
+	struct redis_xrange_iter *iter)
+{
+	char xrange_cmd_buffer[REDIS_CMD_BUFFER_LEN];
+	int ret, done;
+
+	ret = snprintf(xrange_cmd_buffer, REDIS_CMD_BUFFER_LEN,
+		"XRANGE %s %s %s COUNT %lu",
+		iter->name, iter->next_id, iter->end_id, iter->count);
+	if ((ret < 0) || (ret >= REDIS_CMD_BUFFER_LEN)) {
+		fprintf(stderr, "snprintf!\n");
+		return false;
+	}
+
+	#if DEBUG_COMMANDS
+		fprintf(stderr, "Command: %s\n", xrange_cmd_buffer);
+	#endif
+
+	if (redisAppendCommand(iter->ctx, xrange_cmd_buffer) != REDIS_OK) {
+		fprintf(stderr, "Failed to append XRANGE\n");
+		return false;
+	}
+
+	// Write the request out now instead of when we go to get the reply
+	done = 0;
+	while (!done) {
+		if (redisBufferWrite(iter->ctx, &done) != REDIS_OK) {
+			fprintf(stderr, "Failed to send XRANGE\n");
+			return false;
+		}
+	}
+
+	iter->pending = true;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief	Gets the ID right after the passed one s.t. the next page of an
+//			XRANGE starts after the last entry we've seen
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool redis_xrange_next_id(
+	const char *id,
+	char next_id[STREAM_ID_BUFFLEN])
+{
+	unsigned long long ms, seq;
+	int ret;
+
+	if (sscanf(id, "%llu-%llu", &ms, &seq) != 2) {
+		fprintf(stderr, "Invalid stream ID %s\n", id);
+		return false;
+	}
+
+	if (seq == ULLONG_MAX) {
+		ms += 1;
+		seq = 0;
+	} else {
+		seq += 1;
+	}
+
+	ret = snprintf(next_id, STREAM_ID_BUFFLEN, "%llu-%llu", ms, seq);
+	return ((ret > 0) && (ret < STREAM_ID_BUFFLEN));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief	Initializes an iterator over the entries of a stream between
+//			the start and end IDs, inclusive. Entries are read COUNT at a
+//			time with XRANGE, so only about two pages are in memory at once
+//			no matter how long the range is. The first page is requested
+//			right away. Nothing else may be sent on the context until the
+//			iterator is cleaned up.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_xrange_iter_init(
 	redisContext *ctx,
+	struct redis_xrange_iter *iter,
+	const char *stream_name,
+	const char *start_id,
+	const char *end_id,
+	size_t count)
+{
+	memset(iter, 0, sizeof(struct redis_xrange_iter));
+	iter->ctx = ctx;
+	iter->count = (count != 0) ? count : REDIS_XRANGE_DEFAULT_COUNT;
+
+	iter->name = strdup(stream_name);
+	assert(iter->name != NULL);
+	if ((strlen(start_id) >= STREAM_ID_BUFFLEN) ||
+		(strlen(end_id) >= STREAM_ID_BUFFLEN))
+	{
+		fprintf(stderr, "Invalid XRANGE IDs\n");
+		return false;
+	}
+	strcpy(iter->next_id, start_id);
+	strcpy(iter->end_id, end_id);
+
+	return redis_xrange_iter_request(iter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief	Gets the next entry of the range. On success *id is set to the
+//			entry's ID and *data to its key, value array, both of which are
+//			valid until the next call. *id is set to NULL once the range
+//			is exhausted. When the reply for a full page comes in the next
+//			page is requested before any of it is returned s.t. the round
+//			trip overlaps with processing the page.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_xrange_iter_next(
+	struct redis_xrange_iter *iter,
+	const char **id,
+	const struct redisReply **data)
+{
+	redisReply *reply, *reply_item;
+
+	*id = NULL;
+	*data = NULL;
+
+	while (true) {
+
+		// If we have an entry left in the current page then return it
+		if ((iter->page != NULL) && (iter->item < iter->page->elements)) {
+			reply_item = iter->page->element[iter->item++];
+			if ((reply_item->type != REDIS_REPLY_ARRAY) ||
+				(reply_item->elements != 2) ||
+				(reply_item->element[0]->type != REDIS_REPLY_STRING) ||
+				(reply_item->element[1]->type != REDIS_REPLY_ARRAY))
+			{
+				fprintf(stderr, "Reply item doesn't have proper data!\n");
+				return false;
+			}
+
+			*id = reply_item->element[0]->str;
+			*data = reply_item->element[1];
+			return true;
+		}
+
+		// Done with the page
+		if (iter->page != NULL) {
+			freeReplyObject(iter->page);
+			iter->page = NULL;
+		}
+
+		// If we didn't ask for another page then we're at the end
+		if (!iter->pending) {
+			return true;
+		}
+
+		// Get the next page
+		iter->pending = false;
+		if (redis_get_reply(iter->ctx, (void **)&reply) != REDIS_OK) {
+			fprintf(stderr, "Failed to get XRANGE reply\n");
+			return false;
+		}
+		if (reply->type != REDIS_REPLY_ARRAY) {
+			fprintf(stderr, "Reply level 0 not array!\n");
+			freeReplyObject(reply);
+			return false;
+		}
+		iter->page = reply;
+		iter->item = 0;
+
+		// If the page was full then there might be more. Ask for the
+		//	page starting right after the last entry in this one
+		if ((reply->elements != 0) && (reply->elements == iter->count)) {
+			reply_item = reply->element[reply->elements - 1];
+			if ((reply_item->type != REDIS_REPLY_ARRAY) ||
+				(reply_item->elements != 2) ||
+				(reply_item->element[0]->type != REDIS_REPLY_STRING) ||
+				!redis_xrange_next_id(reply_item->element[0]->str, iter->next_id) ||
+				!redis_xrange_iter_request(iter))
+			{
+				return false;
+			}
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief	Cleans up an iterator. If a page is still in flight its reply
+//			is read off of the context and dropped s.t. the context can be
+//			used again.
+//
+////////////////////////////////////////////////////////////////////////////////
+void redis_xrange_iter_cleanup(
+	struct redis_xrange_iter *iter)
+{
+	redisReply *reply;
+
+	if (iter->page != NULL) {
+		freeReplyObject(iter->page);
+		iter->page = NULL;
+	}
+
+	if (iter->pending) {
+		if (redis_get_reply(iter->ctx, (void **)&reply) == REDIS_OK) {
+			freeReplyObject(reply);
+		}
+		iter->pending = false;
+	}
+
+	if (iter->name != NULL) {
+		free(iter->name);
+		iter->name = NULL;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Fills in the argv for an XADD of the (key, value) pairs.
+//			maxlen_buffer needs to stay valid for as long as the argv is
+//			used. Returns the number of args.
+//
+////////////////////////////////////////////////////////////////////////////////
+static int redis_xadd_argv(
 	const char *stream_name,
 	struct redis_xadd_info *infos,
 	size_t info_len,
 	int maxlen,
 	bool approx_maxlen,
-	char ret_id[STREAM_ID_BUFFLEN])
+	const char *argv[REDIS_XADD_MAX_ARGS],
+	size_t argvlen[REDIS_XADD_MAX_ARGS],
+	char maxlen_buffer[REDIS_XADD_MAXLEN_BUFFLEN])
 {
-	struct redisReply *reply;
 	int argc = 0;
-	const char *argv[REDIS_XADD_MAX_ARGS];
-	size_t argvlen[REDIS_XADD_MAX_ARGS];
-	char maxlen_buffer[REDIS_XADD_MAXLEN_BUFFLEN];
 	int maxlen_bytes;
 	int i;
-	bool ret_val = false;
 
 	// First, want to put the XADD and stream name
 	argv[argc] = REDIS_XADD_CMD_STR;
@@ -594,8 +842,38 @@ bool redis_xadd(
 		fprintf(stderr, "\n");
 	#endif
 
+	return argc;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Adds the array of (key, value) pairs to the redis stream.
+//			Pass maxlen == REDIS_XADD_NO_MAXLEN to not use the maxlen
+//			parameter
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_xadd(
+	redisContext *ctx,
+	const char *stream_name,
+	struct redis_xadd_info *infos,
+	size_t info_len,
+	int maxlen,
+	bool approx_maxlen,
+	char ret_id[STREAM_ID_BUFFLEN])
+{
+	struct redisReply *reply;
+	int argc;
+	const char *argv[REDIS_XADD_MAX_ARGS];
+	size_t argvlen[REDIS_XADD_MAX_ARGS];
+	char maxlen_buffer[REDIS_XADD_MAXLEN_BUFFLEN];
+	int i;
+	bool ret_val = false;
+
+	argc = redis_xadd_argv(stream_name, infos, info_len, maxlen,
+		approx_maxlen, argv, argvlen, maxlen_buffer);
+
 	// Now we're ready to send the redis command
-	reply = redisCommandArgv(ctx, argc, argv, argvlen);
+	reply = redis_command_argv(ctx, argc, argv, argvlen);
 	if (reply == NULL){
 		fprintf(stderr, "Bad XADD\n");
 		for (i = 0; i < argc; i++) {
@@ -629,103 +907,354 @@ done:
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// 	@brief	Calls the callback function for each key that matches the
-//			string passed. Redis supports different types of wildcard/pattern
-//			in the pattern string, mainly '*' for wildcard matching.
-//			See the redis KEYS documentation: https://redis.io/commands/keys
+// 	@brief	Queues an XADD in the context's output buffer without sending
+//			it or waiting on the reply s.t. several can be pipelined.
+//			The data is copied, so it can be reused once this returns.
+//			Each append needs a redis_xadd_get_reply.
 //
 ////////////////////////////////////////////////////////////////////////////////
-int redis_get_matching_keys(
+bool redis_xadd_append(
 	redisContext *ctx,
-	const char *pattern,
-	bool (*data_cb)(const char *key, void *user_data),
-	void *user_data)
+	const char *stream_name,
+	struct redis_xadd_info *infos,
+	size_t info_len,
+	int maxlen,
+	bool approx_maxlen)
 {
-	int n_keys = 0;
-	int i;
-	redisReply *reply = NULL;
-	redisReply *matching_keys;
-	char iterator[REDIS_SCAN_ITERATOR_BUFFLEN];
-	bool first_attempt = true;
-	const char *argv[REDIS_SCAN_N_ARGS];
-	size_t argvlen[REDIS_SCAN_N_ARGS];
-
-	// Want to initialize the iterator to the starting iterator
-	memcpy(iterator, REDIS_SCAN_BEGIN_ITERATOR,
-		sizeof(REDIS_SCAN_BEGIN_ITERATOR));
+	int argc;
+	const char *argv[REDIS_XADD_MAX_ARGS];
+	size_t argvlen[REDIS_XADD_MAX_ARGS];
+	char maxlen_buffer[REDIS_XADD_MAXLEN_BUFFLEN];
 
-	// Want to set up the arguments for the SCAN call
-	argv[0] = REDIS_SCAN_CMD_STR;
-	argvlen[0] = CONST_STRLEN(REDIS_SCAN_CMD_STR);
+	argc = redis_xadd_argv(stream_name, infos, info_len, maxlen,
+		approx_maxlen, argv, argvlen, maxlen_buffer);
 
-	argv[1] = iterator;
-	argvlen[1] = CONST_STRLEN(REDIS_SCAN_BEGIN_ITERATOR);
+	return redisAppendCommandArgv(ctx, argc, argv, argvlen) == REDIS_OK;
+}
 
-	argv[2] = REDIS_SCAN_MATCH_STR;
-	argvlen[2] = CONST_STRLEN(REDIS_SCAN_MATCH_STR);
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets the reply to an XADD queued with redis_xadd_append,
+//			flushing the output buffer first if needed
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_xadd_get_reply(
+	redisContext *ctx,
+	char ret_id[STREAM_ID_BUFFLEN])
+{
+	redisReply *reply;
+	bool ret_val = false;
 
-	argv[3] = pattern;
-	argvlen[3] = strlen(pattern);
+	if (redis_get_reply(ctx, (void **)&reply) != REDIS_OK) {
+		goto done;
+	}
 
+	if (reply->type != REDIS_REPLY_STRING) {
+		goto free_reply;
+	}
 
-	// Want to keep calling SCAN until we're not on the first attempt
-	//	and the iterator is not equal to the beginning iterator
-	while (first_attempt ||
-		(strcmp(iterator, REDIS_SCAN_BEGIN_ITERATOR) != 0))
-	{
-		// Make the call to SCAN
-		reply = redisCommandArgv(ctx, REDIS_SCAN_N_ARGS, argv, argvlen);
-		if (reply == NULL) {
-			fprintf(stderr, "NULL reply!\n");
-			goto done;
-		}
+	if (ret_id != NULL) {
+		strncpy(ret_id, reply->str, STREAM_ID_BUFFLEN);
+	}
 
-		// Check the reply type
-		if (reply->type != REDIS_REPLY_ARRAY) {
-			fprintf(stderr, "SCAN return is not an array!\n");
-			goto done;
-		}
+	ret_val = true;
 
-		// The first element in the array is the new iterator
-		if (reply->element[0]->type != REDIS_REPLY_STRING) {
-			fprintf(stderr, "Iterator is not a string!\n");
-			goto done;
-		}
+free_reply:
+	freeReplyObject(reply);
+done:
+	return ret_val;
+}
 
-		// Update the iterator and its length in the argument list
-		strncpy(iterator, reply->element[0]->str, sizeof(iterator));
-		argvlen[1] = strlen(iterator);
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Queues an XTRIM without sending it s.t. it can be pipelined
+//			with writes. Trims to the newest threshold entries, or with
+//			minid to the entries with an ID of at least threshold ms.
+//			Needs a redis_xtrim_get_reply.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_xtrim_append(
+	redisContext *ctx,
+	const char *stream_name,
+	bool minid,
+	uint64_t threshold,
+	bool approx)
+{
+	int argc = 0;
+	const char *argv[5];
+	size_t argvlen[5];
+	char threshold_buffer[REDIS_XADD_MAXLEN_BUFFLEN];
 
-		// The second element in the array is an array of strings for the keys
-		matching_keys = reply->element[1];
-		if (matching_keys->type != REDIS_REPLY_ARRAY) {
-			fprintf(stderr, "Key array is not an array!\n");
-			goto done;
-		}
+	argv[argc] = REDIS_XTRIM_CMD_STR;
+	argvlen[argc++] = CONST_STRLEN(REDIS_XTRIM_CMD_STR);
 
-		// Now, we want to loop over the keys that we got in the reply
-		for (i = 0; i < matching_keys->elements; ++i) {
+	argv[argc] = stream_name;
+	argvlen[argc++] = strlen(stream_name);
 
-			// Make sure each key is a string
-			if (matching_keys->element[i]->type != REDIS_REPLY_STRING) {
-				fprintf(stderr, "Key is not a string!\n");
-				goto done;
-			}
+	if (minid) {
+		argv[argc] = REDIS_XTRIM_MINID_STR;
+		argvlen[argc++] = CONST_STRLEN(REDIS_XTRIM_MINID_STR);
+	} else {
+		argv[argc] = REDIS_XADD_MAXLEN_STR;
+		argvlen[argc++] = CONST_STRLEN(REDIS_XADD_MAXLEN_STR);
+	}
 
-			// Call the callback on each string
-			if (!data_cb(matching_keys->element[i]->str, user_data)) {
-				fprintf(stderr, "Failed to call callback!\n");
-				goto done;
-			}
+	if (approx) {
+		argv[argc] = REDIS_XADD_MAXLEN_APPROX_STR;
+		argvlen[argc++] = CONST_STRLEN(REDIS_XADD_MAXLEN_APPROX_STR);
+	}
 
-			++n_keys;
-		}
+	argv[argc] = threshold_buffer;
+	argvlen[argc++] = snprintf(threshold_buffer, sizeof(threshold_buffer),
+		"%" PRIu64, threshold);
 
-		// Now that we're all done with the reply we can free it. Need to make
-		//	sure that we set it to NULL as well s.t. it doesn't get double
-		//	freed from the error handling stack
-		freeReplyObject(reply);
-		reply = NULL;
+	return redisAppendCommandArgv(ctx, argc, argv, argvlen) == REDIS_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets the reply to an XTRIM queued with redis_xtrim_append,
+//			noting the number of entries trimmed if n_trimmed is non-NULL
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_xtrim_get_reply(
+	redisContext *ctx,
+	long long *n_trimmed)
+{
+	redisReply *reply;
+	bool ret_val = false;
+
+	if (redis_get_reply(ctx, (void **)&reply) != REDIS_OK) {
+		goto done;
+	}
+
+	if (reply->type != REDIS_REPLY_INTEGER) {
+		goto free_reply;
+	}
+
+	if (n_trimmed != NULL) {
+		*n_trimmed = reply->integer;
+	}
+
+	ret_val = true;
+
+free_reply:
+	freeReplyObject(reply);
+done:
+	return ret_val;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Queues an XREVRANGE of the n newest entries on the stream
+//			without sending it s.t. several can be pipelined
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_xrevrange_append(
+	redisContext *ctx,
+	const char *stream_name,
+	size_t n)
+{
+	return redisAppendCommand(ctx, "XREVRANGE %s + - COUNT %zu",
+		stream_name, n) == REDIS_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets the time in ms from a stream ID, i.e. the part before
+//			the dash
+//
+////////////////////////////////////////////////////////////////////////////////
+uint64_t redis_stream_id_ms(
+	const char *id)
+{
+	return strtoull(id, NULL, 10);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Queues a MULTI s.t. the commands appended after it up to
+//			the redis_exec_append are run atomically
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_multi_append(
+	redisContext *ctx)
+{
+	return redisAppendCommand(ctx, "MULTI") == REDIS_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Queues the EXEC ending a transaction
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_exec_append(
+	redisContext *ctx)
+{
+	return redisAppendCommand(ctx, "EXEC") == REDIS_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Queues a DISCARD ending a transaction without running it,
+//			e.g. when not all of its commands could be queued
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_discard_append(
+	redisContext *ctx)
+{
+	return redisAppendCommand(ctx, "DISCARD") == REDIS_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets the replies to a transaction queued with
+//			redis_multi_append, n_queued commands and redis_exec_append
+//			or redis_discard_append.
+//			Returns the reply to the EXEC, which has the replies to the
+//			commands in order and needs to be freed with freeReplyObject,
+//			or NULL if the transaction failed. Always reads all of the
+//			replies s.t. the context can keep being used.
+//
+////////////////////////////////////////////////////////////////////////////////
+redisReply *redis_exec_get_reply(
+	redisContext *ctx,
+	size_t n_queued)
+{
+	redisReply *reply;
+	redisReply *exec_reply = NULL;
+	bool ok = true;
+	size_t i;
+
+	// MULTI and then each of the commands
+	for (i = 0; i < n_queued + 1; ++i) {
+		if (redis_get_reply(ctx, (void **)&reply) != REDIS_OK) {
+			goto done;
+		}
+		if (reply->type != REDIS_REPLY_STATUS) {
+			fprintf(stderr, "Failed to queue command %zu: %s\n", i,
+				(reply->type == REDIS_REPLY_ERROR) ? reply->str : "");
+			ok = false;
+		}
+		freeReplyObject(reply);
+	}
+
+	// And the EXEC itself
+	if (redis_get_reply(ctx, (void **)&reply) != REDIS_OK) {
+		goto done;
+	}
+	if (!ok || (reply->type != REDIS_REPLY_ARRAY) ||
+		(reply->elements != n_queued))
+	{
+		freeReplyObject(reply);
+		goto done;
+	}
+
+	exec_reply = reply;
+
+done:
+	return exec_reply;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Calls the callback function for each key that matches the
+//			string passed. Redis supports different types of wildcard/pattern
+//			in the pattern string, mainly '*' for wildcard matching.
+//			See the redis KEYS documentation: https://redis.io/commands/keys
+//
+////////////////////////////////////////////////////////////////////////////////
+int redis_get_matching_keys(
+	redisContext *ctx,
+	const char *pattern,
+	bool (*data_cb)(const char *key, void *user_data),
+	void *user_data)
+{
+	int n_keys = 0;
+	int i;
+	redisReply *reply = NULL;
+	redisReply *matching_keys;
+	char iterator[REDIS_SCAN_ITERATOR_BUFFLEN];
+	bool first_attempt = true;
+	const char *argv[REDIS_SCAN_N_ARGS];
+	size_t argvlen[REDIS_SCAN_N_ARGS];
+
+	// Want to initialize the iterator to the starting iterator
+	memcpy(iterator, REDIS_SCAN_BEGIN_ITERATOR,
+		sizeof(REDIS_SCAN_BEGIN_ITERATOR));
+
+	// Want to set up the arguments for the SCAN call
+	argv[0] = REDIS_SCAN_CMD_STR;
+	argvlen[0] = CONST_STRLEN(REDIS_SCAN_CMD_STR);
+
+	argv[1] = iterator;
+	argvlen[1] = CONST_STRLEN(REDIS_SCAN_BEGIN_ITERATOR);
+
+	argv[2] = REDIS_SCAN_MATCH_STR;
+	argvlen[2] = CONST_STRLEN(REDIS_SCAN_MATCH_STR);
+
+	argv[3] = pattern;
+	argvlen[3] = strlen(pattern);
+
+
+	// Want to keep calling SCAN until we're not on the first attempt
+	//	and the iterator is not equal to the beginning iterator
+	while (first_attempt ||
+		(strcmp(iterator, REDIS_SCAN_BEGIN_ITERATOR) != 0))
+	{
+		// Make the call to SCAN
+		reply = redisCommandArgv(ctx, REDIS_SCAN_N_ARGS, argv, argvlen);
+		if (reply == NULL) {
+			fprintf(stderr, "NULL reply!\n");
+			goto done;
+		}
+
+		// Check the reply type
+		if (reply->type != REDIS_REPLY_ARRAY) {
+			fprintf(stderr, "SCAN return is not an array!\n");
+			goto done;
+		}
+
+		// The first element in the array is the new iterator
+		if (reply->element[0]->type != REDIS_REPLY_STRING) {
+			fprintf(stderr, "Iterator is not a string!\n");
+			goto done;
+		}
+
+		// Update the iterator and its length in the argument list
+		strncpy(iterator, reply->element[0]->str, sizeof(iterator));
+		argvlen[1] = strlen(iterator);
+
+		// The second element in the array is an array of strings for the keys
+		matching_keys = reply->element[1];
+		if (matching_keys->type != REDIS_REPLY_ARRAY) {
+			fprintf(stderr, "Key array is not an array!\n");
+			goto done;
+		}
+
+		// Now, we want to loop over the keys that we got in the reply
+		for (i = 0; i < matching_keys->elements; ++i) {
+
+			// Make sure each key is a string
+			if (matching_keys->element[i]->type != REDIS_REPLY_STRING) {
+				fprintf(stderr, "Key is not a string!\n");
+				goto done;
+			}
+
+			// Call the callback on each string
+			if (!data_cb(matching_keys->element[i]->str, user_data)) {
+				fprintf(stderr, "Failed to call callback!\n");
+				goto done;
+			}
+
+			++n_keys;
+		}
+
+		// Now that we're all done with the reply we can free it. Need to make
+		//	sure that we set it to NULL as well s.t. it doesn't get double
+		//	freed from the error handling stack
+		freeReplyObject(reply);
+		reply = NULL;
 
 		// Note that we're no longer on the first attempt
 		first_attempt = false;
@@ -738,6 +1267,125 @@ done:
 	return n_keys;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Calls the callback with each member of the set whose key exists.
+//			Gets the members with SMEMBERS and then pipelines an EXISTS for
+//			each s.t. members left behind by something that didn't clean up
+//			are skipped.
+//
+////////////////////////////////////////////////////////////////////////////////
+int redis_get_set_members_existing(
+	redisContext *ctx,
+	const char *set,
+	const char *key_prefix,
+	bool (*data_cb)(const char *member, void *user_data),
+	void *user_data)
+{
+	redisReply *members = NULL;
+	redisReply *exists;
+	size_t n_appended = 0;
+	size_t n_replies = 0;
+	size_t i;
+	int n_found = 0;
+	bool failed = false;
+
+	members = redisCommand(ctx, "SMEMBERS %s", set);
+	if ((members == NULL) || (members->type != REDIS_REPLY_ARRAY)) {
+		fprintf(stderr, "Failed to get members of %s\n", set);
+		n_found = -1;
+		goto done;
+	}
+
+	// Queue an EXISTS for each member
+	for (i = 0; i < members->elements; ++i) {
+		if (members->element[i]->type != REDIS_REPLY_STRING) {
+			continue;
+		}
+		if (redisAppendCommand(ctx, "EXISTS %s%b", key_prefix,
+			members->element[i]->str,
+			members->element[i]->len) != REDIS_OK)
+		{
+			failed = true;
+			break;
+		}
+		n_appended++;
+	}
+
+	// And go through the replies in the same order. Need to get each
+	//	reply even if the callback failed s.t. the context stays in sync
+	for (i = 0; (i < members->elements) && (n_replies < n_appended); ++i) {
+		if (members->element[i]->type != REDIS_REPLY_STRING) {
+			continue;
+		}
+
+		if (redis_get_reply(ctx, (void **)&exists) != REDIS_OK) {
+			n_found = -1;
+			goto done;
+		}
+		n_replies++;
+
+		if ((exists->type == REDIS_REPLY_INTEGER) && (exists->integer > 0) &&
+			!failed)
+		{
+			if (!data_cb(members->element[i]->str, user_data)) {
+				failed = true;
+			} else {
+				n_found++;
+			}
+		}
+		freeReplyObject(exists);
+	}
+
+	if (failed) {
+		n_found = -1;
+	}
+
+done:
+	if (members != NULL) {
+		freeReplyObject(members);
+	}
+	return n_found;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Adds a member to or removes it from a set and publishes a
+//			message about it. The two commands are pipelined.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_set_update_publish(
+	redisContext *ctx,
+	const char *set,
+	const char *member,
+	bool add,
+	const char *channel,
+	const char *message)
+{
+	redisReply *reply;
+	bool ret_val = true;
+	int i;
+
+	if ((redisAppendCommand(ctx, "%s %s %s", add ? "SADD" : "SREM",
+			set, member) != REDIS_OK) ||
+		(redisAppendCommand(ctx, "PUBLISH %s %s", channel, message) != REDIS_OK))
+	{
+		return false;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		if (redis_get_reply(ctx, (void **)&reply) != REDIS_OK) {
+			return false;
+		}
+		if (reply->type == REDIS_REPLY_ERROR) {
+			ret_val = false;
+		}
+		freeReplyObject(reply);
+	}
+
+	return ret_val;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // 	@brief	Removes a key from the redis DB, either using UNLINK or del based
@@ -811,12 +1459,17 @@ redisContext *redis_context_init_local(const char *socket)
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// 	@brief	Gets a new redis handle using all defaults
+// 	@brief	Gets a new redis handle using all defaults. The socket can be
+//			overridden with the same environment variable the python
+//			library uses.
 //
 ////////////////////////////////////////////////////////////////////////////////
 redisContext *redis_context_init(void)
 {
-	return redis_context_init_local(REDIS_DEFAULT_LOCAL_SOCKET);
+	const char *socket = getenv(REDIS_LOCAL_SOCKET_ENV);
+	return redis_context_init_local(
+		((socket != NULL) && (socket[0] != '\0')) ?
+			socket : REDIS_DEFAULT_LOCAL_SOCKET);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -826,33 +1479,1095 @@ redisContext *redis_context_init(void)
 ////////////////////////////////////////////////////////////////////////////////
 void redis_context_cleanup(redisContext * ctx)
 {
+	redis_clock_forget(ctx);
 	redisFree(ctx);
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// 	@brief	Initializes a new stream info. Will set up all of the fields
-//			of the info for use with the XREAD function. If time_ctx is
-//			non-NULL then will quert redis for the current TIME and set the
-//			last_seen_id to the current time. Otherwise will leave the
-//			last_seen_id untouched and the user can choose how to implement
-//			it.
+// 	@brief	Gets a monotonic time in ms
 //
 ////////////////////////////////////////////////////////////////////////////////
-bool redis_init_stream_info(
-	redisContext *ctx,
-	struct redis_stream_info *info,
-	const char *name,
-	bool (*data_cb)(
-		const char *id,
-		const struct redisReply *reply,
-		void *user_data),
-	const char *last_id,
-	void *user_data)
+uint64_t redis_monotonic_ms(void)
 {
-	bool ret_val = false;
-	struct redisReply *reply;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Seed for the backoff jitter
+static __thread unsigned int redis_backoff_seed;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Resets the backoff after a successful connect
+//
+////////////////////////////////////////////////////////////////////////////////
+void redis_backoff_reset(
+	struct redis_backoff *backoff)
+{
+	backoff->delay_ms = 0;
+	backoff->next_attempt_ms = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Notes a failed attempt. Doubles the delay up to the max and
+//			takes up to half of it off at random. Returns the delay.
+//
+////////////////////////////////////////////////////////////////////////////////
+int redis_backoff_failed(
+	struct redis_backoff *backoff)
+{
+	int delay_ms;
+
+	if (backoff->delay_ms == 0) {
+		backoff->delay_ms = REDIS_RECONNECT_BACKOFF_MIN_MS;
+	} else if (backoff->delay_ms < REDIS_RECONNECT_BACKOFF_MAX_MS) {
+		backoff->delay_ms *= 2;
+		if (backoff->delay_ms > REDIS_RECONNECT_BACKOFF_MAX_MS) {
+			backoff->delay_ms = REDIS_RECONNECT_BACKOFF_MAX_MS;
+		}
+	}
+
+	// Seed each thread differently s.t. processes and threads don't all
+	//	pick the same jitter
+	if (redis_backoff_seed == 0) {
+		redis_backoff_seed = (unsigned int)getpid() ^
+			(unsigned int)redis_monotonic_ms() ^
+			(unsigned int)(uintptr_t)&redis_backoff_seed;
+	}
+
+	delay_ms = backoff->delay_ms -
+		(rand_r(&redis_backoff_seed) % (backoff->delay_ms / 2 + 1));
+	backoff->next_attempt_ms = redis_monotonic_ms() + delay_ms;
+
+	return delay_ms;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Whether the backoff has passed
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_backoff_ready(
+	const struct redis_backoff *backoff)
+{
+	return (backoff->next_attempt_ms == 0) ||
+		(redis_monotonic_ms() >= backoff->next_attempt_ms);
+}
+
+// Connection cached for each thread
+struct redis_thread_context {
+	redisContext *ctx;
+	char *read_buffer;
+	pid_t pid;
+	uint64_t last_used_ms;
+	struct redis_backoff backoff;
+#ifdef ATOM_HAVE_URING
+	// Ring for round trips on any of the thread's contexts, with the read
+	//	buffer registered if the memlock limit allows. It's made in
+	//	ring_pid s.t. a forked child makes its own.
+	struct io_uring ring;
+	bool ring_ready;
+	bool ring_failed;
+	bool ring_fixed;
+	pid_t ring_pid;
+#endif
+};
+
+// Whether round trips go through io_uring: < 0 until the environment's
+//	been checked
+static int redis_uring_on = -1;
+
+static pthread_key_t redis_thread_context_key;
+static pthread_once_t redis_thread_context_once = PTHREAD_ONCE_INIT;
+static bool redis_thread_context_key_valid = false;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Frees a thread's cached connection when it exits
+//
+////////////////////////////////////////////////////////////////////////////////
+static void redis_thread_context_free(
+	void *data)
+{
+	struct redis_thread_context *cache = (struct redis_thread_context *)data;
+
+	if (cache->ctx != NULL) {
+		redis_context_cleanup(cache->ctx);
+	}
+#ifdef ATOM_HAVE_URING
+	if (cache->ring_ready && (cache->ring_pid == getpid())) {
+		io_uring_queue_exit(&cache->ring);
+	}
+#endif
+	free(cache->read_buffer);
+	free(cache);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Makes the key for the cached connections
+//
+////////////////////////////////////////////////////////////////////////////////
+static void redis_thread_context_key_init(void)
+{
+	if (pthread_key_create(&redis_thread_context_key,
+		redis_thread_context_free) == 0)
+	{
+		redis_thread_context_key_valid = true;
+	} else {
+		fprintf(stderr, "Failed to make the key for per-thread connections\n");
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets this thread's cache, making it if needed. Returns NULL
+//			if the cache can't be kept for the thread.
+//
+////////////////////////////////////////////////////////////////////////////////
+static struct redis_thread_context *redis_thread_context_get_cache(void)
+{
+	struct redis_thread_context *cache;
+
+	pthread_once(&redis_thread_context_once, redis_thread_context_key_init);
+	if (!redis_thread_context_key_valid) {
+		return NULL;
+	}
+
+	cache = pthread_getspecific(redis_thread_context_key);
+	if (cache == NULL) {
+		cache = calloc(1, sizeof(struct redis_thread_context));
+		assert(cache != NULL);
+		cache->pid = getpid();
+		if (pthread_setspecific(redis_thread_context_key, cache) != 0) {
+			free(cache);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Checks whether a cached connection is still good. One that's
+//			errored is bad, and one that's been idle for a while is
+//			PINGed since redis may have gone away in the meantime.
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool redis_thread_context_healthy(
+	struct redis_thread_context *cache,
+	uint64_t now_ms)
+{
+	redisReply *reply;
+	bool healthy;
+
+	if (cache->ctx->err) {
+		return false;
+	}
+
+	if ((now_ms - cache->last_used_ms) < REDIS_THREAD_CONTEXT_IDLE_CHECK_MS) {
+		return true;
+	}
+
+	reply = redisCommand(cache->ctx, "PING");
+	healthy = (reply != NULL) && (reply->type != REDIS_REPLY_ERROR);
+	if (reply != NULL) {
+		freeReplyObject(reply);
+	}
+
+	return healthy;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets this thread's cached connection, reconnecting with
+//			backoff if it's gone bad
+//
+////////////////////////////////////////////////////////////////////////////////
+redisContext *redis_context_thread(void)
+{
+	struct redis_thread_context *cache;
+	uint64_t now_ms;
+
+	cache = redis_thread_context_get_cache();
+	if (cache == NULL) {
+		return NULL;
+	}
+	now_ms = redis_monotonic_ms();
+
+	// A connection from before a fork is shared with the parent, so
+	//	the child has to make its own
+	if (cache->pid != getpid()) {
+		if (cache->ctx != NULL) {
+			redis_context_cleanup(cache->ctx);
+			cache->ctx = NULL;
+		}
+		redis_backoff_reset(&cache->backoff);
+		cache->pid = getpid();
+	}
+
+	if ((cache->ctx != NULL) && !redis_thread_context_healthy(cache, now_ms)) {
+		redis_context_cleanup(cache->ctx);
+		cache->ctx = NULL;
+	}
+
+	if (cache->ctx == NULL) {
+		if (!redis_backoff_ready(&cache->backoff)) {
+			return NULL;
+		}
+
+		cache->ctx = redis_context_init();
+		if ((cache->ctx == NULL) || cache->ctx->err) {
+			if (cache->ctx != NULL) {
+				redis_context_cleanup(cache->ctx);
+				cache->ctx = NULL;
+			}
+			redis_backoff_failed(&cache->backoff);
+			return NULL;
+		}
+		redis_backoff_reset(&cache->backoff);
+	}
+
+	cache->last_used_ms = now_ms;
+	return cache->ctx;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Drops this thread's cached connection
+//
+////////////////////////////////////////////////////////////////////////////////
+void redis_context_thread_drop(void)
+{
+	struct redis_thread_context *cache = redis_thread_context_get_cache();
+
+	if ((cache != NULL) && (cache->ctx != NULL)) {
+		redis_context_cleanup(cache->ctx);
+		cache->ctx = NULL;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Reads what's on the socket into the reader. Same as
+//			redisBufferRead except that it reads up to
+//			REDIS_READ_CHUNK_LEN at a time into a buffer kept for the
+//			thread instead of 16k at a time from the stack, s.t. large
+//			replies take far fewer read()s. Falls back to redisBufferRead
+//			if there's no buffer for the thread.
+//
+////////////////////////////////////////////////////////////////////////////////
+static int redis_buffer_read(
+	redisContext *ctx)
+{
+	struct redis_thread_context *cache = redis_thread_context_get_cache();
+	ssize_t n;
+
+	if (ctx->err) {
+		return REDIS_ERR;
+	}
+	if (cache == NULL) {
+		return redisBufferRead(ctx);
+	}
+
+	if (cache->read_buffer == NULL) {
+		cache->read_buffer = malloc(REDIS_READ_CHUNK_LEN);
+		assert(cache->read_buffer != NULL);
+	}
+
+	do {
+		n = read(ctx->fd, cache->read_buffer, REDIS_READ_CHUNK_LEN);
+	} while ((n < 0) && (errno == EINTR));
+
+	if (n < 0) {
+		ctx->err = REDIS_ERR_IO;
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "%s", strerror(errno));
+		return REDIS_ERR;
+	} else if (n == 0) {
+		ctx->err = REDIS_ERR_EOF;
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "Server closed the connection");
+		return REDIS_ERR;
+	}
+
+	if (redisReaderFeed(ctx->reader, cache->read_buffer, n) != REDIS_OK) {
+		ctx->err = ctx->reader->err;
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "%s", ctx->reader->errstr);
+		return REDIS_ERR;
+	}
+
+	return REDIS_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Whether round trips go through io_uring. Checks the
+//			environment the first time.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_uring_enabled(void)
+{
+#ifdef ATOM_HAVE_URING
+	int on = __atomic_load_n(&redis_uring_on, __ATOMIC_RELAXED);
+	int unknown = -1;
+	const char *env;
+
+	if (on < 0) {
+		env = getenv(REDIS_URING_ENV);
+		on = ((env == NULL) || (strcmp(env, "0") != 0)) ? 1 : 0;
+
+		// Don't override redis_uring_enable if it got there first
+		__atomic_compare_exchange_n(&redis_uring_on, &unknown, on, false,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		on = __atomic_load_n(&redis_uring_on, __ATOMIC_RELAXED);
+	}
+
+	return on > 0;
+#else
+	return false;
+#endif
+}
+
+void redis_uring_enable(
+	bool enable)
+{
+	__atomic_store_n(&redis_uring_on, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Flushes what's been appended and reads until there's a reply
+//			with a write() and read()s on the socket
+//
+////////////////////////////////////////////////////////////////////////////////
+static int redis_socket_round_trip(
+	redisContext *ctx,
+	void **aux)
+{
+	int done = 0;
+
+	do {
+		if (redisBufferWrite(ctx, &done) != REDIS_OK) {
+			return REDIS_ERR;
+		}
+	} while (!done);
+
+	do {
+		if ((redis_buffer_read(ctx) != REDIS_OK) ||
+			(redisGetReplyFromReader(ctx, aux) != REDIS_OK))
+		{
+			return REDIS_ERR;
+		}
+	} while (*aux == NULL);
+
+	return REDIS_OK;
+}
+
+#ifdef ATOM_HAVE_URING
+
+// Tags for the requests in a round trip
+#define REDIS_URING_WRITE ((void *)1)
+#define REDIS_URING_READ ((void *)2)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets this thread's ring, making it if needed. Returns NULL if
+//			io_uring is off or the ring can't be made, in which case it's
+//			not tried again on this thread.
+//
+////////////////////////////////////////////////////////////////////////////////
+static struct redis_thread_context *redis_uring_get(void)
+{
+	struct redis_thread_context *cache;
+	struct iovec iov;
+
+	if (!redis_uring_enabled()) {
+		return NULL;
+	}
+	cache = redis_thread_context_get_cache();
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	// A ring from before a fork is the parent's, so the child has to
+	//	make its own
+	if (cache->ring_ready && (cache->ring_pid != getpid())) {
+		io_uring_queue_exit(&cache->ring);
+		cache->ring_ready = false;
+		cache->ring_failed = false;
+	}
+	if (cache->ring_ready) {
+		return cache;
+	}
+	if (cache->ring_failed) {
+		return NULL;
+	}
+
+	if (cache->read_buffer == NULL) {
+		cache->read_buffer = malloc(REDIS_READ_CHUNK_LEN);
+		assert(cache->read_buffer != NULL);
+	}
+
+	if (io_uring_queue_init(REDIS_URING_ENTRIES, &cache->ring, 0) != 0) {
+		cache->ring_failed = true;
+		return NULL;
+	}
+
+	// Reading into a registered buffer saves mapping it on each read.
+	//	It counts against the memlock limit, so do without if it's low.
+	iov.iov_base = cache->read_buffer;
+	iov.iov_len = REDIS_READ_CHUNK_LEN;
+	cache->ring_fixed = (io_uring_register_buffers(&cache->ring, &iov, 1) == 0);
+
+	cache->ring_ready = true;
+	cache->ring_pid = getpid();
+	return cache;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Flushes what's been appended and reads until there's a reply
+//			through the thread's ring. The write and the read are linked
+//			and submitted together, s.t. a round trip takes a single
+//			io_uring_enter() instead of a write() and a read(). Everything
+//			pipelined before it goes out in the same write. If the write
+//			comes up short the read is cancelled and the rest is sent with
+//			a new read.
+//
+////////////////////////////////////////////////////////////////////////////////
+static int redis_uring_round_trip(
+	redisContext *ctx,
+	struct redis_thread_context *cache,
+	void **aux)
+{
+	struct io_uring *ring = &cache->ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int n_sqes, i;
+	size_t len;
+	int err = 0;
+	int res;
+
+	while (*aux == NULL) {
+		n_sqes = 0;
+
+		len = sdslen(ctx->obuf);
+		if (len > 0) {
+			sqe = io_uring_get_sqe(ring);
+			io_uring_prep_write(sqe, ctx->fd, ctx->obuf, len, 0);
+			io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+			io_uring_sqe_set_data(sqe, REDIS_URING_WRITE);
+			++n_sqes;
+		}
+
+		sqe = io_uring_get_sqe(ring);
+		if (cache->ring_fixed) {
+			io_uring_prep_read_fixed(sqe, ctx->fd, cache->read_buffer,
+				REDIS_READ_CHUNK_LEN, 0, 0);
+		} else {
+			io_uring_prep_read(sqe, ctx->fd, cache->read_buffer,
+				REDIS_READ_CHUNK_LEN, 0);
+		}
+		io_uring_sqe_set_data(sqe, REDIS_URING_READ);
+		++n_sqes;
+
+		// Nothing's submitted if it's interrupted, so it can be retried
+		while ((res = io_uring_submit_and_wait(ring, n_sqes)) == -EINTR);
+		if (res < 0) {
+			err = -res;
+			ctx->err = REDIS_ERR_IO;
+			snprintf(ctx->errstr, sizeof(ctx->errstr), "%s", strerror(err));
+			return REDIS_ERR;
+		}
+
+		// Reap both before looking at what came back s.t. nothing's left
+		//	in the ring for the next round trip
+		for (i = 0; i < n_sqes; ++i) {
+			while ((res = io_uring_wait_cqe(ring, &cqe)) == -EINTR);
+			if (res < 0) {
+				err = -res;
+				break;
+			}
+
+			res = cqe->res;
+			if (io_uring_cqe_get_data(cqe) == REDIS_URING_WRITE) {
+				if (res >= 0) {
+					sdsrange(ctx->obuf, res, -1);
+				} else if ((res != -EINTR) && (res != -EAGAIN) && (err == 0)) {
+					err = -res;
+				}
+			} else if (res > 0) {
+				if ((err == 0) &&
+					(redisReaderFeed(ctx->reader, cache->read_buffer, res) != REDIS_OK))
+				{
+					ctx->err = ctx->reader->err;
+					snprintf(ctx->errstr, sizeof(ctx->errstr), "%s",
+						ctx->reader->errstr);
+					err = -1;
+				}
+			} else if (res == 0) {
+				if (err == 0) {
+					ctx->err = REDIS_ERR_EOF;
+					snprintf(ctx->errstr, sizeof(ctx->errstr),
+						"Server closed the connection");
+					err = -1;
+				}
+			} else if ((res != -ECANCELED) && (res != -EINTR) &&
+				(res != -EAGAIN) && (err == 0))
+			{
+				err = -res;
+			}
+			io_uring_cqe_seen(ring, cqe);
+		}
+
+		if (err != 0) {
+			if (err > 0) {
+				ctx->err = REDIS_ERR_IO;
+				snprintf(ctx->errstr, sizeof(ctx->errstr), "%s", strerror(err));
+			}
+			return REDIS_ERR;
+		}
+
+		if (redisGetReplyFromReader(ctx, aux) != REDIS_OK) {
+			return REDIS_ERR;
+		}
+	}
+
+	return REDIS_OK;
+}
+
+#endif // ATOM_HAVE_URING
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Flushes what's been appended and reads until there's a reply,
+//			through io_uring if it's on and there's a ring for the thread
+//
+////////////////////////////////////////////////////////////////////////////////
+static int redis_round_trip(
+	redisContext *ctx,
+	void **aux)
+{
+#ifdef ATOM_HAVE_URING
+	struct redis_thread_context *cache = redis_uring_get();
+
+	if (cache != NULL) {
+		return redis_uring_round_trip(ctx, cache, aux);
+	}
+#endif
+
+	return redis_socket_round_trip(ctx, aux);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets the next reply on a blocking context. Same as
+//			redisGetReply, flushing everything that's been appended in as
+//			few write()s as the socket takes, except that it reads with
+//			redis_buffer_read, or through io_uring, see redis_round_trip.
+//
+////////////////////////////////////////////////////////////////////////////////
+int redis_get_reply(
+	redisContext *ctx,
+	void **reply)
+{
+	void *aux = NULL;
+
+	// Might have it read in already
+	if (redisGetReplyFromReader(ctx, &aux) != REDIS_OK) {
+		return REDIS_ERR;
+	}
+
+	if ((aux == NULL) && (redis_round_trip(ctx, &aux) != REDIS_OK)) {
+		return REDIS_ERR;
+	}
+
+	if (reply != NULL) {
+		*reply = aux;
+	} else {
+		freeReplyObject(aux);
+	}
+
+	return REDIS_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Sends a command and gets its reply, same as redisCommandArgv
+//			but reading with redis_get_reply
+//
+////////////////////////////////////////////////////////////////////////////////
+redisReply *redis_command_argv(
+	redisContext *ctx,
+	int argc,
+	const char **argv,
+	const size_t *argvlen)
+{
+	void *reply = NULL;
+
+	if (redisAppendCommandArgv(ctx, argc, argv, argvlen) != REDIS_OK) {
+		return NULL;
+	}
+	if (redis_get_reply(ctx, &reply) != REDIS_OK) {
+		return NULL;
+	}
+
+	return (redisReply *)reply;
+}
+
+// Reconnect counters for the process
+static struct redis_reconnect_stats redis_reconnect_stats;
+static pthread_mutex_t redis_reconnect_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Reconnects a broken context in place. hiredis keeps the
+//			socket path/address in the context, so the same context can
+//			be reconnected and handed back to whoever was using it. Retries
+//			with jittered backoff until it's back or the timeout passes.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_context_reconnect(
+	redisContext *ctx,
+	int timeout_ms)
+{
+	struct redis_backoff backoff;
+	uint64_t start_ms;
+	uint64_t elapsed_ms;
+	uint64_t n_failed = 0;
+	int delay_ms;
+	bool ret_val = false;
+
+	start_ms = redis_monotonic_ms();
+	redis_backoff_reset(&backoff);
+
+	while (true) {
+		if ((redisReconnect(ctx) == REDIS_OK) && !ctx->err) {
+			ret_val = true;
+			break;
+		}
+		n_failed++;
+
+		delay_ms = redis_backoff_failed(&backoff);
+		if ((timeout_ms != REDIS_RECONNECT_FOREVER) &&
+			((redis_monotonic_ms() + delay_ms - start_ms) > timeout_ms))
+		{
+			break;
+		}
+		usleep(delay_ms * 1000);
+	}
+
+	elapsed_ms = redis_monotonic_ms() - start_ms;
+
+	pthread_mutex_lock(&redis_reconnect_stats_lock);
+	redis_reconnect_stats.n_disconnects++;
+	redis_reconnect_stats.n_failed_attempts += n_failed;
+	if (ret_val) {
+		redis_reconnect_stats.n_reconnects++;
+		redis_reconnect_stats.last_reconnect_ms = elapsed_ms;
+		redis_reconnect_stats.total_reconnect_ms += elapsed_ms;
+		if (elapsed_ms > redis_reconnect_stats.max_reconnect_ms) {
+			redis_reconnect_stats.max_reconnect_ms = elapsed_ms;
+		}
+	}
+	pthread_mutex_unlock(&redis_reconnect_stats_lock);
+
+	return ret_val;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets the counters for the reconnects done in this process
+//
+////////////////////////////////////////////////////////////////////////////////
+void redis_get_reconnect_stats(
+	struct redis_reconnect_stats *stats)
+{
+	pthread_mutex_lock(&redis_reconnect_stats_lock);
+	*stats = redis_reconnect_stats;
+	pthread_mutex_unlock(&redis_reconnect_stats_lock);
+}
+
+// Offset from the local monotonic clock to the server's clock for each
+//	context that's measured it. An empty slot has a NULL ctx.
+struct redis_clock_slot {
+	const redisContext *ctx;
+	struct redis_clock clock;
+};
+static struct redis_clock_slot redis_clocks[REDIS_CLOCK_MAX_CONTEXTS];
+static pthread_mutex_t redis_clock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Finds the offset for ctx, or the most recently measured one
+//			if ctx is NULL. Call with the lock held. Returns NULL if there
+//			isn't one.
+//
+////////////////////////////////////////////////////////////////////////////////
+static struct redis_clock_slot *redis_clock_find(
+	const redisContext *ctx)
+{
+	struct redis_clock_slot *found = NULL;
+	int i;
+
+	for (i = 0; i < REDIS_CLOCK_MAX_CONTEXTS; ++i) {
+		if (redis_clocks[i].ctx == NULL) {
+			continue;
+		}
+		if (ctx != NULL) {
+			if (redis_clocks[i].ctx == ctx) {
+				return &redis_clocks[i];
+			}
+		} else if ((found == NULL) ||
+			(redis_clocks[i].clock.synced_ms > found->clock.synced_ms))
+		{
+			found = &redis_clocks[i];
+		}
+	}
+
+	return found;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Stores the offset for ctx, taking an empty slot or the one
+//			measured the longest ago if it doesn't have one yet
+//
+////////////////////////////////////////////////////////////////////////////////
+static void redis_clock_store(
+	const redisContext *ctx,
+	const struct redis_clock *clock)
+{
+	struct redis_clock_slot *slot;
+	int i;
+
+	pthread_mutex_lock(&redis_clock_lock);
+
+	slot = redis_clock_find(ctx);
+	for (i = 0; (slot == NULL) && (i < REDIS_CLOCK_MAX_CONTEXTS); ++i) {
+		if (redis_clocks[i].ctx == NULL) {
+			slot = &redis_clocks[i];
+		}
+	}
+	if (slot == NULL) {
+		slot = &redis_clocks[0];
+		for (i = 1; i < REDIS_CLOCK_MAX_CONTEXTS; ++i) {
+			if (redis_clocks[i].clock.synced_ms < slot->clock.synced_ms) {
+				slot = &redis_clocks[i];
+			}
+		}
+	}
+
+	slot->ctx = ctx;
+	slot->clock = *clock;
+
+	pthread_mutex_unlock(&redis_clock_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Copies out the offset for ctx, see redis_clock_find. Leaves
+//			it invalid if there isn't one.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void redis_clock_load(
+	const redisContext *ctx,
+	struct redis_clock *clock)
+{
+	struct redis_clock_slot *slot;
+
+	memset(clock, 0, sizeof(*clock));
+
+	pthread_mutex_lock(&redis_clock_lock);
+	slot = redis_clock_find(ctx);
+	if (slot != NULL) {
+		*clock = slot->clock;
+	}
+	pthread_mutex_unlock(&redis_clock_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Drops the offset for a context that's going away s.t. a new
+//			one at the same address doesn't pick it up
+//
+////////////////////////////////////////////////////////////////////////////////
+void redis_clock_forget(
+	const redisContext *ctx)
+{
+	struct redis_clock_slot *slot;
+
+	if (ctx == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&redis_clock_lock);
+	slot = redis_clock_find(ctx);
+	if (slot != NULL) {
+		memset(slot, 0, sizeof(*slot));
+	}
+	pthread_mutex_unlock(&redis_clock_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets a monotonic time in us
+//
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t redis_monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Sends a TIME, noting the local monotonic times around it.
+//			Returns the server time in us, or 0 on error.
+//
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t redis_clock_sample(
+	redisContext *ctx,
+	uint64_t *sent_us,
+	uint64_t *received_us)
+{
+	redisReply *reply;
+	uint64_t server_us = 0;
+
+	*sent_us = redis_monotonic_us();
+	reply = redisCommand(ctx, "TIME");
+	*received_us = redis_monotonic_us();
+
+	if (reply == NULL) {
+		goto done;
+	}
+
+	if ((reply->type == REDIS_REPLY_ARRAY) && (reply->elements == 2) &&
+		(reply->element[0]->type == REDIS_REPLY_STRING) &&
+		(reply->element[1]->type == REDIS_REPLY_STRING))
+	{
+		server_us = (strtoull(reply->element[0]->str, NULL, 10) * 1000000ULL) +
+			strtoull(reply->element[1]->str, NULL, 10);
+	}
+
+	freeReplyObject(reply);
+done:
+	return server_us;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Measures the offset to the server's clock for ctx. Takes
+//			n_samples and keeps the one with the lowest RTT since it has
+//			the least room for error, taking the server time to be halfway
+//			through the round trip. The I/O is done without holding the
+//			lock.
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool redis_clock_measure(
+	redisContext *ctx,
+	int n_samples,
+	struct redis_clock *out)
+{
+	struct redis_clock clock;
+	uint64_t sent_us, received_us, server_us;
+	int i;
+
+	memset(&clock, 0, sizeof(clock));
+
+	for (i = 0; i < n_samples; ++i) {
+		server_us = redis_clock_sample(ctx, &sent_us, &received_us);
+		if (server_us == 0) {
+			return false;
+		}
+
+		if (!clock.valid || ((received_us - sent_us) < clock.rtt_us)) {
+			clock.rtt_us = received_us - sent_us;
+			clock.offset_us = (int64_t)server_us -
+				(int64_t)(sent_us + (clock.rtt_us / 2));
+			clock.synced_ms = received_us / 1000;
+			clock.valid = true;
+		}
+	}
+
+	*out = clock;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Measures the offset to the server's clock for ctx now with
+//			the full REDIS_CLOCK_SYNC_SAMPLES
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_clock_sync(
+	redisContext *ctx)
+{
+	struct redis_clock clock;
+
+	if (!redis_clock_measure(ctx, REDIS_CLOCK_SYNC_SAMPLES, &clock)) {
+		return false;
+	}
+
+	redis_clock_store(ctx, &clock);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets the clock offset for ctx, measuring it in full if it
+//			hasn't been yet or it's older than REDIS_CLOCK_REFRESH_MS. If
+//			it's only older than max_age_ms it's refreshed with a single
+//			round trip, which is enough to catch the server's clock being
+//			stepped. If refreshing fails the old offset is still used.
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool redis_clock_get_max_age(
+	redisContext *ctx,
+	struct redis_clock *clock,
+	uint64_t max_age_ms)
+{
+	struct redis_clock fresh;
+	uint64_t age_ms;
+
+	redis_clock_load(ctx, clock);
+	if (ctx == NULL) {
+		return clock->valid;
+	}
+
+	age_ms = redis_monotonic_ms() - clock->synced_ms;
+	if (!clock->valid || (age_ms > REDIS_CLOCK_REFRESH_MS)) {
+		if (redis_clock_measure(ctx, REDIS_CLOCK_SYNC_SAMPLES, &fresh)) {
+			redis_clock_store(ctx, &fresh);
+			*clock = fresh;
+		}
+	} else if (age_ms > max_age_ms) {
+		if (redis_clock_measure(ctx, 1, &fresh)) {
+			redis_clock_store(ctx, &fresh);
+			*clock = fresh;
+		}
+	}
+
+	return clock->valid;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets the clock offset, measuring it if it hasn't been yet or
+//			it's older than REDIS_CLOCK_REFRESH_MS
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_clock_get(
+	redisContext *ctx,
+	struct redis_clock *clock)
+{
+	return redis_clock_get_max_age(ctx, clock, REDIS_CLOCK_REFRESH_MS);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets what the server's clock reads now in ms, without a round
+//			trip once the offset is known
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_clock_server_ms(
+	redisContext *ctx,
+	uint64_t *ms)
+{
+	struct redis_clock clock;
+
+	if (!redis_clock_get(ctx, &clock)) {
+		return false;
+	}
+
+	*ms = (uint64_t)((int64_t)redis_monotonic_us() + clock.offset_us) / 1000;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Converts the time in a stream ID to the local monotonic clock
+//			in ms, s.t. it can be compared with redis_monotonic_ms()
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_clock_id_to_monotonic_ms(
+	redisContext *ctx,
+	const char *id,
+	uint64_t *ms)
+{
+	struct redis_clock clock;
+	int64_t local_us;
+
+	if (!redis_clock_get(ctx, &clock)) {
+		return false;
+	}
+
+	local_us = ((int64_t)redis_stream_id_ms(id) * 1000) - clock.offset_us;
+	*ms = (local_us > 0) ? (uint64_t)local_us / 1000 : 0;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Gets the server's current time as a stream ID s.t. reading
+//			from it gets everything added from now on. An ID past what the
+//			server's adding would skip entries, so the offset is refreshed
+//			if it's older than REDIS_CLOCK_ID_MAX_AGE_MS in case the
+//			server's clock was stepped or slewed, and the ID is moved back
+//			by the RTT the offset was measured with plus a margin. Reads
+//			may get a few entries added just before instead.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_get_time_id(
+	redisContext *ctx,
+	char id[STREAM_ID_BUFFLEN])
+{
+	struct redis_clock clock;
+	int64_t server_us;
+	int64_t back_us;
+	uint64_t ms;
+
+	if (!redis_clock_get_max_age(ctx, &clock, REDIS_CLOCK_ID_MAX_AGE_MS)) {
+		return false;
+	}
+
+	server_us = (int64_t)redis_monotonic_us() + clock.offset_us;
+	back_us = (int64_t)clock.rtt_us + (REDIS_CLOCK_ID_MARGIN_MS * 1000);
+	ms = (server_us > back_us) ? (uint64_t)(server_us - back_us) / 1000 : 0;
+
+	snprintf(id, STREAM_ID_BUFFLEN, "%llu", (unsigned long long)ms);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 	@brief	Initializes a new stream info. Will set up all of the fields
+//			of the info for use with the XREAD function. If time_ctx is
+//			non-NULL then will set the last_seen_id to the server's current
+//			time, see redis_clock_get. Otherwise will leave the
+//			last_seen_id untouched and the user can choose how to implement
+//			it.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool redis_init_stream_info(
+	redisContext *ctx,
+	struct redis_stream_info *info,
+	const char *name,
+	bool (*data_cb)(
+		const char *id,
+		const struct redisReply *reply,
+		void *user_data),
+	const char *last_id,
+	void *user_data)
+{
+	bool ret_val = false;
 
 	// Make sure we either got a context or a last_id
 	if ((ctx == NULL) && (last_id == NULL)) {
@@ -870,36 +2585,11 @@ bool redis_init_stream_info(
 		strncpy(info->last_id, last_id, sizeof(info->last_id));
 	} else {
 
-		// Zero out the last known ID
-		memset(info->last_id, 0, sizeof(info->last_id));
-
-		// Get the current time
-		reply = redisCommand(ctx, "TIME");
-
-		// If the time is invalid then use '$' for now
-		if ((reply == NULL) || (reply->type != REDIS_REPLY_ARRAY) ||
-			(reply->elements != 2) ||
-			(reply->element[0]->type != REDIS_REPLY_STRING) ||
-			(reply->element[1]->type != REDIS_REPLY_STRING))
-		{
-			fprintf(stderr, "Invalid TIME reply\n");
-			info->last_id[0] = '$';
-
-		// Otherwise set the last seen ID to the time
-		} else {
-
-			// Cut off the microseconds from the timestamp
-			reply->element[1]->str[3] = '\0';
-
-			// Otherwise we want to make the first timestamp
-			snprintf(info->last_id, sizeof(info->last_id), "%s%s",
-				reply->element[0]->str,
-				reply->element[1]->str);
-		}
-
-		// If we have a reply then we want to free it
-		if (reply != NULL) {
-			freeReplyObject(reply);
+		// Start from what the server's clock reads now, or from '$' if
+		//	we can't tell
+		if (!redis_get_time_id(ctx, info->last_id)) {
+			fprintf(stderr, "Failed to get the server time\n");
+			strcpy(info->last_id, "$");
 		}
 	}
 
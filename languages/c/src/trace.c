@@ -0,0 +1,514 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file trace.c
+//
+//  @brief Implements span recording and the Chrome trace dump. Each
+//			thread records into its own ring under an uncontended lock,
+//			which is only ever taken by someone else when dumping. Rings
+//			of threads that have exited are handed to the next thread that
+//			records, which carries on after their spans.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <hiredis/hiredis.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "redis.h"
+#include "atom.h"
+#include "element.h"
+#include "trace.h"
+
+// Span and the thread it was recorded on
+struct atom_trace_ring_entry {
+	struct atom_trace_span span;
+	pid_t tid;
+};
+
+// Spans recorded on a thread
+struct atom_trace_ring {
+	pthread_mutex_t lock;
+	struct atom_trace_ring *next;
+	bool in_use;
+	size_t head;
+	size_t n_spans;
+	struct atom_trace_ring_entry entries[ATOM_TRACE_RING_LEN];
+};
+
+int atom_trace_on = -1;
+
+// All of the rings ever made
+static pthread_mutex_t atom_trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct atom_trace_ring *atom_trace_rings = NULL;
+
+// Key whose destructor gives a thread's ring back when it exits
+static pthread_once_t atom_trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t atom_trace_key;
+
+// This thread's ring, ID, current span and ID generator state
+static __thread struct atom_trace_ring *atom_trace_thread_ring = NULL;
+static __thread pid_t atom_trace_tid = 0;
+static __thread struct atom_trace_context atom_trace_current = {0, 0, 0};
+static __thread uint64_t atom_trace_rand_state = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Checks the environment for whether tracing is on
+//
+////////////////////////////////////////////////////////////////////////////////
+bool atom_trace_init(void)
+{
+	const char *env = getenv(ATOM_TRACE_ENV);
+	int on = ((env != NULL) && (strcmp(env, "0") != 0)) ? 1 : 0;
+	int unknown = -1;
+
+	// Don't override atom_trace_enable if it got there first
+	__atomic_compare_exchange_n(&atom_trace_on, &unknown, on, false,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(&atom_trace_on, __ATOMIC_RELAXED) > 0;
+}
+
+void atom_trace_enable(
+	bool enable)
+{
+	__atomic_store_n(&atom_trace_on, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+uint64_t atom_trace_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Makes a random nonzero ID. xorshift64* seeded per thread is
+//			plenty to keep IDs from different elements apart.
+//
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t atom_trace_new_id(void)
+{
+	uint64_t x = atom_trace_rand_state;
+
+	if (x == 0) {
+		x = atom_trace_now_us() ^ ((uint64_t)getpid() << 32) ^
+			((uint64_t)syscall(SYS_gettid) << 16) ^ (uintptr_t)&x;
+		if (x == 0) {
+			x = 1;
+		}
+	}
+
+	do {
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		atom_trace_rand_state = x;
+	} while ((x * 0x2545F4914F6CDD1DULL) == 0);
+
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gives a thread's ring back when it exits. Its spans stay until
+//			another thread takes it.
+//
+////////////////////////////////////////////////////////////////////////////////
+static void atom_trace_ring_release(
+	void *data)
+{
+	struct atom_trace_ring *ring = (struct atom_trace_ring *)data;
+
+	pthread_mutex_lock(&atom_trace_rings_lock);
+	ring->in_use = false;
+	pthread_mutex_unlock(&atom_trace_rings_lock);
+}
+
+static void atom_trace_key_init(void)
+{
+	pthread_key_create(&atom_trace_key, atom_trace_ring_release);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets this thread's ring, taking one a thread that's exited
+//			left or making one
+//
+////////////////////////////////////////////////////////////////////////////////
+static struct atom_trace_ring *atom_trace_ring_get(void)
+{
+	struct atom_trace_ring *ring;
+
+	if (atom_trace_thread_ring != NULL) {
+		return atom_trace_thread_ring;
+	}
+
+	pthread_once(&atom_trace_key_once, atom_trace_key_init);
+
+	pthread_mutex_lock(&atom_trace_rings_lock);
+	for (ring = atom_trace_rings; ring != NULL; ring = ring->next) {
+		if (!ring->in_use) {
+			break;
+		}
+	}
+	if (ring == NULL) {
+		ring = malloc(sizeof(struct atom_trace_ring));
+		assert(ring != NULL);
+		pthread_mutex_init(&ring->lock, NULL);
+		ring->head = 0;
+		ring->n_spans = 0;
+		ring->next = atom_trace_rings;
+		atom_trace_rings = ring;
+	}
+	ring->in_use = true;
+	pthread_mutex_unlock(&atom_trace_rings_lock);
+
+	atom_trace_tid = (pid_t)syscall(SYS_gettid);
+	pthread_setspecific(atom_trace_key, ring);
+	atom_trace_thread_ring = ring;
+	return ring;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Starts timing a span
+//
+////////////////////////////////////////////////////////////////////////////////
+void atom_trace_begin(
+	struct atom_trace_span *span,
+	const struct atom_trace_context *parent,
+	const char *name,
+	const char *detail_fmt,
+	...)
+{
+	va_list args;
+
+	if (parent == NULL) {
+		parent = &atom_trace_current;
+	}
+
+	span->name = name;
+	if (parent->trace_id != 0) {
+		span->trace_id = parent->trace_id;
+		span->parent_id = parent->span_id;
+	} else {
+		span->trace_id = atom_trace_new_id();
+		span->parent_id = 0;
+	}
+	span->span_id = atom_trace_new_id();
+
+	va_start(args, detail_fmt);
+	vsnprintf(span->detail, sizeof(span->detail), detail_fmt, args);
+	va_end(args);
+
+	span->dur_us = 0;
+	span->start_us = atom_trace_now_us();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Stops timing a span and records it
+//
+////////////////////////////////////////////////////////////////////////////////
+void atom_trace_end(
+	struct atom_trace_span *span)
+{
+	struct atom_trace_ring *ring;
+	uint64_t now_us;
+
+	if (span->start_us == 0) {
+		return;
+	}
+
+	// A span can start on another element's clock, e.g. a queue wait,
+	//	so don't let it go negative if the clocks are off
+	now_us = atom_trace_now_us();
+	span->dur_us = (now_us > span->start_us) ? (now_us - span->start_us) : 0;
+
+	ring = atom_trace_ring_get();
+	pthread_mutex_lock(&ring->lock);
+	ring->entries[ring->head].span = *span;
+	ring->entries[ring->head].tid = atom_trace_tid;
+	ring->head = (ring->head + 1) % ATOM_TRACE_RING_LEN;
+	if (ring->n_spans < ATOM_TRACE_RING_LEN) {
+		++ring->n_spans;
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	span->start_us = 0;
+}
+
+void atom_trace_span_context(
+	const struct atom_trace_span *span,
+	struct atom_trace_context *context)
+{
+	context->trace_id = span->trace_id;
+	context->span_id = span->span_id;
+	context->sent_us = atom_trace_now_us();
+}
+
+void atom_trace_set_current(
+	const struct atom_trace_context *context,
+	struct atom_trace_context *prev)
+{
+	if (prev != NULL) {
+		*prev = atom_trace_current;
+	}
+
+	if (context != NULL) {
+		atom_trace_current = *context;
+	} else {
+		memset(&atom_trace_current, 0, sizeof(atom_trace_current));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes and parses the value of the trace key
+//
+////////////////////////////////////////////////////////////////////////////////
+size_t atom_trace_value(
+	const struct atom_trace_context *context,
+	char value[ATOM_TRACE_VALUE_MAXLEN])
+{
+	return snprintf(value, ATOM_TRACE_VALUE_MAXLEN, "%016llx-%016llx-%llu",
+		(unsigned long long)context->trace_id,
+		(unsigned long long)context->span_id,
+		(unsigned long long)context->sent_us);
+}
+
+bool atom_trace_parse(
+	const char *value,
+	size_t len,
+	struct atom_trace_context *context)
+{
+	char buffer[ATOM_TRACE_VALUE_MAXLEN];
+	unsigned long long trace_id, span_id, sent_us;
+
+	if (len >= sizeof(buffer)) {
+		return false;
+	}
+	memcpy(buffer, value, len);
+	buffer[len] = '\0';
+
+	if ((sscanf(buffer, "%llx-%llx-%llu", &trace_id, &span_id, &sent_us) != 3) ||
+		(trace_id == 0))
+	{
+		return false;
+	}
+
+	context->trace_id = trace_id;
+	context->span_id = span_id;
+	context->sent_us = sent_us;
+	return true;
+}
+
+bool atom_trace_find(
+	const redisReply *kv,
+	struct atom_trace_context *context)
+{
+	size_t i;
+
+	for (i = 0; (i + 1) < kv->elements; i += 2) {
+		if ((kv->element[i]->type == REDIS_REPLY_STRING) &&
+			(kv->element[i]->len == CONST_STRLEN(ATOM_TRACE_KEY_STR)) &&
+			!strncmp(kv->element[i]->str, ATOM_TRACE_KEY_STR,
+				CONST_STRLEN(ATOM_TRACE_KEY_STR)) &&
+			(kv->element[i + 1]->type == REDIS_REPLY_STRING))
+		{
+			return atom_trace_parse(kv->element[i + 1]->str,
+				kv->element[i + 1]->len, context);
+		}
+	}
+
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes a string as a JSON string
+//
+////////////////////////////////////////////////////////////////////////////////
+static void atom_trace_dump_json_str(
+	FILE *f,
+	const char *str)
+{
+	fputc('"', f);
+	for (; *str != '\0'; ++str) {
+		if ((*str == '"') || (*str == '\\')) {
+			fprintf(f, "\\%c", *str);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(f, "\\u%04x", (unsigned char)*str);
+		} else {
+			fputc(*str, f);
+		}
+	}
+	fputc('"', f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes the spans as Chrome trace JSON, a complete ("X") event
+//			per span with the IDs in its args
+//
+////////////////////////////////////////////////////////////////////////////////
+bool atom_trace_dump(
+	FILE *f,
+	const char *process_name,
+	bool clear)
+{
+	struct atom_trace_ring *ring;
+	const struct atom_trace_ring_entry *entry;
+	const struct atom_trace_span *span;
+	bool first = true;
+	int pid = getpid();
+	size_t i;
+
+	fprintf(f, "{\"traceEvents\":[");
+
+	if (process_name != NULL) {
+		fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"args\":{\"name\":", pid);
+		atom_trace_dump_json_str(f, process_name);
+		fprintf(f, "}}");
+		first = false;
+	}
+
+	pthread_mutex_lock(&atom_trace_rings_lock);
+	for (ring = atom_trace_rings; ring != NULL; ring = ring->next) {
+		pthread_mutex_lock(&ring->lock);
+
+		// Oldest first
+		for (i = 0; i < ring->n_spans; ++i) {
+			entry = &ring->entries[(ring->head + ATOM_TRACE_RING_LEN -
+				ring->n_spans + i) % ATOM_TRACE_RING_LEN];
+			span = &entry->span;
+
+			fprintf(f, "%s{\"name\":", first ? "" : ",");
+			atom_trace_dump_json_str(f, span->name);
+			fprintf(f, ",\"cat\":\"atom\",\"ph\":\"X\",\"ts\":%llu,"
+				"\"dur\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":",
+				(unsigned long long)span->start_us,
+				(unsigned long long)span->dur_us, pid, (int)entry->tid);
+			atom_trace_dump_json_str(f, span->detail);
+			fprintf(f, ",\"trace_id\":\"%016llx\",\"span_id\":\"%016llx\","
+				"\"parent_id\":\"%016llx\"}}",
+				(unsigned long long)span->trace_id,
+				(unsigned long long)span->span_id,
+				(unsigned long long)span->parent_id);
+			first = false;
+		}
+
+		if (clear) {
+			ring->head = 0;
+			ring->n_spans = 0;
+		}
+		pthread_mutex_unlock(&ring->lock);
+	}
+	pthread_mutex_unlock(&atom_trace_rings_lock);
+
+	fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+
+	return !ferror(f);
+}
+
+char *atom_trace_dump_str(
+	const char *process_name,
+	bool clear,
+	size_t *len)
+{
+	char *str = NULL;
+	size_t str_len = 0;
+	FILE *f;
+	bool ok;
+
+	f = open_memstream(&str, &str_len);
+	if (f == NULL) {
+		return NULL;
+	}
+	ok = atom_trace_dump(f, process_name, clear);
+	fclose(f);
+
+	if (!ok) {
+		free(str);
+		return NULL;
+	}
+	if (len != NULL) {
+		*len = str_len;
+	}
+	return str;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Publishes a dump on the element's trace stream
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t atom_trace_publish(
+	redisContext *ctx,
+	struct element *elem,
+	bool clear)
+{
+	enum atom_error_t ret = ATOM_INTERNAL_ERROR;
+	struct redis_xadd_info info;
+	char stream[ATOM_NAME_MAXLEN];
+	char *json = NULL;
+	size_t json_len = 0;
+
+	// Use this thread's cached connection if we weren't passed one
+	if ((ctx == NULL) && ((ctx = redis_context_thread()) == NULL)) {
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	json = atom_trace_dump_str(elem->name.str, clear, &json_len);
+	if (json == NULL) {
+		goto done;
+	}
+
+	atom_get_data_stream_str(elem->name.str, ATOM_TRACE_STREAM_NAME, stream);
+	info.key = ATOM_TRACE_STREAM_KEY_STR;
+	info.key_len = CONST_STRLEN(ATOM_TRACE_STREAM_KEY_STR);
+	info.data = (const uint8_t *)json;
+	info.data_len = json_len;
+
+	if (!redis_xadd(ctx, stream, &info, 1, ATOM_TRACE_STREAM_MAXLEN,
+		ATOM_DEFAULT_APPROX_MAXLEN, NULL))
+	{
+		atom_logf(ctx, elem, LOG_ERR, "Failed to publish trace");
+		ret = ATOM_REDIS_ERROR;
+		goto done;
+	}
+
+	ret = ATOM_NO_ERROR;
+
+done:
+	free(json);
+	return ret;
+}
+
+void atom_trace_clear(void)
+{
+	struct atom_trace_ring *ring;
+
+	pthread_mutex_lock(&atom_trace_rings_lock);
+	for (ring = atom_trace_rings; ring != NULL; ring = ring->next) {
+		pthread_mutex_lock(&ring->lock);
+		ring->head = 0;
+		ring->n_spans = 0;
+		pthread_mutex_unlock(&ring->lock);
+	}
+	pthread_mutex_unlock(&atom_trace_rings_lock);
+}
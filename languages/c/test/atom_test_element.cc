@@ -8,12 +8,23 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 #include <gtest/gtest.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <list>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
 #include <hiredis/hiredis.h>
 #include "atom.h"
 #include "redis.h"
 #include "element.h"
+#include "element_entry_write.h"
+#include "element_entry_read.h"
+#include "codec.h"
+#include "element_command_shm.h"
+#include "trace.h"
 
 //
 // Tests for valid element names
@@ -33,7 +44,7 @@ protected:
 
 	virtual void TearDown() {
 		element_cleanup(ctx, elem);
-		redisFree(ctx);
+		redis_context_cleanup(ctx);
 		ctx = NULL;
 		elem = NULL;
 	};
@@ -47,3 +58,426 @@ protected:
 TEST_F(AtomElementTest, setup_teardown) {
 	ASSERT_EQ(1, 1);
 }
+
+// Writes n entries of the size to the stream
+static void write_entries(
+	redisContext *ctx,
+	struct element_entry_write_info *info,
+	int n,
+	size_t size)
+{
+	std::string data(size, 'a');
+
+	info->items[0].key = "data";
+	info->items[0].key_len = 4;
+	info->items[0].data = (const uint8_t *)data.c_str();
+	info->items[0].data_len = data.size();
+
+	for (int i = 0; i < n; ++i) {
+		ASSERT_EQ(element_entry_write(ctx, info,
+			ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP, REDIS_XADD_NO_MAXLEN),
+			ATOM_NO_ERROR);
+	}
+}
+
+// Gets the length of the stream
+static long long stream_len(
+	redisContext *ctx,
+	struct element_entry_write_info *info)
+{
+	redisReply *reply = (redisReply *)redisCommand(ctx, "XLEN %s", info->stream);
+	long long len = reply->integer;
+	freeReplyObject(reply);
+	return len;
+}
+
+// Makes sure the stream is trimmed to about its byte budget. Trims are
+//	approximate s.t. up to a node's worth of extra entries can be left
+TEST_F(AtomElementTest, retention_bytes) {
+	struct element_entry_write_info *info =
+		element_entry_write_init(ctx, elem, "retention_bytes", 1);
+	info->retention.max_bytes = 100 * 1024;
+	info->retention.trim_every = 10;
+
+	write_entries(ctx, info, 1000, 1024);
+	EXPECT_GE(stream_len(ctx, info), 90);
+	EXPECT_LE(stream_len(ctx, info), 300);
+
+	element_entry_write_cleanup(ctx, info);
+}
+
+// Makes sure entries older than the window are trimmed
+TEST_F(AtomElementTest, retention_age) {
+	struct element_entry_write_info *info =
+		element_entry_write_init(ctx, elem, "retention_age", 1);
+	info->retention.max_age_ms = 100;
+	info->retention.trim_every = 1;
+
+	write_entries(ctx, info, 1000, 16);
+	usleep(200000);
+	write_entries(ctx, info, 1, 16);
+	EXPECT_LE(stream_len(ctx, info), 100);
+
+	element_entry_write_cleanup(ctx, info);
+}
+
+// Copies the data of the entry read
+static bool codec_read_cb(
+	const char *id,
+	const struct redis_xread_kv_item *kv_items,
+	int n_kv_items,
+	void *user_data)
+{
+	std::string *data = (std::string *)user_data;
+
+	if ((n_kv_items != 1) || !kv_items[0].found) {
+		return false;
+	}
+	data->assign(kv_items[0].reply->str, kv_items[0].reply->len);
+	return true;
+}
+
+// Makes sure values over the threshold are compressed with whichever codec
+//	is built in and read back as they were written. With neither built in
+//	they're written as they are, so CI runs this with ATOM_LZ4=1.
+TEST_F(AtomElementTest, codec_roundtrip) {
+	struct element_entry_write_info *info =
+		element_entry_write_init(ctx, elem, "codec", 1);
+	struct redis_xread_kv_item kv_item;
+	struct element_entry_read_info read_info;
+	std::string written, read;
+	bool compressed;
+
+	info->codec.type = atom_codec_supported(ATOM_CODEC_ZSTD) ?
+		ATOM_CODEC_ZSTD : ATOM_CODEC_LZ4;
+	compressed = atom_codec_supported(info->codec.type);
+
+	for (int i = 0; i < 64 * 1024; ++i) {
+		written.push_back('a' + ((i / 16) % 26));
+	}
+	info->items[0].key = "data";
+	info->items[0].key_len = 4;
+	info->items[0].data = (const uint8_t *)written.data();
+	info->items[0].data_len = written.size();
+	ASSERT_EQ(element_entry_write(ctx, info,
+		ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP, ELEMENT_DATA_WRITE_DEFAULT_MAXLEN),
+		ATOM_NO_ERROR);
+
+	// The caller's items are left alone
+	EXPECT_EQ(info->items[0].data, (const uint8_t *)written.data());
+
+	// What's stored is smaller if the codec is built in
+	redisReply *reply = (redisReply *)redisCommand(ctx,
+		"XREVRANGE %s + - COUNT 1", info->stream);
+	ASSERT_NE(reply, (redisReply *)NULL);
+	ASSERT_EQ(reply->elements, 1);
+	redisReply *kv = reply->element[0]->element[1];
+	ASSERT_GE(kv->elements, 2);
+	if (compressed) {
+		EXPECT_LT(kv->element[1]->len, written.size() / 4);
+	} else {
+		EXPECT_EQ(kv->element[1]->len, written.size());
+	}
+	freeReplyObject(reply);
+
+	kv_item.key = "data";
+	kv_item.key_len = 4;
+	read_info.element = "test_element";
+	read_info.stream = "codec";
+	read_info.kv_items = &kv_item;
+	read_info.n_kv_items = 1;
+	read_info.user_data = &read;
+	read_info.response_cb = codec_read_cb;
+	ASSERT_EQ(element_entry_read_n(ctx, elem, &read_info, 1), ATOM_NO_ERROR);
+	EXPECT_EQ(read, written);
+
+	element_entry_write_cleanup(ctx, info);
+}
+
+// Makes sure traced entries carry their trace context to readers and the
+//	spans on both ends make it into the dump
+TEST_F(AtomElementTest, trace_entry) {
+	struct element_entry_write_info *info =
+		element_entry_write_init(ctx, elem, "traced", 1);
+	struct redis_xread_kv_item kv_item;
+	struct element_entry_read_info read_info;
+	struct atom_trace_context context, parsed;
+	char value[ATOM_TRACE_VALUE_MAXLEN];
+	std::string written("hello"), read;
+
+	context.trace_id = 0x1234;
+	context.span_id = 0xabcd;
+	context.sent_us = 42;
+	ASSERT_TRUE(atom_trace_parse(value, atom_trace_value(&context, value), &parsed));
+	EXPECT_EQ(parsed.trace_id, context.trace_id);
+	EXPECT_EQ(parsed.span_id, context.span_id);
+	EXPECT_EQ(parsed.sent_us, context.sent_us);
+
+	atom_trace_enable(true);
+	atom_trace_clear();
+
+	info->items[0].key = "data";
+	info->items[0].key_len = 4;
+	info->items[0].data = (const uint8_t *)written.data();
+	info->items[0].data_len = written.size();
+	ASSERT_EQ(element_entry_write(ctx, info,
+		ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP, ELEMENT_DATA_WRITE_DEFAULT_MAXLEN),
+		ATOM_NO_ERROR);
+
+	redisReply *reply = (redisReply *)redisCommand(ctx,
+		"XREVRANGE %s + - COUNT 1", info->stream);
+	ASSERT_NE(reply, (redisReply *)NULL);
+	ASSERT_EQ(reply->elements, 1);
+	EXPECT_TRUE(atom_trace_find(reply->element[0]->element[1], &parsed));
+	freeReplyObject(reply);
+
+	kv_item.key = "data";
+	kv_item.key_len = 4;
+	read_info.element = "test_element";
+	read_info.stream = "traced";
+	read_info.kv_items = &kv_item;
+	read_info.n_kv_items = 1;
+	read_info.user_data = &read;
+	read_info.response_cb = codec_read_cb;
+	ASSERT_EQ(element_entry_read_n(ctx, elem, &read_info, 1), ATOM_NO_ERROR);
+	EXPECT_EQ(read, written);
+
+	char *json = atom_trace_dump_str("test_element", true, NULL);
+	ASSERT_NE(json, (char *)NULL);
+	EXPECT_NE(strstr(json, "\"traceEvents\""), (char *)NULL);
+	EXPECT_NE(strstr(json, "\"entry_write\""), (char *)NULL);
+	EXPECT_NE(strstr(json, "\"entry_read\""), (char *)NULL);
+	free(json);
+
+	atom_trace_enable(false);
+	element_entry_write_cleanup(ctx, info);
+}
+
+// Echoes the command data back, repeated s.t. responses can be made
+//	bigger than a channel slot
+static int echo_cb(
+	uint8_t *data,
+	size_t data_len,
+	uint8_t **response,
+	size_t *response_len,
+	char **error_str,
+	void *user_data,
+	void **cleanup_ptr)
+{
+	size_t repeat = *(size_t *)user_data;
+
+	*response = (uint8_t *)malloc(data_len * repeat);
+	*response_len = data_len * repeat;
+	for (size_t i = 0; i < repeat; ++i) {
+		memcpy(*response + (i * data_len), data, data_len);
+	}
+	return 0;
+}
+
+// Takes longer than the channel can go without a heartbeat
+static int slow_cb(
+	uint8_t *data,
+	size_t data_len,
+	uint8_t **response,
+	size_t *response_len,
+	char **error_str,
+	void *user_data,
+	void **cleanup_ptr)
+{
+	usleep((ELEMENT_COMMAND_SHM_STALE_MS + 500) * 1000);
+	return 0;
+}
+
+static bool echo_response_cb(
+	const uint8_t *response,
+	size_t response_len,
+	void *user_data)
+{
+	((std::string *)user_data)->assign((const char *)response, response_len);
+	return true;
+}
+
+// Makes sure commands between elements on the same host go over the
+//	shared-memory channel once it's up, with no command loop running
+TEST_F(AtomElementTest, command_shm_channel) {
+	size_t repeat = 1;
+	std::string data("hello"), response;
+	struct element *caller = element_init(ctx, "test_caller");
+	ASSERT_NE(caller, (struct element *)NULL);
+
+	ASSERT_TRUE(element_command_add(elem, "echo", echo_cb, NULL, &repeat, 1000));
+	ASSERT_EQ(element_command_shm_start(ctx, elem), ATOM_NO_ERROR);
+
+	redisReply *reply = (redisReply *)redisCommand(ctx, "GET %s",
+		ELEMENT_COMMAND_SHM_KEY_PREFIX "test_element");
+	ASSERT_NE(reply, (redisReply *)NULL);
+	EXPECT_EQ(reply->type, REDIS_REPLY_STRING);
+	freeReplyObject(reply);
+
+	ASSERT_EQ(element_command_send(ctx, caller, "test_element", "echo",
+		(const uint8_t *)data.data(), data.size(), true,
+		echo_response_cb, &response, NULL), ATOM_NO_ERROR);
+	EXPECT_EQ(response, data);
+
+	// Responses bigger than a slot are handed over too
+	repeat = (2 * ELEMENT_COMMAND_SHM_SLOT_DATA_LEN) / data.size();
+	ASSERT_EQ(element_command_send(ctx, caller, "test_element", "echo",
+		(const uint8_t *)data.data(), data.size(), true,
+		echo_response_cb, &response, NULL), ATOM_NO_ERROR);
+	ASSERT_EQ(response.size(), data.size() * repeat);
+	EXPECT_EQ(response.compare(response.size() - data.size(), data.size(), data), 0);
+
+	EXPECT_EQ(element_command_send(ctx, caller, "test_element", "missing",
+		NULL, 0, true, NULL, NULL, NULL), ATOM_COMMAND_UNSUPPORTED);
+
+	// Traced commands carry the trace over the channel, with the same
+	//	steps on both ends as over redis
+	repeat = 1;
+	atom_trace_enable(true);
+	atom_trace_clear();
+	ASSERT_EQ(element_command_send(ctx, caller, "test_element", "echo",
+		(const uint8_t *)data.data(), data.size(), true,
+		echo_response_cb, &response, NULL), ATOM_NO_ERROR);
+	char *json = atom_trace_dump_str("test_element", true, NULL);
+	ASSERT_NE(json, (char *)NULL);
+	for (const char *span : {"\"command_send\"", "\"shm_request\"",
+		"\"ack_wait\"", "\"response_wait\"", "\"queue_wait\"",
+		"\"command_handle\"", "\"handler\""})
+	{
+		EXPECT_NE(strstr(json, span), (char *)NULL) << span;
+	}
+	EXPECT_EQ(strstr(json, "\"xadd\""), (char *)NULL);
+	free(json);
+	atom_trace_enable(false);
+
+	// A handler that runs past the stale time shouldn't make the caller
+	//	give up on the channel, which would leave it with no response
+	ASSERT_TRUE(element_command_add(elem, "slow", slow_cb, NULL, NULL,
+		2 * ELEMENT_COMMAND_SHM_STALE_MS));
+	EXPECT_EQ(element_command_send(ctx, caller, "test_element", "slow",
+		NULL, 0, true, NULL, NULL, NULL), ATOM_NO_ERROR);
+
+	element_command_shm_stop(ctx, elem);
+	element_cleanup(ctx, caller);
+}
+
+// Counts its runs. The first one also holds up the serving thread for a
+//	bit s.t. the commands after it pile up in the slots.
+static int counting_cb(
+	uint8_t *data,
+	size_t data_len,
+	uint8_t **response,
+	size_t *response_len,
+	char **error_str,
+	void *user_data,
+	void **cleanup_ptr)
+{
+	if (__atomic_fetch_add((int *)user_data, 1, __ATOMIC_RELAXED) == 0) {
+		usleep(500 * 1000);
+	}
+	return 0;
+}
+
+// Stops the whole process, heartbeat and all, the first time the server
+//	takes a request and before it acks it
+static void stall_first_received(void)
+{
+	static bool stalled = false;
+
+	if (!stalled) {
+		stalled = true;
+		raise(SIGSTOP);
+	}
+}
+
+// Makes sure a request the caller gave up on between being received and
+//	acked isn't run by the server once it comes back, and that its slot
+//	is freed s.t. all of them can be used at once
+TEST_F(AtomElementTest, command_shm_stalled_before_ack) {
+	int ready[2], done[2];
+	int counts[2] = {-1, -1};
+	char byte = 0;
+
+	ASSERT_EQ(pipe(ready), 0);
+	ASSERT_EQ(pipe(done), 0);
+
+	pid_t pid = fork();
+	ASSERT_GE(pid, 0);
+	if (pid == 0) {
+		int stalled_runs = 0, runs = 0;
+		redisContext *srv_ctx = redisConnectUnix("/shared/redis.sock");
+		struct element *srv = element_init(srv_ctx, "test_stalled");
+
+		element_command_add(srv, "stalled", counting_cb, NULL,
+			&stalled_runs, 1000);
+		element_command_add(srv, "count", counting_cb, NULL, &runs, 5000);
+		element_command_shm_received_hook = stall_first_received;
+		element_command_shm_start(srv_ctx, srv);
+		if ((write(ready[1], &byte, 1) != 1) ||
+			(read(done[0], &byte, 1) != 1))
+		{
+			_exit(1);
+		}
+
+		counts[0] = __atomic_load_n(&stalled_runs, __ATOMIC_RELAXED);
+		counts[1] = __atomic_load_n(&runs, __ATOMIC_RELAXED);
+		if (write(ready[1], counts, sizeof(counts)) != sizeof(counts)) {
+			_exit(1);
+		}
+
+		element_command_shm_stop(srv_ctx, srv);
+		element_cleanup(srv_ctx, srv);
+		redisFree(srv_ctx);
+		_exit(0);
+	}
+	ASSERT_EQ(read(ready[0], &byte, 1), 1);
+
+	// The server stops before acking, so once it goes quiet the caller
+	//	gives up on the channel and sends the command over redis, where
+	//	nothing's listening
+	struct element *caller = element_init(ctx, "test_caller");
+	ASSERT_NE(caller, (struct element *)NULL);
+	uint64_t start_ms = redis_monotonic_ms();
+	element_command_send(ctx, caller, "test_stalled", "stalled", NULL, 0,
+		false, NULL, NULL, NULL);
+	EXPECT_GE(redis_monotonic_ms() - start_ms, ELEMENT_COMMAND_SHM_STALE_MS);
+
+	ASSERT_EQ(kill(pid, SIGCONT), 0);
+	usleep(2 * ELEMENT_COMMAND_SHM_HEARTBEAT_MS * 1000);
+
+	// Fill every slot at once from a caller that hasn't seen the channel
+	//	go quiet. If the abandoned slot were stuck one of these would go
+	//	over redis and get no ACK.
+	struct element *caller2 = element_init(ctx, "test_caller2");
+	ASSERT_NE(caller2, (struct element *)NULL);
+	std::vector<enum atom_error_t> rets(ELEMENT_COMMAND_SHM_N_SLOTS,
+		ATOM_INTERNAL_ERROR);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < rets.size(); ++i) {
+		threads.emplace_back([&rets, caller2, i]() {
+			redisContext *thread_ctx = redisConnectUnix("/shared/redis.sock");
+			rets[i] = element_command_send(thread_ctx, caller2, "test_stalled",
+				"count", NULL, 0, true, NULL, NULL, NULL);
+			redisFree(thread_ctx);
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	for (auto ret : rets) {
+		EXPECT_EQ(ret, ATOM_NO_ERROR);
+	}
+
+	ASSERT_EQ(write(done[1], &byte, 1), 1);
+	ASSERT_EQ(read(ready[0], counts, sizeof(counts)), (ssize_t)sizeof(counts));
+	waitpid(pid, NULL, 0);
+	EXPECT_EQ(counts[0], 0);
+	EXPECT_EQ(counts[1], ELEMENT_COMMAND_SHM_N_SLOTS);
+
+	element_cleanup(ctx, caller2);
+	element_cleanup(ctx, caller);
+	close(ready[0]);
+	close(ready[1]);
+	close(done[0]);
+	close(done[1]);
+}
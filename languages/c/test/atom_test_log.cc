@@ -0,0 +1,98 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file atom_test_log.cc
+//
+//  @brief Tests for logging through the background log shipper
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <gtest/gtest.h>
+#include <string.h>
+#include <string>
+#include <hiredis/hiredis.h>
+#include "atom.h"
+#include "redis.h"
+
+#define N_LOGS 100
+
+class AtomLogTest : public testing::Test {
+
+protected:
+	redisContext *ctx;
+
+	virtual void SetUp() {
+		ctx = redis_context_init();
+		ASSERT_NE(ctx, (void*)NULL);
+	};
+
+	virtual void TearDown() {
+		redis_context_cleanup(ctx);
+	};
+};
+
+// Makes sure logs make it to the log stream in order once flushed
+TEST_F(AtomLogTest, shipped_in_order) {
+	std::string prefix = "shipped_in_order " + std::to_string(getpid()) + " ";
+	struct atom_log_stats before, after;
+	redisReply *reply;
+
+	atom_log_get_stats(&before);
+	for (int i = 0; i < N_LOGS; ++i) {
+		ASSERT_EQ(atom_logf(NULL, NULL, LOG_INFO, "%s%d", prefix.c_str(), i),
+			ATOM_NO_ERROR);
+	}
+	ASSERT_EQ(atom_log_flush(0), ATOM_NO_ERROR);
+	atom_log_get_stats(&after);
+	EXPECT_EQ(after.queued - before.queued, N_LOGS);
+	EXPECT_EQ(after.shipped - before.shipped, N_LOGS);
+	EXPECT_EQ(after.dropped_error, before.dropped_error);
+
+	// Read back the newest entries, they should be ours in reverse order
+	reply = (redisReply *)redisCommand(ctx, "XREVRANGE %s + - COUNT %d",
+		ATOM_LOG_STREAM_NAME, N_LOGS);
+	ASSERT_NE(reply, (redisReply *)NULL);
+	ASSERT_EQ(reply->type, REDIS_REPLY_ARRAY);
+	ASSERT_EQ(reply->elements, N_LOGS);
+
+	for (int i = 0; i < N_LOGS; ++i) {
+		redisReply *kv = reply->element[i]->element[1];
+		std::string msg;
+
+		ASSERT_EQ(kv->elements, 2 * LOG_N_KEYS);
+		for (size_t j = 0; j < kv->elements; j += 2) {
+			if (strcmp(kv->element[j]->str, LOG_KEY_MESSAGE_STR) == 0) {
+				msg = std::string(kv->element[j + 1]->str, kv->element[j + 1]->len);
+			}
+		}
+		EXPECT_EQ(msg, prefix + std::to_string(N_LOGS - 1 - i));
+	}
+
+	freeReplyObject(reply);
+}
+
+// Makes sure sampling drops all but 1 in every_n logs at the level
+TEST_F(AtomLogTest, sampling) {
+	struct atom_log_stats before, after;
+
+	ASSERT_EQ(atom_log_set_sampling(LOG_DEBUG, 4), ATOM_NO_ERROR);
+
+	atom_log_get_stats(&before);
+	for (int i = 0; i < N_LOGS; ++i) {
+		ASSERT_EQ(atom_logf(NULL, NULL, LOG_DEBUG, "sampling %d", i), ATOM_NO_ERROR);
+	}
+	ASSERT_EQ(atom_log_flush(0), ATOM_NO_ERROR);
+	atom_log_get_stats(&after);
+
+	EXPECT_EQ(after.dropped_sampled - before.dropped_sampled, N_LOGS - (N_LOGS / 4));
+	EXPECT_EQ(after.queued - before.queued, N_LOGS / 4);
+
+	ASSERT_EQ(atom_log_set_sampling(LOG_DEBUG, 1), ATOM_NO_ERROR);
+}
+
+// Makes sure invalid levels are rejected
+TEST_F(AtomLogTest, invalid_level) {
+	EXPECT_EQ(atom_logf(NULL, NULL, LOG_DEBUG + 1, "invalid"), ATOM_COMMAND_INVALID_DATA);
+	EXPECT_EQ(atom_logf(NULL, NULL, LOG_EMERG - 1, "invalid"), ATOM_COMMAND_INVALID_DATA);
+	EXPECT_EQ(atom_log_set_sampling(LOG_DEBUG + 1, 2), ATOM_COMMAND_INVALID_DATA);
+}
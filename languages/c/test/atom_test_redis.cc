@@ -9,7 +9,9 @@
 ////////////////////////////////////////////////////////////////////////////////
 #include <gtest/gtest.h>
 #include <string.h>
+#include <unistd.h>
 #include <list>
+#include <thread>
 #include <hiredis/hiredis.h>
 #include "atom.h"
 #include "redis.h"
@@ -43,7 +45,7 @@ protected:
 			ASSERT_NE(reply, (redisReply*)NULL) << "Redis doesn't seem to be working...";
 			EXPECT_NE(reply->type, REDIS_REPLY_ERROR);
 		}
-		redisFree(ctx);
+		redis_context_cleanup(ctx);
 		atom_list_free(atom_list);
 	};
 
@@ -239,3 +241,185 @@ TEST_F(AtomRedisTest, multiple_streams_multiple_elements_with_filter) {
 		"hello"
 	});
 }
+
+// Tests that registered elements and streams are found without a SCAN and
+//	unregistered ones only with the SCAN fallback
+TEST_F(AtomRedisTest, registry) {
+	add_element("registered_elem");
+	add_element("unregistered_elem");
+	add_data_stream("registered_elem", "registered_data");
+	add_data_stream("registered_elem", "unregistered_data");
+	ASSERT_EQ(atom_register_element(ctx, "registered_elem", true), ATOM_NO_ERROR);
+	ASSERT_EQ(atom_register_data_stream(ctx,
+		"stream:registered_elem:registered_data", true), ATOM_NO_ERROR);
+
+	// Registered but without a command stream, so should be skipped
+	ASSERT_EQ(atom_register_element(ctx, "stale_elem", true), ATOM_NO_ERROR);
+
+	EXPECT_EQ(atom_get_all_elements(ctx, &atom_list), ATOM_NO_ERROR);
+	check_list(atom_list, std::vector<std::string>{"registered_elem"});
+	atom_list_free(atom_list);
+	atom_list = NULL;
+
+	EXPECT_EQ(atom_get_all_data_streams(ctx, "registered_elem", &atom_list), ATOM_NO_ERROR);
+	check_list(atom_list, std::vector<std::string>{"registered_data"});
+	atom_list_free(atom_list);
+	atom_list = NULL;
+
+	// With the fallback on, the unregistered ones show up too
+	setenv(ATOM_DISCOVERY_SCAN_ENV, "1", 1);
+	EXPECT_EQ(atom_get_all_elements(ctx, &atom_list), ATOM_NO_ERROR);
+	check_list(atom_list, std::vector<std::string>{
+		"registered_elem",
+		"unregistered_elem",
+	});
+	atom_list_free(atom_list);
+	atom_list = NULL;
+	unsetenv(ATOM_DISCOVERY_SCAN_ENV);
+
+	EXPECT_EQ(atom_register_element(ctx, "registered_elem", false), ATOM_NO_ERROR);
+	EXPECT_EQ(atom_register_element(ctx, "stale_elem", false), ATOM_NO_ERROR);
+	EXPECT_EQ(atom_register_data_stream(ctx,
+		"stream:registered_elem:registered_data", false), ATOM_NO_ERROR);
+}
+
+// Makes sure each thread gets its own cached connection and keeps it
+TEST(AtomRedisThreadContextTest, cached_per_thread) {
+	redisContext *ctx, *other_ctx = NULL;
+
+	ctx = redis_context_thread();
+	ASSERT_NE(ctx, (redisContext *)NULL);
+	EXPECT_EQ(redis_context_thread(), ctx);
+
+	std::thread other([&other_ctx]() {
+		other_ctx = redis_context_thread();
+	});
+	other.join();
+	EXPECT_NE(other_ctx, (redisContext *)NULL);
+	EXPECT_NE(other_ctx, ctx);
+
+	// An errored connection gets replaced
+	ctx->err = REDIS_ERR_EOF;
+	ctx = redis_context_thread();
+	ASSERT_NE(ctx, (redisContext *)NULL);
+	EXPECT_EQ(ctx->err, 0);
+}
+
+// Makes sure calls without a context use the thread's cached connection
+TEST(AtomRedisThreadContextTest, null_context) {
+	struct atom_list_node *list = NULL;
+
+	EXPECT_EQ(atom_get_all_elements(NULL, &list), ATOM_NO_ERROR);
+	atom_list_free(list);
+}
+
+// Makes sure a context whose connection was killed can be reconnected
+//	in place
+TEST(AtomRedisReconnectTest, reconnect_in_place) {
+	struct redis_reconnect_stats before, after;
+	redisContext *ctx, *killer;
+	redisReply *reply;
+	long long id;
+
+	ctx = redis_context_init();
+	killer = redis_context_init();
+	ASSERT_NE(ctx, (redisContext *)NULL);
+	ASSERT_NE(killer, (redisContext *)NULL);
+
+	reply = (redisReply *)redisCommand(ctx, "CLIENT ID");
+	ASSERT_NE(reply, (redisReply *)NULL);
+	ASSERT_EQ(reply->type, REDIS_REPLY_INTEGER);
+	id = reply->integer;
+	freeReplyObject(reply);
+
+	// Kill it from the other connection
+	reply = (redisReply *)redisCommand(killer, "CLIENT KILL ID %lld", id);
+	ASSERT_NE(reply, (redisReply *)NULL);
+	freeReplyObject(reply);
+
+	reply = (redisReply *)redisCommand(ctx, "PING");
+	EXPECT_EQ(reply, (redisReply *)NULL);
+	ASSERT_NE(ctx->err, 0);
+
+	redis_get_reconnect_stats(&before);
+	ASSERT_TRUE(redis_context_reconnect(ctx, REDIS_RECONNECT_DEFAULT_TIMEOUT_MS));
+	redis_get_reconnect_stats(&after);
+	EXPECT_EQ(after.n_reconnects, before.n_reconnects + 1);
+	EXPECT_EQ(ctx->err, 0);
+
+	reply = (redisReply *)redisCommand(ctx, "PING");
+	ASSERT_NE(reply, (redisReply *)NULL);
+	EXPECT_EQ(reply->type, REDIS_REPLY_STATUS);
+	freeReplyObject(reply);
+
+	redis_context_cleanup(killer);
+	redis_context_cleanup(ctx);
+}
+
+// Makes sure the clock offset gives the server's time without asking it
+TEST(AtomRedisClockTest, server_time) {
+	struct redis_clock clock;
+	redisContext *ctx;
+	redisReply *reply;
+	uint64_t server_ms, local_ms, now_ms;
+
+	ctx = redis_context_init();
+	ASSERT_NE(ctx, (redisContext *)NULL);
+	ASSERT_TRUE(redis_clock_sync(ctx));
+	ASSERT_TRUE(redis_clock_get(NULL, &clock));
+	EXPECT_TRUE(clock.valid);
+
+	reply = (redisReply *)redisCommand(ctx, "TIME");
+	ASSERT_NE(reply, (redisReply *)NULL);
+	ASSERT_EQ(reply->type, REDIS_REPLY_ARRAY);
+	ASSERT_TRUE(redis_clock_server_ms(NULL, &server_ms));
+	now_ms = (strtoull(reply->element[0]->str, NULL, 10) * 1000) +
+		(strtoull(reply->element[1]->str, NULL, 10) / 1000);
+	freeReplyObject(reply);
+	EXPECT_LE((server_ms > now_ms) ? server_ms - now_ms : now_ms - server_ms, 5);
+
+	// An entry written now is about now on the local clock
+	reply = (redisReply *)redisCommand(ctx, "XADD clock_test * k v");
+	ASSERT_NE(reply, (redisReply *)NULL);
+	ASSERT_EQ(reply->type, REDIS_REPLY_STRING);
+	ASSERT_TRUE(redis_clock_id_to_monotonic_ms(NULL, reply->str, &local_ms));
+	freeReplyObject(reply);
+	now_ms = redis_monotonic_ms();
+	EXPECT_LE((local_ms > now_ms) ? local_ms - now_ms : now_ms - local_ms, 5);
+
+	reply = (redisReply *)redisCommand(ctx, "DEL clock_test");
+	freeReplyObject(reply);
+	redis_context_cleanup(ctx);
+}
+
+// Makes sure each context keeps its own offset and drops it on cleanup
+TEST(AtomRedisClockTest, per_context) {
+	struct redis_clock first_clock, second_clock, clock;
+	redisContext *first, *second;
+
+	first = redis_context_init();
+	ASSERT_NE(first, (redisContext *)NULL);
+	second = redis_context_init();
+	ASSERT_NE(second, (redisContext *)NULL);
+
+	ASSERT_TRUE(redis_clock_sync(first));
+	ASSERT_TRUE(redis_clock_get(first, &first_clock));
+	usleep(2000);
+	ASSERT_TRUE(redis_clock_get(second, &second_clock));
+	EXPECT_GT(second_clock.synced_ms, first_clock.synced_ms);
+
+	// Getting it again doesn't measure it again
+	ASSERT_TRUE(redis_clock_get(first, &clock));
+	EXPECT_EQ(clock.synced_ms, first_clock.synced_ms);
+	EXPECT_EQ(clock.offset_us, first_clock.offset_us);
+
+	// Without a context it's whichever was measured last
+	ASSERT_TRUE(redis_clock_get(NULL, &clock));
+	EXPECT_EQ(clock.synced_ms, second_clock.synced_ms);
+	EXPECT_EQ(clock.offset_us, second_clock.offset_us);
+
+	redis_context_cleanup(second);
+	ASSERT_TRUE(redis_clock_get(NULL, &clock));
+	EXPECT_EQ(clock.synced_ms, first_clock.synced_ms);
+	redis_context_cleanup(first);
+}
@@ -0,0 +1,92 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file bench_element.cc
+//
+//  @brief Benchmarks for the C++ element API
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "element.h"
+#include "element_response.h"
+#include "bench_redis.h"
+
+using namespace atom;
+
+// Command that echoes its msgpack string request back
+class BenchEcho : public CommandMsgpack<std::string, std::string> {
+public:
+	using CommandMsgpack<std::string, std::string>::CommandMsgpack;
+
+	virtual bool validate() { return true; }
+
+	virtual bool run() {
+		res_data->assign(*req_data);
+		return true;
+	}
+};
+
+// Tells the command server to stop
+static bool benchStopFn(
+	const uint8_t *data,
+	size_t data_len,
+	ElementResponse *resp,
+	void *user_data)
+{
+	((std::atomic<bool> *)user_data)->store(true);
+	return true;
+}
+
+// Handles commands until told to stop
+static void benchCommandServer(
+	Element *server,
+	std::atomic<bool> *stop)
+{
+	while (!stop->load()) {
+		server->commandLoop(1);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Msgpack command round trip through Element::sendCommand
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_SendCommandMsgpack(
+	benchmark::State &state)
+{
+	std::string req(state.range(0), 'a');
+	std::string res;
+	std::atomic<bool> stop(false);
+
+	// Set up the server before starting it s.t. it sees every command
+	Element server("bench_cpp_server");
+	server.addCommand(new BenchEcho("echo", "echoes the request", 1000));
+	server.addCommand("stop", "stops the server", benchStopFn, &stop, 1000);
+	std::thread server_thread(benchCommandServer, &server, &stop);
+
+	Element client("bench_cpp_client");
+
+	for (auto _ : state) {
+		ElementResponse response;
+		if (client.sendCommand<std::string, std::string>(
+			response, "bench_cpp_server", "echo", req, res) != ATOM_NO_ERROR)
+		{
+			state.SkipWithError("Command failed");
+			break;
+		}
+	}
+
+	ElementResponse response;
+	client.sendCommand(response, "bench_cpp_server", "stop", NULL, 0, false);
+	server_thread.join();
+
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SendCommandMsgpack)
+	->RangeMultiplier(BENCH_SIZE_MULTIPLIER)
+	->Range(BENCH_MIN_SIZE, BENCH_MAX_SIZE);
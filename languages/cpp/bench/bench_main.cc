@@ -0,0 +1,14 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file bench_main.cc
+//
+//  @brief Runs the C++ benchmarks against a throwaway redis-server
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <benchmark/benchmark.h>
+#include "atom/redis.h"
+#include "bench_redis.h"
+
+ATOM_BENCHMARK_MAIN();
@@ -0,0 +1,173 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file bench_serialization.cc
+//
+//  @brief Benchmarks for command serialization. Compares packing through a
+//			std::stringstream (the old path) against the reusable
+//			per-thread sbuffer, counting heap allocations (malloc, calloc
+//			and realloc) per call
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include "element.h"
+#include "element_response.h"
+#include "serialization.h"
+#include "bench_redis.h"
+
+using namespace atom;
+
+// Counts heap allocations made by the process s.t. each benchmark can
+//	report how many allocations it makes per iteration. malloc, calloc
+//	and realloc are interposed rather than operator new since msgpack's
+//	sbuffer grows with realloc, and operator new ends up in malloc anyway.
+//	Forwards to glibc's own allocator.
+static std::atomic<size_t> n_allocs(0);
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n_memb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) noexcept
+{
+	n_allocs.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n_memb, size_t size) noexcept
+{
+	n_allocs.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(n_memb, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept
+{
+	n_allocs.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+}
+
+// Adds the allocation counter to the benchmark
+static void reportAllocs(
+	benchmark::State &state,
+	size_t start)
+{
+	state.counters["allocs"] =
+		(double)(n_allocs.load() - start) / state.iterations();
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Old request path: pack into a stringstream, seek to get the size
+//			and copy it out with str()
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_SerializeStringstream(
+	benchmark::State &state)
+{
+	std::string payload(state.range(0), 'a');
+	size_t start = n_allocs.load();
+
+	for (auto _ : state) {
+		std::stringstream buffer;
+		msgpack::pack(buffer, payload);
+		buffer.seekg(0, buffer.end);
+		size_t len = (size_t)buffer.tellg();
+		buffer.seekg(0, buffer.beg);
+		std::string data = buffer.str();
+		benchmark::DoNotOptimize(data.c_str());
+		benchmark::DoNotOptimize(len);
+	}
+
+	reportAllocs(state, start);
+}
+BENCHMARK(BM_SerializeStringstream)
+	->RangeMultiplier(BENCH_SIZE_MULTIPLIER)
+	->Range(BENCH_MIN_SIZE, BENCH_MAX_SIZE);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief New request path: pack into the per-thread sbuffer and pass
+//			the pointer and length along
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_SerializeThreadBuffer(
+	benchmark::State &state)
+{
+	std::string payload(state.range(0), 'a');
+	size_t start = n_allocs.load();
+
+	for (auto _ : state) {
+		msgpack::sbuffer &buffer = serializationBuffer();
+		SerializedView view;
+		SerializeMsgpack::serialize(payload, buffer, view);
+		benchmark::DoNotOptimize(view.data(buffer));
+	}
+
+	reportAllocs(state, start);
+}
+BENCHMARK(BM_SerializeThreadBuffer)
+	->RangeMultiplier(BENCH_SIZE_MULTIPLIER)
+	->Range(BENCH_MIN_SIZE, BENCH_MAX_SIZE);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Old response path: pack into a stringstream and copy the string
+//			into the response
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_ResponseStringstream(
+	benchmark::State &state)
+{
+	std::string payload(state.range(0), 'a');
+	size_t start = n_allocs.load();
+
+	for (auto _ : state) {
+		ElementResponse response;
+		std::stringstream buffer;
+		msgpack::pack(buffer, payload);
+		response.setData(buffer.str());
+		benchmark::DoNotOptimize(response.getDataPtr());
+	}
+
+	reportAllocs(state, start);
+}
+BENCHMARK(BM_ResponseStringstream)
+	->RangeMultiplier(BENCH_SIZE_MULTIPLIER)
+	->Range(BENCH_MIN_SIZE, BENCH_MAX_SIZE);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief New response path: pack into the per-thread sbuffer and have the
+//			response reference it
+//
+////////////////////////////////////////////////////////////////////////////////
+static void BM_ResponseThreadBuffer(
+	benchmark::State &state)
+{
+	std::string payload(state.range(0), 'a');
+	size_t start = n_allocs.load();
+
+	for (auto _ : state) {
+		ElementResponse response;
+		msgpack::sbuffer &buffer = serializationBuffer();
+		SerializedView view;
+		SerializeMsgpack::serialize(payload, buffer, view);
+		response.setDataRef(view.data(buffer), view.len);
+		benchmark::DoNotOptimize(response.getDataPtr());
+	}
+
+	reportAllocs(state, start);
+}
+BENCHMARK(BM_ResponseThreadBuffer)
+	->RangeMultiplier(BENCH_SIZE_MULTIPLIER)
+	->Range(BENCH_MIN_SIZE, BENCH_MAX_SIZE);
@@ -3,7 +3,8 @@
 //  @file command.h
 //
 //  @brief Implements easy command class. Optionally can use
-//			msgpack serialization and deserialization.
+//			msgpack (or any other serialization policy) for serialization
+//			and deserialization.
 //
 //  @copy 2018 Elementary Robotics. All rights reserved.
 //
@@ -11,10 +12,12 @@
 #ifndef __ELEMENT_COMMAND_H
 #define __ELEMENT_COMMAND_H
 
-#include <sstream>
 #include <msgpack.hpp>
 #include <iostream>
+#include <atomic>
+#include <vector>
 #include "element_response.h"
+#include "serialization.h"
 
 namespace atom {
 
@@ -32,9 +35,72 @@ typedef bool (*command_handler_t)(
 // Default command timeout of 1s
 #define COMMAND_DEFAULT_TIMEOUT_MS 1000
 
+// Default number of workers that can run a command at once
+#define COMMAND_DEFAULT_WORKERS 1
+
+class Command;
+
+// Per-call state of a command. Each worker running the command gets its
+//	own context from the command's pool and it's reset in place between
+//	calls s.t. handling a command doesn't allocate.
+class CommandContext {
+public:
+	Command *cmd;
+	ElementResponse response;
+	std::atomic<bool> in_use;
+	bool pooled;
+
+	CommandContext() : cmd(NULL), in_use(false), pooled(true) {}
+
+	virtual ~CommandContext() {}
+
+	// Resets the state for the next call
+	virtual void reset() { response.reset(); }
+};
+
+// Resets a value for the next call. Strings and vectors are
+//	cleared s.t. they keep their memory
+template <typename T>
+inline void commandResetValue(T &value) { value = T(); }
+inline void commandResetValue(std::string &value) { value.clear(); }
+template <typename T>
+inline void commandResetValue(std::vector<T> &value) { value.clear(); }
+
+// Handle to a piece of a command's per-call state. Resolves to the state
+//	of the call being handled on the current thread s.t. handlers can use
+//	req_data, res_data and response like plain pointers while multiple
+//	workers run the same command.
+template <class Ctx, class T, T Ctx::*member>
+class CommandData {
+	Command *cmd;
+
+public:
+	explicit CommandData(Command *c) : cmd(c) {}
+
+	T *get() const;
+	T &operator*() const { return *get(); }
+	T *operator->() const { return get(); }
+	operator T*() const { return get(); }
+};
+
 // Base command class. Virtual deserialize and serialize
 //	functions MUST be implemented by any inheriting class
 class Command {
+	std::vector<CommandContext*> contexts;
+	size_t n_workers;
+
+	// Context of the call being handled on this thread, if any
+	static CommandContext *&boundContext() {
+		static thread_local CommandContext *ctx = NULL;
+		return ctx;
+	}
+
+protected:
+
+	// Makes a new context. Commands with more per-call state
+	//	than the response override this
+	virtual CommandContext *newContext() { return new CommandContext(); }
+
 public:
 
 	std::string name;
@@ -43,31 +109,27 @@ public:
 	int timeout_ms;
 
 	Element *elem;
-	ElementResponse *response;
+	CommandData<CommandContext, ElementResponse, &CommandContext::response> response;
 
 	// Constructor takes a name, description and timeout
 	Command(
 		std::string n,
 		std::string d,
 		int t = COMMAND_DEFAULT_TIMEOUT_MS) :
+		n_workers(COMMAND_DEFAULT_WORKERS),
 		name(n),
 		desc(d),
 		timeout_ms(t),
 		elem(NULL),
-		response(NULL)
-	{
-		// Call the _init() function so that we, by default
-		//	have request and response data
-		_init();
-	}
+		response(this) {}
 
 	// Virtual destructor. This is s.t. the derived classes
 	//	can be properly destroyed
 	virtual ~Command()
 	{
-		// Call the _cleanup() function since we created
-		//	memory in the _init() function
-		_cleanup();
+		for (auto ctx : contexts) {
+			delete ctx;
+		}
 	}
 
 	// Add an element to the command
@@ -75,31 +137,79 @@ public:
 		elem = element;
 	}
 
+	// Sets how many workers can run the command at once without
+	//	allocating. Must be called before the command is added to
+	//	an element.
+	void setWorkers(size_t n) {
+		n_workers = (n != 0) ? n : 1;
+	}
+
+	// Allocates the pool of contexts. Called when the command is
+	//	added to an element
+	void prepareContexts() {
+		while (contexts.size() < n_workers) {
+			CommandContext *ctx = newContext();
+			ctx->cmd = this;
+			contexts.push_back(ctx);
+		}
+	}
+
+	// Gets the context of the call being handled on this thread. Outside
+	//	of a call this is the first context in the pool.
+	CommandContext *context() {
+		CommandContext *ctx = boundContext();
+		if ((ctx != NULL) && (ctx->cmd == this)) {
+			return ctx;
+		}
+		prepareContexts();
+		return contexts[0];
+	}
+
 	// Virtual init function. Do anything the
 	//	class needs to do on a once-per-call basis
 	virtual void init() { return; }
 
-	// Set up function for each time we get
-	//	a callback. Will call the inherited
-	//	class's setup as well
-	void _init() {
-		_cleanup();
-		response = new ElementResponse();
+	// Starts a call. Claims a free context from the pool without locking,
+	//	resets it and binds it to this thread. If every context is busy
+	//	then a temporary one is allocated for the call.
+	CommandContext *_begin() {
+		CommandContext *ctx = NULL;
+
+		for (auto c : contexts) {
+			bool expected = false;
+			if (c->in_use.compare_exchange_strong(expected, true,
+				std::memory_order_acquire))
+			{
+				ctx = c;
+				break;
+			}
+		}
+		if (ctx == NULL) {
+			ctx = newContext();
+			ctx->cmd = this;
+			ctx->pooled = false;
+		}
+
+		ctx->reset();
+		boundContext() = ctx;
 		init();
+		return ctx;
 	}
 
 	// Virtual cleanup function. Do anything the class
 	//	needs to do on a once-per-call basis
 	virtual void cleanup() { return; }
 
-	// Cleanup function for each time we finish a callback.
-	//	Will call the inherited class's cleanup as well
-	void _cleanup() {
-		if (response != NULL) {
-			delete response;
-			response = NULL;
-		}
+	// Finishes a call, once the response has been sent, and returns
+	//	the context to the pool
+	void _end(CommandContext *ctx) {
 		cleanup();
+		boundContext() = NULL;
+		if (ctx->pooled) {
+			ctx->in_use.store(false, std::memory_order_release);
+		} else {
+			delete ctx;
+		}
 	}
 
 	// Deserialization function pointer
@@ -115,16 +225,45 @@ public:
 
 	// Run command
 	virtual bool run() = 0;
+
+	// Serialization method of the response data, sent to the caller
+	//	in the "ser" key. NULL if the response data isn't serialized
+	virtual const char *serialization() { return NULL; }
+};
+
+// Gets the piece of state from the current call's context
+template <class Ctx, class T, T Ctx::*member>
+T *CommandData<Ctx, T, member>::get() const
+{
+	return &(static_cast<Ctx*>(cmd->context())->*member);
+}
+
+// Per-call state of a user callback command
+class CommandUserCallbackContext : public CommandContext {
+public:
+	const uint8_t *req_data;
+	size_t req_data_len;
+
+	CommandUserCallbackContext() : req_data(NULL), req_data_len(0) {}
+
+	virtual void reset() {
+		CommandContext::reset();
+		req_data = NULL;
+		req_data_len = 0;
+	}
 };
 
 // Command that executes a user callback with the
 //	given callback function and data
 class CommandUserCallback : public Command {
+protected:
+	virtual CommandContext *newContext() {
+		return new CommandUserCallbackContext();
+	}
+
 public:
 	command_handler_t cb;
 	void *udata;
-	const uint8_t *req_data;
-	size_t req_data_len;
 
 	// Initialize the user callback command with the
 	//	handler and the callback
@@ -143,8 +282,10 @@ public:
 		const uint8_t *data,
 		size_t data_len)
 	{
-		req_data = data;
-		req_data_len = data_len;
+		CommandUserCallbackContext *ctx =
+			static_cast<CommandUserCallbackContext*>(context());
+		ctx->req_data = data;
+		ctx->req_data_len = data_len;
 		return true;
 	}
 
@@ -153,127 +294,107 @@ public:
 
 	// Run function passes the data to the user callback
 	virtual bool run() {
-		return cb(req_data, req_data_len, response, udata);
+		CommandUserCallbackContext *ctx =
+			static_cast<CommandUserCallbackContext*>(context());
+		return cb(ctx->req_data, ctx->req_data_len, &ctx->response, udata);
 	}
 
 	// Serialization. Nothing to do here
 	virtual bool serialize() { return true; }
 };
 
-// Msgpack message template with both request and response
+// Per-call state of a msgpack command. Either type can be
+//	std::nullptr_t if the command has no request or response
 template <class Req, class Res>
+class CommandMsgpackContext : public CommandContext {
+public:
+	Req req;
+	Res res;
+
+	virtual void reset() {
+		CommandContext::reset();
+		commandResetValue(req);
+		commandResetValue(res);
+	}
+};
+
+// Msgpack message template with both request and response. The
+//	serialization can be swapped out by passing a different policy
+//	from serialization.h as Ser. The request and response are handles to
+//	the state of the call being handled on the current thread.
+template <class Req, class Res, class Ser = SerializeMsgpack>
 class CommandMsgpack : public Command {
+	typedef CommandMsgpackContext<Req, Res> Context;
+
+protected:
+	// Request and response live in the per-call context
+	virtual CommandContext *newContext() { return new Context(); }
+
 public:
 	// Request and response
-	Req *req_data;
-	Res *res_data;
+	CommandData<Context, Req, &Context::req> req_data;
+	CommandData<Context, Res, &Context::res> res_data;
 
-	// Use the constructor and destructor from the base class
+	// Constructor binds the data handles to this command
 	CommandMsgpack(
 		std::string n,
 		std::string d,
 		int t = COMMAND_DEFAULT_TIMEOUT_MS) :
 		Command(n, d, t),
-		req_data(NULL),
-		res_data(NULL)
-	{
-		init();
-	}
-
-	virtual ~CommandMsgpack()
-	{
-		cleanup();
-	}
-
-	// Init function. Allocate the request and response
-	virtual void init() {
-		cleanup();
-		req_data = new Req;
-		res_data = new Res;
-	}
-
-	// Cleanup function. Free the request and response
-	virtual void cleanup() {
-		if (req_data != NULL) {
-			delete req_data;
-			req_data = NULL;
-		}
-		if (res_data != NULL) {
-			delete res_data;
-			res_data = NULL;
-		}
-	}
+		req_data(this),
+		res_data(this) {}
 
 	// Deserialization function into req_data.
 	virtual bool deserialize(
 		const uint8_t *data,
 		size_t data_len)
 	{
-        // Convert into the request data
-        try {
-			msgpack::object_handle oh =
-				msgpack::unpack((const char *)data, data_len);
-	        msgpack::object deserialized = oh.get();
-        	deserialized.convert(*req_data);
-        	return true;
-        } catch (...) {
-        	return false;
-        }
+		// Convert into the request data
+		return Ser::deserialize(data, data_len, *req_data);
 	}
 
-	// Serialization function
+	// Serialization function. Packs into the thread's serialization
+	//	buffer and has the response reference it s.t. the data is only
+	//	copied once, when it's sent
 	virtual bool serialize()
 	{
-		std::stringstream buffer;
+		Context *ctx = static_cast<Context*>(context());
+		msgpack::sbuffer &buffer = serializationBuffer();
+		SerializedView view;
 
 		// Try to serialize the data. This shouldn't
 		//	ever fail since the class is templated
-		try {
-			msgpack::pack(buffer, *res_data);
-			response->setData(buffer.str());
-			return true;
-		} catch (...) {
+		if (!Ser::serialize(ctx->res, buffer, view)) {
 			return false;
 		}
+		ctx->response.setDataRef(view.data(buffer), view.len);
+		return true;
 	}
+
+	// Note how the response is serialized
+	virtual const char *serialization() { return Ser::name(); }
 };
 
 // Msgpack message with no request data
-template <class Res>
-class CommandMsgpack<std::nullptr_t, Res> : public Command {
+template <class Res, class Ser>
+class CommandMsgpack<std::nullptr_t, Res, Ser> : public Command {
+	typedef CommandMsgpackContext<std::nullptr_t, Res> Context;
+
+protected:
+	// Request and response live in the per-call context
+	virtual CommandContext *newContext() { return new Context(); }
+
 public:
-	// Request and response
-	Res *res_data;
+	// Response
+	CommandData<Context, Res, &Context::res> res_data;
 
-	// Use the constructor and destructor from the base class
+	// Constructor binds the data handles to this command
 	CommandMsgpack(
 		std::string n,
 		std::string d,
 		int t = COMMAND_DEFAULT_TIMEOUT_MS) :
 		Command(n, d, t),
-		res_data(NULL)
-	{
-		init();
-	}
-
-	virtual ~CommandMsgpack()
-	{
-		cleanup();
-	}
-
-	// Init function. Allocate the request and response
-	virtual void init() {
-		cleanup();
-		res_data = new Res;
-	}
-
-	// Cleanup function. Free the request and response
-	virtual void cleanup() {
-		if (res_data != NULL) {
-			delete res_data;
-			res_data = NULL;
-		}
-	}
+		res_data(this) {}
 
 	// Deserialization function into req_data.
 	virtual bool deserialize(
@@ -287,75 +408,56 @@ public:
 	// Validation function
 	virtual bool validate() { return true; }
 
-	// Serialization function
+	// Serialization function. Packs into the thread's serialization
+	//	buffer and has the response reference it s.t. the data is only
+	//	copied once, when it's sent
 	virtual bool serialize()
 	{
-		std::stringstream buffer;
+		Context *ctx = static_cast<Context*>(context());
+		msgpack::sbuffer &buffer = serializationBuffer();
+		SerializedView view;
 
 		// Try to serialize the data. This shouldn't
 		//	ever fail since the class is templated
-		try {
-			msgpack::pack(buffer, *res_data);
-			response->setData(buffer.str());
-			return true;
-		} catch (...) {
+		if (!Ser::serialize(ctx->res, buffer, view)) {
 			return false;
 		}
+		ctx->response.setDataRef(view.data(buffer), view.len);
+		return true;
 	}
+
+	// Note how the response is serialized
+	virtual const char *serialization() { return Ser::name(); }
 };
 
 // Msgpack message with no response data
-template <class Req>
-class CommandMsgpack<Req, std::nullptr_t>: public Command {
+template <class Req, class Ser>
+class CommandMsgpack<Req, std::nullptr_t, Ser> : public Command {
+	typedef CommandMsgpackContext<Req, std::nullptr_t> Context;
+
+protected:
+	// Request and response live in the per-call context
+	virtual CommandContext *newContext() { return new Context(); }
+
 public:
-	// Request and response
-	Req *req_data;
+	// Request
+	CommandData<Context, Req, &Context::req> req_data;
 
-	// Use the constructor and destructor from the base class
+	// Constructor binds the data handles to this command
 	CommandMsgpack(
 		std::string n,
 		std::string d,
 		int t = COMMAND_DEFAULT_TIMEOUT_MS) :
 		Command(n, d, t),
-		req_data(NULL)
-	{
-		init();
-	}
-
-	virtual ~CommandMsgpack()
-	{
-		cleanup();
-	}
-
-	// Init function. Allocate the request and response
-	virtual void init() {
-		cleanup();
-		req_data = new Req;
-	}
-
-	// Cleanup function. Free the request and response
-	virtual void cleanup() {
-		if (req_data != NULL) {
-			delete req_data;
-			req_data = NULL;
-		}
-	}
+		req_data(this) {}
 
 	// Deserialization function into req_data.
 	virtual bool deserialize(
 		const uint8_t *data,
 		size_t data_len)
 	{
-        // Convert into the request data
-        try {
-			msgpack::object_handle oh =
-				msgpack::unpack((const char *)data, data_len);
-	        msgpack::object deserialized = oh.get();
-        	deserialized.convert(*req_data);
-        	return true;
-        } catch (...) {
-        	return false;
-        }
+		// Convert into the request data
+		return Ser::deserialize(data, data_len, *req_data);
 	}
 
 	// Serialization function
@@ -365,9 +467,9 @@ public:
 	}
 };
 
-// Msgpack message with no request data
-template <>
-class CommandMsgpack<std::nullptr_t, std::nullptr_t> : public Command {
+// Msgpack message with no request or response data
+template <class Ser>
+class CommandMsgpack<std::nullptr_t, std::nullptr_t, Ser> : public Command {
 public:
 
 	// Use the constructor and destructor from the base class
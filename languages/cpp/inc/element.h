@@ -12,6 +12,11 @@
 
 #include <queue>
 #include <mutex>
+#include <map>
+#include <vector>
+#include <tuple>
+#include <assert.h>
+#include <string.h>
 #include <syslog.h>
 #include <iostream>
 
@@ -23,7 +28,12 @@
 #include "atom/element_command_send.h"
 #include "element_response.h"
 #include "element_read_map.h"
+#include "serialization.h"
 #include "command.h"
+#include "watcher.h"
+#include "freshness.h"
+#include "stream_writer.h"
+#include "subscription.h"
 
 #define ELEMENT_DEFAULT_N_CONTEXTS 20
 
@@ -36,6 +46,9 @@ namespace atom {
 // Entry value
 typedef std::map<std::string, std::string> entry_data_t;
 
+// Stream to read with entryReadLatestMulti: element, stream and keys
+typedef std::tuple<std::string, std::string, std::vector<std::string>> entry_read_stream_t;
+
 // Entry Class
 class Entry {
 	std::string id;
@@ -48,6 +61,13 @@ public:
 		const char *xread_id);
 	~Entry();
 
+	// Entries can be moved s.t. the data isn't copied when they're
+	//	handed around
+	Entry(const Entry &) = default;
+	Entry(Entry &&) = default;
+	Entry &operator=(const Entry &) = default;
+	Entry &operator=(Entry &&) = default;
+
 	// Add data to the entry
 	void addData(
 		const char *key,
@@ -68,9 +88,17 @@ public:
 		const std::string &key);
 };
 
+// Plays back recordings through an element. See recorder.h
+class Player;
+
 // Element class itself
 class Element {
 
+	// The player writes recorded entries straight from its memory map
+	friend class Player;
+	friend class Subscription;
+	friend class Scheduler;
+
 	// Name
 	std::string name;
 
@@ -84,23 +112,62 @@ class Element {
 	// Streams that we're currently publishing on
 	std::map<std::string, struct element_entry_write_info *> streams;
 
+	// Retention for the streams we publish on, if set
+	std::map<std::string, struct element_entry_retention> retention;
+
+	// Codecs for the streams we publish on and the commands we send, by
+	//	"element:command", if set
+	std::map<std::string, struct atom_codec> entry_codecs;
+	std::map<std::string, struct atom_codec> command_codecs;
+
 	// List of commands we currently have support for
 	std::map<std::string, Command *> commands;
 
+	// Watcher for elements and streams, made on the first watch
+	Watcher *watcher;
+	std::mutex watcher_mutex;
+
+	// Gets the watcher, making it if needed
+	Watcher *getWatcher();
+
+	// Gets the watcher's snapshot of the streams if we're watching and
+	//	it's in sync
+	bool getWatchedStreams(
+		std::vector<std::string> &stream_list);
+
+	// Freshness of the streams we read, made when the first is tracked
+	FreshnessMonitor *freshness;
+	std::mutex freshness_mutex;
+
+	// Gets the freshness monitor, making it if needed
+	FreshnessMonitor *getFreshnessMonitor();
+
+	// Gets the tracker for a stream we read if it's tracked
+	StreamFreshness *findFreshness(
+		const std::string &element,
+		const std::string &stream);
+
 	// Functions for getting redis contexts
 	void initContextPool(
 		int n_contexts);
 	void cleanupContextPool();
+	redisContext *popContext();
 	redisContext *getContext();
 	void releaseContext(
 		redisContext *ctx);
 
+	// Points the items in the write info at the data. Returns false if
+	//	the data is missing a key
+	bool fillEntryWriteInfo(
+		struct element_entry_write_info *info,
+		entry_data_t &data);
+
 	// Function for converting a readMap into element_entry_read_info
 	struct element_entry_read_info *readMapToEntryInfo(
 		ElementReadMap &m);
 
 	// Function for freeing entry info
-	void freeEntryInfo(
+	static void freeEntryInfo(
 		struct element_entry_read_info *info,
 		size_t n_infos);
 
@@ -110,44 +177,37 @@ class Element {
 		std::string str = "",
 		bool log_atom = true);
 
-	// Serializes Data
-	template <typename Req>
+	// Serializes data into the buffer using the serialization policy,
+	//	returning a pointer to and the length of the serialized data
+	template <typename Ser, typename Req>
 	bool sendCommandSerialize(
-		std::stringstream &buffer,
-		Req &req_data,
-		size_t &buffer_len)
+		msgpack::sbuffer &buffer,
+		const Req &req_data,
+		const uint8_t *&data,
+		size_t &data_len)
 	{
-		try {
-			msgpack::pack(buffer, req_data);
-		} catch (...) {
+		SerializedView view;
+		if (!Ser::serialize(req_data, buffer, view)) {
 			log(LOG_ERR, "Failed to serialize");
 			return false;
 		}
 
-		// Get the buffer size and then seek it back
-		//	to the beginning
-		buffer.seekg(0, buffer.end);
-		buffer_len = (size_t)buffer.tellg();
-		buffer.seekg(0, buffer.beg);
-
+		data = view.data(buffer);
+		data_len = view.len;
 		return true;
 	}
 
-	// Deserializes data
-	template <typename Res>
+	// Deserializes data using the serialization policy
+	template <typename Ser, typename Res>
 	bool sendCommandDeserialize(
 		ElementResponse &response,
 		Res &res_data)
 	{
-		try {
-			msgpack::object_handle oh = msgpack::unpack(
-				response.getData().c_str(),
-				response.getDataLen());
-
-			msgpack::object deserialized = oh.get();
-			deserialized.convert(res_data);
-		// TODO: make this more specific
-		} catch (...) {
+		if (!Ser::deserialize(
+			response.getDataPtr(),
+			response.getDataLen(),
+			res_data))
+		{
 			log(LOG_ERR, "Failed to deserialize");
 			return false;
 		}
@@ -155,6 +215,65 @@ class Element {
 		return true;
 	}
 
+	// Gets the write info for a stream, (re)making it if we haven't
+	//	written the stream before or the number of keys changed
+	template <typename Map>
+	struct element_entry_write_info *getEntryWriteInfo(
+		redisContext *ctx,
+		const std::string &stream,
+		const Map &data)
+	{
+		// Try to find the write info for the stream
+		auto exists = streams.find(stream);
+
+		// We found the write info and the number of keys is right
+		if ((exists != streams.end()) &&
+			(exists->second->n_items == data.size()))
+		{
+			return exists->second;
+		}
+
+		// If the stream info exists we want to clean it up
+		if (exists != streams.end()) {
+			struct element_entry_write_info *old = exists->second;
+			for (size_t i = 0; i < old->n_items; ++i) {
+				free((char*)old->items[i].key);
+			}
+			element_entry_write_cleanup(ctx, old);
+			streams.erase(exists);
+		}
+
+		// Make the info
+		struct element_entry_write_info *info = element_entry_write_init(
+			ctx,
+			elem,
+			stream.c_str(),
+			data.size());
+		assert(info != NULL);
+
+		// Apply the retention if it's been set
+		auto ret = retention.find(stream);
+		if (ret != retention.end()) {
+			info->retention = ret->second;
+		}
+
+		// And the codec
+		auto codec = entry_codecs.find(stream);
+		if (codec != entry_codecs.end()) {
+			info->codec = codec->second;
+		}
+
+		// Fill in the keys in the info
+		int idx = 0;
+		for (auto const &x: data) {
+			info->items[idx].key = strdup(x.first.c_str());
+			info->items[idx].key_len = x.first.size();
+			idx += 1;
+		}
+
+		streams.emplace(stream, info);
+		return info;
+	}
 
 public:
 
@@ -181,6 +300,21 @@ public:
 		std::vector<std::string> &stream_list,
 		std::string element);
 
+	// Calls the handler each time an element/stream is added or removed,
+	//	starting with everything that's already there. Once watching,
+	//	getAllElements and getAllStreams are answered from a local
+	//	snapshot kept up to date through the registry channel instead
+	//	of going to redis. Elements and streams that go away without
+	//	removing themselves, e.g. when their element crashes, are
+	//	dropped from it within WATCHER_RESYNC_MS. Handlers are called
+	//	from the watcher's thread.
+	void watchElements(
+		watchHandlerFn fn,
+		void *user_data);
+	void watchStreams(
+		watchHandlerFn fn,
+		void *user_data);
+
 	// Adds support for a barebones command. Takes a command name,
 	//	handler function and timeout to be returned to callers of this
 	//	command
@@ -211,8 +345,9 @@ public:
 		size_t data_len,
 		bool block = true);
 
-	// Sends a commad using msgpack for serialization and deserialization
-	template <typename Req, typename Res>
+	// Sends a command using msgpack (or the passed serialization policy)
+	//	for serialization and deserialization
+	template <typename Req, typename Res, typename Ser = SerializeMsgpack>
 	enum atom_error_t sendCommand(
 		ElementResponse &response,
 		std::string element,
@@ -222,9 +357,10 @@ public:
 		bool block = true)
 	{
 		// Pack the buffer
-		std::stringstream buffer;
-		size_t buffer_len;
-		if (!sendCommandSerialize<Req>(buffer, req_data, buffer_len)) {
+		msgpack::sbuffer &buffer = serializationBuffer();
+		const uint8_t *data;
+		size_t data_len;
+		if (!sendCommandSerialize<Ser>(buffer, req_data, data, data_len)) {
 			return ATOM_SERIALIZATION_ERROR;
 		}
 
@@ -233,13 +369,14 @@ public:
 			response,
 			element,
 			command,
-			(uint8_t*)buffer.str().c_str(),
-			buffer_len);
+			data,
+			data_len,
+			block);
 		if (err != ATOM_NO_ERROR) {
 			return err;
 		}
 
-		if (!sendCommandDeserialize<Res>(response, res_data)) {
+		if (!sendCommandDeserialize<Ser>(response, res_data)) {
 			return ATOM_DESERIALIZATION_ERROR;
 		}
 
@@ -247,8 +384,9 @@ public:
 		return ATOM_NO_ERROR;
 	}
 
-	// Sends a commad using msgpack with no request data
-	template <typename Res>
+	// Sends a command using msgpack (or the passed serialization policy)
+	//	with no request data
+	template <typename Res, typename Ser = SerializeMsgpack>
 	enum atom_error_t sendCommandNoReq(
 		ElementResponse &response,
 		std::string element,
@@ -256,18 +394,19 @@ public:
 		Res &res_data,
 		bool block = true)
 	{
-		// Send the command using the packed buffer
+		// Send the command with no data
 		enum atom_error_t err = sendCommand(
 			response,
 			element,
 			command,
 			NULL,
-			0);
+			0,
+			block);
 		if (err != ATOM_NO_ERROR) {
 			return err;
 		}
 
-		if (!sendCommandDeserialize<Res>(response, res_data)) {
+		if (!sendCommandDeserialize<Ser>(response, res_data)) {
 			return ATOM_DESERIALIZATION_ERROR;
 		}
 
@@ -275,8 +414,9 @@ public:
 		return ATOM_NO_ERROR;
 	}
 
-	// Sends a commad using msgpack with no response data
-	template <typename Req>
+	// Sends a command using msgpack (or the passed serialization policy)
+	//	with no response data
+	template <typename Req, typename Ser = SerializeMsgpack>
 	enum atom_error_t sendCommandNoRes(
 		ElementResponse &response,
 		std::string element,
@@ -285,9 +425,10 @@ public:
 		bool block = true)
 	{
 		// Pack the buffer
-		std::stringstream buffer;
-		size_t buffer_len;
-		if (!sendCommandSerialize<Req>(buffer, req_data, buffer_len)) {
+		msgpack::sbuffer &buffer = serializationBuffer();
+		const uint8_t *data;
+		size_t data_len;
+		if (!sendCommandSerialize<Ser>(buffer, req_data, data, data_len)) {
 			return ATOM_SERIALIZATION_ERROR;
 		}
 
@@ -296,8 +437,9 @@ public:
 			response,
 			element,
 			command,
-			(uint8_t*)buffer.str().c_str(),
-			buffer_len);
+			data,
+			data_len,
+			block);
 		if (err != ATOM_NO_ERROR) {
 			return err;
 		}
@@ -322,6 +464,18 @@ public:
 		size_t n,
 		std::vector<Entry> &ret);
 
+	// Reads the newest entry of each stream at one point in time and in
+	//	one round trip, putting them in ret in the same order. Streams
+	//	without any entries get an entry with an empty ID. If reference_ms
+	//	is set each stream's entry is instead the one of its newest window
+	//	entries closest in time to it, or to the newest entry of the first
+	//	stream with ELEMENT_ENTRY_READ_ALIGN_FIRST.
+	enum atom_error_t entryReadLatestMulti(
+		std::vector<entry_read_stream_t> &streams,
+		std::vector<Entry> &ret,
+		uint64_t reference_ms = ELEMENT_ENTRY_READ_LATEST,
+		size_t window = ELEMENT_ENTRY_READ_DEFAULT_ALIGN_WINDOW);
+
 	// Reads at most N entries from the stream since the passed ID
 	//	Default nonblocking. Pass 0 for timeout to block indefinitely,
 	//	else a value in milliseconds
@@ -334,6 +488,49 @@ public:
 		std::string last_id = "",
 		int timeout=REDIS_XREAD_DONTBLOCK);
 
+	// Reads all entries on the stream between two IDs, inclusive, and
+	//	passes them to the handler from oldest to newest. Entries are
+	//	paged in page_size at a time s.t. memory use is constant no matter
+	//	how long the range is. Return false from the handler to stop.
+	enum atom_error_t entryReadRange(
+		std::string element,
+		std::string stream,
+		std::vector<std::string> &keys,
+		readHandlerFn fn,
+		void *user_data,
+		std::string start_id = ENTRY_READ_RANGE_OLDEST_ID,
+		std::string end_id = ENTRY_READ_RANGE_NEWEST_ID,
+		size_t page_size = ENTRY_READ_RANGE_DEFAULT_PAGE_SIZE);
+
+	// Sets the retention for a data stream on top of the maxlen passed
+	//	to each write. Entries older than max_age_ms and the oldest
+	//	entries beyond about max_bytes are trimmed every trim_every
+	//	writes, 0 turning any of them off/to the default.
+	void setEntryRetention(
+		std::string stream,
+		uint64_t max_age_ms,
+		uint64_t max_bytes,
+		unsigned int trim_every = ELEMENT_ENTRY_RETENTION_DEFAULT_TRIM_EVERY);
+
+	// Sets the codec values written to a data stream are compressed with
+	//	when they're over its threshold. Readers decompress them
+	//	automatically, see codec.h. Python can't read compressed
+	//	entries, so only set this for streams C and C++ elements read.
+	void setEntryCodec(
+		std::string stream,
+		const struct atom_codec &codec);
+
+	// Sets the codec data sent to another element's command is compressed
+	//	with, and the codec for the responses of one of our commands.
+	//	Neither works with a Python element on the other end.
+	void setCommandCodec(
+		std::string element,
+		std::string command,
+		const struct atom_codec &codec);
+	void setCommandResponseCodec(
+		std::string command,
+		const struct atom_codec &codec);
+
 	// Writes an entry to a data stream
 	enum atom_error_t entryWrite(
 		std::string stream,
@@ -341,6 +538,117 @@ public:
 		int timestamp = ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP,
 		int maxlen = ELEMENT_DATA_WRITE_DEFAULT_MAXLEN);
 
+	// Writes an entry to a data stream, serializing each value with
+	//	msgpack (or the passed serialization policy). The serialization
+	//	is noted in the "ser" key of the entry s.t. readers can
+	//	deserialize it automatically.
+	template <typename T, typename Ser = SerializeMsgpack>
+	enum atom_error_t entryWrite(
+		std::string stream,
+		std::map<std::string, T> &data,
+		int timestamp = ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP,
+		int maxlen = ELEMENT_DATA_WRITE_DEFAULT_MAXLEN)
+	{
+		redisContext *ctx = getContext();
+		if (ctx == NULL) {
+			return ATOM_REDIS_ERROR;
+		}
+		struct element_entry_write_info *info =
+			getEntryWriteInfo(ctx, stream, data);
+
+		// Serialize each of the values. Since the buffer may move
+		//	while we're packing, only get the pointers once done.
+		msgpack::sbuffer &buffer = serializationBuffer();
+		std::vector<SerializedView> views(info->n_items);
+		for (size_t idx = 0; idx < info->n_items; ++idx) {
+			auto item = data.find(info->items[idx].key);
+			if ((item == data.end()) ||
+				!Ser::serialize(item->second, buffer, views[idx]))
+			{
+				releaseContext(ctx);
+				return ATOM_SERIALIZATION_ERROR;
+			}
+		}
+		for (size_t idx = 0; idx < info->n_items; ++idx) {
+			info->items[idx].data = views[idx].data(buffer);
+			info->items[idx].data_len = views[idx].len;
+		}
+
+		// Do the write, noting the serialization
+		info->ser = Ser::name();
+		enum atom_error_t err = element_entry_write(
+			ctx,
+			info,
+			timestamp,
+			maxlen);
+		info->ser = NULL;
+
+		releaseContext(ctx);
+		return err;
+	}
+
+	// Makes a writer for a data stream with the keys bound up front.
+	//	Values are passed to it in the order of the keys, and it has its
+	//	own connection s.t. it can write from its own thread while other
+	//	threads write other streams. The stream is cleaned up when the
+	//	writer goes away.
+	StreamWriter streamWriter(
+		std::string stream,
+		std::vector<std::string> keys);
+
+	// Makes a subscription to the streams in the map that keeps its place
+	//	between polls s.t. nothing is missed and nothing is set up again.
+	//	It reads from start_id on, or from now on if it's empty.
+	Subscription subscribe(
+		ElementReadMap &m,
+		std::string start_id = "");
+
+	// Writes an entry to each of the streams atomically and in one round
+	//	trip, filling in ids with the ID of each entry in the same order.
+	//	Each stream can only be in the list once.
+	enum atom_error_t entryWriteMulti(
+		std::vector<std::pair<std::string, entry_data_t>> &entries,
+		std::vector<std::string> &ids,
+		int timestamp = ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP,
+		int maxlen = ELEMENT_DATA_WRITE_DEFAULT_MAXLEN);
+
+	// Tracks the freshness of a stream read through entryReadLoop or
+	//	subscribe, with the element and stream as they are in the read
+	//	map. Only reads set up after the stream's tracked are counted.
+	void trackFreshness(
+		std::string element,
+		std::string stream);
+
+	// Calls fn from a watchdog thread once each time the stream goes
+	//	timeout_ms without an entry, tracking it if it isn't already. A
+	//	timeout of 0 turns the watchdog off for the stream.
+	void setStalenessWatchdog(
+		std::string element,
+		std::string stream,
+		uint64_t timeout_ms,
+		stalenessFn fn,
+		void *user_data = NULL);
+
+	// Gets the freshness of a tracked stream. Returns false if it isn't
+	//	tracked.
+	bool getFreshness(
+		std::string element,
+		std::string stream,
+		FreshnessStats &stats);
+
+	// Gets the freshness of all tracked streams
+	void getAllFreshness(
+		std::vector<FreshnessStats> &stats);
+
+	// Publishes the spans recorded while tracing on our "trace" stream as
+	//	Chrome trace JSON, dropping them if clear is set. See atom/trace.h.
+	enum atom_error_t tracePublish(
+		bool clear = true);
+
+	// Gets the spans recorded while tracing as Chrome trace JSON
+	std::string traceDump(
+		bool clear = false);
+
 	// Writes an entry to the logs
 	void log(
 		int level,
@@ -22,17 +22,23 @@ namespace atom {
 // Response class
 class ElementResponse {
 	std::string data;
+	const uint8_t *data_ref;
+	size_t data_ref_len;
 	int err;
 	std::string err_str;
 
 public:
 
 	// Constructor
-	ElementResponse() : data(""), err(0), err_str("") {}
+	ElementResponse() : data(""), data_ref(NULL), data_ref_len(0), err(0), err_str("") {}
 
 	// Destructor
 	~ElementResponse() {}
 
+	// Resets the response for another call without freeing
+	//	any of its memory
+	void reset();
+
 	// Sets the data
 	void setData(
 		const uint8_t *d,
@@ -40,6 +46,12 @@ public:
 	void setData(
 		std::string d);
 
+	// Sets the data to reference memory owned by someone else without
+	//	copying it. The memory must stay valid until the response is sent.
+	void setDataRef(
+		const uint8_t *d,
+		size_t l);
+
 	// Checks to see if the response has data
 	bool hasData();
 
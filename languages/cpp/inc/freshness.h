@@ -0,0 +1,204 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file freshness.h
+//
+//  @brief Tracks how fresh the entries on streams we read are. For each
+//			tracked stream it keeps how long ago the last entry arrived,
+//			a histogram of the producer-to-consumer latency taken from the
+//			time in the entry's ID and a histogram of the jitter between
+//			arrivals. A watchdog can call a handler when a stream goes
+//			quiet for longer than a timeout.
+//
+//			Latency compares the server's time in the ID with our clock
+//			through the offset measured in redis_clock_get, s.t. it's the
+//			time from the XADD to the entry being handed to us.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_CPP_FRESHNESS_H
+#define __ATOM_CPP_FRESHNESS_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "atom/atom.h"
+#include "atom/redis.h"
+
+namespace atom {
+
+// Number of buckets in a histogram. Bucket 0 counts zeros and bucket i
+//	counts values in [2^(i-1), 2^i), with the last one taking the rest
+#define FRESHNESS_HISTOGRAM_BUCKETS 32
+
+// How often the watchdog checks the streams it's watching
+#define FRESHNESS_WATCHDOG_POLL_MS 10
+
+// Handler called from the watchdog's thread when a stream's had no entries
+//	for the timeout. It's called once each time the stream goes quiet,
+//	with how long it's been quiet.
+typedef void (*stalenessFn)(
+	const std::string &element,
+	const std::string &stream,
+	uint64_t age_ms,
+	void *user_data);
+
+// Histogram with power-of-two buckets
+class FreshnessHistogram {
+	uint64_t counts[FRESHNESS_HISTOGRAM_BUCKETS];
+	uint64_t n;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+
+public:
+
+	FreshnessHistogram();
+
+	// Adds a value
+	void add(
+		uint64_t value);
+
+	// Drops all values
+	void clear();
+
+	// Number of values added and their min, max and mean. All 0 if
+	//	there are none.
+	uint64_t getCount() const;
+	uint64_t getMin() const;
+	uint64_t getMax() const;
+	double getMean() const;
+
+	// Gets the value p percent of the values are at or below, rounded up
+	//	to the top of its bucket but no higher than the max
+	uint64_t getPercentile(
+		double p) const;
+
+	// Number of values in a bucket
+	uint64_t getBucket(
+		size_t bucket) const;
+};
+
+// Freshness of a stream as of when it was asked for
+struct FreshnessStats {
+	std::string element;
+	std::string stream;
+
+	// Number of entries read since tracking started
+	uint64_t n_entries;
+
+	// ID of the last entry and its "timestamp" key if it had one and it
+	//	was one of the keys read
+	std::string last_id;
+	std::string last_timestamp;
+
+	// ms since the last entry arrived, or since tracking started if none
+	//	has yet
+	uint64_t age_ms;
+
+	// Whether the watchdog's gone off since the last entry
+	bool stale;
+
+	// Time from the entry's XADD to us reading it in ms
+	FreshnessHistogram latency_ms;
+
+	// Difference between consecutive inter-arrival times in us
+	FreshnessHistogram jitter_us;
+};
+
+// Freshness of one tracked stream, updated by the reads on it
+class StreamFreshness {
+	friend class FreshnessMonitor;
+
+	std::mutex mutex;
+	FreshnessStats stats;
+
+	// Local monotonic times in us
+	uint64_t started_us;
+	uint64_t last_arrival_us;
+	uint64_t last_interval_us;
+
+	// Watchdog, off while the timeout is 0
+	uint64_t timeout_ms;
+	stalenessFn fn;
+	void *user_data;
+
+	StreamFreshness(
+		const std::string &element,
+		const std::string &stream);
+
+public:
+
+	// Notes an entry read. timestamp is its "timestamp" key or NULL.
+	void update(
+		const char *id,
+		const std::string *timestamp);
+
+	// Copies out the stats as of now
+	void get(
+		FreshnessStats &out);
+};
+
+// Tracked streams of an element and the watchdog over them
+class FreshnessMonitor {
+
+	// Streams by "element:stream". They're only removed when the monitor
+	//	goes away s.t. reads can hold on to them.
+	std::mutex mutex;
+	std::map<std::string, StreamFreshness *> streams;
+
+	// Watchdog thread, started with the first watchdog
+	std::thread thread;
+	std::condition_variable cond;
+	bool running;
+	bool stop;
+
+	// Runs the watchdog thread
+	void run();
+
+public:
+
+	FreshnessMonitor();
+	~FreshnessMonitor();
+
+	FreshnessMonitor(const FreshnessMonitor &) = delete;
+	FreshnessMonitor &operator=(const FreshnessMonitor &) = delete;
+
+	// Starts tracking a stream if it isn't already and returns its tracker
+	StreamFreshness *track(
+		const std::string &element,
+		const std::string &stream);
+
+	// Gets the tracker for a stream, or NULL if it's not tracked
+	StreamFreshness *find(
+		const std::string &element,
+		const std::string &stream);
+
+	// Calls fn when the stream's had no entries for timeout_ms, tracking
+	//	it if it isn't already. A timeout of 0 turns the watchdog off.
+	void setWatchdog(
+		const std::string &element,
+		const std::string &stream,
+		uint64_t timeout_ms,
+		stalenessFn fn,
+		void *user_data);
+
+	// Gets the stats for a stream. Returns false if it isn't tracked.
+	bool get(
+		const std::string &element,
+		const std::string &stream,
+		FreshnessStats &stats);
+
+	// Gets the stats for all tracked streams
+	void getAll(
+		std::vector<FreshnessStats> &stats);
+};
+
+} // namespace atom
+
+#endif // __ATOM_CPP_FRESHNESS_H
@@ -0,0 +1,254 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file recorder.h
+//
+//  @brief Records entries from streams into a memory-mapped segment log
+//			and plays them back through an element. Meant for capturing a
+//			robot's streams and replaying them, e.g. in CI, without the
+//			original elements running.
+//
+//			A recording is a directory holding numbered segment files and
+//			an index. Each segment is an append-only log of records, one per
+//			entry, and the index has a fixed-size row per record with its ID,
+//			receive time and location. The index is sorted by time when the
+//			recording is finished s.t. playback can seek and walk it in
+//			place without scanning the segments or holding anything per
+//			entry in memory.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_CPP_RECORDER_H
+#define __ATOM_CPP_RECORDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+#include "element.h"
+#include "element_read_map.h"
+
+namespace atom {
+
+// Magic at the start of each segment and the index
+#define RECORDER_SEGMENT_MAGIC "ATOMSEG1"
+#define RECORDER_INDEX_MAGIC "ATOMIDX1"
+#define RECORDER_VERSION 1
+
+// Default size of each segment. Entries bigger than this get
+//	a segment of their own
+#define RECORDER_DEFAULT_SEGMENT_SIZE (64UL * 1024UL * 1024UL)
+
+// Name of the index within the recording directory, and of the sorted
+//	copy made while finishing it
+#define RECORDER_INDEX_FILENAME "index"
+#define RECORDER_INDEX_SORTING_FILENAME "index.sorting"
+
+// Index flags. The rows are in time order.
+#define RECORDER_INDEX_SORTED 0x1
+
+// Number of segments the player keeps mapped at once. Entries from
+//	different streams are recorded in the order they're read, so an entry
+//	that's next in time can be in an earlier segment than the last one.
+#define PLAYER_MAPPED_SEGMENTS 4
+
+// Speed to pass to the player to not wait between entries
+#define PLAYER_AS_FAST_AS_POSSIBLE 0.0
+
+// IDs to play from/to to play the whole recording
+#define PLAYER_START 0
+#define PLAYER_END UINT64_MAX
+
+// Header at the start of each segment file. used is the number of bytes
+//	of records in the segment. If the recorder didn't get to close the
+//	segment it's 0 and readers stop at the first empty record instead.
+struct recorder_segment_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t segment;
+	uint64_t used;
+	uint64_t reserved;
+};
+
+// Header before each record in a segment. It's followed by the element
+//	name, the stream name, and then for each key a uint32_t key length,
+//	uint32_t value length, the key and the value. Records are padded
+//	to 8 bytes.
+struct recorder_record_header {
+	uint32_t len;
+	uint16_t element_len;
+	uint16_t stream_len;
+	uint32_t n_keys;
+	uint32_t reserved;
+	uint64_t id_ms;
+	uint64_t id_seq;
+	uint64_t recv_ns;
+};
+
+// Header of the index file
+struct recorder_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+};
+
+// Row in the index for each record, in the order they were recorded until
+//	the recording is finished and then by time. Rows in the same ms keep
+//	the order they were recorded in, i.e. by segment and offset.
+struct recorder_index_entry {
+	uint64_t id_ms;
+	uint64_t id_seq;
+	uint64_t recv_ns;
+	uint32_t segment;
+	uint32_t reserved;
+	uint64_t offset;
+};
+
+// Records entries to a recording directory
+class Recorder {
+
+	// Stream being recorded. Passed as the user data for its handler
+	struct RecordedStream {
+		Recorder *recorder;
+		std::string element;
+		std::string stream;
+	};
+
+	std::string path;
+	size_t segment_size;
+
+	// Streams added to read maps. A list s.t. pointers stay valid
+	std::list<RecordedStream> recorded;
+
+	// Current segment
+	uint32_t segment;
+	int segment_fd;
+	uint8_t *segment_map;
+	size_t segment_map_len;
+	size_t segment_used;
+
+	// Index
+	FILE *index;
+	size_t n_entries;
+
+	bool openSegment(
+		size_t min_len);
+	void closeSegment();
+	bool sortIndex();
+
+	static bool recordHandler(
+		Entry &e,
+		void *user_data);
+
+public:
+
+	// Starts a new recording in the directory, creating it if needed.
+	//	Throws std::runtime_error if the recording can't be created.
+	Recorder(
+		std::string dir,
+		size_t seg_size = RECORDER_DEFAULT_SEGMENT_SIZE);
+
+	// Finishes the recording, sorting the index by time
+	~Recorder();
+
+	// Adds a handler to the read map that records entries from the
+	//	stream. Only the passed keys are recorded.
+	void addStream(
+		ElementReadMap &m,
+		std::string element,
+		std::string stream,
+		std::vector<std::string> keys);
+
+	// Records an entry from a stream
+	bool record(
+		const std::string &element,
+		const std::string &stream,
+		Entry &e);
+
+	// Flushes the index and notes how much of the current segment is
+	//	in use s.t. the recording can be read while still being written
+	bool flush();
+
+	// Gets the number of entries recorded
+	size_t getNumEntries();
+};
+
+// Plays back a recording through an element. Each recorded stream is
+//	written on the element's stream of the same name.
+class Player {
+
+	Element &elem;
+	std::string path;
+
+	// Write infos for the streams we're publishing on
+	std::map<std::string, struct element_entry_write_info *> streams;
+
+	// Segment mapped for reading. last_used is for evicting the one used
+	//	longest ago once PLAYER_MAPPED_SEGMENTS are mapped.
+	struct MappedSegment {
+		uint32_t segment;
+		const uint8_t *map;
+		size_t len;
+		uint64_t last_used;
+	};
+
+	// Index
+	int index_fd;
+	const uint8_t *index_map;
+	size_t index_map_len;
+	const struct recorder_index_entry *index;
+	size_t n_entries;
+
+	// Positions in the index sorted by time, only for a recording that
+	//	wasn't finished and so isn't sorted already
+	std::vector<size_t> order;
+
+	// Segments mapped
+	MappedSegment mapped[PLAYER_MAPPED_SEGMENTS];
+	uint64_t map_uses;
+
+	const MappedSegment *mapSegment(
+		uint32_t seg);
+	void unmapSegments();
+
+	const struct recorder_index_entry *entryAt(
+		size_t i);
+	size_t seek(
+		uint64_t start_ms);
+
+	enum atom_error_t publish(
+		redisContext *ctx,
+		const struct recorder_record_header *rec,
+		int maxlen);
+
+public:
+
+	// Opens a recording for playback through the element. Throws
+	//	std::runtime_error if the recording can't be opened.
+	Player(
+		Element &e,
+		std::string dir);
+
+	// Closes the recording. What was played is left on the streams.
+	~Player();
+
+	// Gets the number of entries in the recording
+	size_t getNumEntries();
+
+	// Plays the entries recorded between the start and end times, in ms
+	//	of redis time like the first part of an entry ID. A speed of 1.0
+	//	keeps the original timing, 2.0 plays twice as fast, etc. and
+	//	PLAYER_AS_FAST_AS_POSSIBLE doesn't wait between entries.
+	enum atom_error_t play(
+		double speed = 1.0,
+		uint64_t start_ms = PLAYER_START,
+		uint64_t end_ms = PLAYER_END,
+		int maxlen = ELEMENT_DATA_WRITE_DEFAULT_MAXLEN);
+};
+
+} // namespace atom
+
+#endif // __ATOM_CPP_RECORDER_H
@@ -0,0 +1,315 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file scheduler.h
+//
+//  @brief Event loop for running many commands, reads and writes at once
+//			from one thread. Each operation is handed a completion callback
+//			instead of blocking, and the scheduler multiplexes all of them
+//			over one redis connection: pending commands share a single
+//			XREAD on the element's response stream, waiting reads share
+//			one XREAD with it and queued writes go out in one round trip.
+//			Completion callbacks run on the scheduler's thread and can
+//			start more operations, s.t. a chain of interactions is written
+//			as a chain of callbacks rather than a thread each. Commands can
+//			also be served by the scheduler, with the handler answering
+//			through a Responder whenever it's ready. For more cores run a
+//			scheduler per thread.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_CPP_SCHEDULER_H
+#define __ATOM_CPP_SCHEDULER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "atom/atom.h"
+#include "atom/redis.h"
+#include "atom/element_entry_write.h"
+#include "atom/trace.h"
+#include "element.h"
+#include "element_response.h"
+
+namespace atom {
+
+// How long to wait for the ACK of a command sent through the scheduler
+#define SCHEDULER_COMMAND_ACK_TIMEOUT_MS 100000
+
+// How long callers wait for our error response to a command we don't serve
+#define SCHEDULER_NO_COMMAND_TIMEOUT_MS 1000
+
+// Pass as a read's timeout to wait forever
+#define SCHEDULER_NO_TIMEOUT 0
+
+// Most streams reads can wait on in one XREAD, the rest wait their turn
+#define SCHEDULER_MAX_READ_STREAMS 24
+
+// Prefix of the stream other threads wake the scheduler through
+#define SCHEDULER_WAKE_STREAM_PREFIX "scheduler:"
+
+class Scheduler;
+
+// Task run on the scheduler's thread
+typedef void (*taskFn)(
+	void *user_data);
+
+// Called with the response of a command. The error is set in the response
+//	if the command failed.
+typedef void (*commandDoneFn)(
+	ElementResponse &response,
+	void *user_data);
+
+// Called with the entry a read waited for. The ID is empty if the read
+//	timed out.
+typedef void (*entryDoneFn)(
+	Entry &entry,
+	void *user_data);
+
+// Called with the result of a write and the ID of the entry
+typedef void (*writeDoneFn)(
+	enum atom_error_t err,
+	const std::string &id,
+	void *user_data);
+
+// Handle for answering a command served by the scheduler
+class Responder {
+	friend class Scheduler;
+
+	Scheduler *sched;
+	std::string caller;
+	std::string cmd_id;
+	std::string command;
+
+	Responder(
+		Scheduler *s,
+		std::string caller,
+		std::string cmd_id,
+		std::string command);
+
+public:
+
+	// Sends the response and frees the responder. Must be called exactly
+	//	once, from any thread, before the command's timeout.
+	void respond(
+		ElementResponse &response);
+};
+
+// Handler for a command served by the scheduler. Called on the scheduler's
+//	thread, it can start other operations and answer through the
+//	responder once they're done.
+typedef void (*asyncCommandFn)(
+	const uint8_t *data,
+	size_t data_len,
+	Responder *responder,
+	void *user_data);
+
+class Scheduler {
+	friend class Responder;
+
+
+	// Command we've sent, by its ID once it's been sent
+	struct schedCommand {
+		std::string element;
+		std::string command;
+		std::string data;
+		bool block;
+		commandDoneFn fn;
+		void *user_data;
+		bool acked;
+		uint64_t deadline_ms;
+		struct atom_trace_span span;
+	};
+
+	// Read waiting for the next entry after last_id on a stream
+	struct schedRead {
+		std::string stream;
+		std::vector<std::string> keys;
+		std::string last_id;
+		uint64_t deadline_ms;
+		entryDoneFn fn;
+		void *user_data;
+	};
+
+	struct schedWrite {
+		std::string stream;
+		entry_data_t data;
+		int maxlen;
+		writeDoneFn fn;
+		void *user_data;
+	};
+
+	// ACK or response to a command we serve
+	struct schedReply {
+		std::string caller;
+		std::string cmd_id;
+		std::string command;
+		bool ack;
+		int timeout;
+		int err;
+		std::string err_str;
+		std::string data;
+		bool has_data;
+	};
+
+	struct schedTask {
+		taskFn fn;
+		void *user_data;
+	};
+
+	struct schedServed {
+		asyncCommandFn fn;
+		void *user_data;
+		int timeout;
+	};
+
+public:
+
+	// Reads waiting on the same stream, sharing its place in the XREAD
+	struct schedReadGroup {
+		Scheduler *sched;
+		std::string stream;
+		std::vector<schedRead *> reads;
+	};
+
+private:
+
+	Element &element;
+	redisContext *ctx;
+	std::string wake_stream;
+
+	// Operations handed to us, from any thread
+	std::mutex submit_mutex;
+	std::vector<schedCommand *> new_commands;
+	std::vector<schedRead *> new_reads;
+	std::vector<schedWrite *> new_writes;
+	std::vector<schedReply *> new_replies;
+	std::multimap<uint64_t, schedTask> new_tasks;
+	std::atomic<bool> blocked;
+	std::atomic<bool> stopped;
+
+	// Operations in flight, only touched from the scheduler's thread
+	std::map<std::string, schedCommand *> commands;
+	std::map<std::string, schedReadGroup *> read_groups;
+	std::multimap<uint64_t, schedTask> tasks;
+	std::map<std::string, schedServed> served;
+	std::map<std::string, struct element_entry_write_info *> write_infos;
+	size_t n_reads;
+	size_t group_offset;
+
+	// Where we are in the streams we read
+	char response_last_id[STREAM_ID_BUFFLEN];
+	char command_last_id[STREAM_ID_BUFFLEN];
+	char wake_last_id[STREAM_ID_BUFFLEN];
+
+	void wake();
+	bool drain();
+	void sendCommands(
+		std::vector<schedCommand *> &cmds);
+	void sendReplies(
+		std::vector<schedReply *> &replies);
+	void sendWrites(
+		std::vector<schedWrite *> &writes);
+	void addReads(
+		std::vector<schedRead *> &reads);
+	void expire();
+	void poll(
+		int timeout);
+	void finishCommand(
+		schedCommand *cmd,
+		ElementResponse &response);
+	struct element_entry_write_info *getWriteInfo(
+		const std::string &stream,
+		entry_data_t &data);
+
+public:
+
+	// Handlers for the streams we XREAD, called by the C API
+	void onResponse(
+		const char *id,
+		const struct redisReply *reply);
+	void onCommand(
+		const char *id,
+		const struct redisReply *reply);
+	void onEntry(
+		schedReadGroup *group,
+		const char *id,
+		const struct redisReply *reply);
+
+	// Makes a scheduler for the element with its own redis connection
+	Scheduler(
+		Element &element);
+	~Scheduler();
+
+	Scheduler(const Scheduler &) = delete;
+	Scheduler &operator=(const Scheduler &) = delete;
+
+	// Sends a command to an element, calling fn with the response. If
+	//	block is false fn is called once the command's been ACKed.
+	void sendCommand(
+		std::string element,
+		std::string command,
+		const uint8_t *data,
+		size_t data_len,
+		commandDoneFn fn,
+		void *user_data,
+		bool block = true);
+
+	// Waits for the next entry on an element's stream after last_id, or
+	//	from now on if it's empty, and calls fn with it. Only the keys
+	//	passed are filled in, or all of them if there are none. Gives up
+	//	after timeout ms unless it's SCHEDULER_NO_TIMEOUT.
+	void entryReadNext(
+		std::string element,
+		std::string stream,
+		std::vector<std::string> keys,
+		entryDoneFn fn,
+		void *user_data,
+		std::string last_id = "",
+		int timeout = SCHEDULER_NO_TIMEOUT);
+
+	// Writes an entry to one of our streams, calling fn with the result
+	//	if it's non-NULL
+	void entryWrite(
+		std::string stream,
+		entry_data_t data,
+		writeDoneFn fn = NULL,
+		void *user_data = NULL,
+		int maxlen = ELEMENT_DATA_WRITE_DEFAULT_MAXLEN);
+
+	// Runs a task on the scheduler's thread, after delay_ms if nonzero
+	void post(
+		taskFn fn,
+		void *user_data,
+		int delay_ms = 0);
+
+	// Serves a command from the scheduler. Don't also run the element's
+	//	command loop since it reads the same command stream.
+	void addCommand(
+		std::string name,
+		asyncCommandFn fn,
+		void *user_data,
+		int timeout = COMMAND_DEFAULT_TIMEOUT_MS);
+
+	// Runs the scheduler on this thread until stop is called
+	enum atom_error_t run();
+
+	// Runs whatever's ready, waiting at most timeout ms for something to
+	//	be, and returns
+	enum atom_error_t runOnce(
+		int timeout);
+
+	// Makes run return. Can be called from any thread.
+	void stop();
+
+	// Number of commands and reads in flight
+	size_t pending();
+};
+
+} // namespace atom
+
+#endif // __ATOM_CPP_SCHEDULER_H
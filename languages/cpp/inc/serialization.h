@@ -0,0 +1,199 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file serialization.h
+//
+//  @brief Serialization policies for command and entry data. Each policy
+//			has a name which is sent in the "ser" key alongside the data
+//			s.t. elements in other languages can deserialize it automatically.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_CPP_SERIALIZATION_H
+#define __ATOM_CPP_SERIALIZATION_H
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <msgpack.hpp>
+
+#include "atom/atom.h"
+
+namespace atom {
+
+// View of a piece of serialized data. If ptr is NULL then the data was
+//	packed into the serialization buffer starting at offset, else ptr
+//	points directly at the user's memory and nothing was copied. Since the
+//	buffer can be reallocated as more data is packed into it the pointer
+//	should only be taken once all packing is done.
+struct SerializedView {
+	const uint8_t *ptr;
+	size_t offset;
+	size_t len;
+
+	SerializedView() : ptr(NULL), offset(0), len(0) {}
+
+	// Gets the pointer to the serialized data
+	const uint8_t *data(
+		const msgpack::sbuffer &buffer) const
+	{
+		return (ptr != NULL) ? ptr : (const uint8_t*)buffer.data() + offset;
+	}
+};
+
+// Gets this thread's serialization buffer, emptied and ready to pack into.
+//	The buffer's memory is reused from call to call s.t. serializing
+//	only allocates when the data outgrows anything the thread has sent
+//	before. Anything packed into it is only valid until the thread's next
+//	call to this function.
+inline msgpack::sbuffer &serializationBuffer()
+{
+	static thread_local msgpack::sbuffer buffer;
+	buffer.clear();
+	return buffer;
+}
+
+// Msgpack serialization. Packs directly into the buffer
+class SerializeMsgpack {
+public:
+
+	// Name to send in the "ser" key
+	static const char *name() { return ATOM_SER_MSGPACK; }
+
+	// Packs the data onto the end of the buffer
+	template <typename T>
+	static bool serialize(
+		const T &data,
+		msgpack::sbuffer &buffer,
+		SerializedView &view)
+	{
+		view.ptr = NULL;
+		view.offset = buffer.size();
+		try {
+			msgpack::pack(buffer, data);
+		} catch (...) {
+			return false;
+		}
+		view.len = buffer.size() - view.offset;
+		return true;
+	}
+
+	// Unpacks the data into the output
+	template <typename T>
+	static bool deserialize(
+		const uint8_t *data,
+		size_t data_len,
+		T &out)
+	{
+		try {
+			msgpack::object_handle oh =
+				msgpack::unpack((const char *)data, data_len);
+			oh.get().convert(out);
+		} catch (...) {
+			return false;
+		}
+		return true;
+	}
+};
+
+// No serialization. Supports strings, vectors of trivially-copyable types
+//	(tensors, point clouds, etc.) and trivially-copyable structs. The data is
+//	sent as-is from the user's memory without any intermediate copy.
+class SerializeNone {
+public:
+
+	// Name to send in the "ser" key
+	static const char *name() { return ATOM_SER_NONE; }
+
+	// Strings are sent as-is
+	static bool serialize(
+		const std::string &data,
+		msgpack::sbuffer &buffer,
+		SerializedView &view)
+	{
+		view.ptr = (const uint8_t*)data.data();
+		view.offset = 0;
+		view.len = data.size();
+		return true;
+	}
+
+	// Contiguous arrays are sent as-is
+	template <typename T>
+	static bool serialize(
+		const std::vector<T> &data,
+		msgpack::sbuffer &buffer,
+		SerializedView &view)
+	{
+		static_assert(std::is_trivially_copyable<T>::value,
+			"Raw vector elements must be trivially copyable");
+
+		view.ptr = (const uint8_t*)data.data();
+		view.offset = 0;
+		view.len = data.size() * sizeof(T);
+		return true;
+	}
+
+	// Flat structs are sent as-is
+	template <typename T>
+	static typename std::enable_if<std::is_trivially_copyable<T>::value, bool>::type
+	serialize(
+		const T &data,
+		msgpack::sbuffer &buffer,
+		SerializedView &view)
+	{
+		view.ptr = (const uint8_t*)&data;
+		view.offset = 0;
+		view.len = sizeof(T);
+		return true;
+	}
+
+	// Strings are copied out as-is
+	static bool deserialize(
+		const uint8_t *data,
+		size_t data_len,
+		std::string &out)
+	{
+		out.assign((const char *)data, data_len);
+		return true;
+	}
+
+	// Contiguous arrays need to be a whole number of elements
+	template <typename T>
+	static bool deserialize(
+		const uint8_t *data,
+		size_t data_len,
+		std::vector<T> &out)
+	{
+		static_assert(std::is_trivially_copyable<T>::value,
+			"Raw vector elements must be trivially copyable");
+
+		if ((data_len % sizeof(T)) != 0) {
+			return false;
+		}
+		out.resize(data_len / sizeof(T));
+		if (data_len != 0) {
+			memcpy(out.data(), data, data_len);
+		}
+		return true;
+	}
+
+	// Flat structs need to be exactly the right size
+	template <typename T>
+	static typename std::enable_if<std::is_trivially_copyable<T>::value, bool>::type
+	deserialize(
+		const uint8_t *data,
+		size_t data_len,
+		T &out)
+	{
+		if (data_len != sizeof(T)) {
+			return false;
+		}
+		memcpy(&out, data, sizeof(T));
+		return true;
+	}
+};
+
+} // namespace atom
+
+#endif // __ATOM_CPP_SERIALIZATION_H
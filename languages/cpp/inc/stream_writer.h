@@ -0,0 +1,103 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file stream_writer.h
+//
+//  @brief Handle for writing entries to one data stream with the keys
+//			bound up front. Values are passed in the order of the keys
+//			and point at the caller's data s.t. a write doesn't look
+//			anything up, copy or allocate. Each writer has its own redis
+//			connection s.t. one thread per writer can write while other
+//			threads write other streams.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_CPP_STREAM_WRITER_H
+#define __ATOM_CPP_STREAM_WRITER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "atom/atom.h"
+#include "atom/redis.h"
+#include "atom/element_entry_write.h"
+
+namespace atom {
+
+// Value for a key, pointing at data owned by the caller that needs to
+//	stay valid until the write returns
+class EntryValue {
+public:
+	const uint8_t *data;
+	size_t len;
+
+	EntryValue(
+		const void *d,
+		size_t l) : data((const uint8_t *)d), len(l) {}
+	EntryValue(
+		const std::string &s) : data((const uint8_t *)s.data()), len(s.size()) {}
+	EntryValue(
+		const char *s) : data((const uint8_t *)s), len(strlen(s)) {}
+};
+
+class StreamWriter {
+
+	// Keys, which the write info points into
+	std::vector<std::string> keys;
+
+	// Dedicated connection and the write info for the stream
+	redisContext *ctx;
+	struct element_entry_write_info *info;
+
+	void cleanup();
+
+public:
+
+	// Makes a writer for the element's stream with the keys. Use
+	//	Element::streamWriter instead of calling this directly.
+	StreamWriter(
+		struct element *elem,
+		const std::string &stream,
+		std::vector<std::string> keys);
+
+	// Cleans up the stream, same as the element does for the streams
+	//	written with entryWrite
+	~StreamWriter();
+
+	// Writers can be moved but not copied
+	StreamWriter(StreamWriter &&other);
+	StreamWriter &operator=(StreamWriter &&other);
+	StreamWriter(const StreamWriter &) = delete;
+	StreamWriter &operator=(const StreamWriter &) = delete;
+
+	// Writes an entry with a value for each key, in the order of the keys
+	enum atom_error_t write(
+		const EntryValue *values,
+		size_t n_values,
+		int timestamp = ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP,
+		int maxlen = ELEMENT_DATA_WRITE_DEFAULT_MAXLEN);
+	enum atom_error_t write(
+		std::initializer_list<EntryValue> values,
+		int timestamp = ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP,
+		int maxlen = ELEMENT_DATA_WRITE_DEFAULT_MAXLEN);
+
+	// Sets the retention for the stream, see Element::setEntryRetention
+	void setRetention(
+		uint64_t max_age_ms,
+		uint64_t max_bytes,
+		unsigned int trim_every = ELEMENT_ENTRY_RETENTION_DEFAULT_TRIM_EVERY);
+
+	// Sets the codec for the stream, see Element::setEntryCodec
+	void setCodec(
+		const struct atom_codec &codec);
+
+	// Gets the keys, in the order values are passed in
+	const std::vector<std::string> &getKeys();
+};
+
+} // namespace atom
+
+#endif // __ATOM_CPP_STREAM_WRITER_H
@@ -0,0 +1,72 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file subscription.h
+//
+//  @brief Subscription to the streams in an ElementReadMap that keeps its
+//			place between reads. It's set up once and then polled as often
+//			as needed, each poll picking up right after the last entry the
+//			previous one read s.t. nothing written in between is missed
+//			and nothing is set up again. Each subscription has its own
+//			redis connection.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_CPP_SUBSCRIPTION_H
+#define __ATOM_CPP_SUBSCRIPTION_H
+
+#include <stddef.h>
+
+#include "atom/atom.h"
+#include "atom/redis.h"
+#include "atom/element_entry_read.h"
+
+namespace atom {
+
+class Subscription {
+
+	// Dedicated connection, the read info for the handlers and the
+	//	C subscription atop them
+	redisContext *ctx;
+	struct element_entry_read_info *infos;
+	size_t n_infos;
+	struct element_entry_subscription *sub;
+
+	void cleanup();
+
+public:
+
+	// Makes a subscription to the streams in the read info, which it
+	//	takes ownership of, starting from start_id or from now on if it's
+	//	NULL. Use Element::subscribe instead of calling this directly.
+	Subscription(
+		struct element *elem,
+		struct element_entry_read_info *infos,
+		size_t n_infos,
+		const char *start_id);
+	~Subscription();
+
+	// Subscriptions can be moved but not copied
+	Subscription(Subscription &&other);
+	Subscription &operator=(Subscription &&other);
+	Subscription(const Subscription &) = delete;
+	Subscription &operator=(const Subscription &) = delete;
+
+	// Reads entries, calling the handlers, until at least n have been read
+	//	or timeout ms have passed. Pass REDIS_XREAD_BLOCK_INDEFINITE to
+	//	wait as long as it takes. Timing out isn't an error. If n_read is
+	//	non-NULL it gets the number of entries read.
+	enum atom_error_t poll(
+		size_t n,
+		int timeout = REDIS_XREAD_BLOCK_INDEFINITE,
+		size_t *n_read = NULL);
+
+	// Reads everything that comes in over the next timeout ms
+	enum atom_error_t pollFor(
+		int timeout,
+		size_t *n_read = NULL);
+};
+
+} // namespace atom
+
+#endif // __ATOM_CPP_SUBSCRIPTION_H
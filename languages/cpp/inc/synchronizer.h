@@ -0,0 +1,133 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file synchronizer.h
+//
+//  @brief Matches up entries from several streams by time s.t. a single
+//			handler gets one entry from each stream, e.g. the camera image,
+//			lidar scan and IMU reading closest to each other.
+//
+//			The synchronizer adds a handler for each of its streams to an
+//			ElementReadMap and is then driven by Element::entryReadLoop.
+//			Each stream's entries are kept in a fixed-size ring, oldest to
+//			newest. Once every stream has something, the newest of the
+//			oldest entries is the pivot and each stream's entry nearest
+//			it is picked. If all of them are within the tolerance of the
+//			pivot they're handed to the handler and they and everything
+//			older is dropped, otherwise the oldest entry is dropped and
+//			it's tried again. A stream's entry isn't picked while a newer
+//			entry nearer the pivot could still arrive.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_CPP_SYNCHRONIZER_H
+#define __ATOM_CPP_SYNCHRONIZER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "element.h"
+#include "element_read_map.h"
+
+namespace atom {
+
+// Default number of entries buffered per stream
+#define SYNCHRONIZER_DEFAULT_QUEUE_SIZE 16
+
+// Handler called with one entry per stream, in the order the streams
+//	were added
+typedef bool (*syncHandlerFn)(
+	std::vector<Entry> &entries,
+	void *user_data);
+
+class Synchronizer {
+
+	// A stream being synchronized and its ring of entries
+	struct syncStream {
+		Synchronizer *sync;
+		std::string element;
+		std::string stream;
+		std::vector<std::string> keys;
+		std::vector<Entry> ring;
+		std::vector<uint64_t> times;
+		size_t head;
+		size_t count;
+	};
+
+	std::vector<syncStream *> streams;
+
+	// Entries older than this apart from the pivot aren't matched. In ms
+	//	when using the stream IDs or in the unit of the timestamps
+	uint64_t tolerance;
+	size_t queue_size;
+	bool use_timestamp_key;
+
+	syncHandlerFn fn;
+	void *user_data;
+
+	// Matched entries, handed to the handler
+	std::vector<Entry> matched;
+	std::vector<size_t> picks;
+
+	uint64_t n_matched;
+	uint64_t n_dropped;
+
+	// Gets the time of the nth oldest entry of the stream
+	uint64_t time(
+		const syncStream *s,
+		size_t n) const;
+
+	// Drops the n oldest entries of the stream
+	void pop(
+		syncStream *s,
+		size_t n);
+
+	// Adds an entry to the stream's ring
+	void push(
+		syncStream *s,
+		Entry &e);
+
+	// Hands off all of the matches we can make
+	bool match();
+
+	// Read handler for each stream
+	static bool entryCB(
+		Entry &e,
+		void *user_data);
+
+public:
+
+	// Makes a synchronizer calling fn with the matched entries. Entries
+	//	are timed by their stream IDs in ms, or with use_timestamp_key
+	//	by the timestamp passed to entryWrite, falling back to the ID
+	//	for entries without one. queue_size entries are buffered per
+	//	stream, the oldest being dropped when it's full.
+	Synchronizer(
+		uint64_t tolerance,
+		syncHandlerFn fn,
+		void *user_data = NULL,
+		size_t queue_size = SYNCHRONIZER_DEFAULT_QUEUE_SIZE,
+		bool use_timestamp_key = false);
+	~Synchronizer();
+
+	// Adds a stream to synchronize. All of the streams need to be added
+	//	before adding the handlers
+	void addStream(
+		std::string element,
+		std::string stream,
+		std::vector<std::string> keys);
+
+	// Adds the handlers for the streams to the map
+	void addHandlers(
+		ElementReadMap &m);
+
+	// Gets the number of sets of entries handed to the handler and the
+	//	number of entries dropped without being matched
+	uint64_t getNumMatched();
+	uint64_t getNumDropped();
+};
+
+} // namespace atom
+
+#endif // __ATOM_CPP_SYNCHRONIZER_H
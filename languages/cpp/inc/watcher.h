@@ -0,0 +1,142 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file watcher.h
+//
+//  @brief Follows elements and streams coming and going through the
+//			registry channel and keeps a local snapshot of them s.t.
+//			topology queries don't need to go to redis.
+//
+//			The watcher has its own connection subscribed to the registry
+//			channel. Once subscribed it seeds the snapshot with a full
+//			query and then applies the +/- messages on top of it. When
+//			the connection drops it reconnects, resubscribes and queries
+//			again, letting handlers know about anything that changed
+//			while it was gone. It also queries again every
+//			WATCHER_RESYNC_MS, since an element that dies without
+//			cleaning up never sends its "-" messages.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef __ATOM_CPP_WATCHER_H
+#define __ATOM_CPP_WATCHER_H
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "atom/atom.h"
+#include "atom/redis.h"
+
+namespace atom {
+
+// How long the watcher waits on its connection before checking if it's
+//	been told to stop, and between attempts to get the snapshot/reconnect
+#define WATCHER_POLL_MS 100
+
+// How often the watcher queries everything again to drop elements and
+//	streams that went away without saying so, i.e. whose element crashed
+#define WATCHER_RESYNC_MS 5000
+
+// Handler called when an element or stream is added or removed. Elements
+//	are passed by name and streams as element:stream, same as
+//	Element::getAllStreams. Handlers are called from the watcher's thread
+//	and must not add handlers themselves.
+typedef void (*watchHandlerFn)(
+	const std::string &name,
+	bool added,
+	void *user_data);
+
+class Watcher {
+
+	// What a handler is watching
+	enum watchKind {
+		WATCH_ELEMENTS,
+		WATCH_STREAMS,
+	};
+
+	struct handler {
+		watchKind kind;
+		watchHandlerFn fn;
+		void *user_data;
+	};
+
+	// Thread following the registry channel
+	std::thread thread;
+	std::atomic<bool> stop;
+
+	// Snapshot, only valid while synced
+	mutable std::mutex snapshot_mutex;
+	std::set<std::string> elements;
+	std::set<std::string> streams;
+	bool synced;
+
+	// Handlers. Held while applying changes s.t. a handler added
+	//	mid-change sees everything exactly once
+	std::mutex handler_mutex;
+	std::vector<handler> handlers;
+
+	// Runs the watcher thread
+	void run();
+
+	// Subscribes the connection to the registry channel
+	bool subscribe(
+		redisContext *ctx);
+
+	// Queries all elements and streams and applies the difference to
+	//	the snapshot
+	bool sync();
+
+	// Applies a message from the registry channel
+	void apply(
+		const char *msg,
+		size_t msg_len);
+
+	// Adds or removes a member of the snapshot, calling handlers if
+	//	it changed. Must hold handler_mutex.
+	void update(
+		watchKind kind,
+		const std::string &name,
+		bool added);
+
+	void addHandler(
+		watchKind kind,
+		watchHandlerFn fn,
+		void *user_data);
+
+	bool get(
+		watchKind kind,
+		std::vector<std::string> &list) const;
+
+public:
+
+	// Starts watching
+	Watcher();
+
+	// Stops watching
+	~Watcher();
+
+	// Adds a handler for elements/streams. The handler is first called
+	//	with added set for everything already in the snapshot
+	void watchElements(
+		watchHandlerFn fn,
+		void *user_data);
+	void watchStreams(
+		watchHandlerFn fn,
+		void *user_data);
+
+	// Gets the elements/streams in the snapshot. Returns false if the
+	//	snapshot isn't in sync with redis, i.e. before the first query or
+	//	while reconnecting, and the list is left alone
+	bool getElements(
+		std::vector<std::string> &elem_list) const;
+	bool getStreams(
+		std::vector<std::string> &stream_list) const;
+};
+
+} // namespace atom
+
+#endif // __ATOM_CPP_WATCHER_H
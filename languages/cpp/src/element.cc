@@ -9,6 +9,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 #include <mutex>
 #include <queue>
+#include <set>
 #include <assert.h>
 #include <string.h>
 #include <iostream>
@@ -40,6 +41,12 @@ extern "C" {
 		int n_kv_items,
 		void *user_data);
 
+	bool entryRangeResponseCB(
+		const char *id,
+		const struct redis_xread_kv_item *kv_items,
+		int n_kv_items,
+		void *user_data);
+
 	int commandCB(
 		uint8_t *data,
 		size_t data_len,
@@ -58,9 +65,13 @@ public:
 	readHandlerFn fn;
 	void *data;
 
+	// Freshness of the stream if it's tracked
+	StreamFreshness *freshness;
+
 	EntryReadInfo(
 		readHandlerFn f,
-		void *d) : fn(f), data(d)
+		void *d,
+		StreamFreshness *fr = NULL) : fn(f), data(d), freshness(fr)
 	{
 
 	}
@@ -182,10 +193,10 @@ void Element::cleanupContextPool()
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  @brief Gets a context from our context pool
+//  @brief Takes a context from our context pool as it is
 //
 ////////////////////////////////////////////////////////////////////////////////
-redisContext *Element::getContext()
+redisContext *Element::popContext()
 {
 	std::lock_guard<std::mutex> lock(context_mutex);
 	redisContext *ctx = context_pool.front();
@@ -195,11 +206,38 @@ redisContext *Element::getContext()
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  @brief Releases a context back to the context pool
+//  @brief Gets a context from our context pool. If the context lost its
+//			connection it's reconnected before it's handed out. If that
+//			fails the context goes back in the pool to be tried again
+//			later and NULL is returned.
+//
+////////////////////////////////////////////////////////////////////////////////
+redisContext *Element::getContext()
+{
+	redisContext *ctx = popContext();
+
+	if (ctx->err &&
+		!redis_context_reconnect(ctx, REDIS_RECONNECT_DEFAULT_TIMEOUT_MS))
+	{
+		releaseContext(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Releases a context back to the context pool. Does nothing for
+//			NULL s.t. a failed getContext() can be released as well.
 //
 ////////////////////////////////////////////////////////////////////////////////
 void Element::releaseContext(redisContext *ctx)
 {
+	if (ctx == NULL) {
+		return;
+	}
+
 	std::lock_guard<std::mutex> lock(context_mutex);
 	context_pool.push(ctx);
 }
@@ -212,7 +250,8 @@ void Element::releaseContext(redisContext *ctx)
 ////////////////////////////////////////////////////////////////////////////////
 Element::Element(
 	std::string n,
-	int n_contexts) : context_pool(), context_mutex()
+	int n_contexts) : context_pool(), context_mutex(), watcher(NULL),
+	freshness(NULL)
 {
 	// Copy over the name
 	name = n;
@@ -222,6 +261,10 @@ Element::Element(
 
 	// Get a context
 	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		cleanupContextPool();
+		throw std::runtime_error("Failed to connect to redis");
+	}
 
 	// Make an element
 	elem = element_init(ctx, name.c_str());
@@ -238,7 +281,16 @@ Element::Element(
 ////////////////////////////////////////////////////////////////////////////////
 Element::~Element()
 {
+	// Stop watching before anything it could be calling into goes away
+	delete watcher;
+	delete freshness;
+
+	// Clean up even if redis can't be reached, the keys just won't be
+	//	removed then
 	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		ctx = popContext();
+	}
 
 	// Need to clean up all of the stream infos that we're publishing
 	for (auto const &x : streams) {
@@ -313,8 +365,19 @@ bool getAllElementsStreamsCB(
 enum atom_error_t Element::getAllElements(
 	std::vector<std::string> &elem_list)
 {
+	// If we're watching, answer from the snapshot
+	{
+		std::lock_guard<std::mutex> lock(watcher_mutex);
+		if ((watcher != NULL) && watcher->getElements(elem_list)) {
+			return ATOM_NO_ERROR;
+		}
+	}
+
 	// Get a context
 	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
 
 	// Call the function to get all elements
 	enum atom_error_t err = atom_get_all_elements_cb(
@@ -336,8 +399,24 @@ enum atom_error_t Element::getAllStreams(
 	std::vector<std::string> &stream_list,
 	std::string element)
 {
+	// If we're watching, answer from the snapshot. It has streams as
+	//	element:stream and we only want the stream names
+	std::vector<std::string> watched;
+	if (getWatchedStreams(watched)) {
+		std::string prefix = element + ":";
+		for (auto const &x : watched) {
+			if (x.compare(0, prefix.size(), prefix) == 0) {
+				stream_list.emplace_back(x.substr(prefix.size()));
+			}
+		}
+		return ATOM_NO_ERROR;
+	}
+
 	// Get a context
 	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
 
 	// Call the function to get all streams
 	enum atom_error_t err = atom_get_all_data_streams_cb(
@@ -359,20 +438,25 @@ enum atom_error_t Element::getAllStreams(
 enum atom_error_t Element::getAllStreams(
 	std::map<std::string, std::vector<std::string>> &stream_map)
 {
-	// Get a context
-	redisContext *ctx = getContext();
-
 	// Make the list for all of the strings
 	std::vector<std::string> stream_list;
+	enum atom_error_t err = ATOM_NO_ERROR;
 
-	// Call the function to get all streams
-	enum atom_error_t err = atom_get_all_data_streams_cb(
-		ctx,
-		NULL,
-		getAllElementsStreamsCB,
-		(void*)&stream_list);
+	// Call the function to get all streams if we're not watching
+	if (!getWatchedStreams(stream_list)) {
+		redisContext *ctx = getContext();
+		if (ctx == NULL) {
+			return ATOM_REDIS_ERROR;
+		}
 
-	releaseContext(ctx);
+		err = atom_get_all_data_streams_cb(
+			ctx,
+			NULL,
+			getAllElementsStreamsCB,
+			(void*)&stream_list);
+
+		releaseContext(ctx);
+	}
 
 	// Now, parse the list down into the map
 	for (auto const &x: stream_list) {
@@ -398,6 +482,60 @@ enum atom_error_t Element::getAllStreams(
 	return err;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the watcher, starting it on the first call
+//
+////////////////////////////////////////////////////////////////////////////////
+Watcher *Element::getWatcher()
+{
+	std::lock_guard<std::mutex> lock(watcher_mutex);
+
+	if (watcher == NULL) {
+		watcher = new Watcher();
+	}
+
+	return watcher;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the streams from the watcher's snapshot. Returns false if
+//			we're not watching or the snapshot isn't in sync
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Element::getWatchedStreams(
+	std::vector<std::string> &stream_list)
+{
+	std::lock_guard<std::mutex> lock(watcher_mutex);
+
+	return (watcher != NULL) && watcher->getStreams(stream_list);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Calls the handler for each element added or removed
+//
+////////////////////////////////////////////////////////////////////////////////
+void Element::watchElements(
+	watchHandlerFn fn,
+	void *user_data)
+{
+	getWatcher()->watchElements(fn, user_data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Calls the handler for each stream added or removed
+//
+////////////////////////////////////////////////////////////////////////////////
+void Element::watchStreams(
+	watchHandlerFn fn,
+	void *user_data)
+{
+	getWatcher()->watchStreams(fn, user_data);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  @brief Response callback for when we send a command. This will just
@@ -424,11 +562,11 @@ bool sendCommandResponseCB(
 void commandCleanup(
 	void *cleanup_ptr)
 {
-	// Cast the user data into a command
-	Command *cmd = (Command *)cleanup_ptr;
+	// The cleanup pointer is the context of the call
+	CommandContext *ctx = (CommandContext *)cleanup_ptr;
 
-	// Clean up anything the command allocated
-    cmd->_cleanup();
+	// Let the command clean up and return the context to its pool
+	ctx->cmd->_end(ctx);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -452,15 +590,13 @@ int commandCB(
 	const char *runError = "Failed to run";
 	const char *serializeError = "Failed to serialize";
 
-	// We'll need to call the _cleanup function for the
-	//	command after it's done
-	*cleanup_ptr = user_data;
-
 	// Cast the user data into a command
 	Command *cmd = (Command *)user_data;
 
-	// Initialize the command
-	cmd->_init();
+	// Get a context for the call. We'll need to hand it back to the
+	//	command once the response has been sent
+	CommandContext *ctx = cmd->_begin();
+	*cleanup_ptr = ctx;
 
 	// Run through the command functions
     if (!cmd->deserialize(data, data_len)) {
@@ -485,12 +621,12 @@ int commandCB(
     }
 
 	// If we had a successful handler call
-	if (!cmd->response->isError()) {
+	if (!ctx->response.isError()) {
 
 		// Copy over the data, if any
-		if (cmd->response->hasData()) {
-			*response = (uint8_t*)cmd->response->getDataPtr();
-			*response_len = cmd->response->getDataLen();
+		if (ctx->response.hasData()) {
+			*response = (uint8_t*)ctx->response.getDataPtr();
+			*response_len = ctx->response.getDataLen();
 		} else {
 			*response = NULL;
 			*response_len = 0;
@@ -498,10 +634,10 @@ int commandCB(
 
 	// Otherwise get the error string and log the error
 	} else {
-		*error_str = (char*)cmd->response->getErrorStrPtr();
+		*error_str = (char*)ctx->response.getErrorStrPtr();
 	}
 
-	error = cmd->response->getError();
+	error = ctx->response.getError();
 
 done:
 	if (error != 0) {
@@ -539,6 +675,7 @@ void Element::addCommand(
 		user_data,
 		timeout);
 	new_cmd->addElement(this);
+	new_cmd->prepareContexts();
 
 	// Put the command in the map
 	commands.emplace(name, new_cmd);
@@ -565,6 +702,7 @@ void Element::addCommand(
 	Command *cmd)
 {
 	cmd->addElement(this);
+	cmd->prepareContexts();
 	commands.emplace(cmd->name, cmd);
 
 	if (!element_command_add(
@@ -577,6 +715,13 @@ void Element::addCommand(
 	{
 		error("Failed to add command");
 	}
+
+	// Note how the command's responses are serialized
+	if ((cmd->serialization() != NULL) &&
+		!element_command_set_ser(elem, cmd->name.c_str(), cmd->serialization()))
+	{
+		error("Failed to set command serialization");
+	}
 }
 
 
@@ -589,6 +734,9 @@ enum atom_error_t Element::commandLoop(
 	int n_loops)
 {
 	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
 	enum atom_error_t err;
 
 	if (n_loops == ELEMENT_INFINITE_COMMAND_LOOPS) {
@@ -632,15 +780,23 @@ enum atom_error_t Element::sendCommand(
 
 	// Get a redis context
 	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		response.setError(ATOM_REDIS_ERROR, "Failed to connect to redis");
+		return ATOM_REDIS_ERROR;
+	}
+
+	// Compress the data if we've been told to
+	auto codec = command_codecs.find(element + ":" + command);
 
 	// Attempt to send the command
-	enum atom_error_t err = element_command_send(
+	enum atom_error_t err = element_command_send_codec(
 		ctx,
 		elem,
 		element.c_str(),
 		command.c_str(),
 		data,
 		data_len,
+		(codec != command_codecs.end()) ? &codec->second : NULL,
 		block,
 		sendCommandResponseCB,
 		(void*)&response,
@@ -687,6 +843,13 @@ bool entryReadResponseCB(
 		}
 	}
 
+	// Note when it got here before handing it off
+	if (udata->freshness != NULL) {
+		auto timestamp = e.getData().find(DATA_KEY_TIMESTAMP_STR);
+		udata->freshness->update(id,
+			(timestamp != e.getData().end()) ? &timestamp->second : NULL);
+	}
+
 	// Now, we want to call the user callback
 	if (!udata->fn(e, udata->data)) {
 		atom_logf(NULL, NULL, LOG_ERR, "User callback failed");
@@ -695,6 +858,32 @@ bool entryReadResponseCB(
 	return true;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Callback for each entry in a range read. Same as a regular
+//			read except that the user callback returning false stops the read
+//
+////////////////////////////////////////////////////////////////////////////////
+bool entryRangeResponseCB(
+	const char *id,
+	const struct redis_xread_kv_item *kv_items,
+	int n_kv_items,
+	void *user_data)
+{
+	// Cast the user data to the proper handler function
+	EntryReadInfo *udata = (EntryReadInfo *)user_data;
+
+	// Convert the kv items into the entry
+	Entry e(id);
+	for (int i = 0; i < n_kv_items; ++i) {
+		if (kv_items[i].found) {
+			e.addData(kv_items[i].key, kv_items[i].reply->str, kv_items[i].reply->len);
+		}
+	}
+
+	return udata->fn(e, udata->data);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  @brief Reads in a loop from the handlers in the ElementReadMap
@@ -737,7 +926,8 @@ struct element_entry_read_info *Element::readMapToEntryInfo(
 		// Fill in the handler and response callback
 		read_infos[i].user_data = (void*)new EntryReadInfo(
 			std::get<3>(handler),
-			std::get<4>(handler));
+			std::get<4>(handler),
+			findFreshness(element, std::get<1>(handler)));
 		read_infos[i].response_cb = entryReadResponseCB;
 	}
 
@@ -785,12 +975,16 @@ enum atom_error_t Element::entryReadLoop(
 	ElementReadMap &m,
 	int n_loops)
 {
+	// Get a context before allocating anything s.t. there's nothing to
+	//	clean up if redis can't be reached
+	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
+
 	struct element_entry_read_info *read_infos = readMapToEntryInfo(m);
 	size_t n_infos = m.getNumHandlers();
 
-	// And now call element_entry_read_loop
-	redisContext *ctx = getContext();
-
 	// And if we're looping infinitely
 	enum atom_error_t err;
 	if (n_loops == ELEMENT_INFINITE_READ_LOOPS) {
@@ -853,6 +1047,13 @@ enum atom_error_t Element::entryReadN(
 	size_t n,
 	std::vector<Entry> &ret)
 {
+	// Get a context before allocating anything s.t. there's nothing to
+	//	clean up if redis can't be reached
+	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
+
 	struct element_entry_read_info read_info;
 
 	// Fill in the read info
@@ -879,7 +1080,6 @@ enum atom_error_t Element::entryReadN(
 	read_info.response_cb = entryReadResponseCB;
 
 	// And now call element_entry_read_n
-	redisContext *ctx = getContext();
 	enum atom_error_t err = element_entry_read_n(
 		ctx,
 		elem,
@@ -896,6 +1096,77 @@ enum atom_error_t Element::entryReadN(
 	return err;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Reads the newest entry of each stream at one point in time
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t Element::entryReadLatestMulti(
+	std::vector<entry_read_stream_t> &streams,
+	std::vector<Entry> &ret,
+	uint64_t reference_ms,
+	size_t window)
+{
+	// Get a context before allocating anything s.t. there's nothing to
+	//	clean up if redis can't be reached
+	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
+
+	size_t n_infos = streams.size();
+	std::vector<struct element_entry_read_info> read_infos(n_infos);
+	std::vector<std::vector<Entry>> entries(n_infos);
+
+	// Fill in the read info for each stream
+	for (size_t i = 0; i < n_infos; ++i) {
+		const std::string &element = std::get<0>(streams[i]);
+		std::vector<std::string> &keys = std::get<2>(streams[i]);
+
+		read_infos[i].element = (element.size() > 0) ? element.c_str() : NULL;
+		read_infos[i].stream = std::get<1>(streams[i]).c_str();
+
+		read_infos[i].kv_items = (struct redis_xread_kv_item *)
+			malloc(keys.size() * sizeof(struct redis_xread_kv_item));
+		assert(read_infos[i].kv_items != NULL);
+		read_infos[i].n_kv_items = keys.size();
+		for (size_t j = 0; j < keys.size(); ++j) {
+			read_infos[i].kv_items[j].key = keys[j].c_str();
+			read_infos[i].kv_items[j].key_len = keys[j].size();
+		}
+
+		read_infos[i].user_data = (void*)new EntryReadInfo(
+			entryCopyCB, (void*)&entries[i]);
+		read_infos[i].response_cb = entryReadResponseCB;
+	}
+
+	// Do the read
+	enum atom_error_t err = element_entry_read_latest_multi(
+		ctx,
+		elem,
+		read_infos.data(),
+		n_infos,
+		reference_ms,
+		window);
+	releaseContext(ctx);
+
+	// Clean up and pass back one entry per stream
+	for (size_t i = 0; i < n_infos; ++i) {
+		delete (EntryReadInfo *)read_infos[i].user_data;
+		free(read_infos[i].kv_items);
+
+		if (err == ATOM_NO_ERROR) {
+			if (entries[i].size() > 0) {
+				ret.emplace_back(std::move(entries[i][0]));
+			} else {
+				ret.emplace_back("");
+			}
+		}
+	}
+
+	return err;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  @brief Reads at most N entries from the stream since the passed ID.
@@ -911,6 +1182,13 @@ enum atom_error_t Element::entryReadSince(
 	std::string last_id,
 	int timeout)
 {
+	// Get a context before allocating anything s.t. there's nothing to
+	//	clean up if redis can't be reached
+	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
+
 	struct element_entry_read_info read_info;
 
 	// Fill in the read info
@@ -937,7 +1215,6 @@ enum atom_error_t Element::entryReadSince(
 	read_info.response_cb = entryReadResponseCB;
 
 	// And now call element_entry_read_since
-	redisContext *ctx = getContext();
 	enum atom_error_t err = element_entry_read_since(
 		ctx,
 		elem,
@@ -958,69 +1235,159 @@ enum atom_error_t Element::entryReadSince(
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  @brief Writes an entry to a stream
+//  @brief Reads all entries on the stream between the start and end IDs,
+//			inclusive, passing each to the handler from oldest to newest.
+//			Entries are paged in page_size at a time s.t. ranges of any
+//			length can be replayed in constant memory. The handler returning
+//			false stops the read.
 //
 ////////////////////////////////////////////////////////////////////////////////
-enum atom_error_t Element::entryWrite(
+enum atom_error_t Element::entryReadRange(
+	std::string element,
 	std::string stream,
-	entry_data_t &data,
-	int timestamp,
-	int maxlen)
+	std::vector<std::string> &keys,
+	readHandlerFn fn,
+	void *user_data,
+	std::string start_id,
+	std::string end_id,
+	size_t page_size)
 {
+	// Get a context before allocating anything s.t. there's nothing to
+	//	clean up if redis can't be reached
 	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
 
-	// Try to find the write info for the stream
-	auto exists = streams.find(stream);
-	struct element_entry_write_info *info = NULL;
+	struct element_entry_read_info read_info;
 
-	// We did not find the write info or the number of keys was off
-	if ((exists == streams.end()) ||
-		(exists->second->n_items != data.size()))
-	{
-		// If the stream info exists we want to clean it up
-		if (exists != streams.end()) {
-			info = exists->second;
-			for (size_t i = 0; i < info->n_items; ++i) {
-				free((char*)info->items[i].key);
-			}
-			element_entry_write_cleanup(ctx, exists->second);
-		}
+	// Fill in the read info
+	read_info.element = (element.size() > 0) ? element.c_str() : NULL;
+	read_info.stream = stream.c_str();
 
-		// Make the info
-		info = element_entry_write_init(
-			ctx,
-			elem,
-			stream.c_str(),
-			data.size());
-		assert(info != NULL);
+	// Get the keys
+	size_t n_keys = keys.size();
+
+	// Make the KV items
+	read_info.kv_items = (struct redis_xread_kv_item *)
+		malloc(n_keys * sizeof(struct redis_xread_kv_item));
+	assert(read_info.kv_items != NULL);
+	read_info.n_kv_items = n_keys;
 
-		// Fill in the keys in the info
-		int idx = 0;
-		for (auto const &x: data) {
+	// Fill in the kv items
+	for (size_t j = 0; j < n_keys; ++j) {
+		read_info.kv_items[j].key = keys[j].c_str();
+		read_info.kv_items[j].key_len = keys[j].size();
+	}
 
-			// Fill in the write info
-			info->items[idx].key = strdup(x.first.c_str());
-			info->items[idx].key_len = x.first.size();
+	// Fill in the handler and response callback
+	EntryReadInfo handler(fn, user_data);
+	read_info.user_data = (void*)&handler;
+	read_info.response_cb = entryRangeResponseCB;
 
-			// Increment the index
-			idx += 1;
-		}
+	// And now call element_entry_read_range
+	enum atom_error_t err = element_entry_read_range(
+		ctx,
+		elem,
+		&read_info,
+		start_id.c_str(),
+		end_id.c_str(),
+		page_size);
 
-		streams.emplace(stream, info);
+	// Put the context back
+	releaseContext(ctx);
 
-	// We found the write info
-	} else {
-		info = exists->second;
+	free(read_info.kv_items);
+
+	return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the retention for a data stream, applying it to the
+//			stream's write info now if we've written it before
+//
+////////////////////////////////////////////////////////////////////////////////
+void Element::setEntryRetention(
+	std::string stream,
+	uint64_t max_age_ms,
+	uint64_t max_bytes,
+	unsigned int trim_every)
+{
+	struct element_entry_retention r;
+	r.max_age_ms = max_age_ms;
+	r.max_bytes = max_bytes;
+	r.trim_every = trim_every;
+
+	retention[stream] = r;
+
+	auto exists = streams.find(stream);
+	if (exists != streams.end()) {
+		exists->second->retention = r;
 	}
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the codec for a data stream, applying it to the stream's
+//			write info now if we've written it before
+//
+////////////////////////////////////////////////////////////////////////////////
+void Element::setEntryCodec(
+	std::string stream,
+	const struct atom_codec &codec)
+{
+	entry_codecs[stream] = codec;
+
+	auto exists = streams.find(stream);
+	if (exists != streams.end()) {
+		exists->second->codec = codec;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the codec for the data sent to another element's command
+//
+////////////////////////////////////////////////////////////////////////////////
+void Element::setCommandCodec(
+	std::string element,
+	std::string command,
+	const struct atom_codec &codec)
+{
+	command_codecs[element + ":" + command] = codec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the codec for the responses of one of our commands
+//
+////////////////////////////////////////////////////////////////////////////////
+void Element::setCommandResponseCodec(
+	std::string command,
+	const struct atom_codec &codec)
+{
+	if (!element_command_set_codec(elem, command.c_str(), &codec)) {
+		error("Failed to set command codec");
+	}
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Points the items in the write info at the data
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Element::fillEntryWriteInfo(
+	struct element_entry_write_info *info,
+	entry_data_t &data)
+{
 	// Loop over the keys in the info
 	for (size_t idx = 0; idx < info->n_items; ++idx) {
 
 		// Find the item in the input dict
 		auto item = data.find(info->items[idx].key);
 		if (item == data.end()) {
-			std::runtime_error("Invalid key for stream");
+			return false;
 		}
 
 		// Fill in the data size and length
@@ -1028,6 +1395,35 @@ enum atom_error_t Element::entryWrite(
 		info->items[idx].data_len = item->second.size();
 	}
 
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes an entry to a stream
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t Element::entryWrite(
+	std::string stream,
+	entry_data_t &data,
+	int timestamp,
+	int maxlen)
+{
+	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
+
+	// Get the write info for the stream
+	struct element_entry_write_info *info =
+		getEntryWriteInfo(ctx, stream, data);
+
+	// Fill in the data
+	if (!fillEntryWriteInfo(info, data)) {
+		releaseContext(ctx);
+		return ATOM_COMMAND_INVALID_DATA;
+	}
+
 	// Do the write
 	enum atom_error_t err = element_entry_write(
 		ctx,
@@ -1042,6 +1438,218 @@ enum atom_error_t Element::entryWrite(
 	return err;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Makes a writer for a data stream with the keys bound up front
+//
+////////////////////////////////////////////////////////////////////////////////
+StreamWriter Element::streamWriter(
+	std::string stream,
+	std::vector<std::string> keys)
+{
+	return StreamWriter(elem, stream, std::move(keys));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Makes a subscription to the streams in the map
+//
+////////////////////////////////////////////////////////////////////////////////
+Subscription Element::subscribe(
+	ElementReadMap &m,
+	std::string start_id)
+{
+	return Subscription(
+		elem,
+		readMapToEntryInfo(m),
+		m.getNumHandlers(),
+		start_id.empty() ? ELEMENT_ENTRY_SUBSCRIPTION_START_NOW : start_id.c_str());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes an entry to each of the streams atomically
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t Element::entryWriteMulti(
+	std::vector<std::pair<std::string, entry_data_t>> &entries,
+	std::vector<std::string> &ids,
+	int timestamp,
+	int maxlen)
+{
+	std::vector<struct element_entry_write_info *> infos;
+	std::set<std::string> seen;
+
+	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
+
+	// Get the write info for each stream and fill in its data
+	for (auto &x : entries) {
+		if (!seen.insert(x.first).second) {
+			releaseContext(ctx);
+			return ATOM_COMMAND_INVALID_DATA;
+		}
+
+		struct element_entry_write_info *info =
+			getEntryWriteInfo(ctx, x.first, x.second);
+		if (!fillEntryWriteInfo(info, x.second)) {
+			releaseContext(ctx);
+			return ATOM_COMMAND_INVALID_DATA;
+		}
+		infos.push_back(info);
+	}
+
+	// Do the writes
+	std::vector<char> ret_ids(infos.size() * STREAM_ID_BUFFLEN);
+	enum atom_error_t err = element_entry_write_multi(
+		ctx,
+		infos.data(),
+		infos.size(),
+		timestamp,
+		maxlen,
+		(char (*)[STREAM_ID_BUFFLEN])ret_ids.data());
+
+	releaseContext(ctx);
+
+	if (err == ATOM_NO_ERROR) {
+		for (size_t i = 0; i < infos.size(); ++i) {
+			ids.emplace_back(&ret_ids[i * STREAM_ID_BUFFLEN]);
+		}
+	}
+
+	return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the freshness monitor, making it if needed
+//
+////////////////////////////////////////////////////////////////////////////////
+FreshnessMonitor *Element::getFreshnessMonitor()
+{
+	std::lock_guard<std::mutex> lock(freshness_mutex);
+
+	if (freshness == NULL) {
+		freshness = new FreshnessMonitor();
+	}
+
+	return freshness;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the tracker for a stream if we're tracking it. Called when
+//			setting up reads s.t. they update it without a lookup per entry
+//
+////////////////////////////////////////////////////////////////////////////////
+StreamFreshness *Element::findFreshness(
+	const std::string &element,
+	const std::string &stream)
+{
+	std::lock_guard<std::mutex> lock(freshness_mutex);
+
+	return (freshness != NULL) ? freshness->find(element, stream) : NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Starts tracking the freshness of a stream. Measures the offset to
+//			the server's clock if it hasn't been s.t. latencies can be
+//			worked out from entry IDs.
+//
+////////////////////////////////////////////////////////////////////////////////
+void Element::trackFreshness(
+	std::string element,
+	std::string stream)
+{
+	struct redis_clock clock;
+
+	redisContext *ctx = getContext();
+	if ((ctx == NULL) || !redis_clock_get(ctx, &clock)) {
+		log(LOG_WARNING, "Couldn't sync clock, no latencies for %s:%s",
+			element.c_str(), stream.c_str());
+	}
+	releaseContext(ctx);
+
+	getFreshnessMonitor()->track(element, stream);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the staleness watchdog for a stream
+//
+////////////////////////////////////////////////////////////////////////////////
+void Element::setStalenessWatchdog(
+	std::string element,
+	std::string stream,
+	uint64_t timeout_ms,
+	stalenessFn fn,
+	void *user_data)
+{
+	trackFreshness(element, stream);
+	getFreshnessMonitor()->setWatchdog(element, stream, timeout_ms, fn, user_data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the freshness of one or all tracked streams
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Element::getFreshness(
+	std::string element,
+	std::string stream,
+	FreshnessStats &stats)
+{
+	std::lock_guard<std::mutex> lock(freshness_mutex);
+
+	return (freshness != NULL) && freshness->get(element, stream, stats);
+}
+
+void Element::getAllFreshness(
+	std::vector<FreshnessStats> &stats)
+{
+	std::lock_guard<std::mutex> lock(freshness_mutex);
+
+	stats.clear();
+	if (freshness != NULL) {
+		freshness->getAll(stats);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Publishes or gets the spans recorded while tracing
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t Element::tracePublish(
+	bool clear)
+{
+	redisContext *ctx = getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
+	enum atom_error_t err = atom_trace_publish(ctx, elem, clear);
+	releaseContext(ctx);
+
+	return err;
+}
+
+std::string Element::traceDump(
+	bool clear)
+{
+	size_t len = 0;
+	char *json = atom_trace_dump_str(elem->name.str, clear, &len);
+	if (json == NULL) {
+		return "";
+	}
+
+	std::string ret(json, len);
+	free(json);
+	return ret;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  @brief Writes a log message
@@ -1051,9 +1659,8 @@ void Element::log(
 	int level,
 	std::string msg)
 {
-	redisContext *ctx = getContext();
-	enum atom_error_t err = atom_log(ctx, elem, level, msg.c_str(), msg.size());
-	releaseContext(ctx);
+	// Logs are shipped in the background, so no need for a context
+	enum atom_error_t err = atom_log(NULL, elem, level, msg.c_str(), msg.size());
 	if (err != ATOM_NO_ERROR) {
 		error("Failed to log", false);
 	}
@@ -1072,9 +1679,8 @@ void Element::log(
 	va_list args;
 	va_start(args, fmt);
 
-	redisContext *ctx = getContext();
-	enum atom_error_t err = atom_vlogf(ctx, elem, level, fmt, args);
-	releaseContext(ctx);
+	enum atom_error_t err = atom_vlogf(NULL, elem, level, fmt, args);
+	va_end(args);
 	if (err != ATOM_NO_ERROR) {
 		error("Failed to log", false);
 	}
@@ -20,6 +20,21 @@
 
 namespace atom {
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Resets the response in place. The string buffers keep their
+//			capacity s.t. reusing the response doesn't allocate.
+//
+////////////////////////////////////////////////////////////////////////////////
+void ElementResponse::reset()
+{
+	data.clear();
+	data_ref = NULL;
+	data_ref_len = 0;
+	err = 0;
+	err_str.clear();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  @brief Sets the data
@@ -30,7 +45,9 @@ void ElementResponse::setData(
 	size_t l)
 {
 	if (l != 0) {
-		data = std::string((const char *)d, l);
+		data.assign((const char *)d, l);
+		data_ref = NULL;
+		data_ref_len = 0;
 	}
 }
 
@@ -42,7 +59,24 @@ void ElementResponse::setData(
 void ElementResponse::setData(
 	std::string d)
 {
-	data = d;
+	data = std::move(d);
+	data_ref = NULL;
+	data_ref_len = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the data to reference memory we don't own. Nothing is
+//			copied until/unless the data is asked for as a string.
+//
+////////////////////////////////////////////////////////////////////////////////
+void ElementResponse::setDataRef(
+	const uint8_t *d,
+	size_t l)
+{
+	data.clear();
+	data_ref = (l != 0) ? d : NULL;
+	data_ref_len = l;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -52,7 +86,7 @@ void ElementResponse::setData(
 ////////////////////////////////////////////////////////////////////////////////
 bool ElementResponse::hasData()
 {
-	return (data.size() != 0);
+	return (getDataLen() != 0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -90,6 +124,9 @@ void ElementResponse::setError(
 ////////////////////////////////////////////////////////////////////////////////
 const uint8_t *ElementResponse::getDataPtr()
 {
+	if (data_ref != NULL) {
+		return data_ref;
+	}
 	return (const uint8_t*)data.c_str();
 }
 
@@ -100,6 +137,9 @@ const uint8_t *ElementResponse::getDataPtr()
 ////////////////////////////////////////////////////////////////////////////////
 size_t ElementResponse::getDataLen()
 {
+	if (data_ref != NULL) {
+		return data_ref_len;
+	}
 	return data.size();
 }
 
@@ -110,6 +150,13 @@ size_t ElementResponse::getDataLen()
 ////////////////////////////////////////////////////////////////////////////////
 const std::string &ElementResponse::getData()
 {
+	// If we're referencing someone else's memory then we need to
+	//	make the string now
+	if (data_ref != NULL) {
+		data.assign((const char *)data_ref, data_ref_len);
+		data_ref = NULL;
+		data_ref_len = 0;
+	}
 	return data;
 }
 
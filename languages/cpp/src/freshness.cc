@@ -0,0 +1,434 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file freshness.cc
+//
+//  @brief Freshness tracking and staleness watchdog for streams we read
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+#include <tuple>
+
+#include "freshness.h"
+
+namespace atom {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets a monotonic time in us, on the same clock as
+//			redis_monotonic_ms
+//
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t freshnessMonotonicUs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the bucket a value goes in
+//
+////////////////////////////////////////////////////////////////////////////////
+static size_t freshnessBucket(
+	uint64_t value)
+{
+	size_t bucket = 0;
+
+	while ((value != 0) && (bucket < FRESHNESS_HISTOGRAM_BUCKETS - 1)) {
+		value >>= 1;
+		bucket += 1;
+	}
+
+	return bucket;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Histogram constructor
+//
+////////////////////////////////////////////////////////////////////////////////
+FreshnessHistogram::FreshnessHistogram()
+{
+	clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds a value to the histogram
+//
+////////////////////////////////////////////////////////////////////////////////
+void FreshnessHistogram::add(
+	uint64_t value)
+{
+	counts[freshnessBucket(value)] += 1;
+	sum += value;
+	if ((n == 0) || (value < min)) {
+		min = value;
+	}
+	if (value > max) {
+		max = value;
+	}
+	n += 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Drops all values from the histogram
+//
+////////////////////////////////////////////////////////////////////////////////
+void FreshnessHistogram::clear()
+{
+	memset(counts, 0, sizeof(counts));
+	n = 0;
+	sum = 0;
+	min = 0;
+	max = 0;
+}
+
+uint64_t FreshnessHistogram::getCount() const
+{
+	return n;
+}
+
+uint64_t FreshnessHistogram::getMin() const
+{
+	return min;
+}
+
+uint64_t FreshnessHistogram::getMax() const
+{
+	return max;
+}
+
+double FreshnessHistogram::getMean() const
+{
+	return (n > 0) ? ((double)sum / n) : 0.0;
+}
+
+uint64_t FreshnessHistogram::getBucket(
+	size_t bucket) const
+{
+	return (bucket < FRESHNESS_HISTOGRAM_BUCKETS) ? counts[bucket] : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the value p percent of the values are at or below. Only
+//			the bucket is known s.t. it's the top of the bucket, capped
+//			at the max
+//
+////////////////////////////////////////////////////////////////////////////////
+uint64_t FreshnessHistogram::getPercentile(
+	double p) const
+{
+	uint64_t rank, seen = 0;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	// Rank of the value we want, counting from 1
+	rank = (uint64_t)((p / 100.0) * n + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	} else if (rank > n) {
+		rank = n;
+	}
+
+	for (size_t i = 0; i < FRESHNESS_HISTOGRAM_BUCKETS; ++i) {
+		seen += counts[i];
+		if (seen >= rank) {
+			uint64_t top = (i == 0) ? 0 : ((uint64_t)1 << i) - 1;
+			return ((top > max) || (i == FRESHNESS_HISTOGRAM_BUCKETS - 1)) ?
+				max : top;
+		}
+	}
+
+	return max;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Stream tracker constructor
+//
+////////////////////////////////////////////////////////////////////////////////
+StreamFreshness::StreamFreshness(
+	const std::string &element,
+	const std::string &stream) : started_us(freshnessMonotonicUs()),
+	last_arrival_us(0), last_interval_us(0), timeout_ms(0), fn(NULL),
+	user_data(NULL)
+{
+	stats.element = element;
+	stats.stream = stream;
+	stats.n_entries = 0;
+	stats.age_ms = 0;
+	stats.stale = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Notes an entry read from the stream. The latency only makes it
+//			in once the clock offset's been measured.
+//
+////////////////////////////////////////////////////////////////////////////////
+void StreamFreshness::update(
+	const char *id,
+	const std::string *timestamp)
+{
+	uint64_t now_us = freshnessMonotonicUs();
+	uint64_t xadd_ms, latency_ms = 0;
+	bool has_latency;
+
+	// Convert outside the lock, it can take the clock's
+	has_latency = redis_clock_id_to_monotonic_ms(NULL, id, &xadd_ms);
+	if (has_latency && ((now_us / 1000) > xadd_ms)) {
+		latency_ms = (now_us / 1000) - xadd_ms;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (has_latency) {
+		stats.latency_ms.add(latency_ms);
+	}
+
+	// Jitter is how much the time between entries changed
+	if (stats.n_entries > 0) {
+		uint64_t interval_us = now_us - last_arrival_us;
+		if (stats.n_entries > 1) {
+			stats.jitter_us.add((interval_us > last_interval_us) ?
+				(interval_us - last_interval_us) :
+				(last_interval_us - interval_us));
+		}
+		last_interval_us = interval_us;
+	}
+
+	last_arrival_us = now_us;
+	stats.n_entries += 1;
+	stats.last_id.assign(id);
+	if (timestamp != NULL) {
+		stats.last_timestamp = *timestamp;
+	}
+
+	// Re-arm the watchdog
+	stats.stale = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Copies out the stats with the age as of now
+//
+////////////////////////////////////////////////////////////////////////////////
+void StreamFreshness::get(
+	FreshnessStats &out)
+{
+	uint64_t now_us = freshnessMonotonicUs();
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	out = stats;
+	out.age_ms = (now_us - ((stats.n_entries > 0) ? last_arrival_us : started_us)) / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Monitor constructor. The watchdog isn't started until it's
+//			needed.
+//
+////////////////////////////////////////////////////////////////////////////////
+FreshnessMonitor::FreshnessMonitor() : running(false), stop(false)
+{
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Monitor destructor. Stops the watchdog and frees the trackers
+//
+////////////////////////////////////////////////////////////////////////////////
+FreshnessMonitor::~FreshnessMonitor()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	cond.notify_all();
+
+	if (thread.joinable()) {
+		thread.join();
+	}
+
+	for (auto &x : streams) {
+		delete x.second;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Starts tracking a stream if we aren't already
+//
+////////////////////////////////////////////////////////////////////////////////
+StreamFreshness *FreshnessMonitor::track(
+	const std::string &element,
+	const std::string &stream)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto exists = streams.find(element + ":" + stream);
+	if (exists != streams.end()) {
+		return exists->second;
+	}
+
+	StreamFreshness *tracker = new StreamFreshness(element, stream);
+	streams.emplace(element + ":" + stream, tracker);
+	return tracker;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the tracker for a stream if it's tracked
+//
+////////////////////////////////////////////////////////////////////////////////
+StreamFreshness *FreshnessMonitor::find(
+	const std::string &element,
+	const std::string &stream)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto exists = streams.find(element + ":" + stream);
+	return (exists != streams.end()) ? exists->second : NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the watchdog for a stream, starting the watchdog thread if
+//			it's the first
+//
+////////////////////////////////////////////////////////////////////////////////
+void FreshnessMonitor::setWatchdog(
+	const std::string &element,
+	const std::string &stream,
+	uint64_t timeout_ms,
+	stalenessFn fn,
+	void *user_data)
+{
+	StreamFreshness *tracker = track(element, stream);
+
+	{
+		std::lock_guard<std::mutex> lock(tracker->mutex);
+		tracker->timeout_ms = timeout_ms;
+		tracker->fn = fn;
+		tracker->user_data = user_data;
+		tracker->stats.stale = false;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!running && (timeout_ms > 0)) {
+		thread = std::thread(&FreshnessMonitor::run, this);
+		running = true;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the stats for a stream
+//
+////////////////////////////////////////////////////////////////////////////////
+bool FreshnessMonitor::get(
+	const std::string &element,
+	const std::string &stream,
+	FreshnessStats &stats)
+{
+	StreamFreshness *tracker = find(element, stream);
+
+	if (tracker == NULL) {
+		return false;
+	}
+
+	tracker->get(stats);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the stats for all tracked streams
+//
+////////////////////////////////////////////////////////////////////////////////
+void FreshnessMonitor::getAll(
+	std::vector<FreshnessStats> &stats)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	stats.resize(streams.size());
+	size_t idx = 0;
+	for (auto &x : streams) {
+		x.second->get(stats[idx]);
+		idx += 1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Runs the watchdog. Every FRESHNESS_WATCHDOG_POLL_MS it marks
+//			streams that have been quiet for their timeout as stale and
+//			calls their handlers. Handlers are called with no locks held
+//			s.t. they can query the monitor.
+//
+////////////////////////////////////////////////////////////////////////////////
+void FreshnessMonitor::run()
+{
+	// element, stream, age, handler and its user data
+	typedef std::tuple<std::string, std::string, uint64_t, stalenessFn, void *> firing;
+	std::vector<firing> fire;
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (!stop) {
+		cond.wait_for(lock, std::chrono::milliseconds(FRESHNESS_WATCHDOG_POLL_MS));
+		if (stop) {
+			break;
+		}
+
+		uint64_t now_us = freshnessMonotonicUs();
+		for (auto &x : streams) {
+			StreamFreshness *tracker = x.second;
+			std::lock_guard<std::mutex> tracker_lock(tracker->mutex);
+
+			if ((tracker->timeout_ms == 0) || tracker->stats.stale) {
+				continue;
+			}
+
+			uint64_t since_us = (tracker->stats.n_entries > 0) ?
+				tracker->last_arrival_us : tracker->started_us;
+			uint64_t age_ms = (now_us - since_us) / 1000;
+			if (age_ms >= tracker->timeout_ms) {
+				tracker->stats.stale = true;
+				if (tracker->fn != NULL) {
+					fire.push_back(firing(tracker->stats.element,
+						tracker->stats.stream, age_ms, tracker->fn,
+						tracker->user_data));
+				}
+			}
+		}
+
+		if (fire.empty()) {
+			continue;
+		}
+
+		lock.unlock();
+		for (auto &f : fire) {
+			std::get<3>(f)(std::get<0>(f), std::get<1>(f), std::get<2>(f),
+				std::get<4>(f));
+		}
+		fire.clear();
+		lock.lock();
+	}
+}
+
+} // namespace atom
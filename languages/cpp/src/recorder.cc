@@ -0,0 +1,760 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file recorder.cc
+//
+//  @brief Recorder and player implementation
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "atom/atom.h"
+#include "atom/redis.h"
+#include "atom/element_entry_write.h"
+#include "recorder.h"
+
+namespace atom {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the path of a segment within a recording
+//
+////////////////////////////////////////////////////////////////////////////////
+static std::string segmentPath(
+	const std::string &dir,
+	uint32_t segment)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "segment-%06u.log", segment);
+	return dir + "/" + name;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Rounds a record length up to keep records 8-byte aligned
+//
+////////////////////////////////////////////////////////////////////////////////
+static size_t recordPad(
+	size_t len)
+{
+	return (len + 7) & ~((size_t)7);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Starts a new recording. The segments are created as entries
+//			come in.
+//
+////////////////////////////////////////////////////////////////////////////////
+Recorder::Recorder(
+	std::string dir,
+	size_t seg_size) :
+	path(dir),
+	segment_size(seg_size),
+	segment(0),
+	segment_fd(-1),
+	segment_map(NULL),
+	segment_map_len(0),
+	segment_used(0),
+	index(NULL),
+	n_entries(0)
+{
+	if ((mkdir(path.c_str(), 0755) != 0) && (errno != EEXIST)) {
+		throw std::runtime_error("Failed to create recording " + path);
+	}
+
+	std::string index_path = path + "/" + RECORDER_INDEX_FILENAME;
+	index = fopen(index_path.c_str(), "wb");
+	if (index == NULL) {
+		throw std::runtime_error("Failed to create index " + index_path);
+	}
+
+	struct recorder_index_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RECORDER_INDEX_MAGIC, sizeof(header.magic));
+	header.version = RECORDER_VERSION;
+	if (fwrite(&header, sizeof(header), 1, index) != 1) {
+		fclose(index);
+		throw std::runtime_error("Failed to write index " + index_path);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Finishes the recording. Trims the last segment down to what
+//			was used, flushes the index and sorts it by time. If sorting
+//			fails the index is left in the order entries were recorded.
+//
+////////////////////////////////////////////////////////////////////////////////
+Recorder::~Recorder()
+{
+	closeSegment();
+	fclose(index);
+	if (!sortIndex()) {
+		fprintf(stderr, "Failed to sort index of %s\n", path.c_str());
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sorts the index by time. Entries from different streams are
+//			recorded in the order they're read, which isn't always the
+//			order of their IDs. The rows are sorted in a mapped copy s.t.
+//			it doesn't take memory per entry, and the copy is then moved
+//			over the index s.t. anyone reading the recording while it's
+//			written doesn't see it change under them.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Recorder::sortIndex()
+{
+	std::string index_path = path + "/" + RECORDER_INDEX_FILENAME;
+	std::string sorting_path = path + "/" + RECORDER_INDEX_SORTING_FILENAME;
+	void *in_map = MAP_FAILED;
+	void *out_map = MAP_FAILED;
+	int in_fd = -1;
+	int out_fd = -1;
+	struct stat st;
+	bool ret_val = false;
+
+	in_fd = open(index_path.c_str(), O_RDONLY);
+	if ((in_fd < 0) || (fstat(in_fd, &st) != 0) ||
+		((size_t)st.st_size < sizeof(struct recorder_index_header)))
+	{
+		goto done;
+	}
+	out_fd = open(sorting_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if ((out_fd < 0) || (ftruncate(out_fd, st.st_size) != 0)) {
+		goto done;
+	}
+
+	in_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, in_fd, 0);
+	out_map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		out_fd, 0);
+	if ((in_map == MAP_FAILED) || (out_map == MAP_FAILED)) {
+		goto done;
+	}
+	memcpy(out_map, in_map, st.st_size);
+
+	{
+		struct recorder_index_header *header =
+			(struct recorder_index_header *)out_map;
+		struct recorder_index_entry *rows =
+			(struct recorder_index_entry *)(header + 1);
+		size_t n_rows = (st.st_size - sizeof(*header)) / sizeof(*rows);
+
+		// Segment and offset only go up as entries are recorded, so
+		//	they keep entries in the same ms in the order they came in
+		std::sort(rows, rows + n_rows,
+			[](const struct recorder_index_entry &a,
+				const struct recorder_index_entry &b) {
+				if (a.id_ms != b.id_ms) {
+					return a.id_ms < b.id_ms;
+				}
+				if (a.segment != b.segment) {
+					return a.segment < b.segment;
+				}
+				return a.offset < b.offset;
+			});
+		header->flags |= RECORDER_INDEX_SORTED;
+	}
+
+	if ((msync(out_map, st.st_size, MS_SYNC) != 0) ||
+		(rename(sorting_path.c_str(), index_path.c_str()) != 0))
+	{
+		goto done;
+	}
+
+	ret_val = true;
+
+done:
+	if (in_map != MAP_FAILED) {
+		munmap(in_map, st.st_size);
+	}
+	if (out_map != MAP_FAILED) {
+		munmap(out_map, st.st_size);
+	}
+	if (in_fd >= 0) {
+		close(in_fd);
+	}
+	if (out_fd >= 0) {
+		close(out_fd);
+		if (!ret_val) {
+			unlink(sorting_path.c_str());
+		}
+	}
+	return ret_val;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Creates and maps the next segment. It's sized s.t. it can hold
+//			at least min_len bytes of records
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Recorder::openSegment(
+	size_t min_len)
+{
+	size_t len = std::max(segment_size,
+		sizeof(struct recorder_segment_header) + min_len);
+	std::string seg_path = segmentPath(path, segment);
+
+	segment_fd = open(seg_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (segment_fd < 0) {
+		return false;
+	}
+	if (ftruncate(segment_fd, len) != 0) {
+		close(segment_fd);
+		segment_fd = -1;
+		return false;
+	}
+
+	void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+	if (map == MAP_FAILED) {
+		close(segment_fd);
+		segment_fd = -1;
+		return false;
+	}
+	segment_map = (uint8_t *)map;
+	segment_map_len = len;
+
+	// Fill in the header. The file is zero-filled past it s.t. a reader
+	//	finds an empty record after the last one we write
+	struct recorder_segment_header *header =
+		(struct recorder_segment_header *)segment_map;
+	memcpy(header->magic, RECORDER_SEGMENT_MAGIC, sizeof(header->magic));
+	header->version = RECORDER_VERSION;
+	header->segment = segment;
+	header->used = 0;
+	segment_used = sizeof(struct recorder_segment_header);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Closes the current segment, trimming it down to what was used
+//
+////////////////////////////////////////////////////////////////////////////////
+void Recorder::closeSegment()
+{
+	if (segment_map == NULL) {
+		return;
+	}
+
+	((struct recorder_segment_header *)segment_map)->used =
+		segment_used - sizeof(struct recorder_segment_header);
+	munmap(segment_map, segment_map_len);
+	if (ftruncate(segment_fd, segment_used) != 0) {
+		fprintf(stderr, "Failed to trim segment %u\n", segment);
+	}
+	close(segment_fd);
+
+	segment_map = NULL;
+	segment_map_len = 0;
+	segment_used = 0;
+	segment_fd = -1;
+	segment += 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Handler for entries on recorded streams
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Recorder::recordHandler(
+	Entry &e,
+	void *user_data)
+{
+	RecordedStream *stream = (RecordedStream *)user_data;
+	return stream->recorder->record(stream->element, stream->stream, e);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds a handler for the stream to the read map that records
+//			each entry read
+//
+////////////////////////////////////////////////////////////////////////////////
+void Recorder::addStream(
+	ElementReadMap &m,
+	std::string element,
+	std::string stream,
+	std::vector<std::string> keys)
+{
+	recorded.push_back({this, element, stream});
+	m.addHandler(element, stream, keys, recordHandler, &recorded.back());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Appends an entry to the current segment and notes it in the
+//			index, moving on to a new segment if it doesn't fit
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Recorder::record(
+	const std::string &element,
+	const std::string &stream,
+	Entry &e)
+{
+	struct recorder_record_header rec;
+	struct recorder_index_entry idx;
+	unsigned long long id_ms, id_seq;
+	struct timespec now;
+
+	if (sscanf(e.getID().c_str(), "%llu-%llu", &id_ms, &id_seq) != 2) {
+		return false;
+	}
+	if ((element.size() > UINT16_MAX) || (stream.size() > UINT16_MAX)) {
+		return false;
+	}
+
+	// Figure out how much room the record needs
+	const entry_data_t &data = e.getData();
+	size_t len = sizeof(rec) + element.size() + stream.size();
+	for (auto const &x : data) {
+		len += 2 * sizeof(uint32_t) + x.first.size() + x.second.size();
+	}
+	len = recordPad(len);
+	if (len > UINT32_MAX) {
+		return false;
+	}
+
+	// Move on to the next segment if this one is full
+	if ((segment_map == NULL) || (segment_used + len > segment_map_len)) {
+		closeSegment();
+		if (!openSegment(len)) {
+			return false;
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.len = len;
+	rec.element_len = element.size();
+	rec.stream_len = stream.size();
+	rec.n_keys = data.size();
+	rec.id_ms = id_ms;
+	rec.id_seq = id_seq;
+	rec.recv_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	// Copy the record into the segment
+	uint8_t *ptr = segment_map + segment_used;
+	memcpy(ptr, &rec, sizeof(rec));
+	ptr += sizeof(rec);
+	memcpy(ptr, element.data(), element.size());
+	ptr += element.size();
+	memcpy(ptr, stream.data(), stream.size());
+	ptr += stream.size();
+	for (auto const &x : data) {
+		uint32_t lens[2] = {(uint32_t)x.first.size(), (uint32_t)x.second.size()};
+		memcpy(ptr, lens, sizeof(lens));
+		ptr += sizeof(lens);
+		memcpy(ptr, x.first.data(), x.first.size());
+		ptr += x.first.size();
+		memcpy(ptr, x.second.data(), x.second.size());
+		ptr += x.second.size();
+	}
+
+	// And note it in the index
+	memset(&idx, 0, sizeof(idx));
+	idx.id_ms = rec.id_ms;
+	idx.id_seq = rec.id_seq;
+	idx.recv_ns = rec.recv_ns;
+	idx.segment = segment;
+	idx.offset = segment_used;
+	if (fwrite(&idx, sizeof(idx), 1, index) != 1) {
+		return false;
+	}
+
+	segment_used += len;
+	n_entries += 1;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Flushes the index and notes the used size of the current segment
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Recorder::flush()
+{
+	if (segment_map != NULL) {
+		((struct recorder_segment_header *)segment_map)->used =
+			segment_used - sizeof(struct recorder_segment_header);
+	}
+	return (fflush(index) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the number of entries recorded
+//
+////////////////////////////////////////////////////////////////////////////////
+size_t Recorder::getNumEntries()
+{
+	return n_entries;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Opens a recording for playback. Maps the index, which is already
+//			in time order if the recording was finished. If it wasn't, e.g.
+//			it's still being written, the positions in it are sorted here.
+//
+////////////////////////////////////////////////////////////////////////////////
+Player::Player(
+	Element &e,
+	std::string dir) :
+	elem(e),
+	path(dir),
+	index_fd(-1),
+	index_map(NULL),
+	index_map_len(0),
+	index(NULL),
+	n_entries(0),
+	map_uses(0)
+{
+	std::string index_path = path + "/" + RECORDER_INDEX_FILENAME;
+	struct stat st;
+
+	index_fd = open(index_path.c_str(), O_RDONLY);
+	if ((index_fd < 0) || (fstat(index_fd, &st) != 0) ||
+		((size_t)st.st_size < sizeof(struct recorder_index_header)))
+	{
+		if (index_fd >= 0) {
+			close(index_fd);
+		}
+		throw std::runtime_error("Failed to open index " + index_path);
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, index_fd, 0);
+	if (map == MAP_FAILED) {
+		close(index_fd);
+		throw std::runtime_error("Failed to map index " + index_path);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	index_map = (const uint8_t *)map;
+	index_map_len = st.st_size;
+
+	const struct recorder_index_header *header =
+		(const struct recorder_index_header *)index_map;
+	if (memcmp(header->magic, RECORDER_INDEX_MAGIC, sizeof(header->magic)) ||
+		(header->version != RECORDER_VERSION))
+	{
+		munmap((void *)index_map, index_map_len);
+		close(index_fd);
+		throw std::runtime_error("Invalid index " + index_path);
+	}
+
+	index = (const struct recorder_index_entry *)(index_map + sizeof(*header));
+	n_entries = (index_map_len - sizeof(*header)) / sizeof(*index);
+	memset(mapped, 0, sizeof(mapped));
+
+	if (header->flags & RECORDER_INDEX_SORTED) {
+		return;
+	}
+
+	// Keep the order entries were recorded in for those in the same ms
+	order.resize(n_entries);
+	for (size_t i = 0; i < n_entries; ++i) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(),
+		[this](size_t a, size_t b) {
+			return index[a].id_ms < index[b].id_ms;
+		});
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Closes the recording and frees the write infos. The streams are
+//			left in redis s.t. readers can finish with what was played.
+//
+////////////////////////////////////////////////////////////////////////////////
+Player::~Player()
+{
+	for (auto &x : streams) {
+		element_entry_write_free(x.second);
+	}
+
+	unmapSegments();
+	munmap((void *)index_map, index_map_len);
+	close(index_fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Maps a segment for reading if it isn't already, unmapping the
+//			one used longest ago if PLAYER_MAPPED_SEGMENTS are mapped
+//
+////////////////////////////////////////////////////////////////////////////////
+const Player::MappedSegment *Player::mapSegment(
+	uint32_t seg)
+{
+	MappedSegment *slot = NULL;
+	struct stat st;
+	int fd;
+
+	map_uses += 1;
+	for (auto &m : mapped) {
+		if ((m.map != NULL) && (m.segment == seg)) {
+			m.last_used = map_uses;
+			return &m;
+		}
+	}
+
+	// Take a free slot, else the one used longest ago
+	for (auto &m : mapped) {
+		if (m.map == NULL) {
+			slot = &m;
+			break;
+		}
+		if ((slot == NULL) || (m.last_used < slot->last_used)) {
+			slot = &m;
+		}
+	}
+	if (slot->map != NULL) {
+		munmap((void *)slot->map, slot->len);
+		slot->map = NULL;
+		slot->len = 0;
+	}
+
+	std::string seg_path = segmentPath(path, seg);
+	fd = open(seg_path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if ((fstat(fd, &st) != 0) ||
+		((size_t)st.st_size < sizeof(struct recorder_segment_header)))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	const struct recorder_segment_header *header =
+		(const struct recorder_segment_header *)map;
+	if (memcmp(header->magic, RECORDER_SEGMENT_MAGIC, sizeof(header->magic)) ||
+		(header->version != RECORDER_VERSION))
+	{
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	slot->segment = seg;
+	slot->map = (const uint8_t *)map;
+	slot->len = st.st_size;
+	slot->last_used = map_uses;
+	return slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Unmaps all of the mapped segments
+//
+////////////////////////////////////////////////////////////////////////////////
+void Player::unmapSegments()
+{
+	for (auto &m : mapped) {
+		if (m.map != NULL) {
+			munmap((void *)m.map, m.len);
+			m.map = NULL;
+			m.len = 0;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the i-th entry in time order
+//
+////////////////////////////////////////////////////////////////////////////////
+const struct recorder_index_entry *Player::entryAt(
+	size_t i)
+{
+	return order.empty() ? &index[i] : &index[order[i]];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Finds the first entry in the time order at or after the passed
+//			time
+//
+////////////////////////////////////////////////////////////////////////////////
+size_t Player::seek(
+	uint64_t start_ms)
+{
+	size_t lo = 0;
+	size_t hi = n_entries;
+
+	while (lo < hi) {
+		size_t mid = lo + ((hi - lo) / 2);
+		if (entryAt(mid)->id_ms < start_ms) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes a recorded entry on the element's stream of the same name.
+//			The keys and values are written straight from the segment
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t Player::publish(
+	redisContext *ctx,
+	const struct recorder_record_header *rec,
+	int maxlen)
+{
+	const uint8_t *ptr = (const uint8_t *)(rec + 1) + rec->element_len;
+	const uint8_t *end = (const uint8_t *)rec + rec->len;
+
+	if (ptr + rec->stream_len > end) {
+		return ATOM_INTERNAL_ERROR;
+	}
+	std::string stream((const char *)ptr, rec->stream_len);
+	ptr += rec->stream_len;
+
+	// Get the write info for the stream, remaking it if the number of
+	//	keys changed. The stream itself is kept, with what's been played.
+	auto exists = streams.find(stream);
+	if ((exists != streams.end()) && (exists->second->n_items != rec->n_keys)) {
+		element_entry_write_free(exists->second);
+		streams.erase(exists);
+		exists = streams.end();
+	}
+	if (exists == streams.end()) {
+		struct element_entry_write_info *info = element_entry_write_init(
+			ctx, elem.elem, stream.c_str(), rec->n_keys);
+		if (info == NULL) {
+			return ATOM_INTERNAL_ERROR;
+		}
+		exists = streams.emplace(stream, info).first;
+	}
+	struct element_entry_write_info *info = exists->second;
+
+	// Point the items at the keys and values in the segment
+	for (uint32_t i = 0; i < rec->n_keys; ++i) {
+		uint32_t lens[2];
+		if (ptr + sizeof(lens) > end) {
+			return ATOM_INTERNAL_ERROR;
+		}
+		memcpy(lens, ptr, sizeof(lens));
+		ptr += sizeof(lens);
+		if (ptr + (size_t)lens[0] + lens[1] > end) {
+			return ATOM_INTERNAL_ERROR;
+		}
+		info->items[i].key = (const char *)ptr;
+		info->items[i].key_len = lens[0];
+		ptr += lens[0];
+		info->items[i].data = ptr;
+		info->items[i].data_len = lens[1];
+		ptr += lens[1];
+	}
+
+	return element_entry_write(ctx, info, ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP, maxlen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the number of entries in the recording
+//
+////////////////////////////////////////////////////////////////////////////////
+size_t Player::getNumEntries()
+{
+	return n_entries;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Plays back the recording between the start and end times. Walks
+//			the index in time order, mapping segments as they're reached, and
+//			sleeps between entries to keep the recorded spacing scaled by
+//			the speed.
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t Player::play(
+	double speed,
+	uint64_t start_ms,
+	uint64_t end_ms,
+	int maxlen)
+{
+	enum atom_error_t err = ATOM_NO_ERROR;
+	size_t i = seek(start_ms);
+
+	if (i >= n_entries) {
+		return ATOM_NO_ERROR;
+	}
+
+	redisContext *ctx = elem.getContext();
+	if (ctx == NULL) {
+		return ATOM_REDIS_ERROR;
+	}
+	auto play_start = std::chrono::steady_clock::now();
+	uint64_t first_ms = entryAt(i)->id_ms;
+
+	for (; i < n_entries; ++i) {
+		const struct recorder_index_entry *idx = entryAt(i);
+		if (idx->id_ms > end_ms) {
+			break;
+		}
+
+		// Wait until the entry is due
+		if ((speed > 0) && (idx->id_ms > first_ms)) {
+			std::this_thread::sleep_until(play_start +
+				std::chrono::duration<double, std::milli>(
+					(idx->id_ms - first_ms) / speed));
+		}
+
+		const MappedSegment *seg = mapSegment(idx->segment);
+		if ((seg == NULL) ||
+			(idx->offset + sizeof(struct recorder_record_header) > seg->len))
+		{
+			elem.log(LOG_ERR, "Failed to read segment %u", idx->segment);
+			err = ATOM_INTERNAL_ERROR;
+			break;
+		}
+
+		const struct recorder_record_header *rec =
+			(const struct recorder_record_header *)(seg->map + idx->offset);
+		if ((rec->len < sizeof(*rec)) || (idx->offset + rec->len > seg->len)) {
+			elem.log(LOG_ERR, "Invalid record in segment %u", idx->segment);
+			err = ATOM_INTERNAL_ERROR;
+			break;
+		}
+
+		err = publish(ctx, rec, maxlen);
+		if (err != ATOM_NO_ERROR) {
+			elem.log(LOG_ERR, "Failed to publish recorded entry");
+			break;
+		}
+	}
+
+	elem.releaseContext(ctx);
+	return err;
+}
+
+} // namespace atom
@@ -0,0 +1,1249 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file scheduler.cc
+//
+//  @brief Scheduler implementation. Speaks the same command protocol as
+//			element_command_send and element_command_loop, just with many
+//			commands in flight on one connection.
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "atom/atom.h"
+#include "atom/redis.h"
+#include "atom/codec.h"
+#include "scheduler.h"
+
+namespace atom {
+
+// Maximum length of another element's command stream, same as the C API
+#define SCHEDULER_COMMAND_STREAM_MAXLEN 10
+
+// Most keys in a command or response we send
+#define SCHEDULER_MAX_KEYS 8
+
+// Number of schedulers made in the process, for naming wake streams
+static std::atomic<unsigned int> scheduler_count(0);
+
+// Callbacks for atom C api need to be in an "extern C" block
+extern "C" {
+
+	bool schedulerResponseCB(
+		const char *id,
+		const struct redisReply *reply,
+		void *user_data);
+
+	bool schedulerCommandCB(
+		const char *id,
+		const struct redisReply *reply,
+		void *user_data);
+
+	bool schedulerEntryCB(
+		const char *id,
+		const struct redisReply *reply,
+		void *user_data);
+
+	bool schedulerWakeCB(
+		const char *id,
+		const struct redisReply *reply,
+		void *user_data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Decompresses an entry's values in place if they're compressed
+//			and then finds a key's value in it
+//
+////////////////////////////////////////////////////////////////////////////////
+static void schedDecode(
+	const struct redisReply *reply)
+{
+	redisReply *kv = (redisReply *)reply;
+
+	for (size_t i = 0; (i + 1) < kv->elements; i += 2) {
+		if ((kv->element[i]->type == REDIS_REPLY_STRING) &&
+			(strcmp(kv->element[i]->str, ATOM_CODEC_KEY_STR) == 0))
+		{
+			atom_codec_decode_kv(kv, kv->element[i + 1]);
+			return;
+		}
+	}
+}
+
+static const redisReply *schedFind(
+	const struct redisReply *reply,
+	const char *key)
+{
+	for (size_t i = 0; (i + 1) < reply->elements; i += 2) {
+		if ((reply->element[i]->type == REDIS_REPLY_STRING) &&
+			(strcmp(reply->element[i]->str, key) == 0) &&
+			(reply->element[i + 1]->type == REDIS_REPLY_STRING))
+		{
+			return reply->element[i + 1];
+		}
+	}
+
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Whether stream ID a comes after b
+//
+////////////////////////////////////////////////////////////////////////////////
+static bool schedIdAfter(
+	const char *a,
+	const char *b)
+{
+	char *end;
+	uint64_t a_ms = strtoull(a, &end, 10);
+	uint64_t a_seq = (*end == '-') ? strtoull(end + 1, NULL, 10) : 0;
+	uint64_t b_ms = strtoull(b, &end, 10);
+	uint64_t b_seq = (*end == '-') ? strtoull(end + 1, NULL, 10) : 0;
+
+	return (a_ms > b_ms) || ((a_ms == b_ms) && (a_seq > b_seq));
+}
+
+bool schedulerResponseCB(
+	const char *id,
+	const struct redisReply *reply,
+	void *user_data)
+{
+	((Scheduler *)user_data)->onResponse(id, reply);
+	return true;
+}
+
+bool schedulerCommandCB(
+	const char *id,
+	const struct redisReply *reply,
+	void *user_data)
+{
+	((Scheduler *)user_data)->onCommand(id, reply);
+	return true;
+}
+
+bool schedulerWakeCB(
+	const char *id,
+	const struct redisReply *reply,
+	void *user_data)
+{
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Responder constructor
+//
+////////////////////////////////////////////////////////////////////////////////
+Responder::Responder(
+	Scheduler *s,
+	std::string caller,
+	std::string cmd_id,
+	std::string command) :
+	sched(s),
+	caller(std::move(caller)),
+	cmd_id(std::move(cmd_id)),
+	command(std::move(command))
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Hands the response to the scheduler to send and frees the
+//			responder. Errors are offset into the user errors, same as
+//			for commands served by the command loop.
+//
+////////////////////////////////////////////////////////////////////////////////
+void Responder::respond(
+	ElementResponse &response)
+{
+	Scheduler::schedReply *reply = new Scheduler::schedReply();
+
+	reply->caller = std::move(caller);
+	reply->cmd_id = std::move(cmd_id);
+	reply->command = std::move(command);
+	reply->ack = false;
+	reply->timeout = 0;
+	reply->has_data = false;
+
+	if (response.isError()) {
+		reply->err = ATOM_USER_ERRORS_BEGIN + response.getError();
+		reply->err_str = response.getErrorStr();
+	} else {
+		reply->err = ATOM_NO_ERROR;
+		if (response.hasData()) {
+			reply->data.assign((const char *)response.getDataPtr(),
+				response.getDataLen());
+			reply->has_data = true;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(sched->submit_mutex);
+		sched->new_replies.push_back(reply);
+	}
+	sched->wake();
+
+	delete this;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Constructor. Makes the connection and notes where we start
+//			reading the response and command streams.
+//
+////////////////////////////////////////////////////////////////////////////////
+Scheduler::Scheduler(
+	Element &e) :
+	element(e),
+	ctx(NULL),
+	blocked(false),
+	stopped(false),
+	n_reads(0),
+	group_offset(0)
+{
+	ctx = redis_context_init();
+	if ((ctx == NULL) || ctx->err) {
+		if (ctx != NULL) {
+			redis_context_cleanup(ctx);
+		}
+		throw std::runtime_error("Failed to connect to redis");
+	}
+
+	if (!redis_get_time_id(ctx, response_last_id)) {
+		redis_context_cleanup(ctx);
+		throw std::runtime_error("Failed to get the time");
+	}
+	memcpy(command_last_id, response_last_id, sizeof(command_last_id));
+	snprintf(wake_last_id, sizeof(wake_last_id), "0-0");
+
+	wake_stream = std::string(SCHEDULER_WAKE_STREAM_PREFIX) + element.getName() +
+		":" + std::to_string(getpid()) + ":" + std::to_string(scheduler_count++);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Destructor. Anything still in flight is dropped without calling
+//			its callback.
+//
+////////////////////////////////////////////////////////////////////////////////
+Scheduler::~Scheduler()
+{
+	for (auto c : new_commands) {
+		delete c;
+	}
+	for (auto r : new_reads) {
+		delete r;
+	}
+	for (auto w : new_writes) {
+		delete w;
+	}
+	for (auto r : new_replies) {
+		delete r;
+	}
+	for (auto &c : commands) {
+		delete c.second;
+	}
+	for (auto &g : read_groups) {
+		for (auto r : g.second->reads) {
+			delete r;
+		}
+		delete g.second;
+	}
+
+	for (auto &x : write_infos) {
+		for (size_t i = 0; i < x.second->n_items; ++i) {
+			free((char *)x.second->items[i].key);
+		}
+		element_entry_write_cleanup(ctx, x.second);
+	}
+
+	redis_remove_key(ctx, wake_stream.c_str(), true);
+	redis_context_cleanup(ctx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Wakes the scheduler if it's blocked in its XREAD. Once it's
+//			noted that it's blocking it checks for new operations one more
+//			time, so anything submitted before then is picked up without
+//			a wake.
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::wake()
+{
+	struct redis_xadd_info info;
+	redisContext *wake_ctx;
+
+	if (!blocked.load()) {
+		return;
+	}
+
+	wake_ctx = redis_context_thread();
+	if (wake_ctx == NULL) {
+		return;
+	}
+
+	info.key = "wake";
+	info.key_len = CONST_STRLEN("wake");
+	info.data = (const uint8_t *)"";
+	info.data_len = 0;
+	redis_xadd(wake_ctx, wake_stream.c_str(), &info, 1, 1, false, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sends a command, adding it to those in flight once it's sent
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::sendCommand(
+	std::string elem,
+	std::string command,
+	const uint8_t *data,
+	size_t data_len,
+	commandDoneFn fn,
+	void *user_data,
+	bool block)
+{
+	schedCommand *cmd = new schedCommand();
+
+	cmd->element = std::move(elem);
+	cmd->command = std::move(command);
+	if (data != NULL) {
+		cmd->data.assign((const char *)data, data_len);
+	}
+	cmd->block = block;
+	cmd->fn = fn;
+	cmd->user_data = user_data;
+	cmd->acked = false;
+	cmd->deadline_ms = 0;
+	cmd->span = ATOM_TRACE_SPAN_INIT;
+
+	{
+		std::lock_guard<std::mutex> lock(submit_mutex);
+		new_commands.push_back(cmd);
+	}
+	wake();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Waits for the next entry on a stream
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::entryReadNext(
+	std::string elem,
+	std::string stream,
+	std::vector<std::string> keys,
+	entryDoneFn fn,
+	void *user_data,
+	std::string last_id,
+	int timeout)
+{
+	schedRead *read = new schedRead();
+	char stream_name[ATOM_NAME_MAXLEN];
+
+	atom_get_data_stream_str(elem.c_str(), stream.c_str(), stream_name);
+	read->stream = stream_name;
+	read->keys = std::move(keys);
+	read->last_id = std::move(last_id);
+	read->deadline_ms = (timeout != SCHEDULER_NO_TIMEOUT) ?
+		(redis_monotonic_ms() + timeout) : 0;
+	read->fn = fn;
+	read->user_data = user_data;
+
+	{
+		std::lock_guard<std::mutex> lock(submit_mutex);
+		new_reads.push_back(read);
+	}
+	wake();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Queues a write
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::entryWrite(
+	std::string stream,
+	entry_data_t data,
+	writeDoneFn fn,
+	void *user_data,
+	int maxlen)
+{
+	schedWrite *write = new schedWrite();
+
+	write->stream = std::move(stream);
+	write->data = std::move(data);
+	write->maxlen = maxlen;
+	write->fn = fn;
+	write->user_data = user_data;
+
+	{
+		std::lock_guard<std::mutex> lock(submit_mutex);
+		new_writes.push_back(write);
+	}
+	wake();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Queues a task
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::post(
+	taskFn fn,
+	void *user_data,
+	int delay_ms)
+{
+	schedTask task = {fn, user_data};
+
+	{
+		std::lock_guard<std::mutex> lock(submit_mutex);
+		new_tasks.emplace(redis_monotonic_ms() + delay_ms, task);
+	}
+	wake();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Serves a command
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::addCommand(
+	std::string name,
+	asyncCommandFn fn,
+	void *user_data,
+	int timeout)
+{
+	schedServed cmd = {fn, user_data, timeout};
+
+	served[name] = cmd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Makes run return
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::stop()
+{
+	stopped.store(true);
+	wake();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Number of commands and reads in flight
+//
+////////////////////////////////////////////////////////////////////////////////
+size_t Scheduler::pending()
+{
+	std::lock_guard<std::mutex> lock(submit_mutex);
+
+	return commands.size() + n_reads + new_commands.size() + new_reads.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Hands a command's response to its callback
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::finishCommand(
+	schedCommand *cmd,
+	ElementResponse &response)
+{
+	atom_trace_end(&cmd->span);
+	if (cmd->fn != NULL) {
+		cmd->fn(response, cmd->user_data);
+	}
+	delete cmd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sends the commands and replies in one round trip. Commands that
+//			make it out wait on the response stream for their ACK.
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::sendCommands(
+	std::vector<schedCommand *> &cmds)
+{
+	struct redis_xadd_info infos[SCHEDULER_MAX_KEYS];
+	struct atom_codec_buffer codec_buffer = {NULL, 0, 0};
+	char codec_value[ATOM_CODEC_VALUE_MAXLEN];
+	char trace_value[ATOM_TRACE_VALUE_MAXLEN];
+	struct atom_trace_context trace;
+	char stream[ATOM_NAME_MAXLEN];
+	char id[STREAM_ID_BUFFLEN];
+	std::vector<bool> appended(cmds.size(), false);
+	bool tracing = atom_trace_enabled();
+	const std::string &name = element.getName();
+
+	for (size_t i = 0; i < cmds.size(); ++i) {
+		schedCommand *cmd = cmds[i];
+		size_t n = 0;
+
+		infos[n].key = COMMAND_KEY_ELEMENT_STR;
+		infos[n].key_len = CONST_STRLEN(COMMAND_KEY_ELEMENT_STR);
+		infos[n].data = (const uint8_t *)name.data();
+		infos[n].data_len = name.size();
+		++n;
+		infos[n].key = COMMAND_KEY_COMMAND_STR;
+		infos[n].key_len = CONST_STRLEN(COMMAND_KEY_COMMAND_STR);
+		infos[n].data = (const uint8_t *)cmd->command.data();
+		infos[n].data_len = cmd->command.size();
+		++n;
+		infos[n].key = COMMAND_KEY_DATA_STR;
+		infos[n].key_len = CONST_STRLEN(COMMAND_KEY_DATA_STR);
+		infos[n].data = (const uint8_t *)cmd->data.data();
+		infos[n].data_len = cmd->data.size();
+		++n;
+
+		// Compress the data same as sendCommand would
+		auto codec = element.command_codecs.find(cmd->element + ":" + cmd->command);
+		if ((codec != element.command_codecs.end()) &&
+			atom_codec_should_encode(&codec->second, cmd->data.size()) &&
+			atom_codec_encode(&codec->second, (const uint8_t *)cmd->data.data(),
+				cmd->data.size(), &codec_buffer))
+		{
+			infos[n - 1].data = codec_buffer.data;
+			infos[n - 1].data_len = codec_buffer.len;
+			infos[n].key = ATOM_CODEC_KEY_STR;
+			infos[n].key_len = CONST_STRLEN(ATOM_CODEC_KEY_STR);
+			infos[n].data = (const uint8_t *)codec_value;
+			infos[n].data_len = atom_codec_key_value(&codec->second, codec_value);
+			++n;
+		}
+
+		// Time the command from here until it's done, same as sendCommand
+		if (tracing) {
+			atom_trace_begin(&cmd->span, NULL, "command_send", "%s:%s",
+				cmd->element.c_str(), cmd->command.c_str());
+			atom_trace_span_context(&cmd->span, &trace);
+			infos[n].key = ATOM_TRACE_KEY_STR;
+			infos[n].key_len = CONST_STRLEN(ATOM_TRACE_KEY_STR);
+			infos[n].data = (const uint8_t *)trace_value;
+			infos[n].data_len = atom_trace_value(&trace, trace_value);
+			++n;
+		}
+
+		atom_get_command_stream_str(cmd->element.c_str(), stream);
+		appended[i] = redis_xadd_append(ctx, stream, infos, n,
+			SCHEDULER_COMMAND_STREAM_MAXLEN, ATOM_DEFAULT_APPROX_MAXLEN);
+	}
+	atom_codec_buffer_free(&codec_buffer);
+
+	for (size_t i = 0; i < cmds.size(); ++i) {
+		schedCommand *cmd = cmds[i];
+
+		if (appended[i] && redis_xadd_get_reply(ctx, id)) {
+			cmd->deadline_ms = redis_monotonic_ms() + SCHEDULER_COMMAND_ACK_TIMEOUT_MS;
+			commands[id] = cmd;
+		} else {
+			ElementResponse response;
+			response.setError(ATOM_REDIS_ERROR, "Failed to send command");
+			finishCommand(cmd, response);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sends the ACKs and responses for the commands we serve in one
+//			round trip
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::sendReplies(
+	std::vector<schedReply *> &replies)
+{
+	struct redis_xadd_info infos[SCHEDULER_MAX_KEYS];
+	char stream[ATOM_NAME_MAXLEN];
+	char timeout_buffer[32];
+	char err_buffer[32];
+	size_t n_appended = 0;
+	const std::string &name = element.getName();
+
+	for (auto reply : replies) {
+		size_t n = 0;
+
+		infos[n].key = STREAM_KEY_ELEMENT_STR;
+		infos[n].key_len = CONST_STRLEN(STREAM_KEY_ELEMENT_STR);
+		infos[n].data = (const uint8_t *)name.data();
+		infos[n].data_len = name.size();
+		++n;
+		infos[n].key = STREAM_KEY_ID_STR;
+		infos[n].key_len = CONST_STRLEN(STREAM_KEY_ID_STR);
+		infos[n].data = (const uint8_t *)reply->cmd_id.data();
+		infos[n].data_len = reply->cmd_id.size();
+		++n;
+
+		if (reply->ack) {
+			infos[n].key = ACK_KEY_TIMEOUT_STR;
+			infos[n].key_len = CONST_STRLEN(ACK_KEY_TIMEOUT_STR);
+			infos[n].data = (const uint8_t *)timeout_buffer;
+			infos[n].data_len = snprintf(timeout_buffer, sizeof(timeout_buffer),
+				"%d", reply->timeout);
+			++n;
+		} else {
+			infos[n].key = RESPONSE_KEY_ERR_CODE_STR;
+			infos[n].key_len = CONST_STRLEN(RESPONSE_KEY_ERR_CODE_STR);
+			infos[n].data = (const uint8_t *)err_buffer;
+			infos[n].data_len = snprintf(err_buffer, sizeof(err_buffer),
+				"%d", reply->err);
+			++n;
+			if (!reply->command.empty()) {
+				infos[n].key = RESPONSE_KEY_CMD_STR;
+				infos[n].key_len = CONST_STRLEN(RESPONSE_KEY_CMD_STR);
+				infos[n].data = (const uint8_t *)reply->command.data();
+				infos[n].data_len = reply->command.size();
+				++n;
+			}
+			if (reply->err != ATOM_NO_ERROR) {
+				infos[n].key = RESPONSE_KEY_ERR_STR_STR;
+				infos[n].key_len = CONST_STRLEN(RESPONSE_KEY_ERR_STR_STR);
+				infos[n].data = (const uint8_t *)reply->err_str.data();
+				infos[n].data_len = reply->err_str.size();
+				++n;
+			}
+			if (reply->has_data) {
+				infos[n].key = RESPONSE_KEY_DATA_STR;
+				infos[n].key_len = CONST_STRLEN(RESPONSE_KEY_DATA_STR);
+				infos[n].data = (const uint8_t *)reply->data.data();
+				infos[n].data_len = reply->data.size();
+				++n;
+			}
+		}
+
+		atom_get_response_stream_str(reply->caller.c_str(), stream);
+		if (redis_xadd_append(ctx, stream, infos, n,
+			ATOM_DEFAULT_MAXLEN, ATOM_DEFAULT_APPROX_MAXLEN))
+		{
+			++n_appended;
+		} else {
+			element.log(LOG_ERR, "Failed to send reply to %s", reply->caller.c_str());
+		}
+		delete reply;
+	}
+
+	for (size_t i = 0; i < n_appended; ++i) {
+		if (!redis_xadd_get_reply(ctx, NULL)) {
+			element.log(LOG_ERR, "Failed to send reply");
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the write info for one of our streams, (re)making it if the
+//			keys changed. Retention and codecs set on the element apply.
+//
+////////////////////////////////////////////////////////////////////////////////
+struct element_entry_write_info *Scheduler::getWriteInfo(
+	const std::string &stream,
+	entry_data_t &data)
+{
+	auto exists = write_infos.find(stream);
+	if (exists != write_infos.end()) {
+		struct element_entry_write_info *info = exists->second;
+		if ((info->n_items == data.size()) &&
+			element.fillEntryWriteInfo(info, data))
+		{
+			return info;
+		}
+
+		for (size_t i = 0; i < info->n_items; ++i) {
+			free((char *)info->items[i].key);
+		}
+		element_entry_write_cleanup(ctx, info);
+		write_infos.erase(exists);
+	}
+
+	struct element_entry_write_info *info = element_entry_write_init(
+		ctx, element.elem, stream.c_str(), data.size());
+	if (info == NULL) {
+		return NULL;
+	}
+
+	auto ret = element.retention.find(stream);
+	if (ret != element.retention.end()) {
+		info->retention = ret->second;
+	}
+	auto codec = element.entry_codecs.find(stream);
+	if (codec != element.entry_codecs.end()) {
+		info->codec = codec->second;
+	}
+
+	size_t idx = 0;
+	for (auto const &x : data) {
+		info->items[idx].key = strdup(x.first.c_str());
+		info->items[idx].key_len = x.first.size();
+		idx += 1;
+	}
+	element.fillEntryWriteInfo(info, data);
+
+	write_infos.emplace(stream, info);
+	return info;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes the queued entries, as many at once as can be. Each
+//			batch is written in one round trip and can only have a stream
+//			once and one maxlen.
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::sendWrites(
+	std::vector<schedWrite *> &writes)
+{
+	size_t start = 0;
+
+	while (start < writes.size()) {
+		std::vector<struct element_entry_write_info *> infos;
+		std::vector<schedWrite *> batch;
+		size_t end = start;
+
+		for (; end < writes.size(); ++end) {
+			schedWrite *write = writes[end];
+			if ((write->maxlen != writes[start]->maxlen) ||
+				(write_infos.count(write->stream) &&
+				std::find(infos.begin(), infos.end(), write_infos[write->stream]) !=
+					infos.end()))
+			{
+				break;
+			}
+
+			struct element_entry_write_info *info = getWriteInfo(
+				write->stream, write->data);
+			if (info == NULL) {
+				if (write->fn != NULL) {
+					write->fn(ATOM_INTERNAL_ERROR, "", write->user_data);
+				}
+				delete write;
+				continue;
+			}
+			infos.push_back(info);
+			batch.push_back(write);
+		}
+
+		if (!infos.empty()) {
+			std::vector<char> ids(infos.size() * STREAM_ID_BUFFLEN, '\0');
+			enum atom_error_t err = element_entry_write_multi(ctx, infos.data(),
+				infos.size(), ELEMENT_DATA_WRITE_DEFAULT_TIMESTAMP,
+				batch[0]->maxlen, (char (*)[STREAM_ID_BUFFLEN])ids.data());
+
+			for (size_t i = 0; i < batch.size(); ++i) {
+				if (batch[i]->fn != NULL) {
+					batch[i]->fn(err, &ids[i * STREAM_ID_BUFFLEN],
+						batch[i]->user_data);
+				}
+				delete batch[i];
+			}
+		}
+
+		start = end;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds reads to the groups for their streams. Reads from now on
+//			start at the server's current time.
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::addReads(
+	std::vector<schedRead *> &reads)
+{
+	char now_id[STREAM_ID_BUFFLEN];
+
+	for (auto read : reads) {
+		if (read->last_id.empty()) {
+			if (!redis_get_time_id(ctx, now_id)) {
+				Entry e("");
+				read->fn(e, read->user_data);
+				delete read;
+				continue;
+			}
+			read->last_id = now_id;
+		}
+
+		schedReadGroup *&group = read_groups[read->stream];
+		if (group == NULL) {
+			group = new schedReadGroup();
+			group->sched = this;
+			group->stream = read->stream;
+		}
+		group->reads.push_back(read);
+		++n_reads;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Takes the operations handed to us and starts them. Returns
+//			whether there were any.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Scheduler::drain()
+{
+	std::vector<schedCommand *> cmds;
+	std::vector<schedRead *> reads;
+	std::vector<schedWrite *> writes;
+	std::vector<schedReply *> replies;
+
+	{
+		std::lock_guard<std::mutex> lock(submit_mutex);
+		cmds.swap(new_commands);
+		reads.swap(new_reads);
+		writes.swap(new_writes);
+		replies.swap(new_replies);
+		tasks.insert(new_tasks.begin(), new_tasks.end());
+		new_tasks.clear();
+	}
+
+	if (!replies.empty()) {
+		sendReplies(replies);
+	}
+	if (!cmds.empty()) {
+		sendCommands(cmds);
+	}
+	// Reads go first s.t. they see writes handed to us after them
+	if (!reads.empty()) {
+		addReads(reads);
+	}
+	if (!writes.empty()) {
+		sendWrites(writes);
+	}
+
+	return !(cmds.empty() && reads.empty() && writes.empty() && replies.empty());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Runs the tasks that are due and times out commands and reads
+//			that have waited too long
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::expire()
+{
+	uint64_t now_ms = redis_monotonic_ms();
+
+	while (!tasks.empty() && (tasks.begin()->first <= now_ms)) {
+		schedTask task = tasks.begin()->second;
+		tasks.erase(tasks.begin());
+		task.fn(task.user_data);
+	}
+
+	for (auto it = commands.begin(); it != commands.end(); ) {
+		schedCommand *cmd = it->second;
+		if ((cmd->deadline_ms != 0) && (cmd->deadline_ms <= now_ms)) {
+			it = commands.erase(it);
+			ElementResponse response;
+			if (cmd->acked) {
+				response.setError(ATOM_COMMAND_NO_RESPONSE, "Failed to get response");
+			} else {
+				response.setError(ATOM_COMMAND_NO_ACK, "Failed to get ACK");
+			}
+			finishCommand(cmd, response);
+		} else {
+			++it;
+		}
+	}
+
+	for (auto it = read_groups.begin(); it != read_groups.end(); ) {
+		schedReadGroup *group = it->second;
+		std::vector<schedRead *> waiting;
+
+		for (auto read : group->reads) {
+			if ((read->deadline_ms != 0) && (read->deadline_ms <= now_ms)) {
+				Entry e("");
+				read->fn(e, read->user_data);
+				delete read;
+				--n_reads;
+			} else {
+				waiting.push_back(read);
+			}
+		}
+		group->reads.swap(waiting);
+
+		if (group->reads.empty()) {
+			delete group;
+			it = read_groups.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Handles an entry on our response stream, an ACK or response to
+//			one of the commands in flight
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::onResponse(
+	const char *id,
+	const struct redisReply *reply)
+{
+	const redisReply *cmd_id = schedFind(reply, STREAM_KEY_ID_STR);
+	if (cmd_id == NULL) {
+		return;
+	}
+
+	auto it = commands.find(cmd_id->str);
+	if (it == commands.end()) {
+		return;
+	}
+	schedCommand *cmd = it->second;
+
+	const redisReply *err_code = schedFind(reply, RESPONSE_KEY_ERR_CODE_STR);
+	const redisReply *timeout = schedFind(reply, ACK_KEY_TIMEOUT_STR);
+
+	// ACK. Done if we're not waiting for the response, else wait as
+	//	long as it says to, with no timeout meaning forever
+	if ((err_code == NULL) && (timeout != NULL)) {
+		int timeout_ms = atoi(timeout->str);
+		cmd->acked = true;
+		cmd->deadline_ms = (timeout_ms > 0) ?
+			(redis_monotonic_ms() + timeout_ms) : 0;
+
+		if (!cmd->block) {
+			commands.erase(it);
+			ElementResponse response;
+			finishCommand(cmd, response);
+		}
+		return;
+	}
+
+	if (err_code == NULL) {
+		return;
+	}
+
+	commands.erase(it);
+	schedDecode(reply);
+
+	ElementResponse response;
+	int err = atoi(err_code->str);
+	if (err == ATOM_NO_ERROR) {
+		const redisReply *data = schedFind(reply, RESPONSE_KEY_DATA_STR);
+		if (data != NULL) {
+			response.setData((const uint8_t *)data->str, data->len);
+		}
+	} else {
+		const redisReply *err_str = schedFind(reply, RESPONSE_KEY_ERR_STR_STR);
+		response.setError(err, (err_str != NULL) ? err_str->str : "");
+	}
+	finishCommand(cmd, response);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Handles an entry on our command stream. ACKs it and hands it to
+//			the command's handler, or answers that it's unsupported.
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::onCommand(
+	const char *id,
+	const struct redisReply *reply)
+{
+	const redisReply *caller = schedFind(reply, COMMAND_KEY_ELEMENT_STR);
+	if (caller == NULL) {
+		return;
+	}
+	schedDecode(reply);
+	const redisReply *command = schedFind(reply, COMMAND_KEY_COMMAND_STR);
+	const redisReply *data = schedFind(reply, COMMAND_KEY_DATA_STR);
+
+	auto cmd = (command != NULL) ? served.find(command->str) : served.end();
+
+	schedReply *ack = new schedReply();
+	ack->caller = caller->str;
+	ack->cmd_id = id;
+	ack->ack = true;
+	ack->timeout = (cmd != served.end()) ? cmd->second.timeout :
+		SCHEDULER_NO_COMMAND_TIMEOUT_MS;
+	ack->err = ATOM_NO_ERROR;
+	ack->has_data = false;
+
+	schedReply *unsupported = NULL;
+	if (cmd == served.end()) {
+		unsupported = new schedReply();
+		unsupported->caller = caller->str;
+		unsupported->cmd_id = id;
+		unsupported->ack = false;
+		unsupported->timeout = 0;
+		unsupported->err = (command != NULL) ? ATOM_COMMAND_UNSUPPORTED :
+			ATOM_COMMAND_INVALID_DATA;
+		unsupported->err_str = (command != NULL) ? "Unsupported command" :
+			"Missing command";
+		unsupported->has_data = false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(submit_mutex);
+		new_replies.push_back(ack);
+		if (unsupported != NULL) {
+			new_replies.push_back(unsupported);
+		}
+	}
+
+	if (cmd != served.end()) {
+		Responder *responder = new Responder(this, caller->str, id, command->str);
+		cmd->second.fn(
+			(data != NULL) ? (const uint8_t *)data->str : NULL,
+			(data != NULL) ? data->len : 0,
+			responder,
+			cmd->second.user_data);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Handles an entry on a stream reads are waiting on. Each read
+//			waiting for an entry after one before it gets it.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool schedulerEntryCB(
+	const char *id,
+	const struct redisReply *reply,
+	void *user_data)
+{
+	Scheduler::schedReadGroup *group = (Scheduler::schedReadGroup *)user_data;
+
+	group->sched->onEntry(group, id, reply);
+	return true;
+}
+
+void Scheduler::onEntry(
+	schedReadGroup *group,
+	const char *id,
+	const struct redisReply *reply)
+{
+	std::vector<schedRead *> waiting;
+	bool decoded = false;
+
+	for (auto read : group->reads) {
+		if (!schedIdAfter(id, read->last_id.c_str())) {
+			waiting.push_back(read);
+			continue;
+		}
+
+		if (!decoded) {
+			schedDecode(reply);
+			decoded = true;
+		}
+
+		Entry e(id);
+		for (size_t i = 0; (i + 1) < reply->elements; i += 2) {
+			const redisReply *key = reply->element[i];
+			const redisReply *value = reply->element[i + 1];
+			if ((key->type != REDIS_REPLY_STRING) ||
+				(value->type != REDIS_REPLY_STRING) ||
+				(strcmp(key->str, ATOM_CODEC_KEY_STR) == 0) ||
+				(strcmp(key->str, ATOM_TRACE_KEY_STR) == 0))
+			{
+				continue;
+			}
+			if (read->keys.empty() ||
+				(std::find(read->keys.begin(), read->keys.end(), key->str) !=
+					read->keys.end()))
+			{
+				e.addData(key->str, value->str, value->len);
+			}
+		}
+
+		read->fn(e, read->user_data);
+		delete read;
+		--n_reads;
+	}
+
+	group->reads.swap(waiting);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Does one XREAD of everything we're waiting on: the wake stream,
+//			our response stream if commands are in flight, our command
+//			stream if we serve commands and the streams reads are waiting
+//			on. Blocks until the nearest deadline unless there's already
+//			something to do.
+//
+////////////////////////////////////////////////////////////////////////////////
+void Scheduler::poll(
+	int timeout)
+{
+	struct redis_stream_info infos[SCHEDULER_MAX_READ_STREAMS + 3];
+	char stream[ATOM_NAME_MAXLEN];
+	char command_stream[ATOM_NAME_MAXLEN];
+	int n_infos = 0;
+	int response_idx = -1;
+	int command_idx = -1;
+	int block = timeout;
+	uint64_t now_ms = redis_monotonic_ms();
+	uint64_t deadline_ms = 0;
+
+	// Note we're about to block before the last look for new operations
+	//	s.t. anyone submitting after it wakes us
+	blocked.store(true);
+	{
+		std::lock_guard<std::mutex> lock(submit_mutex);
+		if (!new_commands.empty() || !new_reads.empty() || !new_writes.empty() ||
+			!new_replies.empty() || !new_tasks.empty())
+		{
+			block = REDIS_XREAD_DONTBLOCK;
+		}
+	}
+	if (stopped.load()) {
+		block = REDIS_XREAD_DONTBLOCK;
+	}
+
+	// Don't block past the nearest deadline
+	if (!tasks.empty()) {
+		deadline_ms = tasks.begin()->first;
+	}
+	for (auto &c : commands) {
+		if ((c.second->deadline_ms != 0) &&
+			((deadline_ms == 0) || (c.second->deadline_ms < deadline_ms)))
+		{
+			deadline_ms = c.second->deadline_ms;
+		}
+	}
+	for (auto &g : read_groups) {
+		for (auto read : g.second->reads) {
+			if ((read->deadline_ms != 0) &&
+				((deadline_ms == 0) || (read->deadline_ms < deadline_ms)))
+			{
+				deadline_ms = read->deadline_ms;
+			}
+		}
+	}
+	if ((block != REDIS_XREAD_DONTBLOCK) && (deadline_ms != 0)) {
+		int until = (deadline_ms > now_ms) ? (int)(deadline_ms - now_ms) : 0;
+		if (until == 0) {
+			block = REDIS_XREAD_DONTBLOCK;
+		} else if ((block == REDIS_XREAD_BLOCK_INDEFINITE) || (until < block)) {
+			block = until;
+		}
+	}
+
+	redis_init_stream_info(ctx, &infos[n_infos++], wake_stream.c_str(),
+		schedulerWakeCB, wake_last_id, this);
+
+	if (!commands.empty()) {
+		response_idx = n_infos;
+		atom_get_response_stream_str(element.getName().c_str(), stream);
+		redis_init_stream_info(ctx, &infos[n_infos++], stream,
+			schedulerResponseCB, response_last_id, this);
+	}
+
+	if (!served.empty()) {
+		command_idx = n_infos;
+		atom_get_command_stream_str(element.getName().c_str(), command_stream);
+		redis_init_stream_info(ctx, &infos[n_infos++], command_stream,
+			schedulerCommandCB, command_last_id, this);
+	}
+
+	// Each group reads from the earliest place one of its reads is
+	//	waiting from. Groups that don't fit in one XREAD wait their turn.
+	size_t n_groups = std::min(read_groups.size(), (size_t)SCHEDULER_MAX_READ_STREAMS);
+	auto group = read_groups.begin();
+	std::advance(group, (read_groups.size() > n_groups) ?
+		(group_offset % read_groups.size()) : 0);
+	for (size_t i = 0; i < n_groups; ++i) {
+		if (group == read_groups.end()) {
+			group = read_groups.begin();
+		}
+
+		const std::string *last_id = NULL;
+		for (auto read : group->second->reads) {
+			if ((last_id == NULL) || schedIdAfter(last_id->c_str(), read->last_id.c_str())) {
+				last_id = &read->last_id;
+			}
+		}
+		redis_init_stream_info(ctx, &infos[n_infos++], group->second->stream.c_str(),
+			schedulerEntryCB, last_id->c_str(), group->second);
+		++group;
+	}
+	group_offset += n_groups;
+
+	bool read = redis_xread(ctx, infos, n_infos, block, REDIS_XREAD_NOMAXCOUNT);
+	blocked.store(false);
+
+	if (!read) {
+		if (ctx->err) {
+			element.log(LOG_ERR, "Scheduler lost its connection, reconnecting");
+			redis_context_reconnect(ctx, REDIS_RECONNECT_DEFAULT_TIMEOUT_MS);
+		}
+		return;
+	}
+
+	memcpy(wake_last_id, infos[0].last_id, STREAM_ID_BUFFLEN);
+	if (response_idx >= 0) {
+		memcpy(response_last_id, infos[response_idx].last_id, STREAM_ID_BUFFLEN);
+	}
+	if (command_idx >= 0) {
+		memcpy(command_last_id, infos[command_idx].last_id, STREAM_ID_BUFFLEN);
+	}
+
+	// Drop the groups whose reads have all been answered
+	for (auto it = read_groups.begin(); it != read_groups.end(); ) {
+		if (it->second->reads.empty()) {
+			delete it->second;
+			it = read_groups.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Runs whatever's ready, waiting at most timeout ms for something
+//			to be
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t Scheduler::runOnce(
+	int timeout)
+{
+	if (ctx->err &&
+		!redis_context_reconnect(ctx, REDIS_RECONNECT_DEFAULT_TIMEOUT_MS))
+	{
+		return ATOM_REDIS_ERROR;
+	}
+
+	drain();
+	expire();
+	poll(timeout);
+	expire();
+
+	return ctx->err ? ATOM_REDIS_ERROR : ATOM_NO_ERROR;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Runs the scheduler until it's stopped
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t Scheduler::run()
+{
+	enum atom_error_t err = ATOM_NO_ERROR;
+
+	while (!stopped.load()) {
+		err = runOnce(REDIS_XREAD_BLOCK_INDEFINITE);
+		if ((err != ATOM_NO_ERROR) && ctx->err) {
+			break;
+		}
+	}
+	stopped.store(false);
+
+	return err;
+}
+
+} // namespace atom
@@ -0,0 +1,174 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file stream_writer.cc
+//
+//  @brief StreamWriter implementation atop element_entry_write
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <stdexcept>
+
+#include "stream_writer.h"
+
+namespace atom {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Constructor. Makes the connection and the write info with the
+//			keys filled in
+//
+////////////////////////////////////////////////////////////////////////////////
+StreamWriter::StreamWriter(
+	struct element *elem,
+	const std::string &stream,
+	std::vector<std::string> k) : keys(std::move(k)), ctx(NULL), info(NULL)
+{
+	ctx = redis_context_init();
+	if ((ctx == NULL) || ctx->err) {
+		cleanup();
+		throw std::runtime_error("Failed to connect to redis");
+	}
+
+	info = element_entry_write_init(ctx, elem, stream.c_str(), keys.size());
+	if (info == NULL) {
+		cleanup();
+		throw std::runtime_error("Failed to initialize stream " + stream);
+	}
+
+	for (size_t i = 0; i < keys.size(); ++i) {
+		info->items[i].key = keys[i].c_str();
+		info->items[i].key_len = keys[i].size();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Cleans up the stream and the connection
+//
+////////////////////////////////////////////////////////////////////////////////
+void StreamWriter::cleanup()
+{
+	if (info != NULL) {
+		element_entry_write_cleanup(ctx, info);
+		info = NULL;
+	}
+	if (ctx != NULL) {
+		redis_context_cleanup(ctx);
+		ctx = NULL;
+	}
+}
+
+StreamWriter::~StreamWriter()
+{
+	cleanup();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Move constructor/assignment. The keys' strings stay put when
+//			the vector is moved s.t. the info still points at them.
+//
+////////////////////////////////////////////////////////////////////////////////
+StreamWriter::StreamWriter(
+	StreamWriter &&other) : keys(std::move(other.keys)), ctx(other.ctx), info(other.info)
+{
+	other.ctx = NULL;
+	other.info = NULL;
+}
+
+StreamWriter &StreamWriter::operator=(
+	StreamWriter &&other)
+{
+	if (this != &other) {
+		cleanup();
+		keys = std::move(other.keys);
+		ctx = other.ctx;
+		info = other.info;
+		other.ctx = NULL;
+		other.info = NULL;
+	}
+
+	return *this;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Writes an entry with a value for each key
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t StreamWriter::write(
+	const EntryValue *values,
+	size_t n_values,
+	int timestamp,
+	int maxlen)
+{
+	if (info == NULL) {
+		return ATOM_INTERNAL_ERROR;
+	}
+	if (n_values != info->n_items) {
+		return ATOM_COMMAND_INVALID_DATA;
+	}
+
+	for (size_t i = 0; i < n_values; ++i) {
+		info->items[i].data = values[i].data;
+		info->items[i].data_len = values[i].len;
+	}
+
+	// Get our connection back if it broke
+	if (ctx->err) {
+		redis_context_reconnect(ctx, REDIS_RECONNECT_DEFAULT_TIMEOUT_MS);
+	}
+
+	return element_entry_write(ctx, info, timestamp, maxlen);
+}
+
+enum atom_error_t StreamWriter::write(
+	std::initializer_list<EntryValue> values,
+	int timestamp,
+	int maxlen)
+{
+	return write(values.begin(), values.size(), timestamp, maxlen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the retention for the stream
+//
+////////////////////////////////////////////////////////////////////////////////
+void StreamWriter::setRetention(
+	uint64_t max_age_ms,
+	uint64_t max_bytes,
+	unsigned int trim_every)
+{
+	if (info != NULL) {
+		info->retention.max_age_ms = max_age_ms;
+		info->retention.max_bytes = max_bytes;
+		info->retention.trim_every = trim_every;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Sets the codec for the stream
+//
+////////////////////////////////////////////////////////////////////////////////
+void StreamWriter::setCodec(
+	const struct atom_codec &codec)
+{
+	if (info != NULL) {
+		info->codec = codec;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the keys
+//
+////////////////////////////////////////////////////////////////////////////////
+const std::vector<std::string> &StreamWriter::getKeys()
+{
+	return keys;
+}
+
+} // namespace atom
@@ -0,0 +1,127 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file subscription.cc
+//
+//  @brief Subscription implementation atop element_entry_subscription
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <stdint.h>
+#include <stdexcept>
+
+#include "element.h"
+#include "subscription.h"
+
+namespace atom {
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Constructor. Makes the connection and the C subscription
+//
+////////////////////////////////////////////////////////////////////////////////
+Subscription::Subscription(
+	struct element *elem,
+	struct element_entry_read_info *i,
+	size_t n,
+	const char *start_id) : ctx(NULL), infos(i), n_infos(n), sub(NULL)
+{
+	ctx = redis_context_init();
+	if ((ctx == NULL) || ctx->err) {
+		cleanup();
+		throw std::runtime_error("Failed to connect to redis");
+	}
+
+	sub = element_entry_subscription_init(ctx, elem, infos, n_infos, start_id);
+	if (sub == NULL) {
+		cleanup();
+		throw std::runtime_error("Failed to initialize subscription");
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Cleans up the subscription, the read info and the connection
+//
+////////////////////////////////////////////////////////////////////////////////
+void Subscription::cleanup()
+{
+	if (sub != NULL) {
+		element_entry_subscription_cleanup(sub);
+		sub = NULL;
+	}
+	if (infos != NULL) {
+		Element::freeEntryInfo(infos, n_infos);
+		infos = NULL;
+	}
+	if (ctx != NULL) {
+		redis_context_cleanup(ctx);
+		ctx = NULL;
+	}
+}
+
+Subscription::~Subscription()
+{
+	cleanup();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Move constructor/assignment. The C subscription points at the
+//			read info, which doesn't move.
+//
+////////////////////////////////////////////////////////////////////////////////
+Subscription::Subscription(
+	Subscription &&other) : ctx(other.ctx), infos(other.infos),
+	n_infos(other.n_infos), sub(other.sub)
+{
+	other.ctx = NULL;
+	other.infos = NULL;
+	other.sub = NULL;
+}
+
+Subscription &Subscription::operator=(
+	Subscription &&other)
+{
+	if (this != &other) {
+		cleanup();
+		ctx = other.ctx;
+		infos = other.infos;
+		n_infos = other.n_infos;
+		sub = other.sub;
+		other.ctx = NULL;
+		other.infos = NULL;
+		other.sub = NULL;
+	}
+
+	return *this;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Reads until n entries have been read or the timeout passes
+//
+////////////////////////////////////////////////////////////////////////////////
+enum atom_error_t Subscription::poll(
+	size_t n,
+	int timeout,
+	size_t *n_read)
+{
+	if (sub == NULL) {
+		if (n_read != NULL) {
+			*n_read = 0;
+		}
+		return ATOM_INTERNAL_ERROR;
+	}
+
+	return element_entry_subscription_poll(ctx, sub, n, timeout, n_read);
+}
+
+enum atom_error_t Subscription::pollFor(
+	int timeout,
+	size_t *n_read)
+{
+	return poll(SIZE_MAX, timeout, n_read);
+}
+
+} // namespace atom
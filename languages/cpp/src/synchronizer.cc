@@ -0,0 +1,273 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file synchronizer.cc
+//
+//  @brief Synchronizer implementation atop ElementReadMap handlers
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <stdlib.h>
+#include <algorithm>
+
+#include "atom/atom.h"
+#include "atom/redis.h"
+#include "synchronizer.h"
+
+namespace atom {
+
+// Distance between two times
+#define SYNC_DIFF(a, b) (((a) > (b)) ? ((a) - (b)) : ((b) - (a)))
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Constructor
+//
+////////////////////////////////////////////////////////////////////////////////
+Synchronizer::Synchronizer(
+	uint64_t tolerance,
+	syncHandlerFn fn,
+	void *user_data,
+	size_t queue_size,
+	bool use_timestamp_key) :
+	tolerance(tolerance),
+	queue_size(std::max(queue_size, (size_t)1)),
+	use_timestamp_key(use_timestamp_key),
+	fn(fn),
+	user_data(user_data),
+	n_matched(0),
+	n_dropped(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Destructor. Frees the streams
+//
+////////////////////////////////////////////////////////////////////////////////
+Synchronizer::~Synchronizer()
+{
+	for (auto s : streams) {
+		delete s;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds a stream, allocating its ring up front
+//
+////////////////////////////////////////////////////////////////////////////////
+void Synchronizer::addStream(
+	std::string element,
+	std::string stream,
+	std::vector<std::string> keys)
+{
+	syncStream *s = new syncStream();
+
+	s->sync = this;
+	s->element = std::move(element);
+	s->stream = std::move(stream);
+	s->keys = std::move(keys);
+	s->ring.assign(queue_size, Entry(""));
+	s->times.assign(queue_size, 0);
+	s->head = 0;
+	s->count = 0;
+
+	// Need the timestamp to time entries by it
+	if (use_timestamp_key &&
+		(std::find(s->keys.begin(), s->keys.end(), DATA_KEY_TIMESTAMP_STR) ==
+			s->keys.end()))
+	{
+		s->keys.push_back(DATA_KEY_TIMESTAMP_STR);
+	}
+
+	streams.push_back(s);
+	matched.assign(streams.size(), Entry(""));
+	picks.assign(streams.size(), 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds a handler for each stream to the map
+//
+////////////////////////////////////////////////////////////////////////////////
+void Synchronizer::addHandlers(
+	ElementReadMap &m)
+{
+	for (auto s : streams) {
+		m.addHandler(s->element, s->stream, s->keys, entryCB, s);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the time of the nth oldest entry in the stream's ring
+//
+////////////////////////////////////////////////////////////////////////////////
+uint64_t Synchronizer::time(
+	const syncStream *s,
+	size_t n) const
+{
+	return s->times[(s->head + n) % queue_size];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Drops the n oldest entries in the stream's ring
+//
+////////////////////////////////////////////////////////////////////////////////
+void Synchronizer::pop(
+	syncStream *s,
+	size_t n)
+{
+	s->head = (s->head + n) % queue_size;
+	s->count -= n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds an entry to the stream's ring, dropping the oldest if it's
+//			full. Entries older than the newest one already there are
+//			dropped s.t. the ring stays in order.
+//
+////////////////////////////////////////////////////////////////////////////////
+void Synchronizer::push(
+	syncStream *s,
+	Entry &e)
+{
+	uint64_t t = 0;
+	bool timed = false;
+
+	if (use_timestamp_key) {
+		auto ts = e.getData().find(DATA_KEY_TIMESTAMP_STR);
+		if (ts != e.getData().end()) {
+			t = strtoull(ts->second.c_str(), NULL, 10);
+			timed = true;
+		}
+	}
+	if (!timed) {
+		t = redis_stream_id_ms(e.getID().c_str());
+	}
+
+	if ((s->count > 0) && (t < time(s, s->count - 1))) {
+		n_dropped += 1;
+		return;
+	}
+
+	if (s->count == queue_size) {
+		pop(s, 1);
+		n_dropped += 1;
+	}
+
+	size_t slot = (s->head + s->count) % queue_size;
+	s->ring[slot] = std::move(e);
+	s->times[slot] = t;
+	s->count += 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Hands off all of the matches that can be made with what's in
+//			the rings. Returns the handler's result, true if it wasn't
+//			called.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Synchronizer::match()
+{
+	bool ret = true;
+
+	while (true) {
+
+		// Need an entry from every stream. The pivot is the newest of
+		//	the oldest entries
+		uint64_t pivot = 0;
+		uint64_t oldest = UINT64_MAX;
+		syncStream *oldest_stream = NULL;
+		for (auto s : streams) {
+			if (s->count == 0) {
+				return ret;
+			}
+			uint64_t t = time(s, 0);
+			pivot = std::max(pivot, t);
+			if (t < oldest) {
+				oldest = t;
+				oldest_stream = s;
+			}
+		}
+
+		// If the oldest entry is too old to match anything drop it
+		if ((pivot - oldest) > tolerance) {
+			pop(oldest_stream, 1);
+			n_dropped += 1;
+			continue;
+		}
+
+		// Pick each stream's entry nearest the pivot. Since the oldest
+		//	are all within the tolerance so are these. If a stream's newest
+		//	entry is still before the pivot a nearer one could come
+		for (size_t i = 0; i < streams.size(); ++i) {
+			syncStream *s = streams[i];
+			size_t n = 0;
+			while (((n + 1) < s->count) &&
+				(SYNC_DIFF(time(s, n + 1), pivot) <= SYNC_DIFF(time(s, n), pivot)))
+			{
+				++n;
+			}
+			if (((n + 1) == s->count) && (time(s, n) < pivot)) {
+				return ret;
+			}
+			picks[i] = n;
+		}
+
+		// Hand them over, dropping everything older
+		for (size_t i = 0; i < streams.size(); ++i) {
+			syncStream *s = streams[i];
+			matched[i] = std::move(s->ring[(s->head + picks[i]) % queue_size]);
+			n_dropped += picks[i];
+			pop(s, picks[i] + 1);
+		}
+		n_matched += 1;
+
+		if (!fn(matched, user_data)) {
+			ret = false;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Read handler for each of the streams. Buffers the entry and
+//			then matches what it can
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Synchronizer::entryCB(
+	Entry &e,
+	void *user_data)
+{
+	syncStream *s = (syncStream *)user_data;
+
+	s->sync->push(s, e);
+	return s->sync->match();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the number of sets of entries handed to the handler
+//
+////////////////////////////////////////////////////////////////////////////////
+uint64_t Synchronizer::getNumMatched()
+{
+	return n_matched;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the number of entries dropped without being matched
+//
+////////////////////////////////////////////////////////////////////////////////
+uint64_t Synchronizer::getNumDropped()
+{
+	return n_dropped;
+}
+
+} // namespace atom
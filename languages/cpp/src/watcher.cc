@@ -0,0 +1,379 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @file watcher.cc
+//
+//  @brief Watcher implementation atop the registry channel
+//
+//  @copy 2018 Elementary Robotics. All rights reserved.
+//
+////////////////////////////////////////////////////////////////////////////////
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <hiredis/hiredis.h>
+
+#include "watcher.h"
+
+namespace atom {
+
+// Callbacks for atom C api need to be in an "extern C" block
+extern "C" {
+
+	bool watcherSyncCB(
+		const char *name,
+		void *user_data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Callback for each element/stream found when syncing
+//
+////////////////////////////////////////////////////////////////////////////////
+bool watcherSyncCB(
+	const char *name,
+	void *user_data)
+{
+	std::set<std::string> *found = (std::set<std::string> *)user_data;
+
+	found->insert(std::string(name));
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Constructor. Starts the watcher thread
+//
+////////////////////////////////////////////////////////////////////////////////
+Watcher::Watcher() : stop(false), synced(false)
+{
+	thread = std::thread(&Watcher::run, this);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Destructor. Stops the watcher thread, which notices within
+//			WATCHER_POLL_MS
+//
+////////////////////////////////////////////////////////////////////////////////
+Watcher::~Watcher()
+{
+	stop.store(true);
+	thread.join();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds or removes a member of the snapshot and lets the handlers
+//			know if that changed anything
+//
+////////////////////////////////////////////////////////////////////////////////
+void Watcher::update(
+	watchKind kind,
+	const std::string &name,
+	bool added)
+{
+	std::set<std::string> &members =
+		(kind == WATCH_ELEMENTS) ? elements : streams;
+	bool changed;
+
+	{
+		std::lock_guard<std::mutex> lock(snapshot_mutex);
+		changed = added ? members.insert(name).second : (members.erase(name) > 0);
+	}
+
+	if (!changed) {
+		return;
+	}
+
+	for (auto const &h : handlers) {
+		if (h.kind == kind) {
+			h.fn(name, added, h.user_data);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Queries everything in the system and applies the difference
+//			to the snapshot. Uses the thread's cached connection since the
+//			watcher's own connection is subscribed.
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Watcher::sync()
+{
+	std::set<std::string> found_elements;
+	std::set<std::string> found_streams;
+
+	if ((atom_get_all_elements_cb(NULL, watcherSyncCB, &found_elements) != ATOM_NO_ERROR) ||
+		(atom_get_all_data_streams_cb(NULL, NULL, watcherSyncCB, &found_streams) != ATOM_NO_ERROR))
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(handler_mutex);
+
+	// Note everything that went away while we weren't watching
+	std::vector<std::string> gone_elements;
+	std::vector<std::string> gone_streams;
+	{
+		std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex);
+		for (auto const &x : elements) {
+			if (found_elements.find(x) == found_elements.end()) {
+				gone_elements.push_back(x);
+			}
+		}
+		for (auto const &x : streams) {
+			if (found_streams.find(x) == found_streams.end()) {
+				gone_streams.push_back(x);
+			}
+		}
+	}
+
+	for (auto const &x : gone_elements) {
+		update(WATCH_ELEMENTS, x, false);
+	}
+	for (auto const &x : gone_streams) {
+		update(WATCH_STREAMS, x, false);
+	}
+	for (auto const &x : found_elements) {
+		update(WATCH_ELEMENTS, x, true);
+	}
+	for (auto const &x : found_streams) {
+		update(WATCH_STREAMS, x, true);
+	}
+
+	std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex);
+	synced = true;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Applies a +key/-key message from the registry channel
+//
+////////////////////////////////////////////////////////////////////////////////
+void Watcher::apply(
+	const char *msg,
+	size_t msg_len)
+{
+	if ((msg_len < 1) ||
+		((msg[0] != ATOM_REGISTRY_ADD) && (msg[0] != ATOM_REGISTRY_REMOVE)))
+	{
+		return;
+	}
+
+	bool added = (msg[0] == ATOM_REGISTRY_ADD);
+	std::string key(msg + 1, msg_len - 1);
+
+	std::lock_guard<std::mutex> lock(handler_mutex);
+
+	if (key.compare(0, CONST_STRLEN(ATOM_COMMAND_STREAM_PREFIX),
+		ATOM_COMMAND_STREAM_PREFIX) == 0)
+	{
+		update(WATCH_ELEMENTS,
+			key.substr(CONST_STRLEN(ATOM_COMMAND_STREAM_PREFIX)), added);
+	} else if (key.compare(0, CONST_STRLEN(ATOM_DATA_STREAM_PREFIX),
+		ATOM_DATA_STREAM_PREFIX) == 0)
+	{
+		update(WATCH_STREAMS,
+			key.substr(CONST_STRLEN(ATOM_DATA_STREAM_PREFIX)), added);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Subscribes the connection to the registry channel
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Watcher::subscribe(
+	redisContext *ctx)
+{
+	redisReply *reply = (redisReply *)redisCommand(ctx,
+		"SUBSCRIBE %s", ATOM_REGISTRY_CHANNEL);
+	bool ret = (reply != NULL) && (reply->type == REDIS_REPLY_ARRAY);
+
+	if (reply != NULL) {
+		freeReplyObject(reply);
+	}
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Watcher thread. (Re)connects and subscribes, syncs the snapshot
+//			and then applies messages as they come in until told to stop.
+//			Only waits on the connection WATCHER_POLL_MS at a time s.t. it
+//			notices when it's told to stop.
+//
+////////////////////////////////////////////////////////////////////////////////
+void Watcher::run()
+{
+	redisContext *ctx = NULL;
+	bool subscribed = false;
+	bool need_sync = true;
+	uint64_t synced_ms = 0;
+
+	while (!stop.load()) {
+
+		// Get a connection, or get ours back
+		if ((ctx == NULL) || ctx->err) {
+			{
+				std::lock_guard<std::mutex> lock(snapshot_mutex);
+				synced = false;
+			}
+			subscribed = false;
+
+			if (ctx == NULL) {
+				ctx = redis_context_init();
+			} else {
+				redis_context_reconnect(ctx, WATCHER_POLL_MS);
+			}
+			if ((ctx == NULL) || ctx->err) {
+				usleep(WATCHER_POLL_MS * 1000);
+				continue;
+			}
+		}
+
+		// Subscribe before syncing s.t. no change falls in between
+		if (!subscribed) {
+			if (!subscribe(ctx)) {
+				usleep(WATCHER_POLL_MS * 1000);
+				continue;
+			}
+			subscribed = true;
+			need_sync = true;
+		}
+
+		// Query everything again every so often to catch whatever went
+		//	away without a message
+		if (need_sync ||
+			((redis_monotonic_ms() - synced_ms) >= WATCHER_RESYNC_MS))
+		{
+			if (!sync()) {
+				usleep(WATCHER_POLL_MS * 1000);
+				continue;
+			}
+			need_sync = false;
+			synced_ms = redis_monotonic_ms();
+		}
+
+		// Apply anything we've already read in
+		void *reply = NULL;
+		if (redisGetReplyFromReader(ctx, &reply) != REDIS_OK) {
+			continue;
+		}
+		if (reply != NULL) {
+			redisReply *r = (redisReply *)reply;
+			if ((r->type == REDIS_REPLY_ARRAY) && (r->elements == 3) &&
+				(r->element[0]->type == REDIS_REPLY_STRING) &&
+				(strcmp(r->element[0]->str, "message") == 0) &&
+				(r->element[2]->type == REDIS_REPLY_STRING))
+			{
+				apply(r->element[2]->str, r->element[2]->len);
+			}
+			freeReplyObject(reply);
+			continue;
+		}
+
+		// Wait for more
+		struct pollfd pfd;
+		pfd.fd = ctx->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		int ret = poll(&pfd, 1, WATCHER_POLL_MS);
+		if ((ret < 0) && (errno != EINTR)) {
+			ctx->err = REDIS_ERR_IO;
+		} else if (ret > 0) {
+			redisBufferRead(ctx);
+		}
+	}
+
+	if (ctx != NULL) {
+		redis_context_cleanup(ctx);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Adds a handler, first letting it know about everything already
+//			in the snapshot
+//
+////////////////////////////////////////////////////////////////////////////////
+void Watcher::addHandler(
+	watchKind kind,
+	watchHandlerFn fn,
+	void *user_data)
+{
+	std::lock_guard<std::mutex> lock(handler_mutex);
+
+	std::vector<std::string> members;
+	{
+		std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex);
+		const std::set<std::string> &from =
+			(kind == WATCH_ELEMENTS) ? elements : streams;
+		members.assign(from.begin(), from.end());
+	}
+
+	for (auto const &x : members) {
+		fn(x, true, user_data);
+	}
+
+	handler h;
+	h.kind = kind;
+	h.fn = fn;
+	h.user_data = user_data;
+	handlers.push_back(h);
+}
+
+void Watcher::watchElements(
+	watchHandlerFn fn,
+	void *user_data)
+{
+	addHandler(WATCH_ELEMENTS, fn, user_data);
+}
+
+void Watcher::watchStreams(
+	watchHandlerFn fn,
+	void *user_data)
+{
+	addHandler(WATCH_STREAMS, fn, user_data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  @brief Gets the members of the snapshot if it's in sync
+//
+////////////////////////////////////////////////////////////////////////////////
+bool Watcher::get(
+	watchKind kind,
+	std::vector<std::string> &list) const
+{
+	std::lock_guard<std::mutex> lock(snapshot_mutex);
+
+	if (!synced) {
+		return false;
+	}
+
+	const std::set<std::string> &from =
+		(kind == WATCH_ELEMENTS) ? elements : streams;
+	list.insert(list.end(), from.begin(), from.end());
+	return true;
+}
+
+bool Watcher::getElements(
+	std::vector<std::string> &elem_list) const
+{
+	return get(WATCH_ELEMENTS, elem_list);
+}
+
+bool Watcher::getStreams(
+	std::vector<std::string> &stream_list) const
+{
+	return get(WATCH_STREAMS, stream_list);
+}
+
+} // namespace atom
@@ -12,6 +12,9 @@
 #include <list>
 #include <hiredis/hiredis.h>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <unistd.h>
 #include <limits.h>
 #include "atom/atom.h"
@@ -19,6 +22,9 @@
 #include "element.h"
 #include "element_response.h"
 #include "element_read_map.h"
+#include "recorder.h"
+#include "synchronizer.h"
+#include "scheduler.h"
 
 // Need to use the atom namespace
 using namespace atom;
@@ -197,6 +203,220 @@ TEST_F(ElementTest, multiple_entry_multiple_keys) {
 	}
 }
 
+// Tests asking for more entries than are on the stream
+TEST_F(ElementTest, read_n_short_stream) {
+	entry_data_t data;
+	data["hello"] = "world";
+	ASSERT_EQ(element->entryWrite("foobar", data), ATOM_NO_ERROR);
+
+	std::vector<Entry> ret;
+	std::vector<std::string> keys = {"hello"};
+	ASSERT_EQ(element->entryReadN("testing", "foobar", keys, 5, ret), ATOM_NO_ERROR);
+	ASSERT_EQ(ret.size(), 1);
+}
+
+// Handler for range reads. Notes the entries and stops after
+//	the requested number of them
+struct RangeRead {
+	std::vector<std::string> values;
+	size_t stop_after;
+};
+
+bool rangeReadHandler(
+	Entry &e,
+	void *user_data)
+{
+	RangeRead *read = (RangeRead *)user_data;
+	read->values.push_back(e.getData().at("hello"));
+	return (read->values.size() < read->stop_after);
+}
+
+// Tests paging through a range of a stream
+TEST_F(ElementTest, read_range) {
+	entry_data_t data;
+	for (int i = 0; i < 10; ++i) {
+		data["hello"] = "world" + std::to_string(i);
+		ASSERT_EQ(element->entryWrite("foobar", data), ATOM_NO_ERROR);
+	}
+
+	// Read it all back, a few at a time s.t. we cross page boundaries
+	std::vector<std::string> keys = {"hello"};
+	RangeRead all = {{}, 100};
+	ASSERT_EQ(element->entryReadRange("testing", "foobar", keys,
+		rangeReadHandler, &all, "-", "+", 3), ATOM_NO_ERROR);
+	ASSERT_EQ(all.values.size(), 10);
+	for (int i = 0; i < 10; ++i) {
+		ASSERT_EQ(all.values[i], "world" + std::to_string(i));
+	}
+
+	// Stopping early should leave the element usable for other reads
+	RangeRead some = {{}, 4};
+	ASSERT_EQ(element->entryReadRange("testing", "foobar", keys,
+		rangeReadHandler, &some, "-", "+", 3), ATOM_NO_ERROR);
+	ASSERT_EQ(some.values.size(), 4);
+
+	std::vector<Entry> ret;
+	ASSERT_EQ(element->entryReadN("testing", "foobar", keys, 1, ret), ATOM_NO_ERROR);
+	ASSERT_EQ(ret.size(), 1);
+	ASSERT_EQ(ret[0].getData().at("hello"), "world9");
+}
+
+// Tests recording entries across several segments and playing them back
+TEST_F(ElementTest, record_playback) {
+	char dir[] = "/tmp/atom_recording_XXXXXX";
+	ASSERT_NE(mkdtemp(dir), (char*)NULL);
+
+	// Record entries big enough that they span a few small segments
+	{
+		Recorder recorder(dir, 4096);
+		for (int i = 0; i < 10; ++i) {
+			Entry e((std::to_string(1000 + i) + "-0").c_str());
+			std::string value = "world" + std::to_string(i) + std::string(1000, 'x');
+			e.addData("hello", value.c_str(), value.size());
+			ASSERT_TRUE(recorder.record("robot", "foobar", e));
+		}
+
+		// And a second stream over the same time, recorded after, s.t. the
+		//	index isn't in time order
+		for (int i = 0; i < 10; ++i) {
+			Entry e((std::to_string(1000 + i) + "-0").c_str());
+			std::string value = "other" + std::to_string(i);
+			e.addData("hello", value.c_str(), value.size());
+			ASSERT_TRUE(recorder.record("robot", "barfoo", e));
+		}
+		ASSERT_EQ(recorder.getNumEntries(), 20);
+	}
+
+	// Finishing the recording puts the index in time order on disk
+	{
+		FILE *f = fopen((std::string(dir) + "/" + RECORDER_INDEX_FILENAME).c_str(), "rb");
+		ASSERT_NE(f, (FILE *)NULL);
+		struct recorder_index_header header;
+		struct recorder_index_entry row;
+		uint64_t last_ms = 0;
+		size_t n_rows = 0;
+		ASSERT_EQ(fread(&header, sizeof(header), 1, f), 1);
+		EXPECT_TRUE(header.flags & RECORDER_INDEX_SORTED);
+		while (fread(&row, sizeof(row), 1, f) == 1) {
+			EXPECT_GE(row.id_ms, last_ms);
+			last_ms = row.id_ms;
+			n_rows += 1;
+		}
+		EXPECT_EQ(n_rows, 20);
+		fclose(f);
+	}
+
+	// Play back everything from the middle on, as fast as possible
+	{
+		Player player(*element, dir);
+		ASSERT_EQ(player.getNumEntries(), 20);
+		ASSERT_EQ(player.play(PLAYER_AS_FAST_AS_POSSIBLE, 1004), ATOM_NO_ERROR);
+	}
+
+	std::vector<Entry> ret;
+	std::vector<std::string> keys = {"hello"};
+	ASSERT_EQ(element->entryReadN("testing", "foobar", keys, 10, ret), ATOM_NO_ERROR);
+	ASSERT_EQ(ret.size(), 6);
+	for (int i = 0; i < 6; ++i) {
+		ASSERT_EQ(ret[i].getData().at("hello"),
+			"world" + std::to_string(9 - i) + std::string(1000, 'x'));
+	}
+
+	// Both streams should have been played from the same point and kept
+	//	once the player is gone
+	ret.clear();
+	ASSERT_EQ(element->entryReadN("testing", "barfoo", keys, 10, ret), ATOM_NO_ERROR);
+	ASSERT_EQ(ret.size(), 6);
+	for (int i = 0; i < 6; ++i) {
+		ASSERT_EQ(ret[i].getData().at("hello"), "other" + std::to_string(9 - i));
+	}
+
+	ASSERT_EQ(system(("rm -rf " + std::string(dir)).c_str()), 0);
+}
+
+// Tests recording what's read through a read map and playing it back with
+//	the recorded timing
+TEST_F(ElementTest, record_playback_timed) {
+	char dir[] = "/tmp/atom_recording_XXXXXX";
+	ASSERT_NE(mkdtemp(dir), (char*)NULL);
+
+	// Entries 100ms apart, handed to the handlers the recorder added to the
+	//	read map the same way entryReadLoop would
+	{
+		Recorder recorder(dir);
+		ElementReadMap m;
+		recorder.addStream(m, "robot", "timed", {"hello"});
+		ASSERT_EQ(m.getNumHandlers(), 1);
+		handler_t &handler = m.getHandler(0);
+		ASSERT_EQ(std::get<0>(handler), "robot");
+		ASSERT_EQ(std::get<1>(handler), "timed");
+
+		for (int i = 0; i < 3; ++i) {
+			Entry e((std::to_string(1000 + (100 * i)) + "-0").c_str());
+			std::string value = "tick" + std::to_string(i);
+			e.addData("hello", value.c_str(), value.size());
+			ASSERT_TRUE(std::get<3>(handler)(e, std::get<4>(handler)));
+		}
+		ASSERT_EQ(recorder.getNumEntries(), 3);
+	}
+
+	Player player(*element, dir);
+	ASSERT_EQ(player.getNumEntries(), 3);
+
+	// Twice as fast takes half the recorded 200ms
+	auto start = std::chrono::steady_clock::now();
+	ASSERT_EQ(player.play(2.0), ATOM_NO_ERROR);
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	EXPECT_GE(elapsed, 100);
+	EXPECT_LT(elapsed, 200);
+
+	// And without waiting it doesn't take anywhere near that
+	start = std::chrono::steady_clock::now();
+	ASSERT_EQ(player.play(PLAYER_AS_FAST_AS_POSSIBLE), ATOM_NO_ERROR);
+	elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	EXPECT_LT(elapsed, 100);
+
+	std::vector<Entry> ret;
+	std::vector<std::string> keys = {"hello"};
+	ASSERT_EQ(element->entryReadN("testing", "timed", keys, 10, ret), ATOM_NO_ERROR);
+	ASSERT_EQ(ret.size(), 6);
+	for (int i = 0; i < 3; ++i) {
+		ASSERT_EQ(ret[i].getData().at("hello"), "tick" + std::to_string(2 - i));
+	}
+
+	ASSERT_EQ(system(("rm -rf " + std::string(dir)).c_str()), 0);
+}
+
+// Tests writing serialized data and reading back the serialization key
+TEST_F(ElementTest, serialized_entry) {
+
+	// Write some msgpack data
+	std::map<std::string, int> data;
+	data["count"] = 42;
+	ASSERT_EQ(element->entryWrite<int>("serialized", data), ATOM_NO_ERROR);
+
+	// Do the read back
+	std::vector<Entry> ret;
+	std::vector<std::string> keys = {"count", "ser"};
+	ASSERT_EQ(element->entryReadN(
+		"testing",
+		"serialized",
+		keys,
+		1,
+		ret), ATOM_NO_ERROR);
+	ASSERT_EQ(ret.size(), 1);
+	ASSERT_EQ(ret[0].getKey("ser"), "msgpack");
+
+	// And make sure the value deserializes
+	int count = 0;
+	const std::string &packed = ret[0].getKey("count");
+	ASSERT_TRUE(SerializeMsgpack::deserialize(
+		(const uint8_t*)packed.data(), packed.size(), count));
+	ASSERT_EQ(count, 42);
+}
+
 // Tests writing data to multiple streams
 TEST_F(ElementTest, multiple_streams) {
 
@@ -241,6 +461,216 @@ TEST_F(ElementTest, multiple_streams) {
 	ASSERT_EQ(ret2[0].getKey("foo"), "bar");
 }
 
+// Tests writing an entry to several streams at once
+TEST_F(ElementTest, entry_write_multi) {
+	entry_data_t raw, downsampled;
+	raw["image"] = std::string(1024, 'a');
+	downsampled["image"] = std::string(64, 'b');
+
+	std::vector<std::pair<std::string, entry_data_t>> entries = {
+		{"raw", raw}, {"downsampled", downsampled}};
+	std::vector<std::string> ids;
+	ASSERT_EQ(element->entryWriteMulti(entries, ids, 42), ATOM_NO_ERROR);
+	ASSERT_EQ(ids.size(), 2);
+
+	// Each stream got its own data and the ID we were given
+	std::vector<std::string> keys = {"image"};
+	for (size_t i = 0; i < entries.size(); ++i) {
+		std::vector<Entry> ret;
+		ASSERT_EQ(element->entryReadN("testing", entries[i].first, keys, 1, ret),
+			ATOM_NO_ERROR);
+		ASSERT_EQ(ret.size(), 1);
+		EXPECT_EQ(ret[0].getID(), ids[i]);
+		EXPECT_EQ(ret[0].getData().at("image"), entries[i].second["image"]);
+	}
+
+	// Can't write the same stream twice
+	entries.push_back({"raw", raw});
+	ids.clear();
+	EXPECT_EQ(element->entryWriteMulti(entries, ids), ATOM_COMMAND_INVALID_DATA);
+	EXPECT_EQ(ids.size(), 0);
+}
+
+// Tests reading the newest entry of several streams at once
+TEST_F(ElementTest, entry_read_latest_multi) {
+	entry_data_t data;
+	std::vector<std::string> keys = {"value"};
+
+	data["value"] = "early";
+	ASSERT_EQ(element->entryWrite("lidar", data), ATOM_NO_ERROR);
+	usleep(20000);
+	data["value"] = "ref";
+	ASSERT_EQ(element->entryWrite("camera", data), ATOM_NO_ERROR);
+	usleep(200000);
+	data["value"] = "late";
+	ASSERT_EQ(element->entryWrite("lidar", data), ATOM_NO_ERROR);
+
+	std::vector<entry_read_stream_t> streams = {
+		entry_read_stream_t("testing", "camera", keys),
+		entry_read_stream_t("testing", "lidar", keys),
+		entry_read_stream_t("testing", "imu", keys)};
+
+	// Newest of each, with nothing for the stream that was never written
+	std::vector<Entry> ret;
+	ASSERT_EQ(element->entryReadLatestMulti(streams, ret), ATOM_NO_ERROR);
+	ASSERT_EQ(ret.size(), 3);
+	EXPECT_EQ(ret[0].getData().at("value"), "ref");
+	EXPECT_EQ(ret[1].getData().at("value"), "late");
+	EXPECT_EQ(ret[2].getID(), "");
+
+	// Aligned to the camera the lidar entry is the one nearest it in time
+	ret.clear();
+	ASSERT_EQ(element->entryReadLatestMulti(streams, ret,
+		ELEMENT_ENTRY_READ_ALIGN_FIRST), ATOM_NO_ERROR);
+	ASSERT_EQ(ret.size(), 3);
+	EXPECT_EQ(ret[0].getData().at("value"), "ref");
+	EXPECT_EQ(ret[1].getData().at("value"), "early");
+	EXPECT_EQ(ret[2].getID(), "");
+}
+
+// Writes n entries with the writer
+static void stream_writer_thread(
+	StreamWriter *writer,
+	int n)
+{
+	for (int i = 0; i < n; ++i) {
+		std::string value = std::to_string(i);
+		ASSERT_EQ(writer->write({value, "fixed"}), ATOM_NO_ERROR);
+	}
+}
+
+// Tests writing with stream writers from their own threads
+TEST_F(ElementTest, stream_writer) {
+	std::vector<std::string> keys = {"count", "other"};
+	StreamWriter camera = element->streamWriter("camera", keys);
+	StreamWriter lidar = element->streamWriter("lidar", keys);
+
+	// Values need to match the keys
+	EXPECT_EQ(camera.write({"only one"}), ATOM_COMMAND_INVALID_DATA);
+
+	std::thread camera_thread(stream_writer_thread, &camera, 100);
+	std::thread lidar_thread(stream_writer_thread, &lidar, 50);
+	camera_thread.join();
+	lidar_thread.join();
+
+	std::vector<Entry> ret;
+	ASSERT_EQ(element->entryReadN("testing", "camera", keys, 1, ret), ATOM_NO_ERROR);
+	ASSERT_EQ(element->entryReadN("testing", "lidar", keys, 1, ret), ATOM_NO_ERROR);
+	ASSERT_EQ(ret.size(), 2);
+	EXPECT_EQ(ret[0].getKey("count"), "99");
+	EXPECT_EQ(ret[0].getKey("other"), "fixed");
+	EXPECT_EQ(ret[1].getKey("count"), "49");
+
+	// Moving the writer keeps it working
+	StreamWriter moved(std::move(camera));
+	EXPECT_EQ(moved.write({"100", "fixed"}), ATOM_NO_ERROR);
+	EXPECT_EQ(camera.write({"101", "fixed"}), ATOM_INTERNAL_ERROR);
+}
+
+// Counts the entries read on a subscription, checking they're in order
+static bool subscription_cb(
+	Entry &e,
+	void *user_data)
+{
+	std::vector<std::string> *seen = (std::vector<std::string> *)user_data;
+	seen->push_back(e.getKey("count"));
+	return true;
+}
+
+// Tests that a subscription picks up where it left off between polls
+TEST_F(ElementTest, subscription) {
+	std::vector<std::string> keys = {"count"};
+	std::vector<std::string> seen;
+
+	ElementReadMap m;
+	m.addHandler("testing", "subscribed", keys, subscription_cb, &seen);
+	Subscription sub = element->subscribe(m);
+
+	// Nothing there yet
+	size_t n_read;
+	ASSERT_EQ(sub.poll(1, REDIS_XREAD_DONTBLOCK, &n_read), ATOM_NO_ERROR);
+	EXPECT_EQ(n_read, 0);
+
+	// Entries written while we're not polling are still read, in order
+	entry_data_t data;
+	for (int i = 0; i < 10; ++i) {
+		data["count"] = std::to_string(i);
+		ASSERT_EQ(element->entryWrite("subscribed", data), ATOM_NO_ERROR);
+		if (i == 4) {
+			ASSERT_EQ(sub.poll(5, 1000, &n_read), ATOM_NO_ERROR);
+			EXPECT_EQ(n_read, 5);
+		}
+	}
+	ASSERT_EQ(sub.pollFor(100, &n_read), ATOM_NO_ERROR);
+	EXPECT_EQ(n_read, 5);
+
+	ASSERT_EQ(seen.size(), 10);
+	for (int i = 0; i < 10; ++i) {
+		EXPECT_EQ(seen[i], std::to_string(i));
+	}
+}
+
+// Counts the times a stream's gone stale
+static void freshness_stale_cb(
+	const std::string &element,
+	const std::string &stream,
+	uint64_t age_ms,
+	void *user_data)
+{
+	((std::atomic<int> *)user_data)->fetch_add(1);
+}
+
+// Makes sure reads on tracked streams update their freshness and the
+//	watchdog goes off once per quiet period
+TEST_F(ElementTest, freshness) {
+	std::vector<std::string> keys = {"count"};
+	std::vector<std::string> seen;
+	std::atomic<int> n_stale(0);
+	FreshnessStats stats;
+
+	EXPECT_FALSE(element->getFreshness("testing", "fresh", stats));
+	element->setStalenessWatchdog("testing", "fresh", 50, freshness_stale_cb, &n_stale);
+
+	ElementReadMap m;
+	m.addHandler("testing", "fresh", keys, subscription_cb, &seen);
+	Subscription sub = element->subscribe(m);
+
+	entry_data_t data;
+	size_t n_read;
+	for (int i = 0; i < 10; ++i) {
+		data["count"] = std::to_string(i);
+		ASSERT_EQ(element->entryWrite("fresh", data), ATOM_NO_ERROR);
+		ASSERT_EQ(sub.poll(1, 1000, &n_read), ATOM_NO_ERROR);
+		usleep(1000);
+	}
+
+	ASSERT_TRUE(element->getFreshness("testing", "fresh", stats));
+	EXPECT_EQ(stats.n_entries, 10);
+	EXPECT_EQ(stats.latency_ms.getCount(), 10);
+	EXPECT_LT(stats.latency_ms.getPercentile(50), 50);
+	EXPECT_EQ(stats.jitter_us.getCount(), 8);
+	EXPECT_FALSE(stats.stale);
+
+	// Goes off once while quiet, and again once the next entry re-arms it
+	usleep(200000);
+	EXPECT_EQ(n_stale.load(), 1);
+	ASSERT_TRUE(element->getFreshness("testing", "fresh", stats));
+	EXPECT_TRUE(stats.stale);
+	EXPECT_GE(stats.age_ms, 50);
+
+	ASSERT_EQ(element->entryWrite("fresh", data), ATOM_NO_ERROR);
+	ASSERT_EQ(sub.poll(1, 1000, &n_read), ATOM_NO_ERROR);
+	usleep(200000);
+	EXPECT_EQ(n_stale.load(), 2);
+
+	std::vector<FreshnessStats> all;
+	element->getAllFreshness(all);
+	ASSERT_EQ(all.size(), 1);
+	EXPECT_EQ(all[0].stream, "fresh");
+
+	element->setStalenessWatchdog("testing", "fresh", 0, NULL);
+}
+
 // Tests getAllStreams
 TEST_F(ElementTest, get_all_streams_single_element_all_streams) {
 
@@ -388,6 +818,95 @@ TEST_F(ElementTest, get_all_streams_multiple_elements_all_streams) {
 	}
 }
 
+// Membership as seen through watch events
+struct watch_events {
+	std::mutex mutex;
+	std::map<std::string, bool> present;
+};
+
+void watch_handler_fn(
+	const std::string &name,
+	bool added,
+	void *user_data)
+{
+	struct watch_events *events = (struct watch_events *)user_data;
+	std::lock_guard<std::mutex> lock(events->mutex);
+	events->present[name] = added;
+}
+
+// Waits for the watch events to agree with what's expected
+bool watch_wait(
+	struct watch_events &events,
+	std::map<std::string, bool> expected,
+	int timeout_ms = 1000)
+{
+	for (int i = 0; i < (timeout_ms / 10); ++i) {
+		{
+			std::lock_guard<std::mutex> lock(events.mutex);
+			if (events.present == expected) {
+				return true;
+			}
+		}
+		usleep(10000);
+	}
+	return false;
+}
+
+// Tests watching elements and streams come and go
+TEST_F(ElementTest, watch_elements_streams) {
+	struct watch_events elements, streams;
+	entry_data_t data;
+	data["hello"] = "world";
+
+	// Starts out with what's already there
+	ASSERT_EQ(element->entryWrite("before", data), ATOM_NO_ERROR);
+	element->watchElements(watch_handler_fn, &elements);
+	element->watchStreams(watch_handler_fn, &streams);
+	ASSERT_TRUE(watch_wait(elements, {{"testing", true}}));
+	ASSERT_TRUE(watch_wait(streams, {{"testing:before", true}}));
+
+	// Sees new ones come and go
+	{
+		Element hello("hello");
+		ASSERT_EQ(hello.entryWrite("after", data), ATOM_NO_ERROR);
+		ASSERT_TRUE(watch_wait(elements, {{"testing", true}, {"hello", true}}));
+		ASSERT_TRUE(watch_wait(streams,
+			{{"testing:before", true}, {"hello:after", true}}));
+
+		// Topology queries come from the snapshot
+		std::vector<std::string> stream_list;
+		ASSERT_EQ(element->getAllStreams(stream_list, "hello"), ATOM_NO_ERROR);
+		ASSERT_EQ(stream_list, std::vector<std::string>({"after"}));
+	}
+	ASSERT_TRUE(watch_wait(elements, {{"testing", true}, {"hello", false}}));
+	ASSERT_TRUE(watch_wait(streams,
+		{{"testing:before", true}, {"hello:after", false}}));
+
+	std::vector<std::string> elem_list;
+	ASSERT_EQ(element->getAllElements(elem_list), ATOM_NO_ERROR);
+	ASSERT_EQ(elem_list, std::vector<std::string>({"testing"}));
+
+	// A stream whose element died is left registered with no message
+	//	saying it's gone, so it's only dropped on the next resync
+	ASSERT_EQ(element->entryWrite("crashed", data), ATOM_NO_ERROR);
+	ASSERT_TRUE(watch_wait(streams,
+		{{"testing:before", true}, {"hello:after", false},
+			{"testing:crashed", true}}));
+	redisContext *ctx = redis_context_init();
+	redisReply *reply = (redisReply *)redisCommand(ctx, "DEL %s",
+		ATOM_DATA_STREAM_PREFIX "testing:crashed");
+	ASSERT_NE(reply, (redisReply *)NULL);
+	freeReplyObject(reply);
+	redis_context_cleanup(ctx);
+	ASSERT_TRUE(watch_wait(streams,
+		{{"testing:before", true}, {"hello:after", false},
+			{"testing:crashed", false}}, 2 * WATCHER_RESYNC_MS));
+
+	std::vector<std::string> stream_list;
+	ASSERT_EQ(element->getAllStreams(stream_list, "testing"), ATOM_NO_ERROR);
+	ASSERT_EQ(stream_list, std::vector<std::string>({"before"}));
+}
+
 bool hello_callback_fn(
 	const uint8_t *data,
 	size_t data_len,
@@ -470,6 +989,21 @@ public:
 	}
 };
 
+class RawDouble : public CommandMsgpack<std::vector<float>, std::vector<float>, SerializeNone> {
+public:
+	using CommandMsgpack<std::vector<float>, std::vector<float>, SerializeNone>::CommandMsgpack;
+
+	virtual bool validate() { return true; }
+
+	virtual bool run() {
+		res_data->clear();
+		for (auto const &x : *req_data) {
+			res_data->push_back(2 * x);
+		}
+		return true;
+	}
+};
+
 
 // Thread that creates a command element
 void* command_element(void *data)
@@ -492,6 +1026,10 @@ void* command_element(void *data)
 	elem.addCommand(
 		new MsgpackNoReqNoRes("noreqnores", "Tests msgpack no request or response", 1000));
 
+	// Test a command with no serialization of raw arrays
+	elem.addCommand(
+		new RawDouble("raw_double", "Tests raw array serialization", 1000));
+
 	elem.commandLoop(1);
 	return NULL;
 }
@@ -636,6 +1174,69 @@ TEST_F(ElementTest, msgpack_noreqnores) {
 }
 
 
+// Tests a command with raw array serialization
+TEST_F(ElementTest, raw_command) {
+	ElementResponse resp;
+
+	// Start the command thread
+	pthread_t cmd_thread;
+	ASSERT_EQ(pthread_create(&cmd_thread, NULL, command_element, NULL), 0);
+
+	// Wait until the command element is alive
+	while (true) {
+		std::vector<std::string> elements;
+		ASSERT_EQ(element->getAllElements(elements), ATOM_NO_ERROR);
+		if (std::find(elements.begin(), elements.end(), "test_cmd") != elements.end()) {
+			break;
+		}
+		usleep(100000);
+	}
+
+	std::vector<float> req = {1.0, 2.5, -3.0};
+	std::vector<float> res;
+	enum atom_error_t err = element->sendCommand<std::vector<float>, std::vector<float>, SerializeNone>(
+		resp, "test_cmd", "raw_double", req, res);
+	ASSERT_EQ(err, ATOM_NO_ERROR);
+	ASSERT_EQ(resp.getDataLen(), req.size() * sizeof(float));
+	ASSERT_EQ(res.size(), req.size());
+	for (size_t i = 0; i < req.size(); ++i) {
+		ASSERT_EQ(res[i], 2 * req[i]);
+	}
+
+	// Wait for the command thread to finish
+	void *ret;
+	ASSERT_EQ(pthread_join(cmd_thread, &ret), 0);
+}
+
+// Tests that calls reuse the command's contexts and that a worker running
+//	the command at the same time as another gets its own
+TEST(CommandTest, context_pool) {
+	MsgpackHello cmd("hello_msgpack", "tests msgpack hello world", 1000);
+	cmd.setWorkers(2);
+	cmd.prepareContexts();
+
+	CommandContext *first = cmd._begin();
+	*cmd.res_data = "world";
+	cmd._end(first);
+
+	// The next call gets the same context back, reset in place
+	CommandContext *again = cmd._begin();
+	ASSERT_EQ(again, first);
+	ASSERT_EQ(*cmd.res_data, "");
+
+	std::thread other([&cmd, again]() {
+		CommandContext *ctx = cmd._begin();
+		EXPECT_NE(ctx, again);
+		EXPECT_TRUE(ctx->pooled);
+		*cmd.res_data = "other";
+		cmd._end(ctx);
+	});
+	other.join();
+
+	ASSERT_EQ(*cmd.res_data, "");
+	cmd._end(again);
+}
+
 
 // Tests command with an error response
 TEST_F(ElementTest, err_command) {
@@ -726,6 +1327,9 @@ TEST_F(ElementTest, readSinceLog) {
 		element->log(0, "%d", i);
 	}
 
+	// Logs are shipped in the background
+	ASSERT_EQ(atom_log_flush(0), ATOM_NO_ERROR);
+
 	// Do the read back
 	std::vector<Entry> ret;
 	std::vector<std::string> keys = {"level", "element", "msg", "host"};
@@ -900,6 +1504,156 @@ TEST_F(ElementTest, readSinceElement) {
 	}
 }
 
+bool syncHandler(
+	std::vector<Entry> &entries,
+	void *user_data)
+{
+	std::vector<std::vector<std::string>> *matches =
+		(std::vector<std::vector<std::string>> *)user_data;
+
+	std::vector<std::string> timestamps;
+	for (auto &e : entries) {
+		timestamps.push_back(e.getKey(DATA_KEY_TIMESTAMP_STR));
+	}
+	matches->push_back(timestamps);
+	return true;
+}
+
+// Passes an entry with the timestamp to the map's nth handler as the read
+//	loop would
+static void syncPut(
+	ElementReadMap &m,
+	int n,
+	const char *timestamp)
+{
+	handler_t &h = m.getHandler(n);
+	Entry e("1-0");
+	e.addData(DATA_KEY_TIMESTAMP_STR, timestamp, strlen(timestamp));
+	ASSERT_TRUE(std::get<3>(h)(e, std::get<4>(h)));
+}
+
+// Tests matching up entries from two streams by their timestamps
+TEST(SynchronizerTest, approximate_time) {
+	std::vector<std::vector<std::string>> matches;
+	Synchronizer sync(10, syncHandler, &matches, 4, true);
+	sync.addStream("testing", "camera", {"image"});
+	sync.addStream("testing", "lidar", {"scan"});
+
+	ElementReadMap m;
+	sync.addHandlers(m);
+	ASSERT_EQ(m.getNumHandlers(), 2);
+
+	// Lidar nearest the camera is picked once a later one shows up
+	syncPut(m, 0, "100");
+	syncPut(m, 1, "95");
+	syncPut(m, 1, "103");
+	ASSERT_EQ(matches.size(), 1);
+	EXPECT_EQ(matches[0], std::vector<std::string>({"100", "103"}));
+
+	// Entries with nothing within the tolerance are dropped
+	syncPut(m, 0, "160");
+	syncPut(m, 1, "200");
+	syncPut(m, 0, "199");
+	syncPut(m, 0, "210");
+	ASSERT_EQ(matches.size(), 2);
+	EXPECT_EQ(matches[1], std::vector<std::string>({"199", "200"}));
+
+	EXPECT_EQ(sync.getNumMatched(), 2);
+	EXPECT_EQ(sync.getNumDropped(), 2);
+}
+
+// State shared by the scheduler test's callbacks
+struct scheduler_test {
+	Scheduler *sched;
+	int n_responses;
+	int n_entries;
+	int n_writes;
+};
+
+// Echoes the command's data back through the responder
+static void scheduler_echo_cb(
+	const uint8_t *data,
+	size_t data_len,
+	Responder *responder,
+	void *user_data)
+{
+	ElementResponse response;
+	response.setData(data, data_len);
+	responder->respond(response);
+}
+
+static void scheduler_response_cb(
+	ElementResponse &response,
+	void *user_data)
+{
+	struct scheduler_test *test = (struct scheduler_test *)user_data;
+
+	EXPECT_FALSE(response.isError());
+	EXPECT_EQ(std::string((const char *)response.getDataPtr(),
+		response.getDataLen()), "hello");
+	test->n_responses += 1;
+}
+
+static void scheduler_write_cb(
+	enum atom_error_t err,
+	const std::string &id,
+	void *user_data)
+{
+	struct scheduler_test *test = (struct scheduler_test *)user_data;
+
+	EXPECT_EQ(err, ATOM_NO_ERROR);
+	EXPECT_FALSE(id.empty());
+	test->n_writes += 1;
+}
+
+// Reads the next entry too until it's seen three
+static void scheduler_entry_cb(
+	Entry &e,
+	void *user_data)
+{
+	struct scheduler_test *test = (struct scheduler_test *)user_data;
+
+	ASSERT_FALSE(e.getID().empty());
+	EXPECT_EQ(e.getKey("foo"), "bar");
+	test->n_entries += 1;
+	if (test->n_entries < 3) {
+		test->sched->entryReadNext("testing", "scheduled", {"foo"},
+			scheduler_entry_cb, test, e.getID(), 1000);
+	}
+}
+
+// Tests serving and sending commands and reading and writing entries
+//	all at once from one scheduler
+TEST_F(ElementTest, scheduler) {
+	Scheduler sched(*element);
+	struct scheduler_test test = {&sched, 0, 0, 0};
+	std::string hello = "hello";
+
+	sched.addCommand("echo", scheduler_echo_cb, NULL);
+	sched.entryReadNext("testing", "scheduled", {"foo"},
+		scheduler_entry_cb, &test, "", 1000);
+	for (int i = 0; i < 10; ++i) {
+		sched.sendCommand("testing", "echo", (const uint8_t *)hello.data(),
+			hello.size(), scheduler_response_cb, &test);
+	}
+
+	entry_data_t data;
+	data["foo"] = "bar";
+	data["baz"] = "qux";
+	for (int i = 0; i < 3; ++i) {
+		sched.entryWrite("scheduled", data, scheduler_write_cb, &test);
+	}
+
+	for (int i = 0; (i < 100) && (sched.pending() > 0); ++i) {
+		ASSERT_EQ(sched.runOnce(100), ATOM_NO_ERROR);
+	}
+
+	EXPECT_EQ(test.n_responses, 10);
+	EXPECT_EQ(test.n_writes, 3);
+	EXPECT_EQ(test.n_entries, 3);
+	EXPECT_EQ(sched.pending(), 0);
+}
+
 bool readerHandler(
 	Entry &e,
 	void *user_data)
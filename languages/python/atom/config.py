@@ -12,6 +12,13 @@ REDIS_PIPELINE_POOL_SIZE = 20
 DEFAULT_REDIS_SOCKET = "/shared/redis.sock"
 DEFAULT_METRICS_SOCKET = "/shared/metrics.sock"
 
+# Registry of elements and streams s.t. they can be found without a SCAN.
+#   Changes are published on the channel as the command/stream key with
+#   a + in front when added and a - when removed.
+REGISTRY_ELEMENTS_KEY = "atom:registry:elements"
+REGISTRY_STREAMS_KEY = "atom:registry:streams"
+REGISTRY_CHANNEL = "atom:registry"
+
 # Error codes
 ATOM_NO_ERROR = 0
 ATOM_INTERNAL_ERROR = 1
@@ -21,6 +28,8 @@ ATOM_COMMAND_NO_RESPONSE = 4
 ATOM_COMMAND_INVALID_DATA = 5
 ATOM_COMMAND_UNSUPPORTED = 6
 ATOM_CALLBACK_FAILED = 7
+ATOM_SERIALIZATION_ERROR = 8
+ATOM_DESERIALIZATION_ERROR = 9
 ATOM_LANGUAGE_ERRORS_BEGIN = 100
 ATOM_USER_ERRORS_BEGIN = 1000
 
@@ -35,6 +44,11 @@ OVERRIDE_PARAM_FIELD = "override"
 SERIALIZATION_PARAM_FIELD = "ser"
 RESERVED_PARAM_FIELDS = [OVERRIDE_PARAM_FIELD, SERIALIZATION_PARAM_FIELD]
 
+# Key the C and C++ clients note compressed data's codec in. Python can't
+#   decompress it, so data with a codec other than "none" is an error
+CODEC_FIELD = "codec"
+CODEC_NONE = "none"
+
 # Metrics
 METRICS_ELEMENT_LABEL = "element"
 METRICS_TYPE_LABEL = "type"
@@ -24,10 +24,14 @@ from atom.config import (
     ATOM_CALLBACK_FAILED,
     ATOM_COMMAND_NO_ACK,
     ATOM_COMMAND_NO_RESPONSE,
+    ATOM_COMMAND_INVALID_DATA,
     ATOM_COMMAND_UNSUPPORTED,
+    ATOM_DESERIALIZATION_ERROR,
     ATOM_INTERNAL_ERROR,
     ATOM_NO_ERROR,
     ATOM_USER_ERRORS_BEGIN,
+    CODEC_FIELD,
+    CODEC_NONE,
     COMMAND_LIST_COMMAND,
     DEFAULT_METRICS_PORT,
     DEFAULT_METRICS_SOCKET,
@@ -53,6 +57,9 @@ from atom.config import (
     METRICS_TYPE_LABEL,
     OVERRIDE_PARAM_FIELD,
     REDIS_PIPELINE_POOL_SIZE,
+    REGISTRY_CHANNEL,
+    REGISTRY_ELEMENTS_KEY,
+    REGISTRY_STREAMS_KEY,
     RESERVED_COMMANDS,
     RESERVED_PARAM_FIELDS,
     RESPONSE_TIMEOUT,
@@ -438,6 +445,16 @@ class Element:
         # Keep track of command_last_id to know last time the element's command
         #   stream was read from
         self.command_last_id = _pipe.execute()[-1].decode()
+
+        # Register s.t. others can find us without a SCAN
+        self._registry_update(
+            _pipe,
+            REGISTRY_ELEMENTS_KEY,
+            self.name,
+            self._make_command_id(self.name),
+            True,
+        )
+        _pipe.execute()
         _pipe = self._release_pipeline(_pipe)
 
         # Init a default healthcheck, overridable
@@ -502,7 +519,12 @@ class Element:
                 "Stream '%s' is not present in Element "
                 "streams (element: %s)" % (stream, self.name),
             )
-        self._rclient.unlink(self._make_stream_id(self.name, stream))
+        stream_id = self._make_stream_id(self.name, stream)
+        _pipe = self._rpipeline_pool.get()
+        _pipe.unlink(stream_id)
+        self._registry_update(_pipe, REGISTRY_STREAMS_KEY, stream_id, stream_id, False)
+        _pipe.execute()
+        _pipe = self._release_pipeline(_pipe)
         self.streams.remove(stream)
 
     def _clean_up(self) -> None:
@@ -542,6 +564,16 @@ class Element:
         for stream in self.streams.copy():
             self.clean_up_stream(stream)
         try:
+            _pipe = self._rpipeline_pool.get()
+            self._registry_update(
+                _pipe,
+                REGISTRY_ELEMENTS_KEY,
+                self.name,
+                self._make_command_id(self.name),
+                False,
+            )
+            _pipe.execute()
+            _pipe = self._release_pipeline(_pipe)
             self._rclient.unlink(self._make_response_id(self.name))
             self._rclient.unlink(self._make_command_id(self.name))
             self._rclient.unlink(self._make_consumer_group_counter(self.name))
@@ -581,6 +613,26 @@ class Element:
             self.response_last_id = new_id
         self.response_last_id_lock.release()
 
+    def _registry_update(
+        self, _pipe: Pipeline, registry: str, member: str, key: str, add: bool
+    ) -> None:
+        """
+        Queues adding a member to a registry set, or removing it, and
+            publishing the change on the registry channel.
+
+        Args:
+            _pipe (Pipeline): Pipeline to queue the commands on.
+            registry (str): Registry set to update.
+            member (str): Member to add or remove.
+            key (str): Command or stream key to publish the change for.
+            add (bool): Whether to add or remove the member.
+        """
+        if add:
+            _pipe.sadd(registry, member)
+        else:
+            _pipe.srem(registry, member)
+        _pipe.publish(REGISTRY_CHANNEL, ("+" if add else "-") + key)
+
     def _make_response_id(self, element_name: str) -> str:
         """
         Creates the string representation for a element's response stream id.
@@ -729,8 +781,33 @@ class Element:
             else:
                 k_str = k
             decoded_entry[k_str] = entry[k]
+        codec = self._get_codec(decoded_entry)
+        if codec is not None:
+            raise AtomError(
+                f"Entry is compressed with {codec}, which only the C and C++ "
+                "clients can decompress"
+            )
         return decoded_entry
 
+    def _get_codec(self, data: dict[Any, Any]) -> Optional[str]:
+        """
+        Gets the codec data from a C or C++ element was compressed with.
+        Compression isn't supported in Python, so callers treat this as an
+        error.
+
+        Args:
+            data (dict): The entry, command or response to check, with either
+                str or bytes keys.
+        Returns:
+            The codec, or None if the data isn't compressed.
+        """
+        codec = data.get(CODEC_FIELD, data.get(CODEC_FIELD.encode()))
+        if codec is None:
+            return None
+        if type(codec) is bytes:
+            codec = codec.decode()
+        return None if codec == CODEC_NONE else codec
+
     def _deserialize_entry(
         self,
         entry: dict[str, Any],
@@ -1453,6 +1530,7 @@ class Element:
                 )
 
                 # Send response to caller
+                codec = self._get_codec(cmd)
                 if cmd_name not in self.handler_map.keys():
                     self.logger.error("Received unsupported command: %s" % (cmd_name,))
                     response = Response(
@@ -1464,6 +1542,16 @@ class Element:
                         1,
                         pipeline=pipeline,
                     )
+                elif codec is not None:
+                    self.logger.error(
+                        "Received command %s compressed with %s, which only the "
+                        "C and C++ clients can decompress" % (cmd_name, codec)
+                    )
+                    response = Response(
+                        err_code=ATOM_COMMAND_INVALID_DATA,
+                        err_str="Command data compressed with %s isn't supported."
+                        % (codec,),
+                    )
                 else:
 
                     # Pre-handler metrics
@@ -1881,6 +1969,15 @@ class Element:
                             self.logger.error(err_str)
 
                         response_data = response.get(b"data", "")
+                        codec = self._get_codec(response)
+                        if codec is not None:
+                            err_code = ATOM_DESERIALIZATION_ERROR
+                            err_str = (
+                                f"Response is compressed with {codec}, which "
+                                "only the C and C++ clients can decompress"
+                            )
+                            self.logger.error(err_str)
+                            response_data = ""
                         # check response for serialization method; if not
                         #   present, use user specified method
                         if b"ser" in response:
@@ -2314,6 +2411,8 @@ class Element:
         # Get a metrics pipeline
         with MetricsPipeline(self) as pipeline:
 
+            # Register the stream the first time we write to it
+            register = stream_name not in self.streams
             self.streams.add(stream_name)
             field_data_map = format_redis_py(field_data_map)
 
@@ -2343,10 +2442,13 @@ class Element:
             # Write Data
             self.metrics_timing_start(self._entry_write_metrics[stream_name]["data"])
             _pipe = self._rpipeline_pool.get()
-            _pipe.xadd(
-                self._make_stream_id(self.name, stream_name), vars(entry), maxlen=maxlen
-            )
-            ret = _pipe.execute()
+            stream_id = self._make_stream_id(self.name, stream_name)
+            _pipe.xadd(stream_id, vars(entry), maxlen=maxlen)
+            if register:
+                self._registry_update(
+                    _pipe, REGISTRY_STREAMS_KEY, stream_id, stream_id, True
+                )
+            ret = _pipe.execute()[:1]
             _pipe = self._release_pipeline(_pipe)
             self.metrics_timing_end(
                 self._entry_write_metrics[stream_name]["data"], pipeline=pipeline
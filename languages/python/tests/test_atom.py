@@ -1732,6 +1732,17 @@ class TestAtom:
         )
         assert test_data_2 == unpackb(entries[0]["data"], raw=False)
 
+    def test_entry_read_compressed_raises_error(self, caller):
+        """
+        Entries compressed by a C or C++ writer can't be decompressed in
+        Python, so reading them should fail instead of returning the frames.
+        """
+        caller, caller_name = caller
+
+        caller.entry_write("test_stream", {"data": b"frame", "codec": "lz4"})
+        with pytest.raises(AtomError):
+            caller.entry_read_n(caller_name, "test_stream", 1)
+
     def test_reference_ignore_serialization(self, caller):
         caller, caller_name = caller
 